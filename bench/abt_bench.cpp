@@ -0,0 +1,709 @@
+// abt_bench: synthetic datasets, per-stage micro-benchmarks and end-to-end
+// backup/restore runs, reported as JSON so results can be diffed between versions.
+//
+//   abt_bench [--workdir=DIR] [--out=FILE] [--scale=X] [--seed=N]
+//             [--threads=1,2,4] [--profiles=tiny,mixed,...] [--only=micro|e2e]
+//   abt_bench generate <dir> <profile> [--scale=X] [--seed=N]
+
+#include "alloccount.h"
+#include "dataset.h"
+#include "backup.h"
+#include "bufferpool.h"
+#include "chunkstore.h"
+#include "codec.h"
+#include "encrypt.h"
+#include "fileio.h"
+#include "fingerprint.h"
+#include "logger.h"
+#include "metrics.h"
+#include "restore.h"
+#include "verify.h"
+#include "walker.h"
+#include "workpool.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double secondsSince(Clock::time_point start) {
+    return std::chrono::duration<double>(Clock::now() - start).count();
+}
+
+// Flat JSON object builder; values are numbers, strings or pre-rendered JSON
+class JsonObject {
+public:
+    JsonObject &add(const std::string &key, double value) {
+        std::ostringstream os;
+        os.precision(6);
+        os << std::fixed << value;
+        return raw(key, os.str());
+    }
+    JsonObject &add(const std::string &key, uint64_t value) { return raw(key, std::to_string(value)); }
+    JsonObject &add(const std::string &key, int value) { return raw(key, std::to_string(value)); }
+    JsonObject &add(const std::string &key, const std::string &value) { return raw(key, quote(value)); }
+    JsonObject &add(const std::string &key, const char *value) { return raw(key, quote(value)); }
+    JsonObject &raw(const std::string &key, const std::string &json) {
+        m_fields.emplace_back(key, json);
+        return *this;
+    }
+
+    std::string str() const {
+        std::string out = "{";
+        for (size_t i = 0; i < m_fields.size(); ++i) {
+            if (i) out += ", ";
+            out += quote(m_fields[i].first) + ": " + m_fields[i].second;
+        }
+        return out + "}";
+    }
+
+    static std::string quote(const std::string &s) {
+        std::string out = "\"";
+        for (char c : s) {
+            if (c == '"' || c == '\\') out += '\\';
+            if (c == '\n') {
+                out += "\\n";
+                continue;
+            }
+            out += c;
+        }
+        return out + "\"";
+    }
+
+private:
+    std::vector<std::pair<std::string, std::string>> m_fields;
+};
+
+std::string jsonArray(const std::vector<std::string> &items) {
+    std::string out = "[";
+    for (size_t i = 0; i < items.size(); ++i) out += (i ? ",\n    " : "\n    ") + items[i];
+    return out + (items.empty() ? "]" : "\n  ]");
+}
+
+struct BenchConfig {
+    std::string workdir = "abt_bench_work";
+    std::string out;
+    double scale = 1.0;
+    uint64_t seed = 42;
+    std::vector<int> threads;
+    std::vector<std::string> profiles = {"tiny", "mixed", "huge", "dup"};
+    std::string only;
+};
+
+std::vector<std::string> splitList(const std::string &s) {
+    std::vector<std::string> out;
+    std::stringstream ss(s);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        if (!item.empty()) out.push_back(item);
+    }
+    return out;
+}
+
+uint64_t directoryBytes(const fs::path &dir) {
+    uint64_t total = 0;
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+        if (it->is_regular_file(ec)) total += it->file_size(ec);
+    }
+    return total;
+}
+
+// ---- micro-benchmarks ------------------------------------------------------
+
+std::string microResult(const std::string &name, uint64_t bytes, double seconds) {
+    return JsonObject()
+        .add("name", name)
+        .add("bytes", bytes)
+        .add("seconds", seconds)
+        .add("mb_per_s", seconds > 0 ? static_cast<double>(bytes) / (1 << 20) / seconds : 0.0)
+        .str();
+}
+
+std::vector<std::string> runMicro(const BenchConfig &cfg) {
+    std::vector<std::string> results;
+    uint64_t state = cfg.seed;
+    size_t bufSize = static_cast<size_t>(std::max(1.0, 64 * cfg.scale)) << 20;
+    const size_t kChunk = 1 << 16;
+
+    std::vector<unsigned char> text(bufSize), random(bufSize);
+    fillCompressible(text, state);
+    fillRandom(random, state);
+
+    fs::path microDir = fs::path(cfg.workdir) / "micro";
+    fs::create_directories(microDir);
+    fs::path file = microDir / "input.bin";
+
+    // write: 64 KiB writes plus fsync, what copyFile does per object
+    {
+        auto start = Clock::now();
+        std::ofstream out(file, std::ios::binary | std::ios::trunc);
+        for (size_t off = 0; off < bufSize; off += kChunk) {
+            out.write(reinterpret_cast<const char *>(text.data() + off), static_cast<std::streamsize>(std::min(kChunk, bufSize - off)));
+        }
+        out.close();
+        FILE *f = std::fopen(file.c_str(), "rb");
+        if (f) {
+            fsync(fileno(f));
+            std::fclose(f);
+        }
+        results.push_back(microResult("write_64k_fsync", bufSize, secondsSince(start)));
+    }
+
+    // read: page-cache-warm 64 KiB ifstream reads
+    {
+        std::vector<char> buf(kChunk);
+        auto start = Clock::now();
+        std::ifstream in(file, std::ios::binary);
+        uint64_t total = 0;
+        while (in.read(buf.data(), static_cast<std::streamsize>(buf.size())) || in.gcount() > 0) {
+            total += static_cast<uint64_t>(in.gcount());
+        }
+        results.push_back(microResult("read_64k_cached", total, secondsSince(start)));
+    }
+
+    // Whole-file SourceReader pass, touching every byte like deflate would
+    auto readSource = [&file]() {
+        SourceReader in;
+        uint64_t total = 0;
+        volatile unsigned char sink = 0;
+        if (in.open(file.string())) {
+            const unsigned char *data = nullptr;
+            long n;
+            while ((n = in.peek(data)) > 0) {
+                for (long i = 0; i < n; i += 4096) sink = data[i];
+                total += static_cast<uint64_t>(n);
+                in.consume(static_cast<size_t>(n));
+            }
+        }
+        (void)sink;
+        return total;
+    };
+
+    // The same file through each I/O engine: read-ahead reads, then written
+    // back as an object. Engines are per thread, so each gets a fresh one.
+    configureReadStrategy(0, 0);
+    for (IoBackend backend : {kIoPosix, kIoUring}) {
+        std::thread([&]() {
+            configureIo(backend);
+            std::string engine = ioBackendName();
+            auto start = Clock::now();
+            uint64_t total = readSource();
+            results.push_back(microResult("source_read_" + engine, total, secondsSince(start)));
+
+            fs::path copy = microDir / "object.bin";
+            ObjectWriter out;
+            start = Clock::now();
+            bool ok = out.open(copy.string()) && out.write(text.data(), bufSize) && out.finish();
+            if (ok) results.push_back(microResult("object_write_" + engine, bufSize, secondsSince(start)));
+        }).join();
+    }
+    configureIo(kIoAuto);
+
+    // Read strategies for large files: mapped, and O_DIRECT (cold every time)
+    for (int pass = 0; pass < 2; ++pass) {
+        configureReadStrategy(pass == 0 ? 1 : 0, pass == 0 ? 0 : 1);
+        auto start = Clock::now();
+        uint64_t total = readSource();
+        results.push_back(microResult(pass == 0 ? "source_read_mmap" : "source_read_direct", total, secondsSince(start)));
+    }
+    configureReadStrategy(64ULL << 20, 1ULL << 30);
+
+    // deflate at the levels the adaptive policy picks from
+    for (int level : {1, 6, 9}) {
+        for (int pass = 0; pass < 2; ++pass) {
+            const auto &input = pass == 0 ? text : random;
+            z_stream zs{};
+            deflateInit2(&zs, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+            std::vector<unsigned char> out(kChunk * 2);
+            auto start = Clock::now();
+            uint64_t produced = 0;
+            for (size_t off = 0; off < bufSize; off += kChunk) {
+                zs.next_in = const_cast<Bytef *>(input.data() + off);
+                zs.avail_in = static_cast<uInt>(std::min(kChunk, bufSize - off));
+                int flush = off + kChunk >= bufSize ? Z_FINISH : Z_NO_FLUSH;
+                do {
+                    zs.next_out = out.data();
+                    zs.avail_out = static_cast<uInt>(out.size());
+                    deflate(&zs, flush);
+                    produced += out.size() - zs.avail_out;
+                } while (zs.avail_out == 0);
+            }
+            deflateEnd(&zs);
+            double secs = secondsSince(start);
+            std::string name = std::string("deflate_l") + std::to_string(level) + (pass == 0 ? "_text" : "_random");
+            std::string r = microResult(name, bufSize, secs);
+            r.insert(r.size() - 1, ", \"ratio\": " + std::to_string(static_cast<double>(produced) / bufSize));
+            results.push_back(r);
+        }
+    }
+
+    // AES-256-CTR, the cipher every backup object goes through
+    {
+        unsigned char key[32] = {1}, iv[16] = {2};
+        std::vector<unsigned char> out(kChunk + 16);
+        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), nullptr, key, iv);
+        auto start = Clock::now();
+        int outLen = 0;
+        for (size_t off = 0; off < bufSize; off += kChunk) {
+            EVP_EncryptUpdate(ctx, out.data(), &outLen, random.data() + off, static_cast<int>(std::min(kChunk, bufSize - off)));
+        }
+        EVP_CIPHER_CTX_free(ctx);
+        results.push_back(microResult("aes256_ctr", bufSize, secondsSince(start)));
+    }
+
+    // Content fingerprint behind --fingerprint; has to stay far ahead of the
+    // deflate rows above for the check to pay for itself
+    {
+        auto start = Clock::now();
+        ContentHasher hasher;
+        for (size_t off = 0; off < bufSize; off += kChunk) {
+            hasher.update(text.data() + off, std::min(kChunk, bufSize - off));
+        }
+        std::string r = microResult("fingerprint_xxh64", bufSize, secondsSince(start));
+        r.insert(r.size() - 1, ", \"digest\": " + std::to_string(hasher.digest()));
+        results.push_back(r);
+    }
+
+    // Per-file codec setup for small files: a fresh zlib stream and cipher
+    // context each time against the per-thread ones the workers now reuse
+    {
+        const size_t kFileSize = 4096;
+        const uint64_t files = static_cast<uint64_t>(std::max(1.0, 20000 * cfg.scale));
+        unsigned char key[32] = {1}, iv[16] = {2};
+        std::vector<unsigned char> gz(kFileSize * 2), out(kFileSize * 2);
+        auto sealOne = [&](z_stream *zs, EVP_CIPHER_CTX *ctx, uint64_t i) {
+            zs->next_in = text.data() + (i * kFileSize) % (bufSize - kFileSize);
+            zs->avail_in = static_cast<uInt>(kFileSize);
+            zs->next_out = gz.data();
+            zs->avail_out = static_cast<uInt>(gz.size());
+            deflate(zs, Z_FINISH);
+            int outLen = 0;
+            EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), nullptr, key, iv);
+            EVP_EncryptUpdate(ctx, out.data(), &outLen, gz.data(), static_cast<int>(gz.size() - zs->avail_out));
+        };
+        auto setupResult = [&](const std::string &name, double secs) {
+            std::string r = microResult(name, files * kFileSize, secs);
+            r.insert(r.size() - 1, ", \"files_per_s\": " + std::to_string(secs > 0 ? files / secs : 0.0));
+            return r;
+        };
+
+        auto start = Clock::now();
+        for (uint64_t i = 0; i < files; ++i) {
+            z_stream zs{};
+            deflateInit2(&zs, 6, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY);
+            EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+            sealOne(&zs, ctx, i);
+            EVP_CIPHER_CTX_free(ctx);
+            deflateEnd(&zs);
+        }
+        results.push_back(setupResult("codec_setup_fresh", secondsSince(start)));
+
+        start = Clock::now();
+        for (uint64_t i = 0; i < files; ++i) {
+            DeflateStream zs;
+            CipherContext ctx;
+            zs.begin(6, MAX_WBITS + 16);
+            ctx.begin();
+            sealOne(zs.get(), ctx.get(), i);
+        }
+        results.push_back(setupResult("codec_setup_pooled", secondsSince(start)));
+    }
+
+    // FastCDC boundary search used by --dedup
+    {
+        auto start = Clock::now();
+        uint64_t chunks = 0;
+        for (size_t off = 0; off < bufSize;) {
+            off += findChunkBoundary(random.data() + off, bufSize - off);
+            ++chunks;
+        }
+        std::string r = microResult("fastcdc_chunking", bufSize, secondsSince(start));
+        r.insert(r.size() - 1, ", \"chunks\": " + std::to_string(chunks));
+        results.push_back(r);
+    }
+
+    // Discovery: the old iterator loop (is_regular_file, fs::relative and a
+    // stat per file) against the parallel getdents64 walker. Empty files,
+    // so only listing and stat are measured.
+    {
+        fs::path tree = microDir / "walk";
+        uint64_t dirs = static_cast<uint64_t>(std::max(1.0, 100 * cfg.scale));
+        for (uint64_t d = 0; d < dirs; ++d) {
+            for (int sub = 0; sub < 10; ++sub) {
+                fs::path dir = tree / ("d" + std::to_string(d)) / ("s" + std::to_string(sub));
+                fs::create_directories(dir);
+                for (int f = 0; f < 20; ++f) std::ofstream(dir / ("f" + std::to_string(f)));
+            }
+        }
+        auto walkResult = [](const std::string &name, uint64_t entries, double secs) {
+            return JsonObject()
+                .add("name", name)
+                .add("entries", entries)
+                .add("seconds", secs)
+                .add("entries_per_s", secs > 0 ? entries / secs : 0.0)
+                .str();
+        };
+
+        auto start = Clock::now();
+        uint64_t entries = 0, files = 0;
+        for (auto &entry : fs::recursive_directory_iterator(tree)) {
+            ++entries;
+            if (entry.is_regular_file()) {
+                std::string relative = fs::relative(entry.path(), tree).string();
+                struct stat st{};
+                if (::stat(entry.path().c_str(), &st) == 0 && !relative.empty()) ++files;
+            }
+        }
+        results.push_back(walkResult("walk_iterator", entries, secondsSince(start)));
+
+        std::string prefix = tree.string() + "/";
+        for (int threads : {1, 2, 4, 8}) {
+            start = Clock::now();
+            uint64_t seen = 0;
+            WalkStats stats;
+            walkTree(tree.string(), threads, nullptr, [&](const WalkEntry &entry) {
+                fs::path path(prefix + entry.relative);
+                seen += path.empty() ? 0 : 1;
+                return true;
+            }, stats);
+            std::string r = walkResult("walk_parallel_" + std::to_string(threads), stats.entries, secondsSince(start));
+            r.insert(r.size() - 1, ", \"files\": " + std::to_string(seen));
+            results.push_back(r);
+        }
+    }
+
+    fs::remove_all(microDir);
+    return results;
+}
+
+// ---- end-to-end runs (each in its own process for a clean peak RSS) --------
+
+std::string childUsage(double wall) {
+    struct rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    double user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    double sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    BackupMetrics &m = metrics();
+    return JsonObject()
+        .add("seconds", wall)
+        .add("user_s", user)
+        .add("sys_s", sys)
+        .add("peak_rss_kb", static_cast<uint64_t>(ru.ru_maxrss))
+        .add("heap_allocs", heapAllocations())
+        .add("heap_alloc_mb", static_cast<double>(heapAllocatedBytes()) / (1 << 20))
+        .add("pool_allocs", m.poolAllocs.load())
+        .add("pool_reuses", m.poolReuses.load())
+        .add("pool_peak_mb", static_cast<double>(m.poolBytesPeak.load()) / (1 << 20))
+        .add("codec_inits", m.codecInits.load())
+        .add("codec_reuses", m.codecReuses.load())
+        .add("predicted_s", static_cast<double>(m.schedulePredictedNs.load()) / 1e9)
+        .add("makespan_s", static_cast<double>(m.scheduleMakespanNs.load()) / 1e9)
+        .add("tail_s", static_cast<double>(m.scheduleTailNs.load()) / 1e9)
+        .str();
+}
+
+// The pre-pool scheduler: one thread per file, joined in batches of `threads`
+void batchJoinBackup(const std::string &src, const std::string &dst, int threads, const BackupOptions &options) {
+    std::vector<std::thread> batch;
+    for (auto &entry : fs::recursive_directory_iterator(src)) {
+        if (!entry.is_regular_file()) continue;
+        fs::path destPath = fs::path(dst) / fs::relative(entry.path(), src);
+        uint64_t size = entry.file_size();
+        batch.emplace_back([=, &options]() { copyFile(entry.path(), destPath, size, options, nullptr); });
+        if (static_cast<int>(batch.size()) >= threads) {
+            for (auto &t : batch) t.join();
+            batch.clear();
+        }
+    }
+    for (auto &t : batch) t.join();
+}
+
+int runChild(const std::string &mode, const std::vector<std::string> &args) {
+    if (args.size() < 4) return 2;
+    const std::string &src = args[0];
+    const std::string &dst = args[1];
+    int threads = std::stoi(args[2]);
+    const std::string &logPath = args[3];
+    configureLogger(logPath, 0, 0);
+
+    auto start = Clock::now();
+    if (mode == "backup" || mode == "backup-dedup" || mode == "backup-pack" || mode == "backup-legacy" ||
+        mode == "backup-walk") {
+        BackupOptions options;
+        options.threadCount = threads;
+        options.once = true;
+        options.dedup = mode == "backup-dedup";
+        options.pack = mode == "backup-pack";
+        if (mode == "backup-legacy") options.format = kFormatLegacy;
+        if (mode == "backup-walk") options.schedule = kScheduleWalk;
+        performBackup(src, dst, options);
+    } else if (mode == "backup-batch") {
+        BackupOptions options;
+        ensureEncryptionKeyLogged();
+        batchJoinBackup(src, dst, threads, options);
+    } else if (mode == "restore") {
+        // Here `src` is the backup tree and `dst` the restore target
+        std::string key, iv, error;
+        if (!findBackupKey(args[4], src, key, iv, error)) std::cerr << error << std::endl;
+        RestoreOptions options;
+        options.threadCount = threads;
+        RestoreStats stats;
+        if (!performRestore(src, dst, key, iv, options, stats)) {
+            std::cerr << stats.failed << " object(s) failed to restore" << std::endl;
+        }
+    } else if (mode == "verify") {
+        // The backup tree is checked in memory; `dst` goes unused
+        std::string key, iv, error;
+        if (!findBackupKey(args[4], src, key, iv, error)) std::cerr << error << std::endl;
+        VerifyOptions options;
+        options.threadCount = threads;
+        VerifyStats stats;
+        if (!performVerify(src, key, iv, options, stats)) {
+            std::cerr << stats.corrupt + stats.mismatched + stats.missing << " object(s) failed to verify" << std::endl;
+        }
+    } else {
+        return 2;
+    }
+    flushLog();
+    std::cout << "RESULT " << childUsage(secondsSince(start)) << std::endl;
+    return 0;
+}
+
+std::map<std::string, double> parseFlatJson(const std::string &json) {
+    std::map<std::string, double> out;
+    std::string s = json;
+    for (char &c : s) {
+        if (c == '{' || c == '}' || c == ',' || c == '"' || c == ':') c = ' ';
+    }
+    std::istringstream in(s);
+    std::string key;
+    double value;
+    while (in >> key >> value) out[key] = value;
+    return out;
+}
+
+bool spawnChild(const std::string &self, const std::vector<std::string> &args, std::map<std::string, double> &result) {
+    std::string cmd = "'" + self + "'";
+    for (const auto &a : args) cmd += " '" + a + "'";
+    FILE *p = popen(cmd.c_str(), "r");
+    if (!p) return false;
+    char line[4096];
+    bool found = false;
+    while (std::fgets(line, sizeof(line), p)) {
+        std::string l(line);
+        if (l.compare(0, 7, "RESULT ") == 0) {
+            result = parseFlatJson(l.substr(7));
+            found = true;
+        }
+    }
+    return pclose(p) == 0 && found;
+}
+
+std::vector<std::string> runEndToEnd(const BenchConfig &cfg, const std::string &self,
+                                     std::vector<std::string> &datasets) {
+    std::vector<std::string> results;
+    unsigned cpus = std::max(1u, std::thread::hardware_concurrency());
+
+    for (const auto &profile : cfg.profiles) {
+        fs::path src = fs::path(cfg.workdir) / ("src_" + profile);
+        DatasetSpec spec;
+        spec.profile = profile;
+        spec.seed = cfg.seed;
+        spec.scale = cfg.scale;
+        DatasetInfo info;
+        fs::remove_all(src);
+        auto genStart = Clock::now();
+        if (!generateDataset(spec, src.string(), info)) {
+            std::cerr << "Failed to generate dataset " << profile << std::endl;
+            continue;
+        }
+        datasets.push_back(JsonObject()
+                               .add("profile", profile)
+                               .add("files", info.files)
+                               .add("bytes", info.bytes)
+                               .add("generate_s", secondsSince(genStart))
+                               .str());
+
+        std::vector<std::string> modes = {"backup", "backup-legacy", "backup-batch", "restore", "verify"};
+        if (profile == "tiny") modes = {"backup", "backup-pack", "backup-batch", "restore", "verify"};
+        if (profile == "dup") modes = {"backup", "backup-dedup", "restore", "verify"};
+        // Stragglers: largest-first against directory order
+        if (profile == "mixed") modes = {"backup", "backup-walk", "backup-legacy", "backup-batch", "restore", "verify"};
+
+        for (int threads : cfg.threads) {
+            fs::path dst = fs::path(cfg.workdir) / ("dst_" + profile);
+            fs::path restored = fs::path(cfg.workdir) / ("restore_" + profile);
+            fs::path logPath = fs::path(cfg.workdir) / ("bench_" + profile + ".log");
+            for (const auto &mode : modes) {
+                std::vector<std::string> args = {"--child=" + mode};
+                if (mode == "restore" || mode == "verify") {
+                    fs::remove_all(restored);
+                    args.insert(args.end(), {dst.string(), restored.string(), std::to_string(threads),
+                                             (fs::path(cfg.workdir) / "restore.log").string(), logPath.string()});
+                } else {
+                    fs::remove_all(dst);
+                    std::remove(logPath.c_str());
+                    args.insert(args.end(), {src.string(), dst.string(), std::to_string(threads), logPath.string()});
+                }
+
+                std::map<std::string, double> r;
+                if (!spawnChild(self, args, r)) {
+                    std::cerr << "Run failed: " << profile << " " << mode << " x" << threads << std::endl;
+                    continue;
+                }
+                double secs = r["seconds"];
+                double cpu = r["user_s"] + r["sys_s"];
+                JsonObject row;
+                row.add("profile", profile)
+                    .add("mode", mode)
+                    .add("threads", threads)
+                    .add("files", info.files)
+                    .add("bytes", info.bytes)
+                    .add("seconds", secs)
+                    .add("files_per_s", secs > 0 ? info.files / secs : 0.0)
+                    .add("mb_per_s", secs > 0 ? info.bytes / double(1 << 20) / secs : 0.0)
+                    .add("cpu_cores_busy", secs > 0 ? cpu / secs : 0.0)
+                    .add("cpu_utilisation", secs > 0 ? cpu / secs / cpus : 0.0)
+                    .add("peak_rss_kb", static_cast<uint64_t>(r["peak_rss_kb"]))
+                    .add("heap_allocs", static_cast<uint64_t>(r["heap_allocs"]))
+                    .add("heap_allocs_per_file", info.files > 0 ? r["heap_allocs"] / info.files : 0.0)
+                    .add("heap_alloc_mb", r["heap_alloc_mb"])
+                    .add("pool_allocs", static_cast<uint64_t>(r["pool_allocs"]))
+                    .add("pool_reuses", static_cast<uint64_t>(r["pool_reuses"]))
+                    .add("pool_peak_mb", r["pool_peak_mb"])
+                    .add("codec_inits", static_cast<uint64_t>(r["codec_inits"]))
+                    .add("codec_reuses", static_cast<uint64_t>(r["codec_reuses"]));
+                if (mode == "backup" || mode == "backup-walk") {
+                    row.add("predicted_makespan_s", r["predicted_s"])
+                        .add("makespan_s", r["makespan_s"])
+                        .add("tail_s", r["tail_s"]);
+                }
+                if (mode != "restore" && mode != "verify") {
+                    uint64_t written = directoryBytes(dst);
+                    row.add("bytes_written", written)
+                        .add("reduction_ratio", written > 0 ? static_cast<double>(info.bytes) / written : 0.0);
+                }
+                results.push_back(row.str());
+                std::cerr << profile << " " << mode << " x" << threads << ": " << secs << " s" << std::endl;
+            }
+        }
+    }
+    return results;
+}
+
+int generateCommand(int argc, char *argv[]) {
+    if (argc < 4) {
+        std::cerr << "Usage: abt_bench generate <dir> <profile> [--scale=X] [--seed=N]" << std::endl;
+        return 1;
+    }
+    DatasetSpec spec;
+    spec.profile = argv[3];
+    for (int i = 4; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.compare(0, 8, "--scale=") == 0) spec.scale = std::stod(arg.substr(8));
+        else if (arg.compare(0, 7, "--seed=") == 0) spec.seed = std::stoull(arg.substr(7));
+    }
+    DatasetInfo info;
+    if (!generateDataset(spec, argv[2], info)) {
+        std::cerr << "Unknown profile or write error: " << spec.profile << std::endl;
+        return 1;
+    }
+    std::cout << JsonObject().add("profile", spec.profile).add("files", info.files).add("bytes", info.bytes).str() << std::endl;
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char *argv[]) {
+    if (argc >= 2 && std::string(argv[1]).compare(0, 8, "--child=") == 0) {
+        return runChild(std::string(argv[1]).substr(8), std::vector<std::string>(argv + 2, argv + argc));
+    }
+    if (argc >= 2 && std::string(argv[1]) == "generate") {
+        return generateCommand(argc, argv);
+    }
+
+    BenchConfig cfg;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        auto eq = arg.find('=');
+        std::string name = arg.substr(0, eq);
+        std::string value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+        try {
+            if (name == "--workdir") cfg.workdir = value;
+            else if (name == "--out") cfg.out = value;
+            else if (name == "--scale") cfg.scale = std::stod(value);
+            else if (name == "--seed") cfg.seed = std::stoull(value);
+            else if (name == "--only") cfg.only = value;
+            else if (name == "--profiles") cfg.profiles = splitList(value);
+            else if (name == "--threads") {
+                for (const auto &t : splitList(value)) cfg.threads.push_back(std::stoi(t));
+            } else {
+                std::cerr << "Unknown option: " << arg << std::endl;
+                return 1;
+            }
+        } catch (...) {
+            std::cerr << "Invalid value: " << arg << std::endl;
+            return 1;
+        }
+    }
+    if (cfg.threads.empty()) {
+        int cpus = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+        for (int t : {1, 2, 4, cpus}) {
+            if (std::find(cfg.threads.begin(), cfg.threads.end(), t) == cfg.threads.end()) cfg.threads.push_back(t);
+        }
+        std::sort(cfg.threads.begin(), cfg.threads.end());
+    }
+
+    fs::create_directories(cfg.workdir);
+    configureLogger((fs::path(cfg.workdir) / "bench.log").string(), 0, 0);
+    std::string self = fs::read_symlink("/proc/self/exe").string();
+
+    std::vector<std::string> micro, e2e, datasets;
+    if (cfg.only.empty() || cfg.only == "micro") micro = runMicro(cfg);
+    if (cfg.only.empty() || cfg.only == "e2e") e2e = runEndToEnd(cfg, self, datasets);
+
+    char stamp[32];
+    std::time_t now = std::time(nullptr);
+    std::strftime(stamp, sizeof(stamp), "%Y-%m-%dT%H:%M:%SZ", std::gmtime(&now));
+
+    std::ostringstream json;
+    json << "{\n"
+         << "  \"schema\": 1,\n"
+         << "  \"timestamp\": " << JsonObject::quote(stamp) << ",\n"
+         << "  \"cpus\": " << std::max(1u, std::thread::hardware_concurrency()) << ",\n"
+         << "  \"scale\": " << cfg.scale << ",\n"
+         << "  \"seed\": " << cfg.seed << ",\n"
+         << "  \"datasets\": " << jsonArray(datasets) << ",\n"
+         << "  \"micro\": " << jsonArray(micro) << ",\n"
+         << "  \"e2e\": " << jsonArray(e2e) << "\n"
+         << "}\n";
+
+    if (cfg.out.empty()) {
+        std::cout << json.str();
+    } else {
+        std::ofstream out(cfg.out);
+        out << json.str();
+        std::cerr << "Wrote " << cfg.out << std::endl;
+    }
+    return 0;
+}
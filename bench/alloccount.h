@@ -0,0 +1,12 @@
+#ifndef BENCH_ALLOCCOUNT_H
+#define BENCH_ALLOCCOUNT_H
+
+#include <cstdint>
+
+// abt_bench replaces the global operator new/delete to count every C++ heap
+// allocation the engine makes (zlib and OpenSSL call malloc directly and are
+// covered by the codec counters in metrics.h instead)
+uint64_t heapAllocations();
+uint64_t heapAllocatedBytes();
+
+#endif
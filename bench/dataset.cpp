@@ -0,0 +1,146 @@
+#include "dataset.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+
+namespace fs = std::filesystem;
+
+static uint64_t nextRandom(uint64_t &state) {
+    // splitmix64: tiny, fast and identical on every platform
+    uint64_t z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+void fillRandom(std::vector<unsigned char> &out, uint64_t &state) {
+    size_t i = 0;
+    for (; i + 8 <= out.size(); i += 8) {
+        uint64_t v = nextRandom(state);
+        std::copy(reinterpret_cast<unsigned char *>(&v), reinterpret_cast<unsigned char *>(&v) + 8, out.begin() + static_cast<std::ptrdiff_t>(i));
+    }
+    uint64_t v = nextRandom(state);
+    for (; i < out.size(); ++i, v >>= 8) out[i] = static_cast<unsigned char>(v);
+}
+
+void fillCompressible(std::vector<unsigned char> &out, uint64_t &state) {
+    // Log-like text from a small vocabulary; deflates to roughly a quarter
+    static const char *words[] = {
+        "backup", "error", "INFO", "file", "/var/lib/data", "request", "completed", "user",
+        "timeout", "0x7f3a", "session", "GET", "200", "latency_ms=", "worker", "queue",
+    };
+    size_t i = 0;
+    while (i < out.size()) {
+        uint64_t r = nextRandom(state);
+        const char *w = words[r & 15];
+        for (const char *p = w; *p && i < out.size(); ++p) out[i++] = static_cast<unsigned char>(*p);
+        if (i < out.size()) out[i++] = (r >> 8) % 9 == 0 ? '\n' : ' ';
+        if ((r >> 16) % 5 == 0) {
+            std::string num = std::to_string((r >> 24) % 100000);
+            for (char c : num) {
+                if (i < out.size()) out[i++] = static_cast<unsigned char>(c);
+            }
+        }
+    }
+}
+
+static bool writeFile(const fs::path &path, uint64_t size, bool compressible, uint64_t &state, DatasetInfo &info) {
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) return false;
+
+    std::vector<unsigned char> buf;
+    uint64_t left = size;
+    while (left > 0) {
+        buf.resize(static_cast<size_t>(std::min<uint64_t>(left, 1 << 20)));
+        if (compressible) fillCompressible(buf, state);
+        else fillRandom(buf, state);
+        out.write(reinterpret_cast<const char *>(buf.data()), static_cast<std::streamsize>(buf.size()));
+        left -= buf.size();
+    }
+    info.files++;
+    info.bytes += size;
+    return static_cast<bool>(out);
+}
+
+const std::vector<std::string> &datasetProfiles() {
+    static const std::vector<std::string> profiles = {"tiny", "huge", "mixed", "deep", "wide", "dup"};
+    return profiles;
+}
+
+bool generateDataset(const DatasetSpec &spec, const std::string &dir, DatasetInfo &info) {
+    uint64_t state = spec.seed;
+    auto scaled = [&](double n) { return static_cast<uint64_t>(std::max(1.0, n * spec.scale)); };
+    fs::path root(dir);
+    info = DatasetInfo();
+
+    if (spec.profile == "tiny") {
+        // Many small files in a few hundred directories: per-file overhead dominates
+        uint64_t n = scaled(20000);
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t size = 256 + nextRandom(state) % 4096;
+            fs::path p = root / ("d" + std::to_string(i % 200)) / ("f" + std::to_string(i) + ".txt");
+            if (!writeFile(p, size, true, state, info)) return false;
+        }
+    } else if (spec.profile == "huge") {
+        // A few very large files, one compressible and one not
+        uint64_t size = scaled(256) << 20;
+        if (!writeFile(root / "huge_text.log", size, true, state, info)) return false;
+        if (!writeFile(root / "huge_random.bin", size / 2, false, state, info)) return false;
+    } else if (spec.profile == "mixed") {
+        // Log-normal-ish size spread, half incompressible, plus a couple of big stragglers
+        uint64_t n = scaled(2000);
+        for (uint64_t i = 0; i < n; ++i) {
+            uint64_t r = nextRandom(state);
+            uint64_t size = 1024ULL << (r % 12);   // 1 KiB .. 2 MiB
+            bool text = (r >> 8) & 1;
+            fs::path p = root / ("m" + std::to_string(i % 50)) / ("f" + std::to_string(i) + (text ? ".txt" : ".bin"));
+            if (!writeFile(p, size, text, state, info)) return false;
+        }
+        for (int i = 0; i < 2; ++i) {
+            if (!writeFile(root / ("straggler" + std::to_string(i) + ".dat"), scaled(96) << 20, true, state, info)) return false;
+        }
+    } else if (spec.profile == "deep") {
+        // Long directory chains: stresses path handling and the walk
+        uint64_t chains = scaled(50);
+        for (uint64_t c = 0; c < chains; ++c) {
+            fs::path p = root / ("chain" + std::to_string(c));
+            for (int depth = 0; depth < 32; ++depth) {
+                p /= "level" + std::to_string(depth);
+                if (!writeFile(p / "file.txt", 2048, true, state, info)) return false;
+            }
+        }
+    } else if (spec.profile == "wide") {
+        // One huge flat directory
+        uint64_t n = scaled(20000);
+        for (uint64_t i = 0; i < n; ++i) {
+            if (!writeFile(root / "flat" / ("entry" + std::to_string(i)), 1024, true, state, info)) return false;
+        }
+    } else if (spec.profile == "dup") {
+        // VM-image/log-rotation style duplication: copies of one base with small edits
+        uint64_t size = scaled(32) << 20;
+        std::vector<unsigned char> base(static_cast<size_t>(size));
+        fillRandom(base, state);
+        for (int copy = 0; copy < 8; ++copy) {
+            std::vector<unsigned char> data = base;
+            for (int edit = 0; edit < copy * 4; ++edit) {
+                size_t at = static_cast<size_t>(nextRandom(state) % data.size());
+                data[at] ^= 0xFF;
+            }
+            if (copy % 2 == 1) data.insert(data.begin(), 100, static_cast<unsigned char>(copy));
+            fs::path p = root / ("image" + std::to_string(copy) + ".img");
+            std::error_code ec;
+            fs::create_directories(p.parent_path(), ec);
+            std::ofstream out(p, std::ios::binary | std::ios::trunc);
+            out.write(reinterpret_cast<const char *>(data.data()), static_cast<std::streamsize>(data.size()));
+            if (!out) return false;
+            info.files++;
+            info.bytes += data.size();
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,28 @@
+#ifndef BENCH_DATASET_H
+#define BENCH_DATASET_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Reproducible synthetic source trees for abt_bench. The same profile, seed and
+// scale always produce byte-identical trees.
+struct DatasetSpec {
+    std::string profile;   // tiny, huge, mixed, deep, wide or dup
+    uint64_t seed = 42;
+    double scale = 1.0;    // multiplies file counts and sizes
+};
+
+struct DatasetInfo {
+    uint64_t files = 0;
+    uint64_t bytes = 0;
+};
+
+const std::vector<std::string> &datasetProfiles();
+bool generateDataset(const DatasetSpec &spec, const std::string &dir, DatasetInfo &info);
+
+// Fill `out` with text-like (compressible) or uniformly random bytes
+void fillCompressible(std::vector<unsigned char> &out, uint64_t &state);
+void fillRandom(std::vector<unsigned char> &out, uint64_t &state);
+
+#endif
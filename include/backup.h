@@ -1,9 +1,92 @@
 #ifndef BACKUP_H
 #define BACKUP_H
 
+#include "compress.h"
+#include "container.h"
+#include "qos.h"
+#include "snapshot.h"
+
+#include <cstdint>
+#include <filesystem>
 #include <string>
 
+class WorkerPool;
+class SignatureBuilder;
+class BackupJournal;
+struct ManifestRecord;
+
+// Order in which a pass hands changed files to the workers. LPT holds them
+// until the walk is done and starts the largest first, so a huge file found
+// late does not run alone while every other worker sits idle; walk order
+// starts each file as soon as it is listed.
+enum SchedulePolicy { kScheduleLpt, kScheduleWalk };
+
+// Accepts lpt|size and walk
+bool parseSchedulePolicy(const std::string &text, SchedulePolicy &policy);
+
+struct BackupOptions {
+    int threadCount = 4;
+    // Follow changes with inotify/fanotify instead of rescanning every 5 seconds
+    bool watch = false;
+    bool useFanotify = false;
+    // Split files into content-defined chunks stored once under <dest>/.abt_chunks
+    bool dedup = false;
+    // Files at least this large are deflated block-parallel across the workers
+    uint64_t parallelThreshold = 64ULL << 20;
+    CompressionPolicy compression;
+    // Make a single pass over the source and return instead of monitoring
+    bool once = false;
+    // Whole-file object encryption; see container.h
+    ObjectFormat format = kFormatChunked;
+    // Append files up to packThreshold bytes to shared segments under <dest>/.abt_packs
+    bool pack = false;
+    uint64_t packThreshold = 256ULL << 10;
+    // Back up changes to files of at least deltaThreshold bytes as block
+    // deltas against the previous version; see delta.h
+    bool delta = false;
+    uint64_t deltaThreshold = 64ULL << 20;
+    int deltaMaxChain = 8;
+    // Chunked objects larger than this sync and journal a resume point every
+    // checkpointBytes of source, so an interrupted run continues from there
+    uint64_t checkpointBytes = 64ULL << 20;
+    SchedulePolicy schedule = kScheduleLpt;
+    // Threads listing the source tree; 0 picks defaultWalkThreads()
+    int walkThreads = 0;
+    // Bandwidth caps, CPU budget and priorities; see qos.h
+    QosOptions qos;
+    // Keep a content fingerprint per file, and when a file's mtime moved but
+    // its size did not, hash it and skip it if the contents match
+    bool fingerprint = false;
+    // After a --once pass that finished, link the result into a snapshot
+    // named snapshotName (the time if empty) and prune by `retention`
+    bool snapshot = false;
+    std::string snapshotName;
+    RetentionPolicy retention;
+};
+
 void performBackup(const std::string &srcDir, const std::string &destDir, int threadCount = 4);
+void performBackup(const std::string &srcDir, const std::string &destDir, const BackupOptions &options);
+// Only stores a flag, so it is safe from a signal handler
 void requestStopBackup();
+bool backupStopRequested();
+// Hold every running backup at its next checkpoint until resumed
+void setBackupPaused(bool paused);
+// Clear an earlier stop or pause before starting another backup in this process
+void resetBackupControl();
+// Called between blocks by the loops that read source files. Blocks while
+// paused; false once a stop was requested, and the caller should give up on
+// the file, which is then backed up again by the next run.
+bool backupCheckpoint();
+
+// Compress and encrypt one file to <dest>.gz.enc; `pool` (optional) lets large
+// files fan out across the workers and `signature` (optional) sees every byte
+// read, for delta backups. With a `journal` and the `source` record, large
+// chunked objects are checkpointed and resumed from an earlier checkpoint.
+// `fingerprint` (optional) receives the digest of the bytes backed up, or 0
+// when a resumed object did not read all of them.
+bool copyFile(const std::filesystem::path &src, const std::filesystem::path &dest, uint64_t size,
+              const BackupOptions &options, WorkerPool *pool, SignatureBuilder *signature = nullptr,
+              BackupJournal *journal = nullptr, const ManifestRecord *source = nullptr,
+              uint64_t *fingerprint = nullptr);
 
 #endif
@@ -0,0 +1,59 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Reusable 4 KiB aligned buffers for the compression, encryption and chunk
+// stages. Sizes are rounded up to 64 KiB classes and a released buffer goes
+// to a small cache on the releasing thread, so a worker that backs up one
+// small file after another keeps reusing the same few blocks instead of going
+// back to malloc for every file.
+//
+// Buffers in use (and cached) count against a process-wide cap. Taking a
+// buffer never blocks: the cap is enforced at admission, where a worker that
+// holds nothing waits in waitForBufferMemory() before it starts the next file
+// and large writers size their rounds from bufferPoolHeadroom(). Work already
+// in progress always finishes and gives its memory back, so this cannot
+// deadlock.
+
+// Sizes are rounded up to a multiple of this
+static const size_t kPoolClassSize = 64 * 1024;
+
+// Cap in effect unless configureBufferPool says otherwise
+static const uint64_t kDefaultBufferPoolCap = 512ULL << 20;
+
+// Process-wide, before any worker starts. 0 means no cap.
+void configureBufferPool(uint64_t capBytes);
+
+// Bytes that can still be taken without going over the cap
+uint64_t bufferPoolHeadroom();
+
+// Block until `bytes` more fit under the cap, or nothing is in use at all
+void waitForBufferMemory(uint64_t bytes);
+
+class PoolBuffer {
+public:
+    PoolBuffer() = default;
+    explicit PoolBuffer(size_t size) { reserve(size); }
+    ~PoolBuffer() { release(); }
+
+    PoolBuffer(PoolBuffer &&other) noexcept;
+    PoolBuffer &operator=(PoolBuffer &&other) noexcept;
+    PoolBuffer(const PoolBuffer &) = delete;
+    PoolBuffer &operator=(const PoolBuffer &) = delete;
+
+    // Make room for at least `size` bytes. Keeps the current block when it is
+    // large enough; otherwise the contents are not preserved.
+    void reserve(size_t size);
+    void release();
+
+    unsigned char *data() const { return m_data; }
+    size_t capacity() const { return m_capacity; }
+
+private:
+    unsigned char *m_data = nullptr;
+    size_t m_capacity = 0;
+};
+
+#endif
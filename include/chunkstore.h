@@ -0,0 +1,99 @@
+#ifndef CHUNKSTORE_H
+#define CHUNKSTORE_H
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+// FastCDC content-defined chunking: returns the length of the next chunk at
+// the start of `data`. Callers must pass at least kChunkMaxSize bytes unless
+// this is the tail of the file, otherwise cuts would depend on read sizes.
+static const size_t kChunkMinSize = 16 * 1024;
+static const size_t kChunkAvgSize = 64 * 1024;
+static const size_t kChunkMaxSize = 256 * 1024;
+size_t findChunkBoundary(const unsigned char *data, size_t len);
+
+using ChunkId = std::array<unsigned char, 32>;   // SHA-256 of the plain chunk
+
+struct ChunkStoreStats {
+    uint64_t bytesIn;
+    uint64_t bytesNew;
+    uint64_t chunksIn;
+    uint64_t chunksNew;
+};
+
+// Deduplicating object store under <dest>/.abt_chunks. Every distinct chunk is
+// compressed and sealed once into its own object (a one-chunk container, see
+// container.h); a backed-up file becomes a recipe (<dest>/<relative>.abtr.enc)
+// listing its chunks in order.
+//
+// Chunks outlive the run that wrote them, so they are sealed under a store
+// key of their own rather than the session key. Every session key has its
+// own store in .abt_chunks/<key check>/ (see encryptionKeyCheck): the store
+// key in `key`, itself a container sealed under the session key, the index
+// and the chunks. A run under a new key starts a new store and leaves the
+// others alone, so their recipes keep restoring. Stores from before that
+// kept everything straight under .abt_chunks, and older ones still sealed
+// chunks with AES-256-CTR under the session key/IV; both still read back,
+// but new runs do not deduplicate against them.
+class ChunkStore {
+public:
+    explicit ChunkStore(const std::string &destDir);
+
+    // Open (or start) the store of the session key/IV and load its index.
+    // False if its key file does not open; it is never replaced.
+    bool open(const unsigned char *key, const unsigned char *iv);
+
+    // The recipe is sealed under the session `key`
+    bool storeFile(const std::string &srcPath, const std::string &recipePath, const unsigned char *key);
+
+    // Reassemble a file from its recipe; the store is found by walking up from
+    // the recipe and picked by the session key/IV, which also open objects
+    // from before the store key.
+    static bool restoreFile(const std::string &recipePath, const std::string &outPath,
+                            const unsigned char *key, const unsigned char *iv);
+    // Same, handing the file's bytes to `sink` in order; every chunk is still
+    // checked against its id
+    static bool readFile(const std::string &recipePath, const unsigned char *key, const unsigned char *iv,
+                         const std::function<bool(const unsigned char *, size_t)> &sink);
+
+    ChunkStoreStats stats() const;
+
+private:
+    bool storeChunk(const ChunkId &id, const unsigned char *data, size_t len);
+    std::string chunkPath(const ChunkId &id) const;
+
+    struct ChunkIdHash {
+        size_t operator()(const ChunkId &id) const;
+    };
+    // A chunk one worker is writing; others that need it wait on m_written
+    struct PendingChunk {
+        bool done = false;
+        bool ok = false;
+    };
+
+    std::string m_root;        // .abt_chunks
+    std::string m_dir;         // this session key's store below it
+    std::string m_indexPath;
+    std::array<unsigned char, 32> m_key{};   // store key
+    std::unordered_set<ChunkId, ChunkIdHash> m_known;
+    std::unordered_map<ChunkId, std::shared_ptr<PendingChunk>, ChunkIdHash> m_pending;
+    std::mutex m_mutex;
+    std::condition_variable m_written;
+    std::atomic<uint64_t> m_bytesIn{0};
+    std::atomic<uint64_t> m_bytesNew{0};
+    std::atomic<uint64_t> m_chunksIn{0};
+    std::atomic<uint64_t> m_chunksNew{0};
+};
+
+std::string chunkIdToHex(const ChunkId &id);
+
+#endif
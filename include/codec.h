@@ -0,0 +1,74 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <zlib.h>
+#include <openssl/evp.h>
+
+// zlib streams and cipher contexts kept per thread. deflateInit2 allocates
+// about 270 KiB and EVP_CIPHER_CTX_new plus a key schedule is not free
+// either; for small files that setup cost more than the compression itself.
+// Each wrapper takes a context from the calling thread's cache (reset with
+// deflateReset/inflateReset) or makes a new one, and hands it back when it
+// is ended or destroyed. The wrappers are not tied to a thread: one ended on
+// another thread simply lands in that thread's cache.
+
+// Raw deflate for negative windowBits, gzip for MAX_WBITS + 16; memLevel 8
+class DeflateStream {
+public:
+    DeflateStream() = default;
+    ~DeflateStream() { end(); }
+
+    DeflateStream(const DeflateStream &) = delete;
+    DeflateStream &operator=(const DeflateStream &) = delete;
+
+    bool begin(int level, int windowBits);
+    void end();
+
+    z_stream *get() const { return m_zs; }
+    z_stream *operator->() const { return m_zs; }
+
+private:
+    z_stream *m_zs = nullptr;
+    int m_windowBits = 0;
+    int m_level = 0;
+};
+
+class InflateStream {
+public:
+    InflateStream() = default;
+    ~InflateStream() { end(); }
+
+    InflateStream(const InflateStream &) = delete;
+    InflateStream &operator=(const InflateStream &) = delete;
+
+    bool begin(int windowBits);
+    void end();
+
+    z_stream *get() const { return m_zs; }
+    z_stream *operator->() const { return m_zs; }
+
+private:
+    z_stream *m_zs = nullptr;
+    int m_windowBits = 0;
+};
+
+// An EVP_CIPHER_CTX, possibly left initialised by its last user; callers run
+// EVP_*Init_ex with their own cipher, key and IV as before
+class CipherContext {
+public:
+    CipherContext() = default;
+    ~CipherContext() { end(); }
+
+    CipherContext(const CipherContext &) = delete;
+    CipherContext &operator=(const CipherContext &) = delete;
+
+    bool begin();
+    void end();
+
+    EVP_CIPHER_CTX *get() const { return m_ctx; }
+
+private:
+    EVP_CIPHER_CTX *m_ctx = nullptr;
+};
+
+#endif
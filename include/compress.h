@@ -1,9 +1,47 @@
 #ifndef COMPRESS_H
 #define COMPRESS_H
 
+#include <cstddef>
+#include <functional>
 #include <string>
 
+class WorkerPool;
+
+// How copyFile and compressFile pick a zlib level. With `adaptive` set, the
+// first bytes of each file are sampled and data that will not shrink is
+// stored (level 0) instead of burning CPU at -9; compressible data gets the
+// level that matches the throughput/ratio target. Output is always a normal
+// gzip stream, so restore needs nothing extra whichever level was used.
+struct CompressionPolicy {
+    enum Target { Speed, Balanced, Ratio };
+    Target target = Ratio;
+    bool adaptive = true;
+    int fixedLevel = -1;   // 0-9 forces one level for every file
+};
+
+// Accepts auto, speed, balanced, ratio, store, fast, best or a level 0-9
+bool parseCompressionPolicy(const std::string &text, CompressionPolicy &policy);
+
+// Size of the prefix chooseCompressionLevel wants to see
+static const size_t kCompressionSampleSize = 64 * 1024;
+
+// Shannon entropy of the sample in bits per byte (0..8)
+double estimateEntropy(const unsigned char *data, size_t len);
+int chooseCompressionLevel(const unsigned char *sample, size_t len, const CompressionPolicy &policy);
+
 void compressFile(const std::string &filePath);
 void decompressFile(const std::string &filePath);
 
+// Fills up to `len` bytes: the count, 0 at end of input or -1 on error
+using ReadSource = std::function<long(unsigned char *, size_t)>;
+
+// Block size used by gzipParallel; files smaller than a few blocks gain nothing
+static const size_t kParallelGzipBlockSize = 512 * 1024;
+
+// pigz-style gzip: the input is cut into fixed-size blocks that are deflated on
+// the pool, each primed with the previous block's last 32 KiB as dictionary,
+// and handed to `sink` in order as one standard gzip member that gzread reads.
+bool gzipParallel(const ReadSource &source, int level, WorkerPool &pool,
+                  const std::function<bool(const unsigned char *, size_t)> &sink);
+
 #endif
@@ -0,0 +1,142 @@
+#ifndef CONTAINER_H
+#define CONTAINER_H
+
+#include "bufferpool.h"
+#include "fileio.h"
+
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+class WorkerPool;
+
+// How copyFile encrypts whole-file objects. Legacy is one AES-256-CTR stream
+// over a gzip file with the run's global IV; chunked is the container below.
+enum ObjectFormat { kFormatLegacy, kFormatChunked };
+
+// Accepts chunked|gcm and legacy|ctr
+bool parseObjectFormat(const std::string &text, ObjectFormat &format);
+
+// Plaintext bytes per container chunk
+static const uint32_t kContainerChunkSize = 1 << 20;
+
+// How far a suspended ContainerWriter got: full chunks sealed and the bytes
+// of the partial object that hold them, header included
+struct ContainerResume {
+    uint64_t chunks = 0;
+    uint64_t offset = 0;
+};
+
+// Versioned object container: a header with a random per-file nonce prefix,
+// then fixed-size plaintext chunks that are each deflated on their own and
+// sealed with AES-256-GCM, then an index of chunk offsets and a footer.
+// Chunk i is sealed under nonce = prefix || i || last-flag with the header as
+// associated data, so reordered, swapped or truncated chunks fail to verify.
+// Chunks are independent, which lets them be sealed and opened in parallel
+// and lets a reader seek to any plaintext offset.
+class ContainerWriter {
+public:
+    ContainerWriter();
+    ~ContainerWriter();
+
+    ContainerWriter(const ContainerWriter &) = delete;
+    ContainerWriter &operator=(const ContainerWriter &) = delete;
+
+    // `level` 0 stores chunks; with a pool, rounds of chunks are sealed on
+    // all workers
+    bool open(const std::string &outPath, const unsigned char *key, int level, WorkerPool *pool = nullptr);
+    // Continue the partial object suspend() left for `outPath` from `at`;
+    // the caller skips the first at.chunks * kContainerChunkSize plaintext
+    // bytes. `key` must be the one it was started with.
+    bool resume(const std::string &outPath, const unsigned char *key, int level, WorkerPool *pool,
+                const ContainerResume &at);
+    // Every `everyBytes` of plaintext, sync what has been sealed and hand the
+    // resume point to `callback`
+    void setCheckpoint(uint64_t everyBytes, std::function<void(const ContainerResume &)> callback);
+    bool write(const void *data, size_t len);
+    bool finish();
+    // Stop without finishing, keeping the partial object for resume()
+    void suspend();
+
+    const std::string &error() const { return m_error; }
+
+private:
+    struct Chunk {
+        PoolBuffer plain;
+        size_t plainLen = 0;
+        PoolBuffer sealed;
+        size_t sealedLen = 0;
+        bool ok = false;
+    };
+
+    void startRounds(WorkerPool *pool);
+    bool sealRound(size_t count, bool last);
+    bool fail(const std::string &why);
+
+    ObjectWriter m_out;
+    std::vector<unsigned char> m_key;
+    std::vector<unsigned char> m_header;
+    int m_level = 9;
+    WorkerPool *m_pool = nullptr;
+    std::vector<Chunk> m_chunks;
+    size_t m_fill = 0;          // chunks of the current round in use
+    uint64_t m_sealed = 0;      // chunks written so far
+    uint64_t m_offset = 0;
+    uint64_t m_plainSize = 0;
+    std::vector<uint64_t> m_index;
+    uint64_t m_checkpointBytes = 0;
+    uint64_t m_nextCheckpoint = 0;
+    std::function<void(const ContainerResume &)> m_checkpoint;
+    bool m_open = false;
+    std::string m_error;
+};
+
+class ContainerReader {
+public:
+    ContainerReader();
+    ~ContainerReader();
+
+    ContainerReader(const ContainerReader &) = delete;
+    ContainerReader &operator=(const ContainerReader &) = delete;
+
+    // Reads the header, footer and chunk index; chunk data is read on demand
+    bool open(const std::string &path, const unsigned char *key);
+
+    uint64_t size() const { return m_plainSize; }
+
+    // Hand plaintext [offset, offset + length) to `sink` in order, opening
+    // only the chunks that overlap it (on the pool's workers when given)
+    bool read(uint64_t offset, uint64_t length, WorkerPool *pool,
+              const std::function<bool(const unsigned char *, size_t)> &sink);
+
+    const std::string &error() const { return m_error; }
+
+private:
+    // Decrypts in place in `record`; stored chunks are handed out from there
+    // and deflated ones inflated into `plain`
+    struct Slot {
+        PoolBuffer record;
+        PoolBuffer plain;
+        const unsigned char *data = nullptr;
+        size_t size = 0;
+        std::string error;
+    };
+    bool openChunk(uint64_t index, Slot &slot) const;
+
+    int m_fd = -1;
+    std::string m_path;
+    std::vector<unsigned char> m_key;
+    std::vector<unsigned char> m_header;
+    uint32_t m_chunkSize = 0;
+    uint64_t m_plainSize = 0;
+    uint64_t m_indexOffset = 0;
+    std::vector<uint64_t> m_index;
+    std::string m_error;
+};
+
+// True if the file starts with the container magic (legacy objects are
+// ciphertext from the first byte)
+bool isContainerFile(const std::string &path);
+
+#endif
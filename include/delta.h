@@ -0,0 +1,110 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "compress.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <openssl/evp.h>
+
+// Block size of delta signatures; every block costs 20 bytes of signature
+static const uint32_t kDeltaBlockSize = 64 * 1024;
+
+// rsync-style weak checksum (a = sum of the bytes, b = sum of the running a,
+// both mod 2^16) that can be rolled one byte at a time, plus the first 16
+// bytes of the block's SHA-256 to confirm a weak match
+struct BlockSignature {
+    uint32_t weak;
+    unsigned char strong[16];
+};
+
+// Signatures of consecutive fixed-size blocks, built as the data streams past
+class SignatureBuilder {
+public:
+    explicit SignatureBuilder(uint32_t blockSize = kDeltaBlockSize);
+    ~SignatureBuilder();
+
+    SignatureBuilder(const SignatureBuilder &) = delete;
+    SignatureBuilder &operator=(const SignatureBuilder &) = delete;
+
+    void update(const unsigned char *data, size_t len);
+    // Close the trailing partial block
+    void finish();
+
+    uint32_t blockSize() const { return m_blockSize; }
+    uint64_t size() const { return m_size; }
+    const std::vector<BlockSignature> &blocks() const { return m_blocks; }
+
+private:
+    void closeBlock();
+
+    uint32_t m_blockSize;
+    uint32_t m_a = 0;
+    uint32_t m_b = 0;
+    size_t m_fill = 0;
+    uint64_t m_size = 0;
+    EVP_MD_CTX *m_md = nullptr;
+    std::vector<BlockSignature> m_blocks;
+};
+
+enum DeltaResult {
+    kDeltaStored,     // the change went into a new delta
+    kDeltaNeedFull,   // no usable signature, or the chain is due for consolidation
+    kDeltaFailed,
+};
+
+struct DeltaStats {
+    uint32_t sequence = 0;       // delta number written, or the chain length found
+    uint64_t literalBytes = 0;   // new data carried by the delta
+    uint64_t copiedBytes = 0;    // data taken from the previous version
+};
+
+// Delta chains for large files under <dest>/.abt_deltas. The whole-file
+// object stays the base; <relative>.sig holds the block signatures of the
+// latest version and each later change becomes <relative>.<n>.delta: copy ops
+// naming blocks of the previous version plus the bytes that matched nothing.
+// Restore decrypts the base and applies the deltas in order. Signatures and
+// deltas are chunked GCM containers sealed with the run's key, so a signature
+// left by a run with another key fails to open and forces a new base.
+class DeltaStore {
+public:
+    explicit DeltaStore(const std::string &destDir);
+
+    bool exists() const;
+
+    // Store `srcPath` as the next delta of `relativePath`. A chain that has
+    // reached `maxChain` deltas, or whose deltas would carry more than half
+    // the file, asks for a new base instead.
+    DeltaResult storeDelta(const std::string &srcPath, const std::string &relativePath,
+                           const CompressionPolicy &policy, const unsigned char *key,
+                           int maxChain, DeltaStats &stats) const;
+
+    // Record the signatures of a base object that was just written
+    bool saveSignature(const std::string &relativePath, const SignatureBuilder &signature,
+                       const unsigned char *key) const;
+
+    // Forget the chain; must happen before a new base object is written
+    void drop(const std::string &relativePath) const;
+
+    // Bring the restored base at `path` up to date by applying the chain of
+    // `relativePath` found under `backupDir`, if it has one
+    static bool applyChain(const std::string &backupDir, const std::string &relativePath,
+                           const std::string &path, const unsigned char *key);
+
+    // Open every delta of the chain and check that it authenticates, follows
+    // on from the previous version and stays inside it, without the base
+    // bytes. `size` goes in as the base size and comes out as the size the
+    // chain produces; `deltas` is the chain length.
+    static bool checkChain(const std::string &backupDir, const std::string &relativePath,
+                           const unsigned char *key, uint64_t &size, uint32_t &deltas);
+
+private:
+    bool writeSignature(const std::string &relativePath, const SignatureBuilder &signature,
+                        const unsigned char *key, uint32_t chainLength, uint64_t chainLiteral) const;
+
+    std::string m_root;
+};
+
+#endif
@@ -1,7 +1,12 @@
 #ifndef ENCRYPT_H
 #define ENCRYPT_H
 
+#include <cstdint>
+#include <functional>
 #include <string>
+#include <vector>
+
+class WorkerPool;
 
 void encryptFile(const std::string &filePath);
 void decryptFile(const std::string &filePath);
@@ -9,8 +14,50 @@ void decryptFile(const std::string &filePath);
 // Ensure a session key/iv are generated once per run and logged via logger.
 void ensureEncryptionKeyLogged();
 
+// 64-bit fingerprint of the session key/IV (generated if need be). Safe to
+// keep next to the backup; tells which session sealed a partial object.
+uint64_t encryptionKeyCheck();
+// Same for a given 32-byte key and 16-byte IV
+uint64_t encryptionKeyCheck(const unsigned char *key, const unsigned char *iv);
+
+// Use the key/IV with fingerprint `check` from the ENCRYPTION_KEY/IV lines of
+// `logPath` for this session instead of generating new ones, so an
+// interrupted backup resumes under the key it started with. False if the log
+// has no such key or the session already has one.
+bool adoptLoggedEncryptionKey(const std::string &logPath, uint64_t check);
+
+// The ENCRYPTION_KEY/IV pair in `logPath` whose fingerprint is `check`, as hex
+bool findLoggedEncryptionKey(const std::string &logPath, uint64_t check, std::string &keyHex, std::string &ivHex);
+
+// The key/IV that sealed the backup holding `backupPath` (a backup directory
+// or anything inside one): the pair in `logPath` matching the key check of
+// the nearest manifest at or above it. Backups whose manifest predates the
+// key check get the last pair in the log. `error` says what was missing.
+bool findBackupKey(const std::string &logPath, const std::string &backupPath, std::string &keyHex,
+                   std::string &ivHex, std::string &error);
+
 // Decrypt with specific key/IV
 bool decryptFileWithKey(const std::string &encryptedPath, const std::string &outputPath, 
                         const std::string &keyHex, const std::string &ivHex);
 
+// Same with a raw 32-byte key and 16-byte IV; streams decrypt -> inflate -> write.
+// Chunked containers and legacy CTR objects are told apart by their header;
+// `pool` lets a container's chunks be opened in parallel.
+bool decryptFileWithKeyBytes(const std::string &encryptedPath, const std::string &outputPath,
+                             const unsigned char *key, const unsigned char *iv, WorkerPool *pool = nullptr);
+
+// Decrypt and inflate one object (or recipe) in memory, handing its
+// plaintext to `sink` in order; nothing is written. The gzip trailer, GCM
+// tags and chunk ids are checked exactly as on restore.
+bool readObjectWithKeyBytes(const std::string &encryptedPath, const unsigned char *key, const unsigned char *iv,
+                            WorkerPool *pool, const std::function<bool(const unsigned char *, size_t)> &sink);
+
+// Extract plaintext bytes [offset, offset + length) of one object. Containers
+// seek straight to the covering chunks; legacy objects are decoded from the
+// start and the prefix discarded.
+bool decryptFileRange(const std::string &encryptedPath, const std::string &outputPath,
+                      const std::string &keyHex, const std::string &ivHex, uint64_t offset, uint64_t length);
+
+std::vector<unsigned char> hexToBytes(const std::string &hex);
+
 #endif
@@ -0,0 +1,90 @@
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include "backup.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+
+enum BackupState {
+    kBackupIdle,
+    kBackupRunning,
+    kBackupPaused,
+    kBackupStopping,    // cancel requested, waiting for in-flight blocks
+    kBackupFinished,
+    kBackupCancelled,
+    kBackupFailed,      // performBackup threw; see BackupEngine::error()
+};
+
+const char *backupStateName(BackupState state);
+
+struct BackupProgress {
+    BackupState state = kBackupIdle;
+    uint64_t passes = 0;          // walks started so far, this one included
+    uint64_t filesQueued = 0;     // files and bytes of the current pass
+    uint64_t filesDone = 0;
+    uint64_t bytesQueued = 0;
+    uint64_t bytesDone = 0;
+    uint64_t filesFailed = 0;     // over the whole run
+    bool walkDone = false;        // the queued totals are final
+    double bytesPerSec = 0;       // since the previous report
+    double etaSeconds = -1;       // at the pass' average rate; -1 until the walk is done
+};
+
+// Runs performBackup in the calling process on a thread of its own, so the
+// GUI can drive a backup directly and the CLI runs through the same code.
+// Stop and pause reach the workers at their next block boundary instead of
+// the next pass. The key, metrics and QoS caps are process-wide, so only one
+// engine can run at a time.
+class BackupEngine {
+public:
+    using ProgressCallback = std::function<void(const BackupProgress &)>;
+
+    BackupEngine() = default;
+    // Cancels a running backup and waits for it
+    ~BackupEngine();
+
+    BackupEngine(const BackupEngine &) = delete;
+    BackupEngine &operator=(const BackupEngine &) = delete;
+
+    // Called on a reporter thread every `intervalMs` while running, and once
+    // more with the final state. Set before start().
+    void setProgressCallback(ProgressCallback callback, int intervalMs = 1000);
+
+    // False if a backup is already running in this process
+    bool start(const std::string &srcDir, const std::string &destDir, const BackupOptions &options);
+    void pause();
+    void resume();
+    // Files cut short are left for the next run
+    void cancel();
+    // Block until the run ends and return how it ended
+    BackupState wait();
+
+    BackupState state() const;
+    BackupProgress progress() const;
+    std::string error() const;
+
+private:
+    void run(std::string srcDir, std::string destDir, BackupOptions options);
+    void report();
+    void setState(BackupState state);
+
+    ProgressCallback m_callback;
+    int m_intervalMs = 1000;
+    std::thread m_runner;
+    std::thread m_reporter;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_cv;
+    BackupState m_state = kBackupIdle;
+    std::string m_error;
+    // Rate bookkeeping for progress()
+    mutable uint64_t m_lastBytes = 0;
+    mutable uint64_t m_lastPasses = 0;
+    mutable int64_t m_lastNs = 0;
+};
+
+#endif
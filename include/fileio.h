@@ -0,0 +1,221 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Which engine source reads and object writes go through. Auto uses io_uring
+// when the kernel allows it (it may be compiled out or blocked by seccomp)
+// and plain pread/pwrite otherwise.
+enum IoBackend { kIoAuto, kIoUring, kIoPosix };
+
+bool parseIoBackend(const std::string &text, IoBackend &backend);
+
+// Process-wide choice, made before any worker starts. `readDepth` is how many
+// blocks a SourceReader keeps in flight ahead of its consumer.
+void configureIo(IoBackend backend, int readDepth = 4);
+
+// How SourceReader reads a file, picked from its size at open(). Files of at
+// least `mmapThreshold` bytes are mapped with MADV_SEQUENTIAL and handed to
+// deflate straight from the page cache; files of at least `directThreshold`
+// are read with O_DIRECT into aligned blocks so a multi-GB source does not
+// push everything else out of the cache. 0 disables either.
+void configureReadStrategy(uint64_t mmapThreshold, uint64_t directThreshold);
+
+// Blocks are this large; every engine registers a handful of them with the
+// kernel so io_uring can skip pinning pages on each request
+static const size_t kIoBlockSize = 512 * 1024;
+static const int kIoMaxReadDepth = 8;
+
+// Block buffers are 4 KiB aligned so O_DIRECT can use them
+struct AlignedFree {
+    void operator()(unsigned char *p) const;
+};
+unsigned char *allocateIoBlock();
+
+// One outstanding operation. Must stay put until the engine has completed it.
+struct IoRequest {
+    long result = 0;       // bytes transferred or -errno
+    bool pending = false;
+};
+
+// Per-thread I/O engine. Submissions are only queued; they go to the kernel
+// in one batch when someone waits, so a worker's read-ahead and its pending
+// object writes share a single syscall. The posix engine simply does the
+// work at submit time.
+class IoEngine {
+public:
+    virtual ~IoEngine();
+
+    virtual const char *name() const = 0;
+    // `buffer` is a registered buffer index from acquireBuffer, or -1
+    virtual bool submitRead(IoRequest &req, int fd, void *data, size_t len, uint64_t offset, int buffer) = 0;
+    virtual bool submitWrite(IoRequest &req, int fd, const void *data, size_t len, uint64_t offset, int buffer) = 0;
+    virtual void wait(IoRequest &req) = 0;
+
+    // Hand out one of the engine's kIoBlockSize buffers (4 KiB aligned), or
+    // nullptr when all are taken
+    unsigned char *acquireBuffer(int &index);
+    void releaseBuffer(int index);
+
+protected:
+    bool allocateBuffers(int count);
+
+    std::vector<unsigned char *> m_buffers;
+    std::vector<bool> m_bufferUsed;
+};
+
+// The calling thread's engine, created on first use
+IoEngine &ioEngine();
+
+// Name of the engine the calling thread ended up with ("io_uring" or "posix")
+const char *ioBackendName();
+
+// Sequential whole-file reader that keeps up to readDepth blocks in flight.
+// Data is handed out in place with peek()/consume() so nothing is copied on
+// the way to deflate; read() copies for callers that want their own buffer.
+// The file is read up to the size fstat reported at open(). Like the engine,
+// a reader belongs to the thread that opened it. A file that shrinks while it
+// is read fails the read (a mapped one instead of raising SIGBUS), so a
+// truncated copy is never stored as if it were the whole file.
+class SourceReader {
+public:
+    SourceReader();
+    ~SourceReader();
+
+    SourceReader(const SourceReader &) = delete;
+    SourceReader &operator=(const SourceReader &) = delete;
+
+    // Start reading at `offset`, which must be a multiple of kIoBlockSize
+    bool open(const std::string &path, uint64_t offset = 0);
+    void close();
+
+    // Bytes available at the cursor: >0, 0 at end of file, -1 on error
+    long peek(const unsigned char *&data);
+    void consume(size_t n);
+    // Fill `buf` as far as the file allows; same return convention as peek
+    long read(void *buf, size_t len);
+
+    uint64_t size() const { return m_size; }
+    // "buffered", "mmap" or "direct"
+    const char *strategy() const;
+    const std::string &error() const { return m_error; }
+
+private:
+    enum Strategy { kReadBuffered, kReadMapped, kReadDirect };
+
+    struct Slot {
+        IoRequest req;
+        unsigned char *data = nullptr;
+        int buffer = -1;
+        std::unique_ptr<unsigned char, AlignedFree> owned;
+        uint64_t offset = 0;
+        size_t len = 0;
+        bool issued = false;
+    };
+
+    bool adoptPrefetched(const std::string &path);
+    bool openMapped();
+    long peekMapped(const unsigned char *&data);
+    bool issue(Slot &slot);
+    long fail(const std::string &why);
+
+    IoEngine *m_engine = nullptr;
+    int m_fd = -1;
+    std::string m_path;
+    Strategy m_strategy = kReadBuffered;
+    bool m_dropCache = false;  // O_DIRECT refused: drop pages behind us instead
+    unsigned char *m_map = nullptr;
+    int m_mapGuard = -1;
+    uint64_t m_mapPos = 0;
+    uint64_t m_size = 0;
+    int64_t m_changeNs = 0;    // ctime at open(), to tell if a prefetch went stale
+    uint64_t m_nextOffset = 0;
+    std::vector<Slot> m_slots;
+    size_t m_head = 0;
+    size_t m_cursor = 0;
+    bool m_ready = false;      // head slot has completed
+    std::string m_error;
+};
+
+// Cross-file read-ahead for the calling thread: open `path` and queue its
+// first blocks now, while the file before it is still being consumed. The
+// next SourceReader::open() of `path` at offset 0 on this thread takes them
+// over if the file's size and ctime are unchanged. Once a reader has issued
+// the last block of its file it asks the worker pool for the next task, whose
+// prefetch calls this (see WorkerPool::claimNextTask).
+void prefetchSource(const std::string &path);
+
+// Objects are written under their path plus this suffix and renamed into
+// place by finish(), so a crash never leaves a partial object under its
+// real name. Leftovers are swept up by the journal; see journal.h.
+static const char kObjectTempSuffix[] = ".abt_tmp";
+
+// Collect the final path of every object the calling thread finishes until
+// called again with nullptr. Those objects have their writeback started but
+// are not synced; whoever collected them decides when to pay for that.
+void captureFinishedObjects(std::vector<std::string> *paths);
+
+// Sequential writer for backup objects: callers fill the current block in
+// place (reserve/commit) and full blocks are written behind them while the
+// next one fills.
+class ObjectWriter {
+public:
+    ObjectWriter();
+    ~ObjectWriter();
+
+    ObjectWriter(const ObjectWriter &) = delete;
+    ObjectWriter &operator=(const ObjectWriter &) = delete;
+
+    bool open(const std::string &path);
+    // Reopen the temporary a suspended writer left for `path`, cut it back
+    // to `offset` and continue writing there
+    bool resume(const std::string &path, uint64_t offset);
+    // Free space in the current block (never 0 while open)
+    unsigned char *reserve(size_t &avail);
+    bool commit(size_t n);
+    bool write(const void *data, size_t len);
+    // Write out everything so far and fdatasync it, then carry on
+    bool sync();
+    // Flush, wait for every write, close and rename into place; false if
+    // any of it failed
+    bool finish();
+    // Wait for outstanding writes, close and delete the temporary
+    void abort();
+    // Like abort, but keep the temporary for resume()
+    void suspend();
+
+    bool isOpen() const { return m_fd >= 0; }
+    const std::string &error() const { return m_error; }
+
+private:
+    struct Slot {
+        IoRequest req;
+        unsigned char *data = nullptr;
+        int buffer = -1;
+        std::unique_ptr<unsigned char, AlignedFree> owned;
+        uint64_t offset = 0;
+        size_t len = 0;
+        bool issued = false;
+    };
+
+    bool start(int fd, uint64_t offset);
+    bool flushCurrent();
+    bool reap(Slot &slot);
+    void release();
+    bool fail(const std::string &why);
+
+    IoEngine *m_engine = nullptr;
+    int m_fd = -1;
+    std::string m_path;
+    std::string m_tempPath;
+    uint64_t m_offset = 0;
+    Slot m_slots[2];
+    int m_current = 0;
+    std::string m_error;
+};
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 64-bit content fingerprint (XXH64) kept per file in the manifest. It runs
+// at memory speed, an order of magnitude faster than even deflate level 1,
+// so re-reading a file whose mtime moved costs far less than backing it up
+// again. 0 is never produced; the manifest uses it for "not taken".
+class ContentHasher {
+public:
+    ContentHasher();
+
+    void update(const unsigned char *data, size_t len);
+    uint64_t digest() const;
+
+private:
+    void stripe(const unsigned char *p);
+
+    uint64_t m_acc[4];
+    unsigned char m_tail[32];
+    size_t m_tailLen = 0;
+    uint64_t m_total = 0;
+};
+
+// Fingerprint of the whole file at `path`, read through SourceReader
+bool fingerprintFile(const std::string &path, uint64_t &out);
+
+#endif
@@ -0,0 +1,102 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "manifest.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Where an interrupted run left a large object: its source as of the start
+// of the copy, the session key that sealed it and how far it got
+struct ObjectCheckpoint {
+    ManifestRecord source;
+    uint64_t keyCheck = 0;    // encryptionKeyCheck() of that session
+    uint64_t chunks = 0;      // full container chunks sealed
+    uint64_t offset = 0;      // bytes of <object>.abt_tmp that hold them
+    int level = 0;
+};
+
+// Append-only log of a run's progress, <dest>/.abt_journal, so a backup that
+// dies part way resumes where it stopped instead of redoing the whole pass.
+//
+// Workers hand in each finished file together with the objects it wrote
+// (already renamed into place, see ObjectWriter). A committer thread takes
+// them in groups of up to 64 or whatever arrived within a second, fdatasyncs
+// the objects, fsyncs their directories once, then appends one record per
+// file and syncs the journal once. Only then does the file reach the
+// manifest, so neither the journal nor the manifest vouches for an object
+// that might not be on disk.
+//
+// open() replays the records of an interrupted run into the manifest and
+// removes stray temporaries; reset() empties the journal again once the
+// manifest has been saved. Large containers also log checkpoints so the
+// next run can pick a partial object up from its last synced chunk.
+class BackupJournal {
+public:
+    BackupJournal(const std::string &destDir, BackupManifest &manifest);
+    ~BackupJournal();
+
+    BackupJournal(const BackupJournal &) = delete;
+    BackupJournal &operator=(const BackupJournal &) = delete;
+
+    // Recover what an earlier run left behind and start the committer. On
+    // failure the journal passes files straight to the manifest.
+    bool open();
+
+    // The file described by `record` is backed up in `objects`; it reaches
+    // the manifest once they are durable
+    void complete(const ManifestRecord &record, std::vector<std::string> objects);
+    // Block until everything handed to complete() so far is committed
+    void flush();
+    // Call after the manifest was saved: keeps only live checkpoints
+    void reset();
+    // Flush, stop the committer and remove the journal if nothing is left in it
+    void close();
+
+    // Record a synced resume point for a large object
+    void checkpoint(const ObjectCheckpoint &point);
+    // A checkpoint for this exact source (same path, size, mtime and inode)
+    bool findCheckpoint(const ManifestRecord &source, ObjectCheckpoint &out) const;
+    void dropCheckpoint(uint64_t pathHash);
+    // Session key of the recovered checkpoints, 0 if there are none
+    uint64_t checkpointKey() const;
+
+private:
+    struct Pending {
+        ManifestRecord record;
+        std::vector<std::string> objects;
+    };
+
+    bool replay();
+    void sweepTemporaries();
+    bool rewrite();
+    bool append(const void *data, size_t len);
+    void commitLoop();
+    void commitGroup(std::vector<Pending> &group);
+
+    std::string m_destDir;
+    std::string m_path;
+    BackupManifest &m_manifest;
+    int m_fd = -1;
+
+    mutable std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_committed;
+    std::deque<Pending> m_pending;
+    uint64_t m_queued = 0;       // files handed in so far
+    uint64_t m_done = 0;         // and committed (or given up on)
+    bool m_flushRequested = false;
+    bool m_stopping = false;
+    std::thread m_thread;
+    std::unordered_map<uint64_t, ObjectCheckpoint> m_checkpoints;
+    std::mutex m_fileMutex;      // appends from workers and the committer
+    bool m_appended = false;     // entries added since the last rewrite
+};
+
+#endif
@@ -1,10 +1,36 @@
 #ifndef LOGGER_H
 #define LOGGER_H
 
+#include <cstdint>
+#include <functional>
 #include <string>
 #include <mutex>
 #include <fstream>
 
+// Queue a line for log.txt. Callers only copy the text into a lock-free ring;
+// a background thread timestamps, batches and writes it.
 void logMessage(const std::string &message);
 
+// Like logMessage, but the line is repeated at the top of every rotated log so
+// it is never rotated away (used for the session key/IV). The key/IV pairs of
+// earlier sessions still in the log are carried over the same way. Pinned
+// lines are written and fdatasync'ed before this returns.
+void logPinnedMessage(const std::string &message);
+
+// Size-based rotation: log.txt -> log.txt.1 -> ... -> log.txt.<keepFiles>
+void configureLogger(const std::string &path, uint64_t maxBytes, int keepFiles);
+std::string logFilePath();
+
+// Also hand every message (without its timestamp) to `listener`, on the
+// writer thread, after it reached the file. Pinned messages are not passed on
+// since they carry the key. An empty function removes the listener.
+using LogListener = std::function<void(const std::string &)>;
+void setLogListener(LogListener listener);
+
+// Block until everything queued so far is written and fdatasync'ed
+void flushLog();
+
+// Flush and stop the writer thread; later messages are written synchronously
+void shutdownLogger();
+
 #endif
@@ -0,0 +1,73 @@
+#ifndef MANIFEST_H
+#define MANIFEST_H
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// One fixed-size record per backed-up file. The on-disk manifest is a small
+// header followed by a flat array of these, so it can be mapped and copied in
+// one go on startup.
+struct ManifestRecord {
+    uint64_t pathHash;   // hashPath() of the path relative to the source root
+    uint64_t size;
+    int64_t mtimeNs;
+    uint64_t inode;
+    uint64_t location;   // where the backup object lives, see ManifestLocation
+    uint64_t contentHash; // fingerprint of the contents backed up, 0 if not taken
+};
+
+enum ManifestLocation : uint64_t {
+    kLocationObject = 0,   // <dest>/<relative>.gz.enc
+    kLocationRecipe = 1,   // <dest>/<relative>.abtr.enc in the chunk store
+    kLocationPacked = 2,   // a record in a <dest>/.abt_packs segment
+    kLocationDelta = 3,    // <dest>/<relative>.gz.enc plus a chain in <dest>/.abt_deltas
+};
+
+// Persistent record of what has been backed up, stored as <dest>/.abt_manifest.
+// Change checks compare the source stat against the record and never touch
+// the destination. Lookups use an open-addressing table of record indices,
+// roughly 56 bytes per tracked file.
+class BackupManifest {
+public:
+    explicit BackupManifest(const std::string &destDir);
+
+    bool load();
+    bool save();
+
+    static uint64_t hashPath(const std::string &relativePath);
+    // Read only the key check of the manifest in `destDir`; false if it has none
+    static bool readKeyCheck(const std::string &destDir, uint64_t &check);
+
+    // encryptionKeyCheck() of the key every listed object is sealed with;
+    // 0 for manifests written before it was recorded
+    uint64_t keyCheck() const;
+    void setKeyCheck(uint64_t check);
+
+    // True when a record exists and size, mtime and inode all match
+    bool isUnchanged(uint64_t pathHash, uint64_t size, int64_t mtimeNs, uint64_t inode) const;
+    bool find(uint64_t pathHash, ManifestRecord &out) const;
+    void update(const ManifestRecord &record);
+    // Forget every record, so the next pass backs everything up again
+    void clear();
+    // Copy of every record, in no particular order
+    std::vector<ManifestRecord> records() const;
+
+    size_t size() const;
+    bool dirty() const;
+    const std::string &path() const { return m_path; }
+
+private:
+    size_t slotFor(uint64_t pathHash) const;
+    void rebuildIndex(size_t capacity);
+
+    std::string m_path;
+    std::vector<ManifestRecord> m_records;
+    std::vector<uint32_t> m_slots;   // record index + 1; 0 marks an empty slot
+    uint64_t m_keyCheck = 0;
+    bool m_dirty = false;
+    mutable std::mutex m_mutex;
+};
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Process-wide counters, gauges and latency histograms. Everything is a relaxed
+// atomic so the hot paths pay a couple of uncontended adds per 64 KiB block.
+
+enum MetricStage {
+    kStageRead = 0,   // source reads
+    kStageDeflate,    // gzip deflate (streaming and block-parallel)
+    kStageEncrypt,    // AES-256-CTR
+    kStageWrite,      // destination writes
+    kStageChunk,      // content-defined chunking and hashing (--dedup)
+    kStageFingerprint, // content hashes of touched files (--fingerprint)
+    kStageWalk,       // one directory walk per pass; ops = entries visited
+    kStageLog,        // logger batch writes
+    kStageCount
+};
+
+const char *metricStageName(MetricStage stage);
+
+// Power-of-two microsecond buckets: <=1us, <=2us, ... <=2^(kHistogramBuckets-2)us, +Inf
+const int kHistogramBuckets = 28;
+
+struct LatencyHistogram {
+    std::atomic<uint64_t> buckets[kHistogramBuckets] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sumNs{0};
+
+    void record(uint64_t ns);
+};
+
+struct StageMetrics {
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> ops{0};
+    LatencyHistogram latency;
+};
+
+struct BackupMetrics {
+    StageMetrics stages[kStageCount];
+    LatencyHistogram fileLatency;   // whole copyFile/dedupFile per file
+
+    std::atomic<uint64_t> filesBackedUp{0};
+    std::atomic<uint64_t> filesFailed{0};
+    std::atomic<uint64_t> filesSkipped{0};   // unchanged according to the manifest
+    std::atomic<uint64_t> fingerprintSkips{0}; // of those, touched but with matching contents
+    std::atomic<uint64_t> bytesBackedUp{0};  // source bytes of files backed up
+    std::atomic<uint64_t> bytesStored{0};    // bytes written to the destination
+    std::atomic<uint64_t> passes{0};
+
+    // Current pass; the GUI derives progress and ETA from these
+    std::atomic<uint64_t> passFilesQueued{0};
+    std::atomic<uint64_t> passBytesQueued{0};
+    std::atomic<uint64_t> passFilesDone{0};
+    std::atomic<uint64_t> passBytesDone{0};
+    std::atomic<bool> passWalkDone{false};
+    std::atomic<int64_t> passStartNs{0};
+
+    // Last completed pass: makespan the scheduler predicted from its cost
+    // model, what it took from first dispatch to idle, and the tail after
+    // the last file started during which workers ran out of work
+    std::atomic<int64_t> schedulePredictedNs{0};
+    std::atomic<int64_t> scheduleMakespanNs{0};
+    std::atomic<int64_t> scheduleTailNs{0};
+
+    std::atomic<int64_t> queueDepth{0};
+    std::atomic<int64_t> workersBusy{0};
+    std::atomic<int64_t> workers{0};
+    std::atomic<uint64_t> workerBusyNs{0};
+    std::atomic<uint64_t> workerIdleNs{0};
+
+    // QoS: workers allowed to take tasks, the load-driven scale applied to
+    // every limit (in thousandths) and time spent waiting on bandwidth caps
+    std::atomic<int64_t> qosActiveWorkers{0};
+    std::atomic<int64_t> qosScalePermille{1000};
+    std::atomic<uint64_t> qosReadWaitNs{0};
+    std::atomic<uint64_t> qosWriteWaitNs{0};
+
+    // Journal group commits: groups synced, files they made durable and the
+    // time spent syncing them
+    std::atomic<uint64_t> journalGroups{0};
+    std::atomic<uint64_t> journalFiles{0};
+    std::atomic<uint64_t> journalSyncNs{0};
+
+    // Buffer pool: fresh allocations and cache hits, workers held back by
+    // the memory cap and for how long, bytes in use now and at the peak.
+    // Codec contexts (zlib streams, EVP contexts) set up new vs reused.
+    std::atomic<uint64_t> poolAllocs{0};
+    std::atomic<uint64_t> poolReuses{0};
+    std::atomic<uint64_t> poolWaits{0};
+    std::atomic<uint64_t> poolWaitNs{0};
+    std::atomic<int64_t> poolBytesInUse{0};
+    std::atomic<uint64_t> poolBytesPeak{0};
+    std::atomic<uint64_t> codecInits{0};
+    std::atomic<uint64_t> codecReuses{0};
+
+    std::atomic<uint64_t> logLines{0};
+    std::atomic<uint64_t> logBytes{0};
+};
+
+BackupMetrics &metrics();
+
+inline int64_t metricsNowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Account `bytes` handled by `ops` operations that started at `startNs`
+void recordStage(MetricStage stage, uint64_t bytes, int64_t startNs, uint64_t ops = 1);
+
+// Reset the per-pass progress counters at the start of a walk
+void beginMetricsPass();
+
+// The current pass as the metrics file reports it: rate is averaged over the
+// pass and eta is -1 until the walk has seen every file
+struct PassProgress {
+    uint64_t filesQueued, bytesQueued, filesDone, bytesDone;
+    bool walkDone;
+    double elapsed, rate, eta;
+};
+PassProgress passProgress();
+
+std::string renderMetricsJson();
+std::string renderMetricsPrometheus();
+
+// Rewrite `path` every `intervalMs` (atomically, via rename) until stopped.
+// Files ending in .prom or .txt get Prometheus text format, anything else JSON.
+bool startMetricsExporter(const std::string &path, int intervalMs);
+void stopMetricsExporter();
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include "bufferpool.h"
+#include "codec.h"
+#include "fileio.h"
+
+#include <string>
+#include <zlib.h>
+#include <openssl/evp.h>
+
+// AES-256-CTR encrypts whatever is written and appends it to the output file.
+// Used on its own when the caller already has a compressed stream.
+class EncryptedFileWriter {
+public:
+    EncryptedFileWriter();
+    ~EncryptedFileWriter();
+
+    EncryptedFileWriter(const EncryptedFileWriter &) = delete;
+    EncryptedFileWriter &operator=(const EncryptedFileWriter &) = delete;
+
+    bool open(const std::string &outPath, const unsigned char *key, const unsigned char *iv);
+    bool write(const void *data, size_t len);
+    bool finish();
+
+    const std::string &error() const { return m_error; }
+
+private:
+    bool fail(const std::string &why);
+    void release();
+
+    ObjectWriter m_out;
+    CipherContext m_cipher;
+    std::string m_error;
+};
+
+// Streams plain bytes through gzip deflate and AES-256-CTR straight into the
+// destination file, so no intermediate .gz ever touches the disk. The result
+// is byte-for-byte what gzopen("wb9") followed by aes256CtrFile produced.
+class EncryptedGzipWriter {
+public:
+    EncryptedGzipWriter();
+    ~EncryptedGzipWriter();
+
+    EncryptedGzipWriter(const EncryptedGzipWriter &) = delete;
+    EncryptedGzipWriter &operator=(const EncryptedGzipWriter &) = delete;
+
+    bool open(const std::string &outPath, const unsigned char *key, const unsigned char *iv, int level = 9);
+    bool write(const void *data, size_t len);
+    bool finish();
+
+    const std::string &error() const { return m_error.empty() ? m_file.error() : m_error; }
+
+private:
+    bool deflateChunk(int flush);
+    bool fail(const std::string &why);
+    void release();
+
+    EncryptedFileWriter m_file;
+    DeflateStream m_zs;
+    PoolBuffer m_zbuf;
+    std::string m_error;
+};
+
+// Inverse of EncryptedGzipWriter: decrypts and inflates a .gz.enc object in
+// memory as it is read. Concatenated gzip members are read back to back.
+class EncryptedGzipReader {
+public:
+    EncryptedGzipReader();
+    ~EncryptedGzipReader();
+
+    EncryptedGzipReader(const EncryptedGzipReader &) = delete;
+    EncryptedGzipReader &operator=(const EncryptedGzipReader &) = delete;
+
+    bool open(const std::string &inPath, const unsigned char *key, const unsigned char *iv);
+
+    // Returns the number of bytes produced, 0 at end of stream, -1 on error
+    long read(void *buf, size_t len);
+
+    const std::string &error() const { return m_error; }
+
+private:
+    bool refill();
+    long fail(const std::string &why);
+    void release();
+
+    SourceReader m_in;
+    InflateStream m_zs;
+    bool m_eof = false;
+    bool m_done = false;
+    bool m_inMember = false;
+    bool m_sawMember = false;
+    CipherContext m_cipher;
+    PoolBuffer m_pbuf;
+    std::string m_error;
+};
+
+#endif
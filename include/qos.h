@@ -0,0 +1,70 @@
+#ifndef QOS_H
+#define QOS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+class WorkerPool;
+
+// ioprio class for worker threads; none leaves the kernel default
+enum IoPriorityClass { kIoClassNone, kIoClassBestEffort, kIoClassIdle };
+
+// Limits that keep a backup from hurting services on the same host. Every
+// field's default means "no limit".
+struct QosOptions {
+    uint64_t readBytesPerSec = 0;    // token-bucket caps on source reads and
+    uint64_t writeBytesPerSec = 0;   // destination writes
+    double cpuBudget = 0;            // cores the backup may keep busy
+    int nice = 0;                    // nice value for worker threads (0..19)
+    IoPriorityClass ioClass = kIoClassNone;
+    int ioLevel = 4;                 // best-effort level, 0 (high) .. 7 (low)
+    double maxLoad = 0;              // 1-minute load per core (less our own CPU
+                                     // use) above which every limit
+                                     // is scaled down until the host calms down
+};
+
+// Accepts none, idle, be or be:<0-7>
+bool parseIoPriority(const std::string &text, IoPriorityClass &ioClass, int &level);
+
+// Process-wide, before any worker starts
+void configureQos(const QosOptions &options);
+
+// Block until `bytes` more may be read or written under the current caps.
+// Free when no cap is set.
+void throttleRead(uint64_t bytes);
+void throttleWrite(uint64_t bytes);
+
+// Give the calling thread the configured nice value and I/O priority. Every
+// pool worker and walker thread calls this as it starts.
+void applyWorkerPriority();
+
+// Samples the process' CPU use and the host load average once a second.
+// Workers are parked or released to hold CPU use to the budget, and when the
+// load rises past maxLoad the bandwidth caps and worker count are halved
+// (down to 1/8) and then restored step by step as it falls again.
+class QosController {
+public:
+    QosController(WorkerPool &pool, const QosOptions &options);
+    ~QosController();
+
+    QosController(const QosController &) = delete;
+    QosController &operator=(const QosController &) = delete;
+
+private:
+    void run();
+
+    WorkerPool &m_pool;
+    QosOptions m_options;
+    int m_active;
+    double m_scale = 1.0;
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_stop = false;
+};
+
+#endif
@@ -0,0 +1,48 @@
+#ifndef RESTORE_H
+#define RESTORE_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct RestoreOptions {
+    int threadCount = 4;
+    // Globs against the original relative path ("docs/*.txt"). `*` also
+    // matches '/', and a pattern without wildcards selects that file or
+    // subtree. No includes means everything.
+    std::vector<std::string> includes;
+    std::vector<std::string> excludes;
+};
+
+struct RestoreStats {
+    uint64_t files = 0;
+    uint64_t failed = 0;
+    uint64_t bytes = 0;
+};
+
+// Rebuild the source tree from the backup in `backupDir` under `targetDir`.
+// Directories are listed level by level on the worker pool and every object
+// is decrypted and inflated straight into its target file; chunked objects
+// also open their chunks on idle workers.
+bool performRestore(const std::string &backupDir, const std::string &targetDir,
+                    const std::string &keyHex, const std::string &ivHex,
+                    const RestoreOptions &options, RestoreStats &stats);
+
+void requestStopRestore();
+
+// True if `relativePath` passes the include/exclude filters
+bool restoreFilterMatches(const RestoreOptions &options, const std::string &relativePath);
+
+// An object or recipe found in the backup, and the path it restores to
+struct BackupObject {
+    std::string object;
+    std::string relative;   // original path, without the object suffix
+};
+
+// List directory `dir` (relative to `backupDir`, "" for the top): the
+// subdirectories that may hold matching files and the current object of each
+// file that passes the filters. Manifest, stores and other .abt_ files are left out.
+void listBackupDirectory(const std::string &backupDir, const std::string &dir, const RestoreOptions &options,
+                         std::vector<std::string> &subdirs, std::vector<BackupObject> &objects);
+
+#endif
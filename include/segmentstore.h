@@ -0,0 +1,97 @@
+#ifndef SEGMENTSTORE_H
+#define SEGMENTSTORE_H
+
+#include "compress.h"
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+
+// Segments roll over at this size; compaction rewrites sealed segments whose
+// live records take up less than half of the file.
+static const uint64_t kSegmentTargetSize = 256ULL << 20;
+static const double kSegmentCompactLiveRatio = 0.5;
+
+struct PackEntry {
+    uint32_t segment;
+    uint64_t offset;   // start of the object bytes inside the segment
+    uint64_t length;
+};
+
+// Append-only pack files for small objects under <dest>/.abt_packs, so a
+// million tiny files cost a handful of inodes instead of a million. Each
+// record is a small header, the relative path and the file's gzip stream
+// sealed with AES-256-GCM under a random nonce of its own, the path being
+// authenticated with it. Records written before that hold gzip+AES-256-CTR
+// under the session IV and still read back. A sorted index maps path ->
+// (segment, offset, length); records appended after the last index save are
+// recovered by scanning segment tails on open.
+class SegmentStore {
+public:
+    explicit SegmentStore(const std::string &destDir);
+    ~SegmentStore();
+
+    SegmentStore(const SegmentStore &) = delete;
+    SegmentStore &operator=(const SegmentStore &) = delete;
+
+    // `forWriting` also trims a torn record left at the end of a segment
+    bool open(bool forWriting);
+    bool saveIndex();
+
+    // Compress, encrypt and append one file's data under `relativePath`.
+    // `fingerprint` (optional) receives the ContentHasher digest of the data stored.
+    bool storeFile(const std::string &srcPath, const std::string &relativePath,
+                   const CompressionPolicy &policy, const unsigned char *key, uint64_t *fingerprint = nullptr);
+
+    // Drop the entry (its bytes become dead space)
+    void remove(const std::string &relativePath);
+
+    bool find(const std::string &relativePath, PackEntry &out) const;
+
+    // Visit entries in path order, starting at the first path >= `prefix`
+    // and stopping once paths no longer start with it
+    void forEach(const std::string &prefix,
+                 const std::function<void(const std::string &, const PackEntry &)> &fn) const;
+
+    // Random-access restore of one object with a single positioned read
+    bool restoreFile(const std::string &relativePath, const std::string &outPath,
+                     const unsigned char *key, const unsigned char *iv) const;
+    // Same, handing the plaintext to `sink` instead of writing a file
+    bool readFile(const std::string &relativePath, const unsigned char *key, const unsigned char *iv,
+                  const std::function<bool(const unsigned char *, size_t)> &sink) const;
+
+    // Move live records out of mostly-dead sealed segments and delete them
+    bool compact();
+    // Send later appends to a new segment so the existing ones stop changing
+    // (snapshots hard-link them); takes effect once the index is saved
+    bool seal();
+
+    size_t size() const;
+    bool exists() const;
+
+private:
+    struct SegmentInfo {
+        uint64_t size = 0;
+        uint64_t live = 0;   // bytes of records still referenced by the index
+    };
+
+    std::string segmentPath(uint32_t id) const;
+    bool loadIndex();
+    bool scanSegment(uint32_t id, uint64_t from, bool trimTorn);
+    bool appendRecord(const std::string &relativePath, const std::string &object, bool gcm);
+    bool readObject(const std::string &relativePath, const PackEntry &entry, std::string &out, bool &gcm) const;
+    void setEntry(const std::string &relativePath, const PackEntry &entry);
+
+    std::string m_root;
+    std::string m_indexPath;
+    std::map<std::string, PackEntry> m_entries;
+    std::map<uint32_t, SegmentInfo> m_segments;
+    uint32_t m_active = 0;
+    int m_activeFd = -1;
+    bool m_dirty = false;
+    mutable std::mutex m_mutex;
+};
+
+#endif
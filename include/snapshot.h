@@ -0,0 +1,59 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Named point-in-time copies of a backup under <dest>/.abt_snapshots/<name>.
+// A snapshot is the backup directory again with every object hard-linked
+// instead of copied. Objects are only ever replaced by rename (see
+// ObjectWriter) and pack segments are sealed before linking, so a link keeps
+// the version it was taken at while the live tree moves on, and an unchanged
+// object costs one directory entry per snapshot. The link count is the
+// reference count: deleting a snapshot frees exactly the objects nothing else
+// links to. A snapshot directory is a complete backup directory, so
+// --restore and --verify take it as it is.
+
+struct SnapshotInfo {
+    std::string name;
+    int64_t created = 0;   // unix seconds
+    uint64_t objects = 0;
+    uint64_t bytes = 0;    // size of everything it refers to, shared or not
+};
+
+// Which snapshots pruning keeps: the newest `keepLast`, plus the newest one
+// of each of the last `keepDaily` days and `keepWeekly` weeks that have one.
+// All zero keeps everything.
+struct RetentionPolicy {
+    int keepLast = 0;
+    int keepDaily = 0;
+    int keepWeekly = 0;
+
+    bool empty() const { return keepLast <= 0 && keepDaily <= 0 && keepWeekly <= 0; }
+};
+
+struct PruneStats {
+    uint64_t snapshots = 0;     // snapshots deleted
+    uint64_t filesFreed = 0;    // objects no longer linked from anywhere
+    uint64_t bytesFreed = 0;
+};
+
+// Local time as YYYYMMDD-HHMMSS
+std::string defaultSnapshotName();
+
+// Link the current state of `destDir` into a new snapshot. Run it between
+// backups, not while one is writing to `destDir`. `threads` 0 picks
+// defaultWalkThreads().
+bool createSnapshot(const std::string &destDir, const std::string &name, int threads, SnapshotInfo &info);
+
+// Oldest first
+bool listSnapshots(const std::string &destDir, std::vector<SnapshotInfo> &out);
+
+bool deleteSnapshot(const std::string &destDir, const std::string &name, int threads, PruneStats &stats);
+
+// Delete what `policy` does not keep, and whatever an interrupted create or
+// delete left behind
+bool pruneSnapshots(const std::string &destDir, const RetentionPolicy &policy, int threads, PruneStats &stats);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct VerifyOptions {
+    int threadCount = 4;
+    // Share of the objects that are decoded; the rest are only checked to be
+    // there. The pick follows from the seed, so nightly runs with a new seed
+    // each time get through a different part of the backup every night.
+    double samplePercent = 100;
+    uint64_t sampleSeed = 0;   // 0 takes one from the clock
+    // When set, decoded files are also compared with the files under it
+    std::string sourceDir;
+    // As for restore
+    std::vector<std::string> includes;
+    std::vector<std::string> excludes;
+};
+
+struct VerifyStats {
+    uint64_t files = 0;        // decoded and matching
+    uint64_t bytes = 0;        // plaintext decoded
+    uint64_t corrupt = 0;      // failed to decrypt, inflate or authenticate
+    uint64_t mismatched = 0;   // intact, but not what the manifest or source says
+    uint64_t missing = 0;      // in the manifest, but no object in the backup
+    uint64_t skipped = 0;      // left out of the sample
+    uint64_t sampleSeed = 0;
+};
+
+// Check that the backup in `backupDir` can be restored, without writing
+// anything: every selected object is decrypted and inflated in memory on the
+// worker pool (chunked objects on several workers at once), the gzip trailer,
+// GCM tags, chunk ids and delta chains are checked, and the result is held
+// against the size and fingerprint in the manifest and, optionally, the source.
+bool performVerify(const std::string &backupDir, const std::string &keyHex, const std::string &ivHex,
+                   const VerifyOptions &options, VerifyStats &stats);
+
+void requestStopVerify();
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef WALKER_H
+#define WALKER_H
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <sys/stat.h>
+
+struct WalkEntry {
+    std::string relative;   // below the root, '/'-separated
+    struct stat st;         // of the file itself; symlinks are followed
+};
+
+struct WalkStats {
+    uint64_t entries = 0;       // directory entries seen, files and directories alike
+    uint64_t directories = 0;
+    uint64_t errors = 0;        // directories that could not be listed
+};
+
+// Threads walkTree uses when asked for 0
+int defaultWalkThreads();
+
+// Lists the tree under `root` on `threads` threads with openat and
+// getdents64. Every thread keeps a deque of directories still to list,
+// works depth-first off its back and steals from the front of the others'
+// when it runs dry. Regular files, and symlinks to them, are stat'ed on the
+// walker thread and handed to `visit` in batches on the calling thread while
+// the walk goes on, so the caller can queue work before the walk is done.
+// Symlinked directories are not followed, as with recursive_directory_iterator;
+// directories that cannot be opened are logged and skipped.
+// Returns false if the root cannot be opened, `visit` returned false or
+// `stop` was raised.
+bool walkTree(const std::string &root, int threads, const std::atomic<bool> *stop,
+              const std::function<bool(const WalkEntry &)> &visit, WalkStats &stats);
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef WATCHER_H
+#define WATCHER_H
+
+#include <chrono>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+// Linux change notification for watch mode. inotify needs one watch per
+// directory and is added recursively; fanotify marks the whole file system in
+// one call but needs CAP_SYS_ADMIN, so start() falls back to inotify without
+// it. Neither always sees everything: directories past the inotify watch
+// limit get no events, and kernels without fanotify name reporting (before
+// 5.9) only report writes, not renames into the tree. Callers rescan those
+// parts now and then; see needsFullRescan() and rescanUnwatched().
+class ChangeWatcher {
+public:
+    explicit ChangeWatcher(const std::string &root, bool useFanotify = false);
+    ~ChangeWatcher();
+
+    ChangeWatcher(const ChangeWatcher &) = delete;
+    ChangeWatcher &operator=(const ChangeWatcher &) = delete;
+
+    bool start();
+
+    // Wait up to `timeout` for activity, then keep reading until the burst has
+    // been quiet for `settle` (capped at `maxBatch`). Paths are de-duplicated.
+    // `overflowed` is set when events were lost and a full rescan is needed.
+    bool poll(std::set<std::string> &changed, bool &overflowed,
+              std::chrono::milliseconds timeout,
+              std::chrono::milliseconds settle = std::chrono::milliseconds(200),
+              std::chrono::milliseconds maxBatch = std::chrono::milliseconds(2000));
+
+    bool usingFanotify() const { return m_fanotify; }
+    size_t watchCount() const { return m_watches.size(); }
+
+    // Fanotify is limited to write events, so only a walk of the whole tree
+    // finds files renamed or moved into it
+    bool needsFullRescan() const { return m_fanotify && !m_fanotifyNames; }
+    // Retry the inotify directories that hit the watch limit and add the files
+    // of every one of them, watched now or not, to `changed`
+    void rescanUnwatched(std::set<std::string> &changed);
+    size_t unwatchedCount() const { return m_unwatched.size(); }
+
+private:
+    bool startFanotify();
+    bool startInotify();
+    bool addWatch(const std::string &dir);
+    void addWatchTree(const std::string &dir, std::set<std::string> *found);
+    bool drain(std::set<std::string> &changed, bool &overflowed);
+    bool drainInotify(std::set<std::string> &changed, bool &overflowed);
+    bool drainFanotify(std::set<std::string> &changed, bool &overflowed);
+    bool eventPath(const struct fanotify_event_metadata *ev, std::string &path) const;
+    bool underRoot(const std::string &path) const;
+
+    std::string m_root;
+    bool m_wantFanotify;
+    bool m_fanotify = false;
+    bool m_fanotifyNames = false;  // events name a directory handle and entry
+    int m_fd = -1;
+    int m_mountFd = -1;            // resolves those handles
+    std::map<int, std::string> m_watches;
+    std::set<std::string> m_unwatched;
+    std::vector<char> m_buf;
+};
+
+#endif
@@ -0,0 +1,169 @@
+#ifndef WORKPOOL_H
+#define WORKPOOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Bounded multi-producer/multi-consumer queue. push() blocks while the queue is
+// full so the directory walk cannot run arbitrarily far ahead of the workers.
+// Both ends give up once the queue is closed or the optional cancel flag is set.
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity, const std::atomic<bool> *cancel = nullptr)
+        : m_capacity(capacity > 0 ? capacity : 1), m_cancel(cancel) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_items.size() >= m_capacity && !m_closed && !cancelled()) {
+            m_notFull.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        if (m_closed || cancelled()) return false;
+        m_items.push_back(std::move(item));
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    // Queue ahead of everything else, ignoring capacity. Used for short helper
+    // jobs that must not wait behind the whole backlog.
+    bool pushFront(T item) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_closed || cancelled()) return false;
+        m_items.push_front(std::move(item));
+        m_notEmpty.notify_one();
+        return true;
+    }
+
+    // Take the front item without waiting, but only if `wanted` accepts it
+    template <typename Pred>
+    bool tryPop(T &item, Pred wanted) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (cancelled() || m_items.empty() || !wanted(m_items.front())) return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    bool pop(T &item) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (m_items.empty() && !m_closed && !cancelled()) {
+            m_notEmpty.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        if (cancelled() || m_items.empty()) return false;
+        item = std::move(m_items.front());
+        m_items.pop_front();
+        m_notFull.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_notEmpty.notify_all();
+        m_notFull.notify_all();
+    }
+
+    // Drop everything still queued; returns how many items were discarded.
+    size_t clear() {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        size_t dropped = m_items.size();
+        m_items.clear();
+        m_notFull.notify_all();
+        return dropped;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_items.size();
+    }
+
+private:
+    bool cancelled() const { return m_cancel && m_cancel->load(); }
+
+    size_t m_capacity;
+    const std::atomic<bool> *m_cancel;
+    bool m_closed = false;
+    std::deque<T> m_items;
+    mutable std::mutex m_mutex;
+    std::condition_variable m_notEmpty;
+    std::condition_variable m_notFull;
+};
+
+// Fixed set of long-lived worker threads fed from a BoundedQueue. Replaces the
+// old "spawn a thread per file and join the batch" scheme in performBackup.
+class WorkerPool {
+public:
+    using Task = std::function<void()>;
+
+    WorkerPool(int threadCount, size_t queueCapacity, const std::atomic<bool> *cancel = nullptr);
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    // Blocks while the queue is full. Returns false once the pool is cancelled
+    // or shut down, in which case the task was not queued. `prefetch`, if
+    // given, may run ahead of `task` on the worker that will run it, while
+    // that worker is still finishing its current task; see claimNextTask().
+    bool submit(Task task, Task prefetch = nullptr);
+
+    // Called from inside a task once its own reads are all issued: take the
+    // next queued task for this worker and run its prefetch now, so its first
+    // reads overlap with the end of the current task. A claimed task counts
+    // as started. Does nothing outside a worker, while another worker is
+    // waiting for work, or when the next task has no prefetch.
+    static void claimNextTask();
+
+    // Run job(0) .. job(count - 1) using any workers that are free. The caller
+    // takes part as well, so this is safe to call from inside a pool task even
+    // when every other worker is busy; it then simply runs the jobs itself.
+    void parallelFor(size_t count, const std::function<void(size_t)> &job);
+
+    // Wait until every submitted task has finished (or was discarded by cancel).
+    void waitIdle();
+
+    // Stop accepting work and join the workers. With drain=false anything still
+    // queued is discarded; running tasks always complete.
+    void shutdown(bool drain = true);
+
+    // Let only the first `count` workers take tasks; the rest park once their
+    // current task is done. Used by QoS throttling to hold CPU use down.
+    void setActiveLimit(int count);
+    int activeLimit() const { return m_activeLimit.load(); }
+
+    int threadCount() const { return static_cast<int>(m_workers.size()); }
+    size_t queueDepth() const { return m_queue.size(); }
+
+private:
+    struct Job {
+        Task run;
+        Task prefetch;
+    };
+
+    void workerLoop(int index);
+    void waitUntilActive(int index);
+    void finishTasks(size_t count);
+
+    BoundedQueue<Job> m_queue;
+    const std::atomic<bool> *m_cancel;
+    std::atomic<int> m_waiting{0};   // workers blocked on an empty queue
+    std::vector<std::thread> m_workers;
+    std::mutex m_idleMutex;
+    std::condition_variable m_idleCv;
+    size_t m_outstanding = 0;
+    bool m_shutdown = false;
+    std::atomic<int> m_activeLimit;
+    std::mutex m_parkMutex;
+    std::condition_variable m_parkCv;
+};
+
+#endif
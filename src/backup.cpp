@@ -1,23 +1,46 @@
 #include "backup.h"
+#include "bufferpool.h"
 #include "logger.h"
 #include "encrypt.h"
 #include "compress.h"
+#include "workpool.h"
+#include "pipeline.h"
+#include "watcher.h"
+#include "manifest.h"
+#include "chunkstore.h"
+#include "metrics.h"
+#include "segmentstore.h"
+#include "fileio.h"
+#include "delta.h"
+#include "walker.h"
+#include "journal.h"
+#include "fingerprint.h"
 
+#include <algorithm>
+#include <cstdio>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <memory>
+#include <queue>
 #include <thread>
 #include <vector>
 #include <mutex>
 #include <atomic>
 #include <set>
 #include <chrono>
-#include <zlib.h>
-#include <openssl/evp.h>
+#include <condition_variable>
+#include <sys/stat.h>
 
 namespace fs = std::filesystem;
 
 static std::atomic<bool> g_shouldStop{false};
+static std::atomic<bool> g_paused{false};
+static std::mutex g_controlMutex;
+static std::condition_variable g_controlCv;
 static const char *kStopFileName = ".abt_stop";
+// How often watch mode looks at what the watcher cannot see
+static const std::chrono::seconds kBlindSpotRescan(60);
 
 // External encryption key/IV from encrypt.cpp
 extern std::vector<unsigned char> g_key;
@@ -27,162 +50,728 @@ void requestStopBackup() {
     g_shouldStop.store(true);
 }
 
+bool backupStopRequested() {
+    return g_shouldStop.load();
+}
+
+void setBackupPaused(bool paused) {
+    {
+        std::lock_guard<std::mutex> lock(g_controlMutex);
+        g_paused.store(paused);
+    }
+    g_controlCv.notify_all();
+}
+
+void resetBackupControl() {
+    std::lock_guard<std::mutex> lock(g_controlMutex);
+    g_shouldStop.store(false);
+    g_paused.store(false);
+}
+
+bool backupCheckpoint() {
+    if (g_shouldStop.load(std::memory_order_relaxed)) return false;
+    if (!g_paused.load(std::memory_order_relaxed)) return true;
+    std::unique_lock<std::mutex> lock(g_controlMutex);
+    // requestStopBackup cannot notify from a signal handler, so poll as well
+    while (g_paused.load() && !g_shouldStop.load()) {
+        g_controlCv.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    return !g_shouldStop.load();
+}
+
+// Sleep between rescans, waking early for a stop
+static void sleepUnlessStopped(std::chrono::milliseconds duration) {
+    auto deadline = std::chrono::steady_clock::now() + duration;
+    std::unique_lock<std::mutex> lock(g_controlMutex);
+    while (!g_shouldStop.load() && std::chrono::steady_clock::now() < deadline) {
+        g_controlCv.wait_for(lock, std::chrono::milliseconds(100));
+    }
+}
+
 // Copy, compress, and encrypt a single file in one operation
-void copyFile(const fs::path &src, const fs::path &dest) {
+bool copyFile(const fs::path &src, const fs::path &dest, uint64_t size,
+              const BackupOptions &options, WorkerPool *pool, SignatureBuilder *signature,
+              BackupJournal *journal, const ManifestRecord *source, uint64_t *fingerprint) {
     try {
+        if (fingerprint) *fingerprint = 0;
         fs::create_directories(dest.parent_path());
 
-        // Read source file
-        std::ifstream in(src, std::ios::binary);
-        if (!in.is_open()) {
-            logMessage("Failed to open source: " + src.string());
-            return;
-        }
+        std::string encryptedPath = dest.string() + ".gz.enc";
+        ensureEncryptionKeyLogged();
 
-        // Compress and encrypt in one step
-        std::string compressedPath = dest.string() + ".gz";
-        std::string encryptedPath = compressedPath + ".enc";
-        
-        // First compress
-        gzFile gz = gzopen(compressedPath.c_str(), "wb9");
-        if (!gz) {
-            logMessage("Failed to create compressed file: " + compressedPath);
-            return;
-        }
-        
-        std::vector<char> buf(8192);
-        while (in) {
-            in.read(buf.data(), buf.size());
-            std::streamsize got = in.gcount();
-            if (got <= 0) break;
-            if (gzwrite(gz, buf.data(), static_cast<unsigned int>(got)) == 0) {
-                gzclose(gz);
-                logMessage("Compression failed: " + src.string());
-                return;
+        // Containers are checkpointed when nothing else needs every byte of
+        // the source; a checkpoint of an earlier run for the same unchanged
+        // source, sealed under this session's key, is picked up
+        bool chunked = options.format == kFormatChunked;
+        WorkerPool *sealPool = size >= options.parallelThreshold ? pool : nullptr;
+        bool resumable = chunked && journal && source && !signature;
+        ContainerWriter container;
+        ObjectCheckpoint resumed;
+        bool resuming = false;
+        if (resumable && journal->findCheckpoint(*source, resumed)) {
+            ContainerResume at;
+            at.chunks = resumed.chunks;
+            at.offset = resumed.offset;
+            resuming = resumed.keyCheck == encryptionKeyCheck() &&
+                       container.resume(encryptedPath, g_key.data(), resumed.level, sealPool, at);
+            if (resuming) {
+                logMessage("Resuming " + src.string() + " at " +
+                           std::to_string((resumed.chunks * kContainerChunkSize) >> 20) + " MiB");
+            } else {
+                journal->dropCheckpoint(source->pathHash);
             }
         }
-        gzclose(gz);
-        
-        // Then encrypt the compressed file
-        ensureEncryptionKeyLogged();
-        
-        std::ifstream compIn(compressedPath, std::ios::binary);
-        std::ofstream encOut(encryptedPath, std::ios::binary);
-        
-        if (!compIn.is_open() || !encOut.is_open()) {
-            logMessage("Failed to encrypt: " + compressedPath);
-            return;
-        }
-        
-        // AES-256-CTR encryption
-        EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-        if (!ctx) {
-            logMessage("Failed to create encryption context");
-            return;
-        }
-        
-        if (EVP_EncryptInit_ex(ctx, EVP_aes_256_ctr(), nullptr, g_key.data(), g_iv.data()) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            logMessage("Failed to initialize encryption");
-            return;
+
+        // Read source file
+        SourceReader in;
+        if (!in.open(src.string(), resuming ? resumed.chunks * kContainerChunkSize : 0)) {
+            logMessage(in.error());
+            return false;
         }
-        
-        std::vector<unsigned char> inBuf(8192);
-        std::vector<unsigned char> outBuf(inBuf.size() + EVP_CIPHER_block_size(EVP_aes_256_ctr()));
-        int outLen = 0;
-        
-        while (compIn) {
-            compIn.read(reinterpret_cast<char*>(inBuf.data()), inBuf.size());
-            std::streamsize got = compIn.gcount();
-            if (got <= 0) break;
-            
-            if (EVP_EncryptUpdate(ctx, outBuf.data(), &outLen, inBuf.data(), static_cast<int>(got)) != 1) {
-                EVP_CIPHER_CTX_free(ctx);
-                logMessage("Encryption failed: " + compressedPath);
-                return;
+
+        // Pick the level from the first block: incompressible data is stored
+        const unsigned char *data = nullptr;
+        long got = in.peek(data);
+        size_t sample = got > 0 ? static_cast<size_t>(got) : 0;
+        if (sample > kCompressionSampleSize) sample = kCompressionSampleSize;
+        int level = resuming ? resumed.level : chooseCompressionLevel(data, sample, options.compression);
+
+        // Hash exactly the bytes that go into the object
+        ContentHasher contentHasher;
+        ContentHasher *hasher = fingerprint && !resuming ? &contentHasher : nullptr;
+
+        // Feed the read-ahead blocks to `writer` without copying them
+        auto pump = [&in, &data, &got, signature, hasher](auto &writer) {
+            bool good = true;
+            while (good && got > 0) {
+                if (!backupCheckpoint()) return false;
+                if (signature) signature->update(data, static_cast<size_t>(got));
+                if (hasher) hasher->update(data, static_cast<size_t>(got));
+                good = writer.write(data, static_cast<size_t>(got));
+                in.consume(static_cast<size_t>(got));
+                got = in.peek(data);
+            }
+            return good && got == 0 && writer.finish();
+        };
+
+        bool ok;
+        bool checkpointed = resuming;
+        std::string error;
+        if (chunked) {
+            // Per-file nonce and GCM-sealed chunks; large files seal a round
+            // of chunks on all workers at once
+            if (resumable && options.checkpointBytes > 0 && size > options.checkpointBytes) {
+                container.setCheckpoint(options.checkpointBytes, [&](const ContainerResume &at) {
+                    ObjectCheckpoint point;
+                    point.source = *source;
+                    point.keyCheck = encryptionKeyCheck();
+                    point.chunks = at.chunks;
+                    point.offset = at.offset;
+                    point.level = level;
+                    journal->checkpoint(point);
+                    checkpointed = true;
+                });
             }
-            encOut.write(reinterpret_cast<char*>(outBuf.data()), outLen);
+            ok = (resuming || container.open(encryptedPath, g_key.data(), level, sealPool)) && pump(container);
+            error = in.error().empty() ? container.error() : in.error();
+        } else if (pool && pool->threadCount() > 1 && level > 0 && size >= options.parallelThreshold &&
+                   size >= 2 * kParallelGzipBlockSize) {
+            // Large file: deflate blocks on all workers, then encrypt in order
+            EncryptedFileWriter writer;
+            ok = got >= 0 && writer.open(encryptedPath, g_key.data(), g_iv.data()) &&
+                 gzipParallel([&in, signature, hasher](unsigned char *buf, size_t len) {
+                                  if (!backupCheckpoint()) return -1L;
+                                  long n = in.read(buf, len);
+                                  if (n > 0 && signature) signature->update(buf, static_cast<size_t>(n));
+                                  if (n > 0 && hasher) hasher->update(buf, static_cast<size_t>(n));
+                                  return n;
+                              },
+                              level, *pool, [&writer](const unsigned char *data, size_t len) {
+                                  return writer.write(data, len);
+                              }) &&
+                 writer.finish();
+            error = in.error().empty() ? writer.error() : in.error();
+        } else {
+            // Stream read -> deflate -> AES-256-CTR -> write in a single pass
+            EncryptedGzipWriter writer;
+            ok = writer.open(encryptedPath, g_key.data(), g_iv.data(), level) && pump(writer);
+            error = in.error().empty() ? writer.error() : in.error();
         }
-        
-        if (EVP_EncryptFinal_ex(ctx, outBuf.data(), &outLen) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
-            logMessage("Encryption final failed: " + compressedPath);
-            return;
+        // The previous object, if any, is only replaced by finish()
+        if (!ok) {
+            if (g_shouldStop.load()) {
+                // Keep the synced part for the next run to resume
+                if (checkpointed) container.suspend();
+                logMessage("Stopped before finishing: " + src.string());
+                return false;
+            }
+            logMessage("Compression/encryption failed: " + src.string() +
+                       (error.empty() ? std::string() : " (" + error + ")"));
+            return false;
         }
-        if (outLen > 0) encOut.write(reinterpret_cast<char*>(outBuf.data()), outLen);
-        
-        EVP_CIPHER_CTX_free(ctx);
-        
-        // Remove intermediate compressed file
-        std::remove(compressedPath.c_str());
         
         // Remove original backup file if it exists
         if (fs::exists(dest)) {
             fs::remove(dest);
         }
+        if (hasher) *fingerprint = hasher->digest();
+
+        logMessage(std::string(options.format == kFormatChunked ? "Backed up (chunked GCM" : "Backed up (compressed+encrypted") +
+                   ", level " + std::to_string(level) + "): " +
+                   src.string() + " -> " + encryptedPath);
+        return true;
+    } catch (...) {
+        logMessage("Failed to copy: " + src.string());
+        return false;
+    }
+}
+
+// Store a file as a recipe of deduplicated chunks instead of one object
+static bool dedupFile(ChunkStore &store, const fs::path &src, const fs::path &dest) {
+    try {
+        fs::create_directories(dest.parent_path());
+        ensureEncryptionKeyLogged();
+
+        std::string recipePath = dest.string() + ".abtr.enc";
+        if (!store.storeFile(src.string(), recipePath, g_key.data())) {
+            logMessage("Deduplicated backup failed: " + src.string());
+            return false;
+        }
+
+        // A whole-file object from a run without --dedup is now stale
+        std::error_code ec;
+        fs::remove(dest.string() + ".gz.enc", ec);
+
+        logMessage("Backed up (deduplicated): " + src.string() + " -> " + recipePath);
+        return true;
+    } catch (...) {
+        logMessage("Failed to copy: " + src.string());
+        return false;
+    }
+}
+
+// Append a small file to the pack store instead of giving it its own object
+static bool packFile(SegmentStore &store, const fs::path &src, const fs::path &dest,
+                     const std::string &relative, const BackupOptions &options, uint64_t *fingerprint) {
+    try {
+        ensureEncryptionKeyLogged();
+        if (!store.storeFile(src.string(), relative, options.compression, g_key.data(), fingerprint)) {
+            logMessage("Packed backup failed: " + src.string());
+            return false;
+        }
 
-        logMessage("Backed up (compressed+encrypted): " + src.string() + " -> " + encryptedPath);
+        // Objects from runs without --pack are now stale
+        std::error_code ec;
+        fs::remove(dest.string() + ".gz.enc", ec);
+        fs::remove(dest.string() + ".abtr.enc", ec);
+
+        logMessage("Backed up (packed): " + src.string() + " -> .abt_packs/" + relative);
+        return true;
     } catch (...) {
         logMessage("Failed to copy: " + src.string());
+        return false;
+    }
+}
+
+// Back up a large file as a delta against its previous version, or write a
+// new base object (and its signatures) when there is no usable chain. Only a
+// new base sets `fingerprint`.
+static bool deltaFile(const DeltaStore &store, const fs::path &src, const fs::path &dest,
+                      const std::string &relative, uint64_t size, const BackupOptions &options,
+                      WorkerPool *pool, uint64_t *fingerprint) {
+    try {
+        ensureEncryptionKeyLogged();
+        DeltaStats stats;
+        DeltaResult result = kDeltaNeedFull;
+        if (fs::exists(dest.string() + ".gz.enc")) {
+            result = store.storeDelta(src.string(), relative, options.compression, g_key.data(),
+                                      options.deltaMaxChain, stats);
+        }
+        if (result == kDeltaFailed) return false;
+        if (result == kDeltaStored) {
+            logMessage("Backed up (delta " + std::to_string(stats.sequence) + ", " +
+                       std::to_string(stats.literalBytes) + " new of " +
+                       std::to_string(stats.literalBytes + stats.copiedBytes) + " bytes): " + src.string());
+            return true;
+        }
+
+        if (stats.sequence > 0) {
+            logMessage("Consolidating delta chain of " + std::to_string(stats.sequence) + ": " + src.string());
+        }
+        store.drop(relative);
+        SignatureBuilder signature;
+        if (!copyFile(src, dest, size, options, pool, &signature, nullptr, nullptr, fingerprint)) return false;
+        // Without signatures the next change is simply another full backup
+        signature.finish();
+        store.saveSignature(relative, signature, g_key.data());
+        return true;
+    } catch (...) {
+        logMessage("Failed to copy: " + src.string());
+        return false;
+    }
+}
+
+static void logDedupStats(const ChunkStore &store) {
+    ChunkStoreStats st = store.stats();
+    if (st.bytesIn == 0) return;
+    // Nothing new stored means everything was already there
+    std::string ratio = st.bytesNew > 0
+        ? std::to_string(static_cast<double>(st.bytesIn) / static_cast<double>(st.bytesNew)) : std::string("inf");
+    logMessage("Dedup: " + std::to_string(st.chunksNew) + "/" + std::to_string(st.chunksIn) +
+               " chunks new, " + std::to_string(st.bytesNew) + "/" + std::to_string(st.bytesIn) +
+               " bytes stored, ratio " + ratio);
+}
+
+bool parseSchedulePolicy(const std::string &text, SchedulePolicy &policy) {
+    if (text == "lpt" || text == "size") policy = kScheduleLpt;
+    else if (text == "walk") policy = kScheduleWalk;
+    else return false;
+    return true;
+}
+
+// A file the pass has decided to back up
+struct PendingFile {
+    fs::path srcPath;
+    std::string relative;
+    ManifestRecord record;
+};
+
+// Least-squares fit of per-file backup time against size, seconds =
+// perFile + perByte * bytes. Until there is any history it assumes 0.5 ms
+// per file and 25 MB/s per worker, roughly gzip -9 on one core.
+class ScheduleModel {
+public:
+    void add(uint64_t bytes, int64_t ns) {
+        double x = static_cast<double>(bytes);
+        double y = static_cast<double>(ns) / 1e9;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_n += 1;
+        m_sx += x;
+        m_sy += y;
+        m_sxx += x * x;
+        m_sxy += x * y;
+    }
+
+    void coefficients(double &perFile, double &perByte) const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        perFile = 0.5e-3;
+        perByte = 1.0 / 25e6;
+        if (m_n == 0) return;
+        double spread = m_n * m_sxx - m_sx * m_sx;
+        if (m_n >= 2 && spread > 0) {
+            double slope = (m_n * m_sxy - m_sx * m_sy) / spread;
+            double intercept = (m_sy - slope * m_sx) / m_n;
+            if (slope > 0 && intercept >= 0) {
+                perFile = intercept;
+                perByte = slope;
+                return;
+            }
+        }
+        // Sizes too alike for a fit: fall back to the average rate
+        perFile = m_sx > 0 ? 0.0 : m_sy / m_n;
+        perByte = m_sx > 0 ? m_sy / m_sx : 0.0;
     }
+
+private:
+    mutable std::mutex m_mutex;
+    double m_n = 0, m_sx = 0, m_sy = 0, m_sxx = 0, m_sxy = 0;
+};
+
+// Replay the pool's list scheduling (each file goes to the first worker to
+// free up) over `sizes` in dispatch order
+static int64_t predictMakespanNs(const std::vector<uint64_t> &sizes, int workers, double perFile, double perByte) {
+    std::priority_queue<double, std::vector<double>, std::greater<double>> freeAt;
+    for (int i = 0; i < workers; ++i) freeAt.push(0.0);
+    double makespan = 0.0;
+    for (uint64_t size : sizes) {
+        double done = freeAt.top() + perFile + perByte * static_cast<double>(size);
+        freeAt.pop();
+        freeAt.push(done);
+        makespan = std::max(makespan, done);
+    }
+    return static_cast<int64_t>(makespan * 1e9);
+}
+
+static std::string formatSeconds(int64_t ns) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.3f s", static_cast<double>(ns) / 1e9);
+    return buf;
+}
+
+// Unchanged files keep their objects, so this run must write with the key
+// those were sealed under: take it over from the log by the manifest's key
+// check (or, for an older manifest, the interrupted run's). When that key is
+// gone, or the manifest never said which it was, the objects cannot be
+// vouched for and everything is backed up again under the run's own key.
+static void adoptBackupKey(BackupManifest &manifest, uint64_t checkpointKey) {
+    uint64_t wanted = manifest.keyCheck() != 0 ? manifest.keyCheck() : checkpointKey;
+    if (wanted != 0 && !adoptLoggedEncryptionKey(logFilePath(), wanted) && encryptionKeyCheck() != wanted) {
+        logMessage("Key of the existing backup not found in " + logFilePath());
+    }
+    uint64_t current = encryptionKeyCheck();
+    if (checkpointKey != 0 && checkpointKey != current) {
+        logMessage("Partial objects of the interrupted run were sealed under another key and are redone");
+    }
+    if (manifest.keyCheck() == current) return;
+    if (manifest.size() > 0) {
+        logMessage("Backing up every file again: " + std::to_string(manifest.size()) +
+                   " manifest entries are not known to open with this run's key");
+        manifest.clear();
+    }
+    manifest.setKeyCheck(current);
+    manifest.save();
 }
 
 // Perform multithreaded backup
 void performBackup(const std::string &srcDir, const std::string &destDir, int threadCount) {
-    if (threadCount <= 0) threadCount = 1;
+    BackupOptions options;
+    options.threadCount = threadCount;
+    performBackup(srcDir, destDir, options);
+}
+
+void performBackup(const std::string &srcDir, const std::string &destDir, const BackupOptions &options) {
+    int threadCount = options.threadCount > 0 ? options.threadCount : 1;
     
     logMessage("Starting backup from " + srcDir + " to " + destDir);
     logMessage("Press Ctrl+C to stop backup process");
+
+    // Absolute root so walk results and watcher events name files the same way
+    fs::path srcRoot = fs::absolute(srcDir).lexically_normal();
+    if (srcRoot.filename().empty()) srcRoot = srcRoot.parent_path();
+    std::string rootPrefix = srcRoot.string();
+    if (rootPrefix.empty() || rootPrefix.back() != '/') rootPrefix += '/';
     
-    std::set<fs::path> processedFiles;
-    
-    while (!g_shouldStop.load()) {
+    // Survives restarts, so unchanged files are skipped without touching the destination
+    BackupManifest manifest(destDir);
+    manifest.load();
+
+    // Files reach the manifest through the journal once their objects are
+    // durable; a run that was cut short is picked up from it here
+    BackupJournal journal(destDir, manifest);
+    journal.open();
+    adoptBackupKey(manifest, journal.checkpointKey());
+
+    std::unique_ptr<ChunkStore> chunkStore;
+    if (options.dedup) {
+        chunkStore.reset(new ChunkStore(destDir));
+        ensureEncryptionKeyLogged();
+        if (!chunkStore->open(g_key.data(), g_iv.data())) chunkStore.reset();
+    }
+
+    // Opened whenever packs exist so files that leave them drop their stale entry
+    std::unique_ptr<SegmentStore> packStore(new SegmentStore(destDir));
+    if (options.pack || packStore->exists()) {
+        if (!packStore->open(true)) packStore.reset();
+    } else {
+        packStore.reset();
+    }
+
+    // Likewise kept whenever chains exist, so a base rewritten without
+    // --delta does not have stale deltas applied on top of it
+    std::unique_ptr<DeltaStore> deltaStore(new DeltaStore(destDir));
+    if (!options.delta && !deltaStore->exists()) deltaStore.reset();
+
+    // Long-lived workers fed by the directory walk; a few tasks per worker keeps
+    // everyone busy while bounding how far the walk can run ahead.
+    configureQos(options.qos);
+    WorkerPool pool(threadCount, static_cast<size_t>(threadCount) * 4, &g_shouldStop);
+    QosController qos(pool, options.qos);
+
+    // Decide whether one source file needs a backup and fill in its record
+    auto planFile = [&](const fs::path &srcPath, const std::string &relative, const struct stat &st,
+                        PendingFile &item) {
+        item.srcPath = srcPath;
+        item.relative = relative;
+        ManifestRecord &record = item.record;
+        record = ManifestRecord{};
+        record.pathHash = BackupManifest::hashPath(item.relative);
+        record.size = static_cast<uint64_t>(st.st_size);
+        record.mtimeNs = static_cast<int64_t>(st.st_mtim.tv_sec) * 1000000000LL + st.st_mtim.tv_nsec;
+        record.inode = static_cast<uint64_t>(st.st_ino);
+        record.location = chunkStore ? kLocationRecipe : kLocationObject;
+        if (!chunkStore && packStore && options.pack && record.size <= options.packThreshold) {
+            record.location = kLocationPacked;
+        }
+        if (!chunkStore && deltaStore && options.delta && record.size >= options.deltaThreshold) {
+            record.location = kLocationDelta;
+        }
+
+        if (manifest.isUnchanged(record.pathHash, record.size, record.mtimeNs, record.inode)) {
+            metrics().filesSkipped.fetch_add(1, std::memory_order_relaxed);
+            return false; // File hasn't changed
+        }
+        // Same size, fingerprinted last time and stored the same way: the
+        // worker hashes it first and skips it if only the stat moved. Until
+        // then contentHash holds the fingerprint to compare against.
+        ManifestRecord previous;
+        if (options.fingerprint && manifest.find(record.pathHash, previous) && previous.size == record.size &&
+            previous.contentHash != 0 && previous.location == record.location) {
+            record.contentHash = previous.contentHash;
+        }
+        metrics().passFilesQueued.fetch_add(1, std::memory_order_relaxed);
+        metrics().passBytesQueued.fetch_add(record.size, std::memory_order_relaxed);
+        return true;
+    };
+
+    // Cost model fitted on every file backed up so far; the pass snapshots
+    // it before dispatching so its prediction never sees its own results
+    ScheduleModel model;
+    double passPerFile = 0.0, passPerByte = 0.0;
+    std::vector<uint64_t> dispatched;   // sizes in dispatch order
+    int64_t dispatchStart = 0;
+    std::atomic<int64_t> lastStartNs{0};
+
+    // Hand one file to the workers. Returns false only when a stop was
+    // requested while waiting for queue space.
+    auto dispatch = [&](const PendingFile &item) {
+        if (dispatched.empty()) {
+            model.coefficients(passPerFile, passPerByte);
+            dispatchStart = metricsNowNs();
+        }
+        dispatched.push_back(item.record.size);
+        fs::path srcPath = item.srcPath;
+        fs::path destPath = fs::path(destDir) / item.relative;
+        std::string relative = item.relative;
+        ManifestRecord record = item.record;
+
+        // The record carries the stat taken before the copy, so a write that
+        // races with the backup is picked up again on the next pass
+        ChunkStore *store = chunkStore.get();
+        SegmentStore *packs = packStore.get();
+        DeltaStore *deltas = deltaStore.get();
+        return pool.submit([srcPath, destPath, relative, record, store, packs, deltas, &manifest, &journal,
+                            &options, &pool, &model, &lastStartNs]() mutable {
+            // Backpressure: a worker holds nothing between files, so this is
+            // where it waits while pooled buffers are over the memory cap.
+            // Files already in flight finish and give theirs back.
+            waitForBufferMemory(std::min<uint64_t>(record.size, kContainerChunkSize) * 2 + kPoolClassSize);
+            int64_t start = metricsNowNs();
+            int64_t last = lastStartNs.load(std::memory_order_relaxed);
+            while (last < start && !lastStartNs.compare_exchange_weak(last, start, std::memory_order_relaxed)) {
+            }
+            BackupMetrics &m = metrics();
+            uint64_t expected = record.contentHash;
+            record.contentHash = 0;
+            uint64_t current = 0;
+            if (expected != 0 && fingerprintFile(srcPath.string(), current) && current == expected) {
+                // Touched but unchanged: only the new stat goes to the manifest
+                record.contentHash = current;
+                manifest.update(record);
+                m.filesSkipped.fetch_add(1, std::memory_order_relaxed);
+                m.fingerprintSkips.fetch_add(1, std::memory_order_relaxed);
+                m.passFilesDone.fetch_add(1, std::memory_order_relaxed);
+                m.passBytesDone.fetch_add(record.size, std::memory_order_relaxed);
+                return;
+            }
+
+            // The stored fingerprint is taken from the bytes actually backed
+            // up, never from the read above, so a write racing with the copy
+            // cannot leave a hash that vouches for contents the object lacks
+            uint64_t *fingerprint = options.fingerprint ? &record.contentHash : nullptr;
+            bool ok;
+            std::vector<std::string> written;
+            captureFinishedObjects(&written);
+            if (deltas && record.location != kLocationDelta) deltas->drop(relative);
+            if (record.location == kLocationDelta) {
+                ok = deltaFile(*deltas, srcPath, destPath, relative, record.size, options, &pool, fingerprint);
+                if (ok && packs) packs->remove(relative);
+            } else if (record.location == kLocationPacked) {
+                ok = packFile(*packs, srcPath, destPath, relative, options, fingerprint);
+            } else {
+                ok = store ? dedupFile(*store, srcPath, destPath)
+                           : copyFile(srcPath, destPath, record.size, options, &pool, nullptr, &journal, &record,
+                                      fingerprint);
+                if (ok && packs) packs->remove(relative);
+            }
+            captureFinishedObjects(nullptr);
+            // Packed records only become durable with the pack index saved
+            // at the end of the pass, together with the manifest
+            if (ok && record.location == kLocationPacked) manifest.update(record);
+            else if (ok) journal.complete(record, std::move(written));
+
+            int64_t elapsed = metricsNowNs() - start;
+            if (ok) model.add(record.size, elapsed);
+            m.fileLatency.record(elapsed > 0 ? static_cast<uint64_t>(elapsed) : 0);
+            // A file cut short by a stop did not fail; the next run redoes it
+            if (ok || !g_shouldStop.load()) {
+                (ok ? m.filesBackedUp : m.filesFailed).fetch_add(1, std::memory_order_relaxed);
+            }
+            if (ok) m.bytesBackedUp.fetch_add(record.size, std::memory_order_relaxed);
+            m.passFilesDone.fetch_add(1, std::memory_order_relaxed);
+            m.passBytesDone.fetch_add(record.size, std::memory_order_relaxed);
+        }, [srcPath]() {
+            // Started by a worker whose current file has all its reads in flight
+            prefetchSource(srcPath.string());
+        });
+    };
+
+    // Queue a file that needs a backup: straight away in walk order, or held
+    // in `held` until the walk has seen every size. Returns false only when
+    // a stop was requested.
+    auto considerFile = [&](const fs::path &srcPath, const std::string &relative, const struct stat &st,
+                            std::vector<PendingFile> &held, bool &queued) {
+        PendingFile item;
+        if (!planFile(srcPath, relative, st, item)) return true;
+        queued = true;
+        if (options.schedule == kScheduleLpt) {
+            held.push_back(std::move(item));
+            return true;
+        }
+        return dispatch(item);
+    };
+
+    // Dispatch whatever was held, largest first (LPT), wait for the pass to
+    // drain and report how the schedule compared with the prediction
+    auto drainPass = [&](std::vector<PendingFile> &held) {
+        std::stable_sort(held.begin(), held.end(), [](const PendingFile &a, const PendingFile &b) {
+            return a.record.size > b.record.size;
+        });
+        for (const auto &item : held) {
+            if (g_shouldStop.load() || !dispatch(item)) break;
+        }
+        held.clear();
+        // Finish the pass before rescanning so in-flight files are not queued twice
+        pool.waitIdle();
+        if (dispatched.empty()) return;
+
+        int64_t now = metricsNowNs();
+        int64_t predicted = predictMakespanNs(dispatched, threadCount, passPerFile, passPerByte);
+        int64_t makespan = now - dispatchStart;
+        int64_t tail = now - std::max(lastStartNs.load(), dispatchStart);
+        BackupMetrics &m = metrics();
+        m.schedulePredictedNs = predicted;
+        m.scheduleMakespanNs = makespan;
+        m.scheduleTailNs = tail;
+        logMessage(std::string("Schedule (") + (options.schedule == kScheduleLpt ? "lpt" : "walk") + "): " +
+                   std::to_string(dispatched.size()) + " file(s) on " + std::to_string(threadCount) +
+                   " worker(s), predicted makespan " + formatSeconds(predicted) + ", actual " +
+                   formatSeconds(makespan) + ", tail " + formatSeconds(tail));
+        dispatched.clear();
+        lastStartNs = 0;
+    };
+
+    auto fullScan = [&]() {
+        bool foundNewFiles = false;
+        std::vector<PendingFile> held;
+        beginMetricsPass();
+        int64_t walkStart = metricsNowNs();
+        // Walker threads list and stat; files reach the manifest check and
+        // the queue while the rest of the tree is still being listed
+        WalkStats walk;
+        walkTree(srcRoot.string(), options.walkThreads, &g_shouldStop, [&](const WalkEntry &entry) {
+            return considerFile(fs::path(rootPrefix + entry.relative), entry.relative, entry.st, held, foundNewFiles);
+        }, walk);
+        recordStage(kStageWalk, 0, walkStart, walk.entries);
+        metrics().passWalkDone = true;
+        drainPass(held);
+        journal.flush();
+        if (packStore) {
+            packStore->saveIndex();
+            if (foundNewFiles) packStore->compact();
+        }
+        if (manifest.save()) journal.reset();
+        if (chunkStore && foundNewFiles) logDedupStats(*chunkStore);
+        return foundNewFiles;
+    };
+
+    auto stopFileSeen = [&]() {
         // Stop if stop-file exists in destination root
         if (fs::exists(fs::path(destDir) / kStopFileName)) {
             g_shouldStop.store(true);
-            break;
+            return true;
         }
-        std::vector<std::thread> threads;
-        bool foundNewFiles = false;
-        
-        for (auto &entry : fs::recursive_directory_iterator(srcDir)) {
-            if (g_shouldStop.load()) break;
-            if (entry.is_regular_file()) {
-                fs::path relative = fs::relative(entry.path(), srcDir);
-                fs::path destPath = fs::path(destDir) / relative;
-                fs::path encryptedPath = destPath.string() + ".gz.enc";
-                
-                // Check if file was already processed and is newer
-                if (processedFiles.find(entry.path()) != processedFiles.end()) {
-                    // Check if source file is newer than encrypted backup
-                    if (fs::exists(encryptedPath)) {
-                        auto srcTime = fs::last_write_time(entry.path());
-                        auto destTime = fs::last_write_time(encryptedPath);
-                        if (srcTime <= destTime) {
-                            continue; // File hasn't changed
-                        }
-                    }
-                }
-                
-                processedFiles.insert(entry.path());
-                foundNewFiles = true;
-                
-                threads.emplace_back(copyFile, entry.path(), destPath);
-
-                if (static_cast<int>(threads.size()) >= threadCount) {
-                    for (auto &t : threads) t.join();
-                    threads.clear();
+        return false;
+    };
+
+    std::unique_ptr<ChangeWatcher> watcher;
+    if (options.watch && !options.once) {
+        // Watches go in before the initial scan so nothing written during it is lost
+        watcher.reset(new ChangeWatcher(srcRoot.string(), options.useFanotify));
+        if (!watcher->start()) {
+            logMessage("Change notification unavailable, falling back to periodic rescans");
+            watcher.reset();
+        }
+    }
+
+    if (watcher) {
+        bool needScan = true;
+        auto lastRescan = std::chrono::steady_clock::now();
+        while (!g_shouldStop.load() && !stopFileSeen()) {
+            if (needScan) {
+                needScan = false;
+                fullScan();
+                lastRescan = std::chrono::steady_clock::now();
+                if (!g_shouldStop.load()) logMessage("Initial scan complete. Watching for changes...");
+                continue;
+            }
+
+            std::set<std::string> changed;
+            bool overflowed = false;
+            if (!watcher->poll(changed, overflowed, std::chrono::seconds(1))) {
+                logMessage("Change watcher failed, falling back to periodic rescans");
+                watcher.reset();
+                break;
+            }
+            if (overflowed) {
+                // Events were dropped, so only a full walk can tell what changed
+                logMessage("Change notification queue overflowed, rescanning " + srcRoot.string());
+                needScan = true;
+                continue;
+            }
+            if (std::chrono::steady_clock::now() - lastRescan >= kBlindSpotRescan) {
+                // Renames fanotify cannot report, directories past the inotify limit
+                lastRescan = std::chrono::steady_clock::now();
+                if (watcher->needsFullRescan()) {
+                    needScan = true;
+                    continue;
                 }
+                watcher->rescanUnwatched(changed);
             }
+
+            bool queued = false;
+            std::vector<PendingFile> held;
+            beginMetricsPass();
+            for (const auto &path : changed) {
+                if (g_shouldStop.load()) break;
+                struct stat st{};
+                if (::stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+                fs::path srcPath(path);
+                if (!considerFile(srcPath, fs::relative(srcPath, srcRoot).string(), st, held, queued)) break;
+            }
+            metrics().passWalkDone = true;
+            drainPass(held);
+            journal.flush();
+            if (packStore) packStore->saveIndex();
+            if (queued && manifest.save()) journal.reset();
         }
+    }
 
-        for (auto &t : threads) t.join();
+    while (!watcher && !g_shouldStop.load()) {
+        if (stopFileSeen()) break;
+        bool foundNewFiles = fullScan();
+        if (options.once) break;
         
         if (!foundNewFiles && !g_shouldStop.load()) {
             logMessage("No new files to backup. Monitoring for changes...");
-            std::this_thread::sleep_for(std::chrono::seconds(5)); // Wait 5 seconds before checking again
+            sleepUnlessStopped(std::chrono::seconds(5));
+        }
+    }
+
+    pool.shutdown(false);
+    journal.flush();
+    if (packStore) packStore->saveIndex();
+    if (manifest.save()) journal.reset();
+    journal.close();
+
+    if (options.snapshot && options.once && !g_shouldStop.load()) {
+        packStore.reset();   // The snapshot seals the segments itself
+        SnapshotInfo info;
+        PruneStats pruned;
+        std::string name = options.snapshotName.empty() ? defaultSnapshotName() : options.snapshotName;
+        if (createSnapshot(destDir, name, options.walkThreads, info)) {
+            pruneSnapshots(destDir, options.retention, options.walkThreads, pruned);
         }
     }
     
-    logMessage("Backup process stopped by user");
+    logMessage(options.once && !g_shouldStop.load() ? "Backup pass complete" : "Backup process stopped by user");
 }
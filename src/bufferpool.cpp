@@ -0,0 +1,156 @@
+#include "bufferpool.h"
+#include "metrics.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <vector>
+
+static const size_t kPoolAlign = 4096;
+// What one thread keeps around for reuse
+static const size_t kThreadCacheBytes = 32ULL << 20;
+static const size_t kThreadCacheBuffers = 32;
+
+static std::atomic<uint64_t> g_poolCap{kDefaultBufferPoolCap};
+static std::atomic<uint64_t> g_inUse{0};
+static std::atomic<uint64_t> g_cached{0};
+static std::mutex g_waitMutex;
+static std::condition_variable g_released;
+static std::atomic<int> g_waiters{0};
+
+static size_t roundToClass(size_t size) {
+    if (size == 0) size = 1;
+    return (size + kPoolClassSize - 1) / kPoolClassSize * kPoolClassSize;
+}
+
+static void noteInUse(uint64_t inUse) {
+    BackupMetrics &m = metrics();
+    m.poolBytesInUse.store(static_cast<int64_t>(inUse), std::memory_order_relaxed);
+    uint64_t peak = m.poolBytesPeak.load(std::memory_order_relaxed);
+    while (inUse > peak && !m.poolBytesPeak.compare_exchange_weak(peak, inUse, std::memory_order_relaxed)) {
+    }
+}
+
+namespace {
+
+struct CachedBuffer {
+    unsigned char *data;
+    size_t size;
+};
+
+// Freed on thread exit so a pool that shrinks gives its memory back
+struct ThreadCache {
+    std::vector<CachedBuffer> buffers;
+    size_t bytes = 0;
+
+    ~ThreadCache() {
+        for (const CachedBuffer &b : buffers) {
+            std::free(b.data);
+            g_cached.fetch_sub(b.size);
+        }
+    }
+};
+
+} // namespace
+
+static thread_local ThreadCache t_cache;
+
+void configureBufferPool(uint64_t capBytes) {
+    g_poolCap.store(capBytes);
+}
+
+uint64_t bufferPoolHeadroom() {
+    uint64_t cap = g_poolCap.load();
+    if (cap == 0) return UINT64_MAX;
+    uint64_t used = g_inUse.load();
+    return used < cap ? cap - used : 0;
+}
+
+void waitForBufferMemory(uint64_t bytes) {
+    uint64_t cap = g_poolCap.load();
+    if (cap == 0) return;
+    auto fits = [&]() {
+        uint64_t used = g_inUse.load();
+        return used == 0 || used + bytes <= cap;
+    };
+    if (fits()) return;
+
+    int64_t start = metricsNowNs();
+    {
+        std::unique_lock<std::mutex> lock(g_waitMutex);
+        g_waiters.fetch_add(1);
+        g_released.wait(lock, fits);
+        g_waiters.fetch_sub(1);
+    }
+    BackupMetrics &m = metrics();
+    m.poolWaits.fetch_add(1, std::memory_order_relaxed);
+    m.poolWaitNs.fetch_add(static_cast<uint64_t>(metricsNowNs() - start), std::memory_order_relaxed);
+}
+
+PoolBuffer::PoolBuffer(PoolBuffer &&other) noexcept
+    : m_data(std::exchange(other.m_data, nullptr)), m_capacity(std::exchange(other.m_capacity, 0)) {}
+
+PoolBuffer &PoolBuffer::operator=(PoolBuffer &&other) noexcept {
+    if (this != &other) {
+        release();
+        m_data = std::exchange(other.m_data, nullptr);
+        m_capacity = std::exchange(other.m_capacity, 0);
+    }
+    return *this;
+}
+
+void PoolBuffer::reserve(size_t size) {
+    if (m_data && m_capacity >= size) return;
+    release();
+    size_t want = roundToClass(size);
+
+    ThreadCache &cache = t_cache;
+    for (size_t i = 0; i < cache.buffers.size(); ++i) {
+        if (cache.buffers[i].size != want) continue;
+        m_data = cache.buffers[i].data;
+        cache.buffers[i] = cache.buffers.back();
+        cache.buffers.pop_back();
+        cache.bytes -= want;
+        g_cached.fetch_sub(want);
+        metrics().poolReuses.fetch_add(1, std::memory_order_relaxed);
+        break;
+    }
+    if (!m_data) {
+        void *p = nullptr;
+        if (posix_memalign(&p, kPoolAlign, want) != 0) throw std::bad_alloc();
+        m_data = static_cast<unsigned char *>(p);
+        metrics().poolAllocs.fetch_add(1, std::memory_order_relaxed);
+    }
+    m_capacity = want;
+    noteInUse(g_inUse.fetch_add(want) + want);
+}
+
+void PoolBuffer::release() {
+    if (!m_data) return;
+    uint64_t inUse = g_inUse.fetch_sub(m_capacity) - m_capacity;
+    noteInUse(inUse);
+
+    // Cache it unless this thread already keeps enough or the cached memory
+    // would push the process over the cap
+    ThreadCache &cache = t_cache;
+    uint64_t cap = g_poolCap.load();
+    bool keep = cache.buffers.size() < kThreadCacheBuffers && cache.bytes + m_capacity <= kThreadCacheBytes &&
+                (cap == 0 || inUse + g_cached.load() + m_capacity <= cap);
+    if (keep) {
+        cache.buffers.push_back({m_data, m_capacity});
+        cache.bytes += m_capacity;
+        g_cached.fetch_add(m_capacity);
+    } else {
+        std::free(m_data);
+    }
+    m_data = nullptr;
+    m_capacity = 0;
+
+    if (g_waiters.load() > 0) {
+        std::lock_guard<std::mutex> lock(g_waitMutex);
+        g_released.notify_all();
+    }
+}
@@ -0,0 +1,421 @@
+#include "chunkstore.h"
+#include "backup.h"
+#include "bufferpool.h"
+#include "container.h"
+#include "encrypt.h"
+#include "pipeline.h"
+#include "logger.h"
+#include "metrics.h"
+#include "fileio.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+namespace fs = std::filesystem;
+
+static const char kChunkDirName[] = ".abt_chunks";
+static const char kChunkIndexName[] = "index";
+static const char kChunkKeyName[] = "key";
+static const char kRecipeMagic[] = "ABT-RECIPE 1";
+
+// Normalised chunking (FastCDC): a stricter mask before the average size and a
+// looser one after it pulls chunk lengths towards kChunkAvgSize. The masks use
+// the high bits, which depend on the most recent 64 input bytes.
+static const uint64_t kMaskSmall = ~0ULL << (64 - 18);
+static const uint64_t kMaskLarge = ~0ULL << (64 - 14);
+
+struct GearTable {
+    uint64_t values[256];
+    GearTable() {
+        // Fixed seed: cut points must be identical across runs and machines
+        uint64_t x = 0x9E3779B97F4A7C15ULL;
+        for (auto &v : values) {
+            x += 0x9E3779B97F4A7C15ULL;
+            uint64_t z = x;
+            z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+            v = z ^ (z >> 31);
+        }
+    }
+};
+static const GearTable g_gear;
+
+size_t findChunkBoundary(const unsigned char *data, size_t len) {
+    if (len <= kChunkMinSize) return len;
+    if (len > kChunkMaxSize) len = kChunkMaxSize;
+
+    size_t normal = len < kChunkAvgSize ? len : kChunkAvgSize;
+    uint64_t fp = 0;
+    size_t i = kChunkMinSize;
+    for (; i < normal; ++i) {
+        fp = (fp << 1) + g_gear.values[data[i]];
+        if (!(fp & kMaskSmall)) return i + 1;
+    }
+    for (; i < len; ++i) {
+        fp = (fp << 1) + g_gear.values[data[i]];
+        if (!(fp & kMaskLarge)) return i + 1;
+    }
+    return len;
+}
+
+std::string chunkIdToHex(const ChunkId &id) {
+    static const char *digits = "0123456789abcdef";
+    std::string out;
+    out.reserve(id.size() * 2);
+    for (unsigned char b : id) {
+        out.push_back(digits[b >> 4]);
+        out.push_back(digits[b & 0xF]);
+    }
+    return out;
+}
+
+static bool chunkIdFromHex(const std::string &hex, ChunkId &id) {
+    if (hex.size() != id.size() * 2) return false;
+    for (size_t i = 0; i < id.size(); ++i) {
+        unsigned int byte = 0;
+        if (std::sscanf(hex.c_str() + i * 2, "%2x", &byte) != 1) return false;
+        id[i] = static_cast<unsigned char>(byte);
+    }
+    return true;
+}
+
+static ChunkId hashChunk(const unsigned char *data, size_t len) {
+    ChunkId id{};
+    unsigned int outLen = 0;
+    EVP_Digest(data, len, id.data(), &outLen, EVP_sha256(), nullptr);
+    return id;
+}
+
+static std::string chunkPathUnder(const std::string &root, const ChunkId &id) {
+    std::string hex = chunkIdToHex(id);
+    return (fs::path(root) / hex.substr(0, 2) / hex).string() + ".gz.enc";
+}
+
+// Each session key gets a store of its own, named by its key check, so
+// chunks sealed for one key are never overwritten by a run under another
+static std::string keyDirName(const unsigned char *key, const unsigned char *iv) {
+    char hex[17];
+    std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(encryptionKeyCheck(key, iv)));
+    return hex;
+}
+
+// The store key lives in a container sealed under the session key
+static bool loadStoreKey(const std::string &root, const unsigned char *sessionKey,
+                         std::array<unsigned char, 32> &out) {
+    std::string path = (fs::path(root) / kChunkKeyName).string();
+    ContainerReader reader;
+    if (!reader.open(path, sessionKey) || reader.size() != out.size()) return false;
+    size_t got = 0;
+    bool ok = reader.read(0, out.size(), nullptr, [&](const unsigned char *data, size_t len) {
+        std::memcpy(out.data() + got, data, len);
+        got += len;
+        return true;
+    });
+    return ok && got == out.size();
+}
+
+static bool saveStoreKey(const std::string &root, const unsigned char *sessionKey,
+                         const std::array<unsigned char, 32> &key) {
+    ContainerWriter writer;
+    std::string path = (fs::path(root) / kChunkKeyName).string();
+    if (!writer.open(path, sessionKey, 0) || !writer.write(key.data(), key.size()) || !writer.finish()) {
+        logMessage("Failed to write chunk store key " + path + ": " + writer.error());
+        return false;
+    }
+    return true;
+}
+
+// Readers look the store key up once per store and session key
+static bool cachedStoreKey(const std::string &root, const unsigned char *sessionKey,
+                           std::array<unsigned char, 32> &out) {
+    static std::mutex mutex;
+    static std::string cachedRoot;
+    static std::array<unsigned char, 32> cachedSession{}, cachedKey{};
+    std::lock_guard<std::mutex> lock(mutex);
+    if (root == cachedRoot && std::memcmp(cachedSession.data(), sessionKey, cachedSession.size()) == 0) {
+        out = cachedKey;
+        return true;
+    }
+    if (!loadStoreKey(root, sessionKey, out)) return false;
+    cachedRoot = root;
+    std::memcpy(cachedSession.data(), sessionKey, cachedSession.size());
+    cachedKey = out;
+    return true;
+}
+
+// Both recipes and chunks are containers now; older ones are gzip+CTR
+// under the session key/IV
+static bool readObjectText(const std::string &path, const unsigned char *key, const unsigned char *iv,
+                           std::string &out, std::string &error) {
+    if (isContainerFile(path)) {
+        ContainerReader reader;
+        bool ok = reader.open(path, key) && reader.read(0, UINT64_MAX, nullptr, [&out](const unsigned char *data, size_t len) {
+            out.append(reinterpret_cast<const char *>(data), len);
+            return true;
+        });
+        if (!ok) error = reader.error();
+        return ok;
+    }
+    EncryptedGzipReader reader;
+    char buf[1 << 14];
+    long got = reader.open(path, key, iv) ? 0 : -1;
+    while (got >= 0 && (got = reader.read(buf, sizeof(buf))) > 0) out.append(buf, static_cast<size_t>(got));
+    if (got != 0) error = reader.error();
+    return got == 0;
+}
+
+size_t ChunkStore::ChunkIdHash::operator()(const ChunkId &id) const {
+    // SHA-256 output is already uniform
+    size_t h;
+    std::memcpy(&h, id.data(), sizeof(h));
+    return h;
+}
+
+ChunkStore::ChunkStore(const std::string &destDir)
+    : m_root((fs::path(destDir) / kChunkDirName).string()) {}
+
+bool ChunkStore::open(const unsigned char *key, const unsigned char *iv) {
+    m_dir = (fs::path(m_root) / keyDirName(key, iv)).string();
+    m_indexPath = (fs::path(m_dir) / kChunkIndexName).string();
+    std::error_code ec;
+    fs::create_directories(m_dir, ec);
+    if (ec) {
+        logMessage("Failed to create chunk store: " + m_dir);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    std::string keyPath = (fs::path(m_dir) / kChunkKeyName).string();
+    if (fs::exists(keyPath, ec)) {
+        // Named by this key's check, so it should open; never replace it,
+        // the chunks below it are only readable with the key it holds
+        if (!loadStoreKey(m_dir, key, m_key)) {
+            logMessage("Chunk store key " + keyPath + " does not open with this session key");
+            return false;
+        }
+    } else {
+        std::ofstream(m_indexPath, std::ios::binary | std::ios::trunc);
+        if (RAND_bytes(m_key.data(), static_cast<int>(m_key.size())) != 1 || !saveStoreKey(m_dir, key, m_key)) {
+            return false;
+        }
+    }
+    std::ifstream index(m_indexPath, std::ios::binary);
+    ChunkId id;
+    while (index.read(reinterpret_cast<char *>(id.data()), static_cast<std::streamsize>(id.size()))) {
+        m_known.insert(id);
+    }
+    logMessage("Chunk store has " + std::to_string(m_known.size()) + " chunks");
+    return true;
+}
+
+std::string ChunkStore::chunkPath(const ChunkId &id) const {
+    return chunkPathUnder(m_dir, id);
+}
+
+bool ChunkStore::storeChunk(const ChunkId &id, const unsigned char *data, size_t len) {
+    m_chunksIn++;
+    m_bytesIn += len;
+    std::shared_ptr<PendingChunk> claim;
+    {
+        // Claim the chunk first so two workers never write the same object.
+        // Whoever finds it claimed waits for the outcome: a recipe may only
+        // name the chunk once it is on disk.
+        std::unique_lock<std::mutex> lock(m_mutex);
+        if (m_known.count(id)) return true;
+        auto pending = m_pending.find(id);
+        if (pending != m_pending.end()) {
+            std::shared_ptr<PendingChunk> other = pending->second;
+            m_written.wait(lock, [&other]() { return other->done; });
+            if (!other->ok) logMessage("Chunk " + chunkIdToHex(id) + " failed to store in another worker");
+            return other->ok;
+        }
+        claim = std::make_shared<PendingChunk>();
+        m_pending.emplace(id, claim);
+    }
+
+    std::string path = chunkPath(id);
+    std::error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+
+    // Its own random nonce, so no two chunks share a keystream
+    ContainerWriter writer;
+    bool ok = writer.open(path, m_key.data(), 9) && writer.write(data, len) && writer.finish();
+    if (!ok) {
+        std::remove(path.c_str());
+        logMessage("Failed to store chunk " + chunkIdToHex(id) + ": " + writer.error());
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (ok) {
+            // Index only after the object is complete, so a crash can only lose an entry
+            m_known.insert(id);
+            std::ofstream index(m_indexPath, std::ios::binary | std::ios::app);
+            index.write(reinterpret_cast<const char *>(id.data()), static_cast<std::streamsize>(id.size()));
+            m_chunksNew++;
+            m_bytesNew += len;
+        }
+        claim->ok = ok;
+        claim->done = true;
+        m_pending.erase(id);
+    }
+    m_written.notify_all();
+    return ok;
+}
+
+bool ChunkStore::storeFile(const std::string &srcPath, const std::string &recipePath, const unsigned char *key) {
+    SourceReader in;
+    if (!in.open(srcPath)) {
+        logMessage(in.error());
+        return false;
+    }
+
+    std::ostringstream recipe;
+    recipe << kRecipeMagic << "\n";
+
+    const size_t kWindow = 4 * kChunkMaxSize;
+    PoolBuffer buf(kWindow);
+    size_t begin = 0, end = 0;
+    uint64_t total = 0;
+    bool eof = false;
+    for (;;) {
+        if (!eof && end - begin < kChunkMaxSize) {
+            std::memmove(buf.data(), buf.data() + begin, end - begin);
+            end -= begin;
+            begin = 0;
+            size_t want = kWindow - end;
+            if (!backupCheckpoint()) return false;
+            long got = in.read(buf.data() + end, want);
+            if (got < 0) {
+                logMessage(in.error());
+                return false;
+            }
+            end += static_cast<size_t>(got);
+            if (static_cast<size_t>(got) < want) eof = true;
+            continue;
+        }
+        if (begin == end) break;
+
+        int64_t start = metricsNowNs();
+        size_t n = findChunkBoundary(buf.data() + begin, end - begin);
+        ChunkId id = hashChunk(buf.data() + begin, n);
+        recordStage(kStageChunk, n, start);
+        if (!storeChunk(id, buf.data() + begin, n)) return false;
+        recipe << chunkIdToHex(id) << " " << n << "\n";
+        total += n;
+        begin += n;
+    }
+    recipe << "end " << total << "\n";
+
+    std::string text = recipe.str();
+    ContainerWriter writer;
+    if (!writer.open(recipePath, key, 9) || !writer.write(text.data(), text.size()) || !writer.finish()) {
+        std::remove(recipePath.c_str());
+        logMessage("Failed to write recipe " + recipePath + ": " + writer.error());
+        return false;
+    }
+    return true;
+}
+
+bool ChunkStore::readFile(const std::string &recipePath, const unsigned char *key, const unsigned char *iv,
+                          const std::function<bool(const unsigned char *, size_t)> &sink) {
+    fs::path root = fs::absolute(recipePath).parent_path();
+    while (!fs::is_directory(root / kChunkDirName)) {
+        if (root == root.root_path()) {
+            logMessage("No chunk store found above " + recipePath);
+            return false;
+        }
+        root = root.parent_path();
+    }
+    std::string storeRoot = (root / kChunkDirName).string();
+    std::string keyDir = (fs::path(storeRoot) / keyDirName(key, iv)).string();
+
+    std::string text, error;
+    if (!readObjectText(recipePath, key, iv, text, error)) {
+        logMessage("Failed to read recipe " + recipePath + ": " + error);
+        return false;
+    }
+
+    std::istringstream lines(text);
+    std::string line;
+    if (!std::getline(lines, line) || line != kRecipeMagic) {
+        logMessage("Not a chunk recipe: " + recipePath);
+        return false;
+    }
+
+    uint64_t total = 0;
+    bool complete = false;
+    // Chunks sit in the store of the recipe's session key; stores from
+    // before per-key stores kept them straight under .abt_chunks
+    std::array<unsigned char, 32> storeKey{}, flatStoreKey{};
+    bool haveStoreKey = false, haveFlatStoreKey = false;
+    while (std::getline(lines, line)) {
+        std::istringstream fields(line);
+        std::string hex;
+        uint64_t len = 0;
+        if (!(fields >> hex >> len)) break;
+        if (hex == "end") {
+            complete = len == total;
+            break;
+        }
+
+        ChunkId id;
+        std::string chunk;
+        std::string path;
+        bool flat = false;
+        if (chunkIdFromHex(hex, id)) {
+            path = chunkPathUnder(keyDir, id);
+            std::error_code ec;
+            if (!fs::exists(path, ec)) {
+                path = chunkPathUnder(storeRoot, id);
+                flat = true;
+            }
+        }
+        bool sealed = !path.empty() && isContainerFile(path);
+        bool &haveKey = flat ? haveFlatStoreKey : haveStoreKey;
+        std::array<unsigned char, 32> &chunkKey = flat ? flatStoreKey : storeKey;
+        if (sealed && !haveKey) {
+            const std::string &dir = flat ? storeRoot : keyDir;
+            haveKey = cachedStoreKey(dir, key, chunkKey);
+            if (!haveKey) {
+                logMessage("Chunk store key of " + dir + " does not open with this key");
+                return false;
+            }
+        }
+        if (path.empty() || !readObjectText(path, sealed ? chunkKey.data() : key, iv, chunk, error)) {
+            logMessage("Missing or unreadable chunk " + hex + " for " + recipePath);
+            return false;
+        }
+        if (chunk.size() != len || hashChunk(reinterpret_cast<const unsigned char *>(chunk.data()), chunk.size()) != id) {
+            logMessage("Corrupt chunk " + hex + " for " + recipePath);
+            return false;
+        }
+        if (!sink(reinterpret_cast<const unsigned char *>(chunk.data()), chunk.size())) return false;
+        total += len;
+    }
+
+    if (!complete) logMessage("Truncated recipe: " + recipePath);
+    return complete;
+}
+
+bool ChunkStore::restoreFile(const std::string &recipePath, const std::string &outPath,
+                             const unsigned char *key, const unsigned char *iv) {
+    std::ofstream out(outPath, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) return false;
+    bool ok = readFile(recipePath, key, iv, [&out](const unsigned char *data, size_t len) {
+        out.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(len));
+        return static_cast<bool>(out);
+    });
+    out.close();
+    return ok && !out.fail();
+}
+
+ChunkStoreStats ChunkStore::stats() const {
+    return ChunkStoreStats{m_bytesIn.load(), m_bytesNew.load(), m_chunksIn.load(), m_chunksNew.load()};
+}
@@ -0,0 +1,167 @@
+#include "codec.h"
+#include "metrics.h"
+
+#include <vector>
+
+// Contexts a thread keeps per kind; a worker rarely has more than a couple
+// open at once
+static const size_t kCodecCacheSize = 4;
+
+namespace {
+
+struct CachedStream {
+    z_stream *zs;
+    int windowBits;
+    int level;      // deflate only
+};
+
+struct CodecCache {
+    std::vector<CachedStream> deflaters;
+    std::vector<CachedStream> inflaters;
+    std::vector<EVP_CIPHER_CTX *> ciphers;
+
+    ~CodecCache() {
+        for (const CachedStream &s : deflaters) {
+            deflateEnd(s.zs);
+            delete s.zs;
+        }
+        for (const CachedStream &s : inflaters) {
+            inflateEnd(s.zs);
+            delete s.zs;
+        }
+        for (EVP_CIPHER_CTX *ctx : ciphers) EVP_CIPHER_CTX_free(ctx);
+    }
+};
+
+} // namespace
+
+static thread_local CodecCache t_codecs;
+
+static void countCodec(bool reused) {
+    BackupMetrics &m = metrics();
+    (reused ? m.codecReuses : m.codecInits).fetch_add(1, std::memory_order_relaxed);
+}
+
+// A cached stream with these parameters, detached from the cache. The reset
+// calls keep next_in/avail_in, which still point into the last user's buffer
+// when it stopped early or failed, so they are cleared here.
+static z_stream *takeStream(std::vector<CachedStream> &cache, int windowBits, int level) {
+    for (size_t i = 0; i < cache.size(); ++i) {
+        if (cache[i].windowBits != windowBits || cache[i].level != level) continue;
+        z_stream *zs = cache[i].zs;
+        cache[i] = cache.back();
+        cache.pop_back();
+        zs->next_in = Z_NULL;
+        zs->avail_in = 0;
+        zs->next_out = Z_NULL;
+        zs->avail_out = 0;
+        return zs;
+    }
+    return nullptr;
+}
+
+bool DeflateStream::begin(int level, int windowBits) {
+    end();
+    // Streams are only reused at the same level: deflateParams on a reset
+    // stream is not reliable across zlib versions, and a run uses one level
+    z_stream *zs = takeStream(t_codecs.deflaters, windowBits, level);
+    if (zs) {
+        if (deflateReset(zs) == Z_OK) {
+            countCodec(true);
+            m_zs = zs;
+            m_windowBits = windowBits;
+            m_level = level;
+            return true;
+        }
+        deflateEnd(zs);
+        delete zs;
+    }
+
+    zs = new z_stream{};
+    if (deflateInit2(zs, level, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        delete zs;
+        return false;
+    }
+    countCodec(false);
+    m_zs = zs;
+    m_windowBits = windowBits;
+    m_level = level;
+    return true;
+}
+
+void DeflateStream::end() {
+    if (!m_zs) return;
+    std::vector<CachedStream> &cache = t_codecs.deflaters;
+    if (cache.size() < kCodecCacheSize) {
+        cache.push_back({m_zs, m_windowBits, m_level});
+    } else {
+        deflateEnd(m_zs);
+        delete m_zs;
+    }
+    m_zs = nullptr;
+}
+
+bool InflateStream::begin(int windowBits) {
+    end();
+    z_stream *zs = takeStream(t_codecs.inflaters, windowBits, 0);
+    if (zs) {
+        if (inflateReset(zs) == Z_OK) {
+            countCodec(true);
+            m_zs = zs;
+            m_windowBits = windowBits;
+            return true;
+        }
+        inflateEnd(zs);
+        delete zs;
+    }
+
+    zs = new z_stream{};
+    if (inflateInit2(zs, windowBits) != Z_OK) {
+        delete zs;
+        return false;
+    }
+    countCodec(false);
+    m_zs = zs;
+    m_windowBits = windowBits;
+    return true;
+}
+
+void InflateStream::end() {
+    if (!m_zs) return;
+    std::vector<CachedStream> &cache = t_codecs.inflaters;
+    if (cache.size() < kCodecCacheSize) {
+        cache.push_back({m_zs, m_windowBits, 0});
+    } else {
+        inflateEnd(m_zs);
+        delete m_zs;
+    }
+    m_zs = nullptr;
+}
+
+bool CipherContext::begin() {
+    end();
+    std::vector<EVP_CIPHER_CTX *> &cache = t_codecs.ciphers;
+    if (!cache.empty()) {
+        m_ctx = cache.back();
+        cache.pop_back();
+        countCodec(true);
+        return true;
+    }
+    m_ctx = EVP_CIPHER_CTX_new();
+    if (!m_ctx) return false;
+    countCodec(false);
+    return true;
+}
+
+void CipherContext::end() {
+    if (!m_ctx) return;
+    std::vector<EVP_CIPHER_CTX *> &cache = t_codecs.ciphers;
+    if (cache.size() < kCodecCacheSize * 2) {
+        // Kept initialised: the next EVP_*Init_ex with the same cipher reuses
+        // its state and only sets the new key and IV
+        cache.push_back(m_ctx);
+    } else {
+        EVP_CIPHER_CTX_free(m_ctx);
+    }
+    m_ctx = nullptr;
+}
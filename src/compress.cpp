@@ -1,24 +1,102 @@
 #include "compress.h"
+#include "bufferpool.h"
+#include "codec.h"
 #include "logger.h"
+#include "metrics.h"
+#include "workpool.h"
+#include <algorithm>
 #include <iostream>
 #include <zlib.h>
 #include <fstream>
 #include <vector>
+#include <cstdint>
+#include <cmath>
 
-static bool gzipFile(const std::string &inPath, const std::string &outPath) {
+double estimateEntropy(const unsigned char *data, size_t len) {
+    if (len == 0) return 0.0;
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < len; ++i) counts[data[i]]++;
+    double entropy = 0.0;
+    for (size_t c : counts) {
+        if (c == 0) continue;
+        double p = static_cast<double>(c) / static_cast<double>(len);
+        entropy -= p * std::log2(p);
+    }
+    return entropy;
+}
+
+// Compressed/original size of a fast trial deflate over the sample
+static double trialRatio(const unsigned char *data, size_t len) {
+    uLong bound = compressBound(static_cast<uLong>(len));
+    std::vector<unsigned char> out(bound);
+    uLongf outLen = bound;
+    if (compress2(out.data(), &outLen, data, static_cast<uLong>(len), 1) != Z_OK) return 1.0;
+    return static_cast<double>(outLen) / static_cast<double>(len);
+}
+
+int chooseCompressionLevel(const unsigned char *sample, size_t len, const CompressionPolicy &policy) {
+    if (policy.fixedLevel >= 0) return policy.fixedLevel;
+
+    int level = policy.target == CompressionPolicy::Speed ? 1
+              : policy.target == CompressionPolicy::Balanced ? 6 : 9;
+    if (!policy.adaptive || len < 512) return level;
+
+    // Byte entropy is nearly free and catches JPEG/zip/video/encrypted input;
+    // the trial deflate confirms before giving up on compression entirely
+    double entropy = estimateEntropy(sample, len);
+    if (entropy < 6.0) return level;
+    double ratio = trialRatio(sample, len);
+    if (ratio > 0.97) return 0;
+    // Barely compressible: higher levels cost several times the CPU for little gain
+    if (ratio > 0.85) return 1;
+    return level;
+}
+
+bool parseCompressionPolicy(const std::string &text, CompressionPolicy &policy) {
+    CompressionPolicy p;
+    if (text == "auto" || text == "ratio") {
+        p.target = CompressionPolicy::Ratio;
+    } else if (text == "speed") {
+        p.target = CompressionPolicy::Speed;
+    } else if (text == "balanced") {
+        p.target = CompressionPolicy::Balanced;
+    } else if (text == "store") {
+        p.fixedLevel = 0;
+    } else if (text == "fast") {
+        p.fixedLevel = 1;
+    } else if (text == "best") {
+        p.fixedLevel = 9;
+    } else if (text.size() == 1 && text[0] >= '0' && text[0] <= '9') {
+        p.fixedLevel = text[0] - '0';
+    } else {
+        return false;
+    }
+    if (p.fixedLevel >= 0) p.adaptive = false;
+    policy = p;
+    return true;
+}
+
+static bool gzipFile(const std::string &inPath, const std::string &outPath, int &level) {
     std::ifstream in(inPath, std::ios::binary);
     if (!in.is_open()) return false;
-    gzFile out = gzopen(outPath.c_str(), "wb9");
-    if (!out) return false;
+
     std::vector<char> buf(1 << 15);
-    while (in) {
-        in.read(buf.data(), static_cast<std::streamsize>(buf.size()));
-        std::streamsize got = in.gcount();
-        if (got <= 0) break;
+    in.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+    std::streamsize got = in.gcount();
+    level = chooseCompressionLevel(reinterpret_cast<const unsigned char *>(buf.data()),
+                                   static_cast<size_t>(got), CompressionPolicy());
+
+    std::string mode = "wb" + std::to_string(level);
+    gzFile out = gzopen(outPath.c_str(), mode.c_str());
+    if (!out) return false;
+    while (got > 0) {
         if (gzwrite(out, buf.data(), static_cast<unsigned int>(got)) == 0) {
             gzclose(out);
             return false;
         }
+        if (!in) break;
+        in.read(buf.data(), static_cast<std::streamsize>(buf.size()));
+        got = in.gcount();
     }
     gzclose(out);
     return true;
@@ -26,8 +104,9 @@ static bool gzipFile(const std::string &inPath, const std::string &outPath) {
 
 void compressFile(const std::string &filePath) {
     std::string outPath = filePath + ".gz";
-    if (gzipFile(filePath, outPath)) {
-        logMessage("Compressed file: " + filePath + " -> " + outPath);
+    int level = 9;
+    if (gzipFile(filePath, outPath, level)) {
+        logMessage("Compressed file (level " + std::to_string(level) + "): " + filePath + " -> " + outPath);
     } else {
         logMessage("Compression failed: " + filePath);
     }
@@ -36,3 +115,127 @@ void compressFile(const std::string &filePath) {
 void decompressFile(const std::string &filePath) {
     logMessage("Decompressed file: " + filePath);
 }
+
+struct GzipBlock {
+    PoolBuffer in;
+    size_t inLen = 0;
+    PoolBuffer out;
+    size_t outLen = 0;
+    uLong crc = 0;
+    bool ok = false;
+};
+
+// Deflate one block as raw deflate data. Every block but the last ends with a
+// sync flush so the next block starts byte-aligned and can simply be appended.
+static void deflateBlock(GzipBlock &block, const unsigned char *dict, size_t dictLen, int level, bool last) {
+    int64_t start = metricsNowNs();
+    block.crc = crc32(0L, block.in.data(), static_cast<uInt>(block.inLen));
+    block.ok = false;
+
+    DeflateStream zs;
+    if (!zs.begin(level, -MAX_WBITS)) return;
+    if (dictLen > 0 && deflateSetDictionary(zs.get(), dict, static_cast<uInt>(dictLen)) != Z_OK) return;
+
+    size_t room = deflateBound(zs.get(), static_cast<uLong>(block.inLen)) + 16;
+    block.out.reserve(room);
+    zs->next_in = block.in.data();
+    zs->avail_in = static_cast<uInt>(block.inLen);
+    zs->next_out = block.out.data();
+    zs->avail_out = static_cast<uInt>(room);
+    int ret = deflate(zs.get(), last ? Z_FINISH : Z_SYNC_FLUSH);
+    block.ok = last ? ret == Z_STREAM_END : (ret == Z_OK && zs->avail_in == 0);
+    block.outLen = room - zs->avail_out;
+    recordStage(kStageDeflate, block.inLen, start);
+}
+
+bool gzipParallel(const ReadSource &source, int level, WorkerPool &pool,
+                  const std::function<bool(const unsigned char *, size_t)> &sink) {
+    const size_t kDictSize = 32 * 1024;
+
+    // Same header gzopen writes: no name or mtime, XFL from the level, OS = Unix
+    unsigned char header[10] = {0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3};
+    header[8] = level >= 9 ? 2 : (level < 2 ? 4 : 0);
+    if (!sink(header, sizeof(header))) return false;
+
+    // Work in rounds of a few blocks per worker so memory stays bounded, and
+    // fewer if the buffer pool is short (a block holds about twice its size)
+    size_t perRound = static_cast<size_t>(pool.threadCount()) * 2;
+    uint64_t fit = bufferPoolHeadroom() / (2ULL * kParallelGzipBlockSize);
+    perRound = static_cast<size_t>(std::max<uint64_t>(1, std::min<uint64_t>(perRound, fit)));
+    std::vector<GzipBlock> blocks(perRound);
+    std::vector<unsigned char> dict;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    uint64_t total = 0;
+
+    // Read one block ahead so the final block can be flagged as last
+    auto readBlock = [&source](GzipBlock &block) {
+        block.in.reserve(kParallelGzipBlockSize);
+        long got = source(block.in.data(), kParallelGzipBlockSize);
+        block.inLen = got > 0 ? static_cast<size_t>(got) : 0;
+        return got;
+    };
+    GzipBlock pending;
+    if (readBlock(pending) < 0) return false;
+    bool eof = pending.inLen < kParallelGzipBlockSize;
+
+    for (;;) {
+        size_t n = 0;
+        bool lastRound = false;
+        while (n < perRound) {
+            std::swap(blocks[n].in, pending.in);
+            std::swap(blocks[n].inLen, pending.inLen);
+            ++n;
+            if (eof) {
+                lastRound = true;
+                break;
+            }
+            if (readBlock(pending) < 0) return false;
+            eof = pending.inLen < kParallelGzipBlockSize;
+            if (pending.inLen == 0) {
+                lastRound = true;
+                break;
+            }
+        }
+
+        // Block i uses the tail of block i-1; the first block of a round uses
+        // the tail carried over from the previous round
+        std::vector<unsigned char> roundDict = dict;
+        pool.parallelFor(n, [&](size_t i) {
+            const unsigned char *d = nullptr;
+            size_t dlen = 0;
+            if (i == 0) {
+                d = roundDict.data();
+                dlen = roundDict.size();
+            } else {
+                const GzipBlock &prev = blocks[i - 1];
+                dlen = prev.inLen < kDictSize ? prev.inLen : kDictSize;
+                d = prev.in.data() + prev.inLen - dlen;
+            }
+            deflateBlock(blocks[i], d, dlen, level, lastRound && i == n - 1);
+        });
+
+        for (size_t i = 0; i < n; ++i) {
+            GzipBlock &b = blocks[i];
+            if (!b.ok) {
+                logMessage("Parallel deflate failed");
+                return false;
+            }
+            if (b.outLen > 0 && !sink(b.out.data(), b.outLen)) return false;
+            crc = crc32_combine(crc, b.crc, static_cast<z_off_t>(b.inLen));
+            total += b.inLen;
+        }
+
+        const GzipBlock &tail = blocks[n - 1];
+        size_t keep = tail.inLen < kDictSize ? tail.inLen : kDictSize;
+        dict.assign(tail.in.data() + tail.inLen - keep, tail.in.data() + tail.inLen);
+        if (lastRound) break;
+    }
+
+    // Trailer: CRC-32 and length mod 2^32, little-endian
+    unsigned char trailer[8];
+    for (int i = 0; i < 4; ++i) {
+        trailer[i] = static_cast<unsigned char>((crc >> (8 * i)) & 0xFF);
+        trailer[4 + i] = static_cast<unsigned char>((total >> (8 * i)) & 0xFF);
+    }
+    return sink(trailer, sizeof(trailer));
+}
@@ -0,0 +1,513 @@
+#include "container.h"
+#include "codec.h"
+#include "logger.h"
+#include "metrics.h"
+#include "workpool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+static const char kContainerMagic[8] = {'A', 'B', 'T', 'C', 'H', 'U', 'N', 'K'};
+static const char kFooterMagic[8] = {'A', 'B', 'T', 'C', 'E', 'N', 'D', '1'};
+static const uint32_t kContainerVersion = 1;
+static const size_t kGcmTagSize = 16;
+static const uint32_t kMaxChunkSize = 64 << 20;
+
+enum ChunkMethod : uint8_t { kChunkStored = 0, kChunkDeflate = 1 };
+
+struct ContainerHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t chunkSize;
+    uint32_t flags;
+    uint8_t noncePrefix[7];
+    uint8_t reserved[5];
+};
+
+// Precedes each chunk's ciphertext and is authenticated with it
+struct ChunkHeader {
+    uint32_t storedLen;     // ciphertext bytes, tag not included
+    uint32_t plainLen;
+    uint8_t method;
+    uint8_t reserved[7];
+};
+
+struct ContainerFooter {
+    uint64_t indexOffset;
+    uint64_t chunkCount;
+    uint64_t plainSize;
+    char magic[8];
+};
+
+static_assert(sizeof(ContainerHeader) == 32, "container header layout");
+static_assert(sizeof(ChunkHeader) == 16, "chunk header layout");
+static_assert(sizeof(ContainerFooter) == 32, "container footer layout");
+
+bool parseObjectFormat(const std::string &text, ObjectFormat &format) {
+    if (text == "chunked" || text == "gcm") format = kFormatChunked;
+    else if (text == "legacy" || text == "ctr") format = kFormatLegacy;
+    else return false;
+    return true;
+}
+
+// prefix(7) || big-endian chunk number(4) || 1 on the final chunk
+static void chunkNonce(const ContainerHeader &header, uint64_t index, bool last, unsigned char nonce[12]) {
+    std::memcpy(nonce, header.noncePrefix, 7);
+    nonce[7] = static_cast<unsigned char>(index >> 24);
+    nonce[8] = static_cast<unsigned char>(index >> 16);
+    nonce[9] = static_cast<unsigned char>(index >> 8);
+    nonce[10] = static_cast<unsigned char>(index);
+    nonce[11] = last ? 1 : 0;
+}
+
+static bool preadAll(int fd, void *data, size_t len, uint64_t offset) {
+    char *p = static_cast<char *>(data);
+    while (len > 0) {
+        ssize_t n = ::pread(fd, p, len, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+// Deflate (raw, per chunk) if it helps, then AES-256-GCM. The payload is
+// deflated straight into `out` behind the chunk header and encrypted there in
+// place, so sealing needs no buffer besides the sealed record itself.
+static bool sealChunk(const unsigned char *plain, size_t plainLen, int level, const unsigned char *key,
+                      const std::vector<unsigned char> &headerBytes, uint64_t index, bool last,
+                      PoolBuffer &out, size_t &outLen) {
+    ChunkHeader ch;
+    std::memset(&ch, 0, sizeof(ch));
+    ch.plainLen = static_cast<uint32_t>(plainLen);
+    ch.method = kChunkStored;
+
+    DeflateStream zs;
+    size_t room = plainLen;
+    if (level > 0 && plainLen > 0) {
+        if (!zs.begin(level, -MAX_WBITS)) return false;
+        room = std::max<size_t>(room, deflateBound(zs.get(), static_cast<uLong>(plainLen)));
+    }
+    out.reserve(sizeof(ch) + room + kGcmTagSize);
+    unsigned char *payload = out.data() + sizeof(ch);
+    size_t payloadLen = plainLen;
+    if (zs.get()) {
+        int64_t start = metricsNowNs();
+        zs->next_in = const_cast<Bytef *>(plain);
+        zs->avail_in = static_cast<uInt>(plainLen);
+        zs->next_out = payload;
+        zs->avail_out = static_cast<uInt>(room);
+        int ret = deflate(zs.get(), Z_FINISH);
+        if (ret != Z_STREAM_END) return false;
+        recordStage(kStageDeflate, plainLen, start);
+        size_t packedLen = room - zs->avail_out;
+        if (packedLen < plainLen) {
+            ch.method = kChunkDeflate;
+            payloadLen = packedLen;
+        }
+    }
+    const unsigned char *in = ch.method == kChunkDeflate ? payload : plain;
+    ch.storedLen = static_cast<uint32_t>(payloadLen);
+
+    const ContainerHeader *header = reinterpret_cast<const ContainerHeader *>(headerBytes.data());
+    unsigned char nonce[12];
+    chunkNonce(*header, index, last, nonce);
+
+    outLen = sizeof(ch) + payloadLen + kGcmTagSize;
+    std::memcpy(out.data(), &ch, sizeof(ch));
+    int64_t start = metricsNowNs();
+    CipherContext cipher;
+    if (!cipher.begin()) return false;
+    EVP_CIPHER_CTX *ctx = cipher.get();
+    unsigned char tail[EVP_MAX_BLOCK_LENGTH];
+    int len = 0;
+    bool ok = EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key, nonce) == 1 &&
+              EVP_EncryptUpdate(ctx, nullptr, &len, headerBytes.data(), static_cast<int>(headerBytes.size())) == 1 &&
+              EVP_EncryptUpdate(ctx, nullptr, &len, out.data(), sizeof(ch)) == 1 &&
+              (payloadLen == 0 ||
+               EVP_EncryptUpdate(ctx, payload, &len, in, static_cast<int>(payloadLen)) == 1) &&
+              EVP_EncryptFinal_ex(ctx, tail, &len) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, kGcmTagSize, payload + payloadLen) == 1;
+    if (ok) recordStage(kStageEncrypt, payloadLen, start);
+    return ok;
+}
+
+ContainerWriter::ContainerWriter() {}
+
+ContainerWriter::~ContainerWriter() {
+    m_out.abort();
+}
+
+bool ContainerWriter::open(const std::string &outPath, const unsigned char *key, int level, WorkerPool *pool) {
+    m_error.clear();
+    m_key.assign(key, key + 32);
+    m_level = level;
+    m_sealed = 0;
+    m_offset = 0;
+    m_plainSize = 0;
+    m_index.clear();
+
+    ContainerHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kContainerMagic, sizeof(header.magic));
+    header.version = kContainerVersion;
+    header.chunkSize = kContainerChunkSize;
+    if (RAND_bytes(header.noncePrefix, sizeof(header.noncePrefix)) != 1) return fail("Failed to generate nonce");
+    const unsigned char *h = reinterpret_cast<const unsigned char *>(&header);
+    m_header.assign(h, h + sizeof(header));
+    startRounds(pool);
+
+    if (!m_out.open(outPath)) return fail(m_out.error());
+    if (!m_out.write(m_header.data(), m_header.size())) return fail(m_out.error());
+    m_offset = m_header.size();
+    m_open = true;
+    return true;
+}
+
+bool ContainerWriter::resume(const std::string &outPath, const unsigned char *key, int level, WorkerPool *pool,
+                             const ContainerResume &at) {
+    m_error.clear();
+    m_key.assign(key, key + 32);
+    m_level = level;
+    m_index.clear();
+
+    // Take the header (and its nonce prefix) back from the partial object
+    // and walk the chunk headers to rebuild the index
+    std::string tempPath = outPath + kObjectTempSuffix;
+    int fd = ::open(tempPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return fail("No partial object to resume: " + outPath);
+    ContainerHeader header;
+    bool ok = preadAll(fd, &header, sizeof(header), 0) &&
+              std::memcmp(header.magic, kContainerMagic, sizeof(header.magic)) == 0 &&
+              header.version == kContainerVersion && header.chunkSize == kContainerChunkSize;
+    uint64_t offset = sizeof(header);
+    for (uint64_t i = 0; ok && i < at.chunks; ++i) {
+        ChunkHeader ch;
+        ok = preadAll(fd, &ch, sizeof(ch), offset) && ch.plainLen == kContainerChunkSize;
+        m_index.push_back(offset);
+        offset += sizeof(ch) + ch.storedLen + kGcmTagSize;
+    }
+    ::close(fd);
+    if (!ok || offset != at.offset) return fail("Partial object does not match its checkpoint: " + outPath);
+
+    const unsigned char *h = reinterpret_cast<const unsigned char *>(&header);
+    m_header.assign(h, h + sizeof(header));
+    startRounds(pool);
+    if (!m_out.resume(outPath, at.offset)) return fail(m_out.error());
+    m_sealed = at.chunks;
+    m_offset = at.offset;
+    m_plainSize = at.chunks * kContainerChunkSize;
+    m_open = true;
+    return true;
+}
+
+void ContainerWriter::startRounds(WorkerPool *pool) {
+    m_pool = pool;
+    // A round is a couple of chunks per worker so memory stays bounded, and
+    // fewer when the buffer pool is short: each chunk holds about two chunks'
+    // worth of buffers
+    size_t perRound = pool && pool->threadCount() > 1 ? static_cast<size_t>(pool->threadCount()) * 2 : 1;
+    uint64_t fit = bufferPoolHeadroom() / (2ULL * kContainerChunkSize);
+    perRound = static_cast<size_t>(std::max<uint64_t>(1, std::min<uint64_t>(perRound, fit)));
+    m_chunks.resize(perRound);
+    m_chunks[0].plain.reserve(kContainerChunkSize);
+    m_chunks[0].plainLen = 0;
+    m_fill = 1;
+}
+
+void ContainerWriter::setCheckpoint(uint64_t everyBytes, std::function<void(const ContainerResume &)> callback) {
+    m_checkpointBytes = everyBytes;
+    m_nextCheckpoint = m_plainSize + everyBytes;
+    m_checkpoint = std::move(callback);
+}
+
+bool ContainerWriter::write(const void *data, size_t len) {
+    if (!m_open) return fail(m_error.empty() ? "Writer is not open" : m_error);
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    while (len > 0) {
+        Chunk *chunk = &m_chunks[m_fill - 1];
+        if (chunk->plainLen == kContainerChunkSize) {
+            // Only seal once more data shows the round does not hold the final chunk
+            if (m_fill == m_chunks.size()) {
+                if (!sealRound(m_fill, false)) return false;
+                m_fill = 0;
+            }
+            chunk = &m_chunks[m_fill++];
+            chunk->plain.reserve(kContainerChunkSize);
+            chunk->plainLen = 0;
+        }
+        size_t take = std::min<size_t>(len, kContainerChunkSize - chunk->plainLen);
+        std::memcpy(chunk->plain.data() + chunk->plainLen, p, take);
+        chunk->plainLen += take;
+        m_plainSize += take;
+        p += take;
+        len -= take;
+    }
+    return true;
+}
+
+bool ContainerWriter::sealRound(size_t count, bool last) {
+    if (m_sealed + count > 0xffffffffULL) return fail("File too large for the container");
+    auto seal = [&](size_t i) {
+        Chunk &chunk = m_chunks[i];
+        chunk.ok = sealChunk(chunk.plain.data(), chunk.plainLen, m_level, m_key.data(), m_header, m_sealed + i,
+                             last && i + 1 == count, chunk.sealed, chunk.sealedLen);
+    };
+    if (m_pool && count > 1) {
+        m_pool->parallelFor(count, seal);
+    } else {
+        for (size_t i = 0; i < count; ++i) seal(i);
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        Chunk &chunk = m_chunks[i];
+        if (!chunk.ok) return fail("Compression/encryption failed");
+        if (!m_out.write(chunk.sealed.data(), chunk.sealedLen)) return fail(m_out.error());
+        metrics().bytesStored.fetch_add(chunk.sealedLen, std::memory_order_relaxed);
+        m_index.push_back(m_offset);
+        m_offset += chunk.sealedLen;
+    }
+    m_sealed += count;
+
+    // Only full rounds are checkpointed, so every chunk before the point is
+    // a full one and none of them is sealed as the last
+    if (m_checkpoint && !last && m_checkpointBytes > 0 && m_sealed * kContainerChunkSize >= m_nextCheckpoint) {
+        if (!m_out.sync()) return fail(m_out.error());
+        m_nextCheckpoint = m_sealed * kContainerChunkSize + m_checkpointBytes;
+        ContainerResume at;
+        at.chunks = m_sealed;
+        at.offset = m_offset;
+        m_checkpoint(at);
+    }
+    return true;
+}
+
+bool ContainerWriter::finish() {
+    if (!m_open) return fail(m_error.empty() ? "Writer is not open" : m_error);
+    if (!sealRound(m_fill, true)) return false;
+
+    ContainerFooter footer;
+    std::memset(&footer, 0, sizeof(footer));
+    footer.indexOffset = m_offset;
+    footer.chunkCount = m_index.size();
+    footer.plainSize = m_plainSize;
+    std::memcpy(footer.magic, kFooterMagic, sizeof(footer.magic));
+    if (!m_out.write(m_index.data(), m_index.size() * sizeof(uint64_t)) ||
+        !m_out.write(&footer, sizeof(footer)) || !m_out.finish()) {
+        return fail(m_out.error());
+    }
+    m_open = false;
+    return true;
+}
+
+void ContainerWriter::suspend() {
+    m_open = false;
+    m_out.suspend();
+}
+
+bool ContainerWriter::fail(const std::string &why) {
+    if (m_error.empty()) m_error = why;
+    m_open = false;
+    m_out.abort();
+    return false;
+}
+
+ContainerReader::ContainerReader() {}
+
+ContainerReader::~ContainerReader() {
+    if (m_fd >= 0) ::close(m_fd);
+}
+
+bool ContainerReader::open(const std::string &path, const unsigned char *key) {
+    if (m_fd >= 0) ::close(m_fd);
+    m_error.clear();
+    m_path = path;
+    m_key.assign(key, key + 32);
+    m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0) {
+        m_error = "Failed to open: " + path;
+        return false;
+    }
+
+    struct stat st;
+    ContainerHeader header;
+    ContainerFooter footer;
+    if (fstat(m_fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < sizeof(header) + sizeof(footer) ||
+        !preadAll(m_fd, &header, sizeof(header), 0) ||
+        !preadAll(m_fd, &footer, sizeof(footer), static_cast<uint64_t>(st.st_size) - sizeof(footer))) {
+        m_error = "Truncated container: " + path;
+        return false;
+    }
+    if (std::memcmp(header.magic, kContainerMagic, sizeof(header.magic)) != 0) {
+        m_error = "Not a container: " + path;
+        return false;
+    }
+    if (header.version > kContainerVersion) {
+        m_error = "Unsupported container version " + std::to_string(header.version) + ": " + path;
+        return false;
+    }
+    uint64_t fileSize = static_cast<uint64_t>(st.st_size);
+    if (header.chunkSize == 0 || header.chunkSize > kMaxChunkSize ||
+        std::memcmp(footer.magic, kFooterMagic, sizeof(footer.magic)) != 0 || footer.chunkCount == 0 ||
+        footer.chunkCount > (fileSize - sizeof(footer)) / sizeof(uint64_t) ||
+        footer.indexOffset + footer.chunkCount * sizeof(uint64_t) + sizeof(footer) != fileSize ||
+        footer.plainSize > footer.chunkCount * header.chunkSize) {
+        m_error = "Corrupt container footer: " + path;
+        return false;
+    }
+
+    m_index.resize(footer.chunkCount);
+    if (!preadAll(m_fd, m_index.data(), m_index.size() * sizeof(uint64_t), footer.indexOffset)) {
+        m_error = "Truncated container: " + path;
+        return false;
+    }
+    uint64_t previous = sizeof(header);
+    for (uint64_t offset : m_index) {
+        if (offset < previous || offset >= footer.indexOffset) {
+            m_error = "Corrupt container index: " + path;
+            return false;
+        }
+        previous = offset + sizeof(ChunkHeader) + kGcmTagSize;
+    }
+
+    const unsigned char *h = reinterpret_cast<const unsigned char *>(&header);
+    m_header.assign(h, h + sizeof(header));
+    m_chunkSize = header.chunkSize;
+    m_plainSize = footer.plainSize;
+    m_indexOffset = footer.indexOffset;
+    return true;
+}
+
+bool ContainerReader::openChunk(uint64_t index, Slot &slot) const {
+    uint64_t start = m_index[index];
+    uint64_t end = index + 1 < m_index.size() ? m_index[index + 1] : m_indexOffset;
+    size_t recordLen = static_cast<size_t>(end - start);
+    if (recordLen < sizeof(ChunkHeader) + kGcmTagSize || recordLen > sizeof(ChunkHeader) + m_chunkSize + kGcmTagSize) {
+        slot.error = "Truncated chunk " + std::to_string(index);
+        return false;
+    }
+    slot.record.reserve(recordLen);
+    unsigned char *record = slot.record.data();
+    if (!preadAll(m_fd, record, recordLen, start)) {
+        slot.error = "Truncated chunk " + std::to_string(index);
+        return false;
+    }
+    ChunkHeader ch;
+    std::memcpy(&ch, record, sizeof(ch));
+    bool last = index + 1 == m_index.size();
+    if (static_cast<uint64_t>(ch.storedLen) + sizeof(ch) + kGcmTagSize != recordLen || ch.plainLen > m_chunkSize ||
+        ch.plainLen != (last ? m_plainSize - index * m_chunkSize : m_chunkSize) || ch.method > kChunkDeflate) {
+        slot.error = "Corrupt chunk header " + std::to_string(index);
+        return false;
+    }
+
+    const ContainerHeader *header = reinterpret_cast<const ContainerHeader *>(m_header.data());
+    unsigned char nonce[12];
+    chunkNonce(*header, index, last, nonce);
+    unsigned char *payload = record + sizeof(ch);
+    unsigned char *tag = payload + ch.storedLen;
+    CipherContext cipher;
+    if (!cipher.begin()) {
+        slot.error = "Failed to create decryption context";
+        return false;
+    }
+    EVP_CIPHER_CTX *ctx = cipher.get();
+    unsigned char tail[EVP_MAX_BLOCK_LENGTH];
+    int len = 0;
+    bool ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, m_key.data(), nonce) == 1 &&
+              EVP_DecryptUpdate(ctx, nullptr, &len, m_header.data(), static_cast<int>(m_header.size())) == 1 &&
+              EVP_DecryptUpdate(ctx, nullptr, &len, record, sizeof(ch)) == 1 &&
+              (ch.storedLen == 0 ||
+               EVP_DecryptUpdate(ctx, payload, &len, payload, static_cast<int>(ch.storedLen)) == 1) &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, kGcmTagSize, tag) == 1 &&
+              EVP_DecryptFinal_ex(ctx, tail, &len) == 1;
+    if (!ok) {
+        slot.error = "Authentication failed for chunk " + std::to_string(index) + " (wrong key or corrupt data)";
+        return false;
+    }
+
+    if (ch.method == kChunkStored) {
+        slot.data = payload;
+        slot.size = ch.storedLen;
+        return true;
+    }
+    slot.plain.reserve(ch.plainLen);
+    InflateStream zs;
+    if (!zs.begin(-MAX_WBITS)) {
+        slot.error = "inflateInit2 failed";
+        return false;
+    }
+    zs->next_in = payload;
+    zs->avail_in = ch.storedLen;
+    zs->next_out = slot.plain.data();
+    zs->avail_out = ch.plainLen;
+    int ret = inflate(zs.get(), Z_FINISH);
+    if (ret != Z_STREAM_END || zs->avail_out != 0) {
+        slot.error = "Decompression failed for chunk " + std::to_string(index);
+        return false;
+    }
+    slot.data = slot.plain.data();
+    slot.size = ch.plainLen;
+    return true;
+}
+
+bool ContainerReader::read(uint64_t offset, uint64_t length, WorkerPool *pool,
+                           const std::function<bool(const unsigned char *, size_t)> &sink) {
+    if (m_fd < 0) return false;
+    uint64_t end = offset + std::min(length, m_plainSize - std::min(offset, m_plainSize));
+    // An empty file still has its one chunk checked
+    uint64_t first = std::min<uint64_t>(offset / m_chunkSize, m_index.size() - 1);
+    uint64_t stop = end > offset ? (end - 1) / m_chunkSize + 1 : first + 1;
+
+    // As on the write side, a slot needs about two chunks of buffers
+    size_t perRound = pool && pool->threadCount() > 1 ? static_cast<size_t>(pool->threadCount()) * 2 : 1;
+    uint64_t fit = bufferPoolHeadroom() / (2ULL * m_chunkSize);
+    perRound = static_cast<size_t>(std::max<uint64_t>(1, std::min<uint64_t>({perRound, fit, stop - first})));
+    std::vector<Slot> slots(perRound);
+    for (uint64_t base = first; base < stop; base += perRound) {
+        size_t count = static_cast<size_t>(std::min<uint64_t>(perRound, stop - base));
+        auto decode = [&](size_t i) {
+            slots[i].error.clear();
+            if (!openChunk(base + i, slots[i]) && slots[i].error.empty()) slots[i].error = "Chunk failed";
+        };
+        if (pool && count > 1) {
+            pool->parallelFor(count, decode);
+        } else {
+            for (size_t i = 0; i < count; ++i) decode(i);
+        }
+
+        for (size_t i = 0; i < count; ++i) {
+            const Slot &slot = slots[i];
+            if (!slot.error.empty()) {
+                m_error = slot.error;
+                return false;
+            }
+            uint64_t chunkStart = (base + i) * m_chunkSize;
+            uint64_t from = std::max(offset, chunkStart) - chunkStart;
+            uint64_t to = std::min<uint64_t>(end, chunkStart + slot.size);
+            if (to > chunkStart + from && !sink(slot.data + from, static_cast<size_t>(to - chunkStart - from))) {
+                m_error = "Write failed";
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool isContainerFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    char magic[sizeof(kContainerMagic)];
+    bool match = preadAll(fd, magic, sizeof(magic), 0) && std::memcmp(magic, kContainerMagic, sizeof(magic)) == 0;
+    ::close(fd);
+    return match;
+}
@@ -0,0 +1,626 @@
+#include "delta.h"
+#include "backup.h"
+#include "container.h"
+#include "fileio.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+static const char kDeltaDirName[] = ".abt_deltas";
+static const char kSignatureMagic[8] = {'A', 'B', 'T', 'S', 'I', 'G', '0', '1'};
+static const char kDeltaMagic[8] = {'A', 'B', 'T', 'D', 'L', 'T', '0', '1'};
+
+struct SignatureHeader {
+    char magic[8];
+    uint32_t blockSize;
+    uint32_t chainLength;    // deltas written on top of the base so far
+    uint64_t fileSize;       // size of the version the blocks describe
+    uint64_t blockCount;
+    uint64_t chainLiteral;   // literal bytes carried by those deltas
+};
+
+struct DeltaHeader {
+    char magic[8];
+    uint32_t blockSize;
+    uint32_t sequence;
+    uint64_t baseSize;
+    uint64_t targetSize;
+};
+
+enum DeltaOpKind : uint32_t { kOpCopy = 1, kOpLiteral = 2, kOpEnd = 3 };
+
+// Copy: `count` blocks of the previous version starting at block `value`.
+// Literal: `value` bytes that follow the op.
+struct DeltaOp {
+    uint32_t kind;
+    uint32_t count;
+    uint64_t value;
+};
+
+static_assert(sizeof(BlockSignature) == 20, "block signature layout");
+static_assert(sizeof(SignatureHeader) == 40, "signature header layout");
+static_assert(sizeof(DeltaHeader) == 32, "delta header layout");
+static_assert(sizeof(DeltaOp) == 16, "delta op layout");
+
+static std::string signaturePath(const std::string &root, const std::string &relativePath) {
+    return (fs::path(root) / kDeltaDirName / relativePath).string() + ".sig";
+}
+
+static std::string deltaPath(const std::string &root, const std::string &relativePath, uint32_t sequence) {
+    return (fs::path(root) / kDeltaDirName / relativePath).string() + "." + std::to_string(sequence) + ".delta";
+}
+
+static bool fileExists(const std::string &path) {
+    struct stat st{};
+    return ::stat(path.c_str(), &st) == 0;
+}
+
+static bool preadAll(int fd, void *data, size_t len, uint64_t offset) {
+    char *p = static_cast<char *>(data);
+    while (len > 0) {
+        ssize_t n = ::pread(fd, p, len, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+static void weakSums(const unsigned char *data, size_t len, uint32_t &a, uint32_t &b) {
+    a = 0;
+    b = 0;
+    for (size_t i = 0; i < len; ++i) {
+        a += data[i];
+        b += a;
+    }
+}
+
+static uint32_t weakOf(uint32_t a, uint32_t b) {
+    return (a & 0xffff) | ((b & 0xffff) << 16);
+}
+
+static void strongHash(const unsigned char *data, size_t len, unsigned char out[32]) {
+    unsigned int outLen = 0;
+    EVP_Digest(data, len, out, &outLen, EVP_sha256(), nullptr);
+}
+
+SignatureBuilder::SignatureBuilder(uint32_t blockSize)
+    : m_blockSize(blockSize), m_md(EVP_MD_CTX_new()) {
+    EVP_DigestInit_ex(m_md, EVP_sha256(), nullptr);
+}
+
+SignatureBuilder::~SignatureBuilder() {
+    EVP_MD_CTX_free(m_md);
+}
+
+void SignatureBuilder::update(const unsigned char *data, size_t len) {
+    m_size += len;
+    while (len > 0) {
+        size_t take = std::min(len, static_cast<size_t>(m_blockSize) - m_fill);
+        for (size_t i = 0; i < take; ++i) {
+            m_a += data[i];
+            m_b += m_a;
+        }
+        EVP_DigestUpdate(m_md, data, take);
+        m_fill += take;
+        data += take;
+        len -= take;
+        if (m_fill == m_blockSize) closeBlock();
+    }
+}
+
+void SignatureBuilder::finish() {
+    if (m_fill > 0) closeBlock();
+}
+
+void SignatureBuilder::closeBlock() {
+    BlockSignature sig;
+    unsigned char digest[32];
+    unsigned int digestLen = 0;
+    EVP_DigestFinal_ex(m_md, digest, &digestLen);
+    sig.weak = weakOf(m_a, m_b);
+    std::memcpy(sig.strong, digest, sizeof(sig.strong));
+    m_blocks.push_back(sig);
+    EVP_DigestInit_ex(m_md, EVP_sha256(), nullptr);
+    m_a = 0;
+    m_b = 0;
+    m_fill = 0;
+}
+
+// Sequential view of a container's plaintext, one chunk at a time
+class DeltaInput {
+public:
+    explicit DeltaInput(ContainerReader &reader) : m_reader(reader) {}
+
+    bool take(void *out, size_t len) {
+        unsigned char *p = static_cast<unsigned char *>(out);
+        while (len > 0) {
+            if (m_pos == m_buf.size() && !refill()) return false;
+            size_t n = std::min(len, m_buf.size() - m_pos);
+            std::memcpy(p, m_buf.data() + m_pos, n);
+            m_pos += n;
+            p += n;
+            len -= n;
+        }
+        return true;
+    }
+
+private:
+    bool refill() {
+        if (m_offset >= m_reader.size()) return false;
+        m_buf.clear();
+        m_pos = 0;
+        bool ok = m_reader.read(m_offset, kContainerChunkSize, nullptr, [this](const unsigned char *data, size_t len) {
+            m_buf.insert(m_buf.end(), data, data + len);
+            return true;
+        });
+        m_offset += m_buf.size();
+        return ok && !m_buf.empty();
+    }
+
+    ContainerReader &m_reader;
+    std::vector<unsigned char> m_buf;
+    size_t m_pos = 0;
+    uint64_t m_offset = 0;
+};
+
+// Either way the next backup writes a new base. A missing signature is the
+// normal first time; one that exists but does not open is logged, so a
+// corrupt signature does not silently turn every run into a full rewrite.
+static bool loadSignature(const std::string &path, const unsigned char *key,
+                          SignatureHeader &header, std::vector<BlockSignature> &blocks) {
+    if (!fileExists(path)) return false;
+    ContainerReader reader;
+    if (!reader.open(path, key)) {
+        logMessage("Delta signature " + path + " does not open (" + reader.error() + "), writing a new base");
+        return false;
+    }
+    DeltaInput input(reader);
+    bool ok = input.take(&header, sizeof(header)) &&
+              std::memcmp(header.magic, kSignatureMagic, sizeof(header.magic)) == 0 &&
+              header.blockSize != 0 && header.blockSize <= kContainerChunkSize &&
+              header.blockCount == (header.fileSize + header.blockSize - 1) / header.blockSize &&
+              reader.size() == sizeof(header) + header.blockCount * sizeof(BlockSignature);
+    if (ok) {
+        blocks.resize(static_cast<size_t>(header.blockCount));
+        ok = input.take(blocks.data(), blocks.size() * sizeof(BlockSignature));
+    }
+    if (!ok) logMessage("Delta signature " + path + " is corrupt, writing a new base");
+    return ok;
+}
+
+DeltaStore::DeltaStore(const std::string &destDir) : m_root(destDir) {}
+
+bool DeltaStore::exists() const {
+    std::error_code ec;
+    return fs::is_directory(fs::path(m_root) / kDeltaDirName, ec);
+}
+
+DeltaResult DeltaStore::storeDelta(const std::string &srcPath, const std::string &relativePath,
+                                   const CompressionPolicy &policy, const unsigned char *key,
+                                   int maxChain, DeltaStats &stats) const {
+    stats = DeltaStats();
+    SignatureHeader base;
+    std::vector<BlockSignature> blocks;
+    if (!loadSignature(signaturePath(m_root, relativePath), key, base, blocks)) return kDeltaNeedFull;
+    stats.sequence = base.chainLength;
+    if (static_cast<int64_t>(base.chainLength) >= maxChain) return kDeltaNeedFull;
+
+    SourceReader in;
+    if (!in.open(srcPath)) {
+        logMessage(in.error());
+        return kDeltaFailed;
+    }
+    // Once the chain carries half the file in literals, a new base is cheaper
+    uint64_t budget = in.size() / 2;
+    if (base.chainLiteral >= budget) return kDeltaNeedFull;
+    budget -= base.chainLiteral;
+
+    // Weak sums sorted for lookup, behind a 64K-entry filter that rejects
+    // most positions without touching the table
+    const uint32_t blockSize = base.blockSize;
+    std::vector<std::pair<uint32_t, uint32_t>> index;
+    std::vector<unsigned char> filter(1 << 16, 0);
+    index.reserve(blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        index.emplace_back(blocks[i].weak, static_cast<uint32_t>(i));
+        filter[(blocks[i].weak ^ (blocks[i].weak >> 16)) & 0xffff] = 1;
+    }
+    std::sort(index.begin(), index.end());
+
+    auto findBlock = [&](uint32_t weak, const unsigned char *data, size_t len) -> int64_t {
+        if (!filter[(weak ^ (weak >> 16)) & 0xffff]) return -1;
+        auto it = std::lower_bound(index.begin(), index.end(), std::make_pair(weak, 0u));
+        unsigned char strong[32];
+        bool hashed = false;
+        for (; it != index.end() && it->first == weak; ++it) {
+            uint64_t offset = static_cast<uint64_t>(it->second) * blockSize;
+            if (std::min<uint64_t>(blockSize, base.fileSize - offset) != len) continue;
+            if (!hashed) {
+                strongHash(data, len, strong);
+                hashed = true;
+            }
+            if (std::memcmp(strong, blocks[it->second].strong, sizeof(blocks[it->second].strong)) == 0) return it->second;
+        }
+        return -1;
+    };
+
+    uint32_t sequence = base.chainLength + 1;
+    std::string finalPath = deltaPath(m_root, relativePath, sequence);
+    std::error_code ec;
+    fs::create_directories(fs::path(finalPath).parent_path(), ec);
+
+    // Written under a temporary name and only renamed into place by finish()
+    ContainerWriter out;
+    auto abandon = [&](DeltaResult result, const std::string &why) {
+        if (!why.empty()) logMessage("Delta backup failed: " + srcPath + " (" + why + ")");
+        return result;
+    };
+
+    const unsigned char *sample = nullptr;
+    long got = in.peek(sample);
+    if (got < 0) {
+        logMessage("Delta backup failed: " + srcPath + " (" + in.error() + ")");
+        return kDeltaFailed;
+    }
+    int level = chooseCompressionLevel(sample, std::min<size_t>(static_cast<size_t>(got), kCompressionSampleSize), policy);
+
+    DeltaHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kDeltaMagic, sizeof(header.magic));
+    header.blockSize = blockSize;
+    header.sequence = sequence;
+    header.baseSize = base.fileSize;
+    header.targetSize = in.size();
+    if (!out.open(finalPath, key, level) || !out.write(&header, sizeof(header))) {
+        return abandon(kDeltaFailed, out.error());
+    }
+
+    // Signatures of the new version, fed in file order as ops are emitted
+    SignatureBuilder next(blockSize);
+    uint64_t copyFirst = 0;
+    uint32_t copyCount = 0;
+    auto flushCopy = [&]() {
+        if (copyCount == 0) return true;
+        DeltaOp op{kOpCopy, copyCount, copyFirst};
+        copyCount = 0;
+        return out.write(&op, sizeof(op));
+    };
+    auto emitLiteral = [&](const unsigned char *data, size_t len) {
+        if (len == 0) return true;
+        next.update(data, len);
+        stats.literalBytes += len;
+        DeltaOp op{kOpLiteral, 0, len};
+        return flushCopy() && out.write(&op, sizeof(op)) && out.write(data, len);
+    };
+    auto emitCopy = [&](uint64_t block, const unsigned char *data, size_t len) {
+        next.update(data, len);
+        stats.copiedBytes += len;
+        if (copyCount > 0 && copyFirst + copyCount == block && copyCount < UINT32_MAX) {
+            ++copyCount;
+            return true;
+        }
+        if (!flushCopy()) return false;
+        copyFirst = block;
+        copyCount = 1;
+        return true;
+    };
+
+    // Window [start, start + blockSize) slides over `buf`; bytes between
+    // litStart and start matched nothing yet
+    std::vector<unsigned char> buf(std::max<size_t>(4 * static_cast<size_t>(blockSize), 1 << 20));
+    size_t start = 0, end = 0, litStart = 0;
+    bool eof = false;
+    auto refill = [&]() {
+        if (!emitLiteral(buf.data() + litStart, start - litStart)) return false;
+        std::memmove(buf.data(), buf.data() + start, end - start);
+        end -= start;
+        start = 0;
+        litStart = 0;
+        while (end < buf.size()) {
+            if (!backupCheckpoint()) return false;
+            long n = in.read(buf.data() + end, buf.size() - end);
+            if (n < 0) return false;
+            if (n == 0) {
+                eof = true;
+                break;
+            }
+            end += static_cast<size_t>(n);
+        }
+        return true;
+    };
+    auto error = [&]() { return in.error().empty() ? out.error() : in.error(); };
+
+    uint32_t a = 0, b = 0;
+    bool haveSum = false;
+    while (true) {
+        if (!eof && end - start <= blockSize) {
+            if (!refill()) return abandon(kDeltaFailed, error());
+            if (stats.literalBytes > budget) return abandon(kDeltaNeedFull, "");
+        }
+        size_t avail = end - start;
+        if (avail == 0) break;
+
+        if (avail < blockSize) {
+            // The tail can only match the previous version's last block
+            weakSums(buf.data() + start, avail, a, b);
+            int64_t match = findBlock(weakOf(a, b), buf.data() + start, avail);
+            if (match >= 0) {
+                if (!emitLiteral(buf.data() + litStart, start - litStart) ||
+                    !emitCopy(static_cast<uint64_t>(match), buf.data() + start, avail)) {
+                    return abandon(kDeltaFailed, error());
+                }
+                litStart = end;
+            }
+            start = end;
+            break;
+        }
+
+        if (!haveSum) {
+            weakSums(buf.data() + start, blockSize, a, b);
+            haveSum = true;
+        }
+        int64_t match = findBlock(weakOf(a, b), buf.data() + start, blockSize);
+        if (match >= 0) {
+            if (!emitLiteral(buf.data() + litStart, start - litStart) ||
+                !emitCopy(static_cast<uint64_t>(match), buf.data() + start, blockSize)) {
+                return abandon(kDeltaFailed, error());
+            }
+            start += blockSize;
+            litStart = start;
+            haveSum = false;
+            continue;
+        }
+
+        if (start + blockSize == end) {
+            // Only reached at end of file: the rest is handled as the tail
+            ++start;
+            haveSum = false;
+            continue;
+        }
+        // Roll the window one byte forward
+        uint32_t out0 = buf[start];
+        a = a - out0 + buf[start + blockSize];
+        b = b - blockSize * out0 + a;
+        ++start;
+    }
+
+    DeltaOp endOp{kOpEnd, 0, 0};
+    if (!emitLiteral(buf.data() + litStart, start - litStart) || !flushCopy() ||
+        !out.write(&endOp, sizeof(endOp))) {
+        return abandon(kDeltaFailed, error());
+    }
+    if (stats.literalBytes > budget) return abandon(kDeltaNeedFull, "");
+    if (stats.literalBytes + stats.copiedBytes != in.size()) {
+        return abandon(kDeltaFailed, "Source changed while it was read");
+    }
+    if (!out.finish()) return abandon(kDeltaFailed, out.error());
+    stats.sequence = sequence;
+
+    // Should this fail, the old signature still describes the previous
+    // version and the next change simply rewrites this delta
+    next.finish();
+    writeSignature(relativePath, next, key, sequence, base.chainLiteral + stats.literalBytes);
+    return kDeltaStored;
+}
+
+bool DeltaStore::saveSignature(const std::string &relativePath, const SignatureBuilder &signature,
+                               const unsigned char *key) const {
+    return writeSignature(relativePath, signature, key, 0, 0);
+}
+
+bool DeltaStore::writeSignature(const std::string &relativePath, const SignatureBuilder &signature,
+                                const unsigned char *key, uint32_t chainLength, uint64_t chainLiteral) const {
+    std::string path = signaturePath(m_root, relativePath);
+    std::error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+
+    SignatureHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kSignatureMagic, sizeof(header.magic));
+    header.blockSize = signature.blockSize();
+    header.chainLength = chainLength;
+    header.fileSize = signature.size();
+    header.blockCount = signature.blocks().size();
+    header.chainLiteral = chainLiteral;
+
+    // Checksums do not deflate, so the blocks are only sealed
+    ContainerWriter out;
+    bool ok = out.open(path, key, 0) && out.write(&header, sizeof(header)) &&
+              out.write(signature.blocks().data(), signature.blocks().size() * sizeof(BlockSignature)) &&
+              out.finish();
+    if (!ok) {
+        logMessage("Failed to save delta signature: " + path +
+                   (out.error().empty() ? std::string() : " (" + out.error() + ")"));
+    }
+    return ok;
+}
+
+void DeltaStore::drop(const std::string &relativePath) const {
+    bool hadSignature = std::remove(signaturePath(m_root, relativePath).c_str()) == 0;
+    if (!hadSignature && !fileExists(deltaPath(m_root, relativePath, 1))) return;
+
+    // Newest first, so an interrupted drop leaves a shorter chain that
+    // still applies to the old base rather than a gap
+    uint32_t count = 0;
+    while (fileExists(deltaPath(m_root, relativePath, count + 1))) ++count;
+    for (uint32_t seq = count; seq > 0; --seq) std::remove(deltaPath(m_root, relativePath, seq).c_str());
+}
+
+static bool applyDelta(const std::string &deltaFile, uint32_t sequence, const std::string &path,
+                       const unsigned char *key) {
+    ContainerReader reader;
+    if (!reader.open(deltaFile, key)) {
+        logMessage("Failed to open delta " + deltaFile + ": " + reader.error());
+        return false;
+    }
+    DeltaInput input(reader);
+    DeltaHeader header;
+    if (!input.take(&header, sizeof(header)) || std::memcmp(header.magic, kDeltaMagic, sizeof(header.magic)) != 0 ||
+        header.sequence != sequence || header.blockSize == 0) {
+        logMessage("Invalid delta: " + deltaFile);
+        return false;
+    }
+
+    int baseFd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st{};
+    if (baseFd < 0 || ::fstat(baseFd, &st) != 0 || static_cast<uint64_t>(st.st_size) != header.baseSize) {
+        if (baseFd >= 0) ::close(baseFd);
+        logMessage("Delta " + deltaFile + " does not match the restored base " + path);
+        return false;
+    }
+
+    // The new version replaces the base only once it is complete
+    ObjectWriter out;
+    std::string error;
+    uint64_t written = 0;
+    if (!out.open(path)) error = out.error();
+    while (error.empty()) {
+        DeltaOp op;
+        if (!input.take(&op, sizeof(op))) {
+            error = reader.error().empty() ? "Truncated delta" : reader.error();
+            break;
+        }
+        if (op.kind == kOpEnd) break;
+
+        uint64_t from = 0, len = 0;
+        if (op.kind == kOpCopy) {
+            if (op.count == 0 || op.value >= (header.baseSize + header.blockSize - 1) / header.blockSize) {
+                error = "Copy outside the base";
+                break;
+            }
+            from = op.value * header.blockSize;
+            len = std::min<uint64_t>(static_cast<uint64_t>(op.count) * header.blockSize, header.baseSize - from);
+        } else if (op.kind == kOpLiteral) {
+            len = op.value;
+        } else {
+            error = "Unknown delta op";
+            break;
+        }
+        if (written + len > header.targetSize) {
+            error = "Delta overruns its target size";
+            break;
+        }
+
+        while (len > 0 && error.empty()) {
+            size_t avail = 0;
+            unsigned char *dst = out.reserve(avail);
+            size_t n = static_cast<size_t>(std::min<uint64_t>(avail, len));
+            bool ok = op.kind == kOpCopy ? preadAll(baseFd, dst, n, from) : input.take(dst, n);
+            if (!ok || !out.commit(n)) {
+                error = !ok ? (op.kind == kOpCopy ? "Failed to read the base" : "Truncated delta") : out.error();
+                break;
+            }
+            from += n;
+            len -= n;
+            written += n;
+        }
+    }
+    ::close(baseFd);
+
+    if (error.empty() && written != header.targetSize) error = "Delta produced the wrong size";
+    if (error.empty() && !out.finish()) error = out.error();
+    if (!error.empty()) {
+        out.abort();
+        logMessage("Failed to apply delta " + deltaFile + ": " + error);
+        return false;
+    }
+    return true;
+}
+
+bool DeltaStore::applyChain(const std::string &backupDir, const std::string &relativePath,
+                            const std::string &path, const unsigned char *key) {
+    for (uint32_t sequence = 1;; ++sequence) {
+        std::string deltaFile = deltaPath(backupDir, relativePath, sequence);
+        if (!fileExists(deltaFile)) return true;
+        if (!applyDelta(deltaFile, sequence, path, key)) return false;
+    }
+}
+
+// applyDelta's checks without the base: the ops are walked and literals read
+// (so every chunk is authenticated) but nothing is written
+static bool checkDelta(const std::string &deltaFile, uint32_t sequence, uint64_t &size, const unsigned char *key) {
+    ContainerReader reader;
+    if (!reader.open(deltaFile, key)) {
+        logMessage("Failed to open delta " + deltaFile + ": " + reader.error());
+        return false;
+    }
+    DeltaInput input(reader);
+    DeltaHeader header;
+    if (!input.take(&header, sizeof(header)) || std::memcmp(header.magic, kDeltaMagic, sizeof(header.magic)) != 0 ||
+        header.sequence != sequence || header.blockSize == 0) {
+        logMessage("Invalid delta: " + deltaFile);
+        return false;
+    }
+    if (header.baseSize != size) {
+        logMessage("Delta " + deltaFile + " does not follow on from the previous version");
+        return false;
+    }
+
+    std::string error;
+    std::vector<unsigned char> scratch(kDeltaBlockSize);
+    uint64_t produced = 0;
+    while (error.empty()) {
+        DeltaOp op;
+        if (!input.take(&op, sizeof(op))) {
+            error = reader.error().empty() ? "Truncated delta" : reader.error();
+            break;
+        }
+        if (op.kind == kOpEnd) break;
+
+        uint64_t len = 0;
+        if (op.kind == kOpCopy) {
+            if (op.count == 0 || op.value >= (header.baseSize + header.blockSize - 1) / header.blockSize) {
+                error = "Copy outside the base";
+                break;
+            }
+            uint64_t from = op.value * header.blockSize;
+            len = std::min<uint64_t>(static_cast<uint64_t>(op.count) * header.blockSize, header.baseSize - from);
+        } else if (op.kind == kOpLiteral) {
+            len = op.value;
+        } else {
+            error = "Unknown delta op";
+            break;
+        }
+        if (produced + len > header.targetSize) {
+            error = "Delta overruns its target size";
+            break;
+        }
+        produced += len;
+        for (uint64_t left = op.kind == kOpLiteral ? len : 0; left > 0 && error.empty();) {
+            size_t n = static_cast<size_t>(std::min<uint64_t>(left, scratch.size()));
+            if (!input.take(scratch.data(), n)) error = "Truncated delta";
+            left -= n;
+        }
+    }
+    if (error.empty() && produced != header.targetSize) error = "Delta produced the wrong size";
+    if (!error.empty()) {
+        logMessage("Corrupt delta " + deltaFile + ": " + error);
+        return false;
+    }
+    size = header.targetSize;
+    return true;
+}
+
+bool DeltaStore::checkChain(const std::string &backupDir, const std::string &relativePath,
+                            const unsigned char *key, uint64_t &size, uint32_t &deltas) {
+    deltas = 0;
+    for (uint32_t sequence = 1;; ++sequence) {
+        std::string deltaFile = deltaPath(backupDir, relativePath, sequence);
+        if (!fileExists(deltaFile)) return true;
+        if (!checkDelta(deltaFile, sequence, size, key)) return false;
+        deltas = sequence;
+    }
+}
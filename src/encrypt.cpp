@@ -1,8 +1,19 @@
 #include "encrypt.h"
+#include "bufferpool.h"
+#include "codec.h"
 #include "logger.h"
+#include "chunkstore.h"
+#include "pipeline.h"
+#include "fileio.h"
+#include "container.h"
+#include "manifest.h"
 #include <openssl/evp.h>
 #include <openssl/aes.h>
 #include <openssl/rand.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
 #include <fstream>
 #include <vector>
 #include <iostream>
@@ -33,50 +44,133 @@ void ensureEncryptionKeyLogged() {
         RAND_bytes(g_iv.data(), static_cast<int>(g_iv.size()));
         std::string keyHex = toHex(g_key);
         std::string ivHex = toHex(g_iv);
-        logMessage(std::string("ENCRYPTION_KEY=") + keyHex);
-        logMessage(std::string("ENCRYPTION_IV=") + ivHex);
+        logPinnedMessage(std::string("ENCRYPTION_KEY=") + keyHex);
+        logPinnedMessage(std::string("ENCRYPTION_IV=") + ivHex);
         std::cout << "Generated encryption key: " << keyHex << std::endl;
         std::cout << "Generated encryption IV: " << ivHex << std::endl;
     });
 }
 
-static bool aes256CtrFile(const std::string &inPath, const std::string &outPath, bool encrypt) {
+// First 8 bytes of SHA-256 over a label and the key/IV
+static uint64_t keyCheck(const std::vector<unsigned char> &key, const std::vector<unsigned char> &iv) {
+    static const char kLabel[] = "abt key check";
+    std::vector<unsigned char> input(kLabel, kLabel + sizeof(kLabel) - 1);
+    input.insert(input.end(), key.begin(), key.end());
+    input.insert(input.end(), iv.begin(), iv.end());
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if (EVP_Digest(input.data(), input.size(), digest, &len, EVP_sha256(), nullptr) != 1) return 0;
+    uint64_t check = 0;
+    for (int i = 0; i < 8; ++i) check = (check << 8) | digest[i];
+    return check;
+}
+
+uint64_t encryptionKeyCheck() {
     ensureEncryptionKeyLogged();
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) return false;
+    return keyCheck(g_key, g_iv);
+}
 
-    const EVP_CIPHER *cipher = EVP_aes_256_ctr();
-    if (EVP_EncryptInit_ex(ctx, cipher, nullptr, g_key.data(), g_iv.data()) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+uint64_t encryptionKeyCheck(const unsigned char *key, const unsigned char *iv) {
+    return keyCheck(std::vector<unsigned char>(key, key + 32), std::vector<unsigned char>(iv, iv + 16));
+}
+
+// Pinned lines come in KEY, IV pairs, one pair per session. With `check` 0
+// the last pair is taken.
+static bool scanLoggedKeys(const std::string &logPath, uint64_t check, std::string &keyHex, std::string &ivHex) {
+    std::ifstream log(logPath);
+    if (!log.is_open()) return false;
+
+    std::string pendingKey, line;
+    bool found = false;
+    while (std::getline(log, line)) {
+        auto kpos = line.find("ENCRYPTION_KEY=");
+        if (kpos != std::string::npos) pendingKey = line.substr(kpos + 15);
+        auto ipos = line.find("ENCRYPTION_IV=");
+        if (ipos == std::string::npos || pendingKey.empty()) continue;
+        std::string ivText = line.substr(ipos + 14);
+        if (check == 0 || keyCheck(hexToBytes(pendingKey), hexToBytes(ivText)) == check) {
+            keyHex = pendingKey;
+            ivHex = ivText;
+            found = true;
+            if (check != 0) break;
+        }
+    }
+    return found;
+}
+
+bool findLoggedEncryptionKey(const std::string &logPath, uint64_t check, std::string &keyHex, std::string &ivHex) {
+    return check != 0 && scanLoggedKeys(logPath, check, keyHex, ivHex);
+}
+
+bool findBackupKey(const std::string &logPath, const std::string &backupPath, std::string &keyHex,
+                   std::string &ivHex, std::string &error) {
+    namespace fs = std::filesystem;
+    std::error_code ec;
+    fs::path dir = fs::absolute(backupPath, ec).lexically_normal();
+    if (!fs::is_directory(dir, ec)) dir = dir.parent_path();
+    uint64_t check = 0;
+    while (!BackupManifest::readKeyCheck(dir.string(), check) && dir != dir.root_path() && !dir.empty()) {
+        dir = dir.parent_path();
+    }
+    if (check != 0) {
+        if (findLoggedEncryptionKey(logPath, check, keyHex, ivHex)) return true;
+        char hex[17];
+        std::snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(check));
+        error = "The key that sealed this backup (check " + std::string(hex) + ") is not in " + logPath;
         return false;
     }
+    if (scanLoggedKeys(logPath, 0, keyHex, ivHex)) return true;
+    error = "Could not find encryption keys in " + logPath;
+    return false;
+}
+
+bool adoptLoggedEncryptionKey(const std::string &logPath, uint64_t check) {
+    std::string keyHex, ivHex;
+    if (!findLoggedEncryptionKey(logPath, check, keyHex, ivHex)) return false;
+    std::vector<unsigned char> key = hexToBytes(keyHex);
+    std::vector<unsigned char> iv = hexToBytes(ivHex);
+    if (key.size() != 32 || iv.size() != 16) return false;
+
+    bool adopted = false;
+    std::call_once(g_keyOnce, [&]() {
+        g_key = key;
+        g_iv = iv;
+        // Pin it again so this run's log keeps the key its objects need
+        logPinnedMessage(std::string("ENCRYPTION_KEY=") + toHex(g_key));
+        logPinnedMessage(std::string("ENCRYPTION_IV=") + toHex(g_iv));
+        std::cout << "Resuming with encryption key: " << toHex(g_key) << std::endl;
+        adopted = true;
+    });
+    return adopted;
+}
+
+static bool aes256CtrFile(const std::string &inPath, const std::string &outPath, bool encrypt) {
+    ensureEncryptionKeyLogged();
+    CipherContext ctx;
+    if (!ctx.begin()) return false;
+
+    const EVP_CIPHER *cipher = EVP_aes_256_ctr();
+    if (EVP_EncryptInit_ex(ctx.get(), cipher, nullptr, g_key.data(), g_iv.data()) != 1) return false;
 
     std::ifstream in(inPath, std::ios::binary);
     std::ofstream out(outPath, std::ios::binary);
-    if (!in.is_open() || !out.is_open()) {
-        EVP_CIPHER_CTX_free(ctx);
-        return false;
-    }
+    if (!in.is_open() || !out.is_open()) return false;
 
-    std::vector<unsigned char> inBuf(4096);
-    std::vector<unsigned char> outBuf(inBuf.size() + EVP_CIPHER_block_size(cipher));
+    const size_t kBufSize = 64 * 1024;
+    PoolBuffer inBuf(kBufSize);
+    PoolBuffer outBuf(kBufSize + EVP_CIPHER_block_size(cipher));
     int outLen = 0;
     while (in) {
-        in.read(reinterpret_cast<char*>(inBuf.data()), static_cast<std::streamsize>(inBuf.size()));
+        in.read(reinterpret_cast<char*>(inBuf.data()), static_cast<std::streamsize>(kBufSize));
         std::streamsize got = in.gcount();
         if (got <= 0) break;
-        if (EVP_EncryptUpdate(ctx, outBuf.data(), &outLen, inBuf.data(), static_cast<int>(got)) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
+        if (EVP_EncryptUpdate(ctx.get(), outBuf.data(), &outLen, inBuf.data(), static_cast<int>(got)) != 1) {
             return false;
         }
         out.write(reinterpret_cast<char*>(outBuf.data()), outLen);
     }
-    if (EVP_EncryptFinal_ex(ctx, outBuf.data(), &outLen) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
-        return false;
-    }
+    if (EVP_EncryptFinal_ex(ctx.get(), outBuf.data(), &outLen) != 1) return false;
     if (outLen > 0) out.write(reinterpret_cast<char*>(outBuf.data()), outLen);
-    EVP_CIPHER_CTX_free(ctx);
     return true;
 }
 
@@ -98,7 +192,7 @@ void decryptFile(const std::string &filePath) {
     }
 }
 
-static std::vector<unsigned char> hexToBytes(const std::string &hex) {
+std::vector<unsigned char> hexToBytes(const std::string &hex) {
     std::vector<unsigned char> bytes;
     for (size_t i = 0; i < hex.length(); i += 2) {
         std::string byteStr = hex.substr(i, 2);
@@ -108,82 +202,166 @@ static std::vector<unsigned char> hexToBytes(const std::string &hex) {
     return bytes;
 }
 
-bool decryptFileWithKey(const std::string &encryptedPath, const std::string &outputPath, 
-                        const std::string &keyHex, const std::string &ivHex) {
-    std::vector<unsigned char> key = hexToBytes(keyHex);
-    std::vector<unsigned char> iv = hexToBytes(ivHex);
-    
-    if (key.size() != 32 || iv.size() != 16) {
-        logMessage("Invalid key/IV size for decryption");
+static bool isRecipePath(const std::string &path) {
+    static const std::string kRecipeSuffix = ".abtr.enc";
+    return path.size() > kRecipeSuffix.size() &&
+           path.compare(path.size() - kRecipeSuffix.size(), kRecipeSuffix.size(), kRecipeSuffix) == 0;
+}
+
+// Open only the chunks covering the range and write their plaintext out
+static bool decryptContainer(const std::string &encryptedPath, const std::string &outputPath,
+                             const unsigned char *key, WorkerPool *pool, uint64_t offset, uint64_t length) {
+    ContainerReader reader;
+    if (!reader.open(encryptedPath, key)) {
+        logMessage("Failed to open " + encryptedPath + ": " + reader.error());
         return false;
     }
-    
-    // Step 1: Decrypt the encrypted file to get compressed file
-    std::string tempCompressed = outputPath + ".temp.gz";
-    
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) return false;
+    ObjectWriter out;
+    if (!out.open(outputPath)) {
+        logMessage(out.error());
+        return false;
+    }
+    bool ok = reader.read(offset, length, pool, [&out](const unsigned char *data, size_t len) {
+        return out.write(data, len);
+    }) && out.finish();
+    if (!ok) {
+        out.abort();
+        std::remove(outputPath.c_str());
+        logMessage("Decryption failed: " + encryptedPath + " (" +
+                   (out.error().empty() ? reader.error() : out.error()) + ")");
+    }
+    return ok;
+}
 
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_ctr(), nullptr, key.data(), iv.data()) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+bool decryptFileWithKeyBytes(const std::string &encryptedPath, const std::string &outputPath,
+                             const unsigned char *key, const unsigned char *iv, WorkerPool *pool) {
+    // Deduplicated backups store a recipe of chunks rather than the data itself
+    if (isRecipePath(encryptedPath)) {
+        return ChunkStore::restoreFile(encryptedPath, outputPath, key, iv);
+    }
+    if (isContainerFile(encryptedPath)) {
+        return decryptContainer(encryptedPath, outputPath, key, pool, 0, UINT64_MAX);
+    }
+
+    // Decrypt and inflate in memory straight into the output file
+    EncryptedGzipReader reader;
+    if (!reader.open(encryptedPath, key, iv)) {
+        logMessage("Failed to open " + encryptedPath + ": " + reader.error());
         return false;
     }
 
-    std::ifstream in(encryptedPath, std::ios::binary);
-    std::ofstream tempOut(tempCompressed, std::ios::binary);
-    if (!in.is_open() || !tempOut.is_open()) {
-        EVP_CIPHER_CTX_free(ctx);
+    ObjectWriter out;
+    if (!out.open(outputPath)) {
+        logMessage(out.error());
         return false;
     }
 
-    std::vector<unsigned char> inBuf(4096);
-    std::vector<unsigned char> outBuf(inBuf.size() + EVP_CIPHER_block_size(EVP_aes_256_ctr()));
-    int outLen = 0;
-    
-    while (in) {
-        in.read(reinterpret_cast<char*>(inBuf.data()), static_cast<std::streamsize>(inBuf.size()));
-        std::streamsize got = in.gcount();
+    // Inflate directly into the writer's blocks
+    long got;
+    bool written = true;
+    for (;;) {
+        size_t avail = 0;
+        unsigned char *dst = out.reserve(avail);
+        got = reader.read(dst, avail);
         if (got <= 0) break;
-        
-        if (EVP_DecryptUpdate(ctx, outBuf.data(), &outLen, inBuf.data(), static_cast<int>(got)) != 1) {
-            EVP_CIPHER_CTX_free(ctx);
+        if (!(written = out.commit(static_cast<size_t>(got)))) break;
+    }
+    written = written && got == 0 && out.finish();
+    if (!written) {
+        out.abort();
+        std::remove(outputPath.c_str());
+        logMessage("Decryption failed: " + encryptedPath +
+                   (reader.error().empty() ? " (" + out.error() + ")" : " (" + reader.error() + ")"));
+        return false;
+    }
+    return true;
+}
+
+bool readObjectWithKeyBytes(const std::string &encryptedPath, const unsigned char *key, const unsigned char *iv,
+                            WorkerPool *pool, const std::function<bool(const unsigned char *, size_t)> &sink) {
+    if (isRecipePath(encryptedPath)) {
+        return ChunkStore::readFile(encryptedPath, key, iv, sink);
+    }
+    if (isContainerFile(encryptedPath)) {
+        ContainerReader reader;
+        if (!reader.open(encryptedPath, key) || !reader.read(0, UINT64_MAX, pool, sink)) {
+            logMessage("Failed to read " + encryptedPath + ": " + reader.error());
             return false;
         }
-        tempOut.write(reinterpret_cast<char*>(outBuf.data()), outLen);
+        return true;
     }
-    
-    if (EVP_DecryptFinal_ex(ctx, outBuf.data(), &outLen) != 1) {
-        EVP_CIPHER_CTX_free(ctx);
+
+    EncryptedGzipReader reader;
+    if (!reader.open(encryptedPath, key, iv)) {
+        logMessage("Failed to open " + encryptedPath + ": " + reader.error());
         return false;
     }
-    if (outLen > 0) tempOut.write(reinterpret_cast<char*>(outBuf.data()), outLen);
-    
-    EVP_CIPHER_CTX_free(ctx);
-    tempOut.close();
-    
-    // Step 2: Decompress the compressed file to get original
-    gzFile gz = gzopen(tempCompressed.c_str(), "rb");
-    if (!gz) {
-        std::remove(tempCompressed.c_str());
+    PoolBuffer buf(kContainerChunkSize);
+    long got;
+    while ((got = reader.read(buf.data(), buf.capacity())) > 0) {
+        if (!sink(buf.data(), static_cast<size_t>(got))) return false;
+    }
+    if (got < 0) {
+        logMessage("Failed to read " + encryptedPath + ": " + reader.error());
         return false;
     }
+    return true;
+}
+
+bool decryptFileWithKey(const std::string &encryptedPath, const std::string &outputPath, 
+                        const std::string &keyHex, const std::string &ivHex) {
+    std::vector<unsigned char> key = hexToBytes(keyHex);
+    std::vector<unsigned char> iv = hexToBytes(ivHex);
     
-    std::ofstream finalOut(outputPath, std::ios::binary);
-    if (!finalOut.is_open()) {
-        gzclose(gz);
-        std::remove(tempCompressed.c_str());
+    if (key.size() != 32 || iv.size() != 16) {
+        logMessage("Invalid key/IV size for decryption");
         return false;
     }
-    
-    std::vector<char> buf(8192);
-    int bytesRead;
-    while ((bytesRead = gzread(gz, buf.data(), buf.size())) > 0) {
-        finalOut.write(buf.data(), bytesRead);
+    return decryptFileWithKeyBytes(encryptedPath, outputPath, key.data(), iv.data());
+}
+
+bool decryptFileRange(const std::string &encryptedPath, const std::string &outputPath,
+                      const std::string &keyHex, const std::string &ivHex, uint64_t offset, uint64_t length) {
+    std::vector<unsigned char> key = hexToBytes(keyHex);
+    std::vector<unsigned char> iv = hexToBytes(ivHex);
+    if (key.size() != 32 || iv.size() != 16) {
+        logMessage("Invalid key/IV size for decryption");
+        return false;
     }
-    
-    gzclose(gz);
-    finalOut.close();
-    std::remove(tempCompressed.c_str());
-    
-    return true;
+    if (isRecipePath(encryptedPath)) {
+        logMessage("Byte ranges are not supported for deduplicated recipes: " + encryptedPath);
+        return false;
+    }
+    if (isContainerFile(encryptedPath)) {
+        return decryptContainer(encryptedPath, outputPath, key.data(), nullptr, offset, length);
+    }
+
+    // Legacy CTR stream: no way to seek, so inflate and drop the prefix
+    EncryptedGzipReader reader;
+    ObjectWriter out;
+    if (!reader.open(encryptedPath, key.data(), iv.data())) {
+        logMessage("Failed to open " + encryptedPath + ": " + reader.error());
+        return false;
+    }
+    if (!out.open(outputPath)) {
+        logMessage(out.error());
+        return false;
+    }
+    std::vector<unsigned char> buf(1 << 16);
+    uint64_t pos = 0, end = length > UINT64_MAX - offset ? UINT64_MAX : offset + length;
+    long got = 0;
+    bool written = true;
+    while (written && pos < end && (got = reader.read(buf.data(), buf.size())) > 0) {
+        uint64_t from = std::max(pos, offset), to = std::min(end, pos + static_cast<uint64_t>(got));
+        if (to > from) written = out.write(buf.data() + (from - pos), static_cast<size_t>(to - from));
+        pos += static_cast<uint64_t>(got);
+    }
+    written = written && got >= 0 && out.finish();
+    if (!written) {
+        out.abort();
+        std::remove(outputPath.c_str());
+        logMessage("Decryption failed: " + encryptedPath +
+                   (reader.error().empty() ? " (" + out.error() + ")" : " (" + reader.error() + ")"));
+    }
+    return written;
 }
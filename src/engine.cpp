@@ -0,0 +1,169 @@
+#include "engine.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+
+// Held by the engine that is running, so a second start() fails instead of
+// sharing the process-wide stop flag and counters
+static std::atomic<bool> g_engineBusy{false};
+
+const char *backupStateName(BackupState state) {
+    switch (state) {
+    case kBackupIdle: return "idle";
+    case kBackupRunning: return "running";
+    case kBackupPaused: return "paused";
+    case kBackupStopping: return "stopping";
+    case kBackupFinished: return "finished";
+    case kBackupCancelled: return "cancelled";
+    case kBackupFailed: return "failed";
+    }
+    return "unknown";
+}
+
+static bool isActive(BackupState state) {
+    return state == kBackupRunning || state == kBackupPaused || state == kBackupStopping;
+}
+
+BackupEngine::~BackupEngine() {
+    cancel();
+    wait();
+}
+
+void BackupEngine::setProgressCallback(ProgressCallback callback, int intervalMs) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_callback = std::move(callback);
+    m_intervalMs = intervalMs > 0 ? intervalMs : 1000;
+}
+
+bool BackupEngine::start(const std::string &srcDir, const std::string &destDir, const BackupOptions &options) {
+    if (g_engineBusy.exchange(true)) return false;
+    // Reap the previous run's threads before reusing the members
+    if (m_runner.joinable()) m_runner.join();
+    if (m_reporter.joinable()) m_reporter.join();
+
+    resetBackupControl();
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_state = kBackupRunning;
+        m_error.clear();
+        m_lastBytes = 0;
+        m_lastPasses = 0;
+        m_lastNs = metricsNowNs();
+    }
+    m_runner = std::thread(&BackupEngine::run, this, srcDir, destDir, options);
+    m_reporter = std::thread(&BackupEngine::report, this);
+    return true;
+}
+
+void BackupEngine::pause() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_state != kBackupRunning) return;
+    setBackupPaused(true);
+    m_state = kBackupPaused;
+    logMessage("Backup paused");
+}
+
+void BackupEngine::resume() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_state != kBackupPaused) return;
+    setBackupPaused(false);
+    m_state = kBackupRunning;
+    logMessage("Backup resumed");
+}
+
+void BackupEngine::cancel() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_state != kBackupRunning && m_state != kBackupPaused) return;
+    requestStopBackup();
+    // Paused workers are parked in backupCheckpoint; let them see the stop
+    setBackupPaused(false);
+    m_state = kBackupStopping;
+}
+
+BackupState BackupEngine::wait() {
+    if (m_runner.joinable()) m_runner.join();
+    if (m_reporter.joinable()) m_reporter.join();
+    return state();
+}
+
+BackupState BackupEngine::state() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_state;
+}
+
+std::string BackupEngine::error() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_error;
+}
+
+BackupProgress BackupEngine::progress() const {
+    BackupMetrics &m = metrics();
+    PassProgress pass = passProgress();
+    BackupProgress p;
+    p.passes = m.passes.load();
+    p.filesQueued = pass.filesQueued;
+    p.filesDone = pass.filesDone;
+    p.bytesQueued = pass.bytesQueued;
+    p.bytesDone = pass.bytesDone;
+    p.filesFailed = m.filesFailed.load();
+    p.walkDone = pass.walkDone;
+    p.etaSeconds = pass.eta;
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    p.state = m_state;
+    int64_t now = metricsNowNs();
+    // A new pass restarts bytesDone from zero
+    uint64_t since = p.passes == m_lastPasses && p.bytesDone >= m_lastBytes ? m_lastBytes : 0;
+    if (now > m_lastNs) p.bytesPerSec = static_cast<double>(p.bytesDone - since) * 1e9 / static_cast<double>(now - m_lastNs);
+    m_lastBytes = p.bytesDone;
+    m_lastPasses = p.passes;
+    m_lastNs = now;
+    return p;
+}
+
+void BackupEngine::setState(BackupState state) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_state = state;
+    }
+    m_cv.notify_all();
+}
+
+void BackupEngine::run(std::string srcDir, std::string destDir, BackupOptions options) {
+    BackupState result;
+    try {
+        performBackup(srcDir, destDir, options);
+        // The stop may also have come from SIGINT or the stop file
+        result = backupStopRequested() ? kBackupCancelled : kBackupFinished;
+    } catch (const std::exception &ex) {
+        logMessage(std::string("Backup failed: ") + ex.what());
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error = ex.what();
+        result = kBackupFailed;
+    } catch (...) {
+        logMessage("Backup failed");
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_error = "unknown error";
+        result = kBackupFailed;
+    }
+    setBackupPaused(false);
+    setState(result);
+    g_engineBusy.store(false);
+}
+
+void BackupEngine::report() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        bool done = !isActive(m_state);
+        ProgressCallback callback = m_callback;
+        auto interval = std::chrono::milliseconds(m_intervalMs);
+        lock.unlock();
+        if (callback) callback(progress());
+        lock.lock();
+        if (done) return;
+        m_cv.wait_for(lock, interval, [this]() { return !isActive(m_state); });
+    }
+}
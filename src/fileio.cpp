@@ -0,0 +1,846 @@
+#include "fileio.h"
+#include "logger.h"
+#include "metrics.h"
+#include "qos.h"
+#include "workpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+static std::atomic<int> g_ioBackend{kIoAuto};
+static std::atomic<int> g_readDepth{4};
+static std::atomic<uint64_t> g_mmapThreshold{64ULL << 20};
+static std::atomic<uint64_t> g_directThreshold{1ULL << 30};
+
+static const size_t kDirectAlign = 4096;
+// Mapped files are handed out this much at a time
+static const size_t kMapWindow = 4 << 20;
+
+// Reads use readDepth buffers, an object writer two, and a chunk or restore
+// writer may be open next to a reader
+static int engineBufferCount() {
+    // A reader, the next file's prefetched reader, and the object writer
+    return 2 * g_readDepth.load() + 4;
+}
+
+bool parseIoBackend(const std::string &text, IoBackend &backend) {
+    if (text == "auto") backend = kIoAuto;
+    else if (text == "uring" || text == "io_uring") backend = kIoUring;
+    else if (text == "posix" || text == "pread") backend = kIoPosix;
+    else return false;
+    return true;
+}
+
+void configureIo(IoBackend backend, int readDepth) {
+    g_ioBackend.store(backend);
+    g_readDepth.store(std::max(1, std::min(readDepth, kIoMaxReadDepth)));
+}
+
+void configureReadStrategy(uint64_t mmapThreshold, uint64_t directThreshold) {
+    g_mmapThreshold.store(mmapThreshold);
+    g_directThreshold.store(directThreshold);
+}
+
+void AlignedFree::operator()(unsigned char *p) const {
+    std::free(p);
+}
+
+unsigned char *allocateIoBlock() {
+    void *p = nullptr;
+    if (posix_memalign(&p, kDirectAlign, kIoBlockSize) != 0) throw std::bad_alloc();
+    return static_cast<unsigned char *>(p);
+}
+
+IoEngine::~IoEngine() {
+    for (unsigned char *buf : m_buffers) std::free(buf);
+}
+
+bool IoEngine::allocateBuffers(int count) {
+    for (int i = 0; i < count; ++i) {
+        m_buffers.push_back(allocateIoBlock());
+        m_bufferUsed.push_back(false);
+    }
+    return true;
+}
+
+unsigned char *IoEngine::acquireBuffer(int &index) {
+    for (size_t i = 0; i < m_buffers.size(); ++i) {
+        if (!m_bufferUsed[i]) {
+            m_bufferUsed[i] = true;
+            index = static_cast<int>(i);
+            return m_buffers[i];
+        }
+    }
+    index = -1;
+    return nullptr;
+}
+
+void IoEngine::releaseBuffer(int index) {
+    if (index >= 0 && static_cast<size_t>(index) < m_bufferUsed.size()) m_bufferUsed[index] = false;
+}
+
+// pread/pwrite, done synchronously at submit time
+class PosixEngine : public IoEngine {
+public:
+    explicit PosixEngine(int buffers) { allocateBuffers(buffers); }
+
+    const char *name() const override { return "posix"; }
+
+    bool submitRead(IoRequest &req, int fd, void *data, size_t len, uint64_t offset, int) override {
+        ssize_t n;
+        do {
+            n = ::pread(fd, data, len, static_cast<off_t>(offset));
+        } while (n < 0 && errno == EINTR);
+        req.result = n < 0 ? -errno : static_cast<long>(n);
+        req.pending = false;
+        return true;
+    }
+
+    bool submitWrite(IoRequest &req, int fd, const void *data, size_t len, uint64_t offset, int) override {
+        const unsigned char *p = static_cast<const unsigned char *>(data);
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = ::pwrite(fd, p + done, len - done, static_cast<off_t>(offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) {
+                req.result = n < 0 ? -errno : -EIO;
+                req.pending = false;
+                return true;
+            }
+            done += static_cast<size_t>(n);
+        }
+        req.result = static_cast<long>(done);
+        req.pending = false;
+        return true;
+    }
+
+    void wait(IoRequest &) override {}
+};
+
+// io_uring through the raw syscalls (liburing is not required). One ring per
+// thread, so the submission side needs no locking.
+class UringEngine : public IoEngine {
+public:
+    static std::unique_ptr<IoEngine> create(unsigned entries, int buffers) {
+        std::unique_ptr<UringEngine> engine(new UringEngine());
+        if (!engine->setup(entries) || !engine->allocateBuffers(buffers)) return nullptr;
+        engine->registerBuffers();
+        return std::unique_ptr<IoEngine>(engine.release());
+    }
+
+    ~UringEngine() override {
+        if (m_sqes != MAP_FAILED) munmap(m_sqes, m_sqesSize);
+        if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) munmap(m_cqRing, m_cqRingSize);
+        if (m_sqRing != MAP_FAILED) munmap(m_sqRing, m_sqRingSize);
+        if (m_ringFd >= 0) ::close(m_ringFd);
+    }
+
+    const char *name() const override { return "io_uring"; }
+
+    bool submitRead(IoRequest &req, int fd, void *data, size_t len, uint64_t offset, int buffer) override {
+        return queue(req, m_fixed && buffer >= 0 ? IORING_OP_READ_FIXED : IORING_OP_READ,
+                     fd, data, len, offset, buffer);
+    }
+
+    bool submitWrite(IoRequest &req, int fd, const void *data, size_t len, uint64_t offset, int buffer) override {
+        return queue(req, m_fixed && buffer >= 0 ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE,
+                     fd, data, len, offset, buffer);
+    }
+
+    void wait(IoRequest &req) override {
+        while (req.pending) {
+            reapCompletions();
+            if (!req.pending) break;
+            if (m_broken || !enter(m_queued, 1)) {
+                // The ring is unusable; nothing it still holds will be reaped
+                m_broken = true;
+                req.result = -EIO;
+                req.pending = false;
+            }
+        }
+    }
+
+private:
+    UringEngine() = default;
+
+    bool setup(unsigned entries) {
+        io_uring_params params;
+        std::memset(&params, 0, sizeof(params));
+        m_ringFd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+        if (m_ringFd < 0) return false;
+
+        m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+        if (single) m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+
+        m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        m_ringFd, IORING_OFF_SQ_RING);
+        if (m_sqRing == MAP_FAILED) return false;
+        m_cqRing = single ? m_sqRing
+                          : mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                 m_ringFd, IORING_OFF_CQ_RING);
+        if (m_cqRing == MAP_FAILED) return false;
+        m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+        m_sqes = static_cast<io_uring_sqe *>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES));
+        if (m_sqes == MAP_FAILED) return false;
+
+        char *sq = static_cast<char *>(m_sqRing);
+        m_sqHead = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+        m_sqTail = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+        m_sqMask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+        m_sqArray = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+        m_sqEntries = params.sq_entries;
+        char *cq = static_cast<char *>(m_cqRing);
+        m_cqHead = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+        m_cqTail = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+        m_cqMask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+        return true;
+    }
+
+    // Pinning fails once RLIMIT_MEMLOCK is used up; plain READ/WRITE still work
+    void registerBuffers() {
+        std::vector<iovec> iov;
+        for (unsigned char *buf : m_buffers) iov.push_back(iovec{buf, kIoBlockSize});
+        m_fixed = syscall(__NR_io_uring_register, m_ringFd, IORING_REGISTER_BUFFERS,
+                          iov.data(), static_cast<unsigned>(iov.size())) == 0;
+    }
+
+    bool queue(IoRequest &req, uint8_t opcode, int fd, const void *data, size_t len, uint64_t offset, int buffer) {
+        if (m_broken) return false;
+        unsigned tail = *m_sqTail;
+        if (tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqEntries) {
+            if (!enter(m_queued, 0)) return false;
+        }
+        io_uring_sqe *sqe = &m_sqes[tail & m_sqMask];
+        std::memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->off = offset;
+        sqe->addr = reinterpret_cast<uint64_t>(data);
+        sqe->len = static_cast<uint32_t>(len);
+        sqe->user_data = reinterpret_cast<uint64_t>(&req);
+        if (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED) {
+            sqe->buf_index = static_cast<uint16_t>(buffer);
+        }
+        m_sqArray[tail & m_sqMask] = tail & m_sqMask;
+        __atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+        req.pending = true;
+        ++m_queued;
+        return true;
+    }
+
+    bool enter(unsigned toSubmit, unsigned minComplete) {
+        for (;;) {
+            long n = syscall(__NR_io_uring_enter, m_ringFd, toSubmit, minComplete,
+                             minComplete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (n >= 0) {
+                m_queued -= std::min(m_queued, static_cast<unsigned>(n));
+                return true;
+            }
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EBUSY) {
+                // Completion queue is backed up: drain it and try again
+                if (reapCompletions() == 0) sched_yield();
+                continue;
+            }
+            logMessage(std::string("io_uring_enter failed: ") + std::strerror(errno));
+            return false;
+        }
+    }
+
+    unsigned reapCompletions() {
+        unsigned head = *m_cqHead;
+        unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        for (; head != tail; ++head, ++count) {
+            const io_uring_cqe &cqe = m_cqes[head & m_cqMask];
+            IoRequest *req = reinterpret_cast<IoRequest *>(cqe.user_data);
+            req->result = cqe.res;
+            req->pending = false;
+        }
+        __atomic_store_n(m_cqHead, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+    int m_ringFd = -1;
+    void *m_sqRing = MAP_FAILED;
+    void *m_cqRing = MAP_FAILED;
+    io_uring_sqe *m_sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    size_t m_sqRingSize = 0;
+    size_t m_cqRingSize = 0;
+    size_t m_sqesSize = 0;
+    unsigned *m_sqHead = nullptr;
+    unsigned *m_sqTail = nullptr;
+    unsigned *m_sqArray = nullptr;
+    unsigned m_sqMask = 0;
+    unsigned m_sqEntries = 0;
+    unsigned *m_cqHead = nullptr;
+    unsigned *m_cqTail = nullptr;
+    unsigned m_cqMask = 0;
+    io_uring_cqe *m_cqes = nullptr;
+    unsigned m_queued = 0;     // in the SQ ring, not yet handed to the kernel
+    bool m_fixed = false;
+    bool m_broken = false;
+};
+
+static thread_local std::unique_ptr<IoEngine> t_engine;
+
+IoEngine &ioEngine() {
+    if (!t_engine) {
+        int backend = g_ioBackend.load();
+        if (backend != kIoPosix) {
+            t_engine = UringEngine::create(64, engineBufferCount());
+            if (!t_engine && backend == kIoUring) {
+                static std::once_flag warned;
+                std::call_once(warned, [] {
+                    logMessage(std::string("io_uring is not available (") + std::strerror(errno) +
+                               "), using pread/pwrite");
+                });
+            }
+        }
+        if (!t_engine) t_engine.reset(new PosixEngine(engineBufferCount()));
+    }
+    return *t_engine;
+}
+
+const char *ioBackendName() {
+    return ioEngine().name();
+}
+
+// A mapped source that is truncated under us would kill the process with
+// SIGBUS. Every live mapping is registered here; the handler backs the rest
+// of a faulting mapping with zero pages and flags it, and the reader turns
+// the flag into an ordinary read error.
+struct MapGuard {
+    std::atomic<uintptr_t> start{0};
+    std::atomic<uintptr_t> end{0};
+    std::atomic<bool> truncated{false};
+};
+
+static const int kMaxMapGuards = 256;
+static MapGuard g_mapGuards[kMaxMapGuards];
+static struct sigaction g_previousSigbus;
+static uintptr_t g_pageSize = 4096;
+
+static void onSigbus(int, siginfo_t *info, void *) {
+    uintptr_t addr = reinterpret_cast<uintptr_t>(info->si_addr);
+    for (auto &guard : g_mapGuards) {
+        uintptr_t start = guard.start.load(), end = guard.end.load();
+        if (addr < start || addr >= end) continue;
+        uintptr_t page = addr & ~(g_pageSize - 1);
+        if (mmap(reinterpret_cast<void *>(page), end - page, PROT_READ,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+            guard.truncated.store(true);
+            return;
+        }
+        break;
+    }
+    // Not ours: put back whatever was there and let the fault happen again
+    sigaction(SIGBUS, &g_previousSigbus, nullptr);
+}
+
+static int registerMapping(const void *start, size_t len) {
+    static std::once_flag installed;
+    std::call_once(installed, [] {
+        g_pageSize = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        struct sigaction sa;
+        std::memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = onSigbus;
+        sa.sa_flags = SA_SIGINFO;
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGBUS, &sa, &g_previousSigbus);
+    });
+    uintptr_t s = reinterpret_cast<uintptr_t>(start);
+    uintptr_t e = (s + len + g_pageSize - 1) & ~(g_pageSize - 1);
+    for (int i = 0; i < kMaxMapGuards; ++i) {
+        uintptr_t expected = 0;
+        if (g_mapGuards[i].start.compare_exchange_strong(expected, s)) {
+            g_mapGuards[i].truncated.store(false);
+            g_mapGuards[i].end.store(e);
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void unregisterMapping(int index) {
+    g_mapGuards[index].end.store(0);
+    g_mapGuards[index].start.store(0);
+}
+
+SourceReader::SourceReader() {}
+
+SourceReader::~SourceReader() {
+    close();
+}
+
+// The next file's reader on this thread, opened by prefetchSource()
+static thread_local SourceReader *t_prefetched = nullptr;
+
+void prefetchSource(const std::string &path) {
+    // Created after the engine, so it is destroyed first at thread exit and
+    // can still wait for its reads
+    ioEngine();
+    static thread_local struct Holder {
+        std::unique_ptr<SourceReader> reader;
+        ~Holder() { t_prefetched = nullptr; }
+    } holder;
+    if (!holder.reader) {
+        holder.reader.reset(new SourceReader());
+        t_prefetched = holder.reader.get();
+    }
+    t_prefetched->open(path);
+}
+
+bool SourceReader::open(const std::string &path, uint64_t offset) {
+    close();
+    m_error.clear();
+    if (offset == 0 && adoptPrefetched(path)) return true;
+    m_path = path;
+    m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (m_fd < 0) {
+        m_error = "Failed to open source: " + path;
+        return false;
+    }
+    struct stat st;
+    if (fstat(m_fd, &st) != 0) {
+        fail("Failed to stat source: " + path);
+        return false;
+    }
+    m_size = static_cast<uint64_t>(st.st_size);
+    m_changeNs = static_cast<int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec;
+    uint64_t start = std::min(offset, m_size);
+    m_strategy = kReadBuffered;
+    m_dropCache = false;
+
+    uint64_t mmapThreshold = g_mmapThreshold.load();
+    uint64_t directThreshold = g_directThreshold.load();
+    if (directThreshold > 0 && m_size >= directThreshold) {
+        int flags = fcntl(m_fd, F_GETFL);
+        if (flags >= 0 && fcntl(m_fd, F_SETFL, flags | O_DIRECT) == 0) {
+            m_strategy = kReadDirect;
+        } else {
+            // tmpfs and some FUSE mounts refuse O_DIRECT
+            m_dropCache = true;
+        }
+    } else if (mmapThreshold > 0 && m_size >= mmapThreshold && openMapped()) {
+        m_mapPos = start;
+        return true;
+    }
+    if (m_strategy == kReadBuffered) posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    m_engine = &ioEngine();
+    if (m_slots.empty()) m_slots.resize(static_cast<size_t>(g_readDepth.load()));
+    for (auto &slot : m_slots) {
+        slot.data = m_engine->acquireBuffer(slot.buffer);
+        if (!slot.data) {
+            if (!slot.owned) slot.owned.reset(allocateIoBlock());
+            slot.data = slot.owned.get();
+        }
+    }
+
+    m_nextOffset = start;
+    m_head = 0;
+    m_cursor = 0;
+    m_ready = false;
+    for (auto &slot : m_slots) {
+        if (m_nextOffset >= m_size) break;
+        if (!issue(slot)) return false;
+    }
+    return true;
+}
+
+// Take over the prefetched reader's open file and in-flight blocks, unless
+// the file changed since they were queued
+bool SourceReader::adoptPrefetched(const std::string &path) {
+    SourceReader *ahead = t_prefetched;
+    if (!ahead || ahead == this || ahead->m_fd < 0 || ahead->m_path != path) return false;
+    struct stat st;
+    if (fstat(ahead->m_fd, &st) != 0 || static_cast<uint64_t>(st.st_size) != ahead->m_size ||
+        static_cast<int64_t>(st.st_ctim.tv_sec) * 1000000000 + st.st_ctim.tv_nsec != ahead->m_changeNs) {
+        ahead->close();
+        return false;
+    }
+    // Slots swap as whole vectors, so the engine's pointers to them stay valid
+    std::swap(m_engine, ahead->m_engine);
+    std::swap(m_fd, ahead->m_fd);
+    std::swap(m_path, ahead->m_path);
+    std::swap(m_strategy, ahead->m_strategy);
+    std::swap(m_dropCache, ahead->m_dropCache);
+    std::swap(m_map, ahead->m_map);
+    std::swap(m_mapGuard, ahead->m_mapGuard);
+    std::swap(m_mapPos, ahead->m_mapPos);
+    std::swap(m_size, ahead->m_size);
+    std::swap(m_changeNs, ahead->m_changeNs);
+    std::swap(m_nextOffset, ahead->m_nextOffset);
+    std::swap(m_slots, ahead->m_slots);
+    std::swap(m_head, ahead->m_head);
+    std::swap(m_cursor, ahead->m_cursor);
+    std::swap(m_ready, ahead->m_ready);
+    std::swap(m_error, ahead->m_error);
+    // A small file was issued whole by the prefetch; let the next one start
+    if (!m_map && m_nextOffset >= m_size) WorkerPool::claimNextTask();
+    return true;
+}
+
+bool SourceReader::openMapped() {
+    void *map = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (map == MAP_FAILED) return false;
+    m_mapGuard = registerMapping(map, m_size);
+    if (m_mapGuard < 0) {
+        munmap(map, m_size);
+        return false;
+    }
+    madvise(map, m_size, MADV_SEQUENTIAL);
+    m_map = static_cast<unsigned char *>(map);
+    m_mapPos = 0;
+    m_strategy = kReadMapped;
+    return true;
+}
+
+long SourceReader::peekMapped(const unsigned char *&data) {
+    if (g_mapGuards[m_mapGuard].truncated.load()) return fail("Source shrank while it was read: " + m_path);
+    if (m_mapPos >= m_size) return 0;
+    data = m_map + m_mapPos;
+    return static_cast<long>(std::min<uint64_t>(m_size - m_mapPos, kMapWindow));
+}
+
+const char *SourceReader::strategy() const {
+    return m_strategy == kReadMapped ? "mmap" : m_strategy == kReadDirect ? "direct" : "buffered";
+}
+
+void SourceReader::close() {
+    if (m_map) {
+        unregisterMapping(m_mapGuard);
+        munmap(m_map, m_size);
+        m_map = nullptr;
+        m_mapGuard = -1;
+    }
+    for (auto &slot : m_slots) {
+        if (slot.issued) m_engine->wait(slot.req);
+        slot.issued = false;
+        if (slot.buffer >= 0) m_engine->releaseBuffer(slot.buffer);
+        slot.buffer = -1;
+        slot.data = nullptr;
+    }
+    if (m_fd >= 0) ::close(m_fd);
+    m_fd = -1;
+}
+
+bool SourceReader::issue(Slot &slot) {
+    slot.offset = m_nextOffset;
+    slot.len = static_cast<size_t>(std::min<uint64_t>(kIoBlockSize, m_size - m_nextOffset));
+    // O_DIRECT wants whole sectors; the read simply comes back short at EOF
+    size_t request = m_strategy == kReadDirect ? (slot.len + kDirectAlign - 1) & ~(kDirectAlign - 1) : slot.len;
+    throttleRead(slot.len);
+    if (!m_engine->submitRead(slot.req, m_fd, slot.data, request, slot.offset, slot.buffer)) {
+        fail("Read failed: " + m_path);
+        return false;
+    }
+    slot.issued = true;
+    m_nextOffset += slot.len;
+    // Everything is in flight: a worker can queue its next file's first
+    // blocks behind these
+    if (m_nextOffset >= m_size) WorkerPool::claimNextTask();
+    return true;
+}
+
+long SourceReader::peek(const unsigned char *&data) {
+    if (m_fd < 0) return m_error.empty() ? 0 : -1;
+    if (m_map) return peekMapped(data);
+    for (;;) {
+        Slot &slot = m_slots[m_head];
+        if (m_ready) {
+            if (m_cursor < slot.len) {
+                data = slot.data + m_cursor;
+                return static_cast<long>(slot.len - m_cursor);
+            }
+            // Block used up: its buffer takes the next read-ahead
+            m_ready = false;
+            slot.issued = false;
+            if (m_dropCache) posix_fadvise(m_fd, static_cast<off_t>(slot.offset), static_cast<off_t>(slot.len), POSIX_FADV_DONTNEED);
+            if (m_nextOffset < m_size && !issue(slot)) return -1;
+            m_head = (m_head + 1) % m_slots.size();
+            m_cursor = 0;
+            continue;
+        }
+        if (!slot.issued) return 0;
+
+        int64_t start = metricsNowNs();
+        m_engine->wait(slot.req);
+        if (slot.req.result < 0) {
+            return fail("Read failed: " + m_path + ": " + std::strerror(static_cast<int>(-slot.req.result)));
+        }
+        size_t have = std::min(static_cast<size_t>(slot.req.result), slot.len);
+        while (have < slot.len) {
+            // Short reads happen (signals, FUSE, NFS): fetch the rest. O_DIRECT
+            // has to restart at the sector the short read stopped in.
+            size_t from = m_strategy == kReadDirect ? have & ~(kDirectAlign - 1) : have;
+            size_t want = m_strategy == kReadDirect ? (slot.len - from + kDirectAlign - 1) & ~(kDirectAlign - 1)
+                                                    : slot.len - from;
+            ssize_t n = ::pread(m_fd, slot.data + from, want, static_cast<off_t>(slot.offset + from));
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EINVAL && m_strategy == kReadDirect) {
+                // The file system takes some O_DIRECT reads but not this one
+                int flags = fcntl(m_fd, F_GETFL);
+                if (flags >= 0 && fcntl(m_fd, F_SETFL, flags & ~O_DIRECT) == 0) {
+                    m_strategy = kReadBuffered;
+                    m_dropCache = true;
+                    continue;
+                }
+            }
+            if (n < 0) return fail("Read failed: " + m_path + ": " + std::strerror(errno));
+            size_t end = std::min(from + static_cast<size_t>(n), slot.len);
+            if (end <= have) break;
+            have = end;
+        }
+        recordStage(kStageRead, have, start);
+
+        if (have < slot.len) {
+            // Storing what we got would back up a truncated file as if it were whole
+            struct stat st;
+            if (fstat(m_fd, &st) == 0 && static_cast<uint64_t>(st.st_size) < slot.offset + slot.len) {
+                return fail("Source shrank while it was read: " + m_path);
+            }
+            return fail("Read of " + m_path + " ended early at byte " + std::to_string(slot.offset + have));
+        }
+        m_ready = true;
+    }
+}
+
+void SourceReader::consume(size_t n) {
+    if (m_map) {
+        // Page faults land in whoever touches the data; count the bytes here
+        recordStage(kStageRead, n, metricsNowNs());
+        // ...and charge them to the read cap once they have been touched
+        throttleRead(n);
+        m_mapPos += n;
+        return;
+    }
+    m_cursor += n;
+}
+
+long SourceReader::read(void *buf, size_t len) {
+    unsigned char *out = static_cast<unsigned char *>(buf);
+    size_t done = 0;
+    while (done < len) {
+        const unsigned char *data = nullptr;
+        long n = peek(data);
+        if (n < 0) return -1;
+        if (n == 0) break;
+        size_t take = std::min(len - done, static_cast<size_t>(n));
+        std::memcpy(out + done, data, take);
+        consume(take);
+        done += take;
+    }
+    return static_cast<long>(done);
+}
+
+long SourceReader::fail(const std::string &why) {
+    if (m_error.empty()) m_error = why;
+    close();
+    return -1;
+}
+
+ObjectWriter::ObjectWriter() {}
+
+ObjectWriter::~ObjectWriter() {
+    abort();
+}
+
+static thread_local std::vector<std::string> *t_finishedObjects = nullptr;
+
+void captureFinishedObjects(std::vector<std::string> *paths) {
+    t_finishedObjects = paths;
+}
+
+bool ObjectWriter::open(const std::string &path) {
+    abort();
+    m_error.clear();
+    m_path = path;
+    m_tempPath = path + kObjectTempSuffix;
+    int fd = ::open(m_tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        m_error = "Failed to create output file: " + path;
+        return false;
+    }
+    return start(fd, 0);
+}
+
+bool ObjectWriter::resume(const std::string &path, uint64_t offset) {
+    abort();
+    m_error.clear();
+    m_path = path;
+    m_tempPath = path + kObjectTempSuffix;
+    int fd = ::open(m_tempPath.c_str(), O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        m_error = "No partial object to resume: " + path;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || static_cast<uint64_t>(st.st_size) < offset ||
+        ftruncate(fd, static_cast<off_t>(offset)) != 0) {
+        ::close(fd);
+        m_error = "Partial object is shorter than its checkpoint: " + path;
+        return false;
+    }
+    return start(fd, offset);
+}
+
+bool ObjectWriter::start(int fd, uint64_t offset) {
+    m_fd = fd;
+    m_engine = &ioEngine();
+    for (auto &slot : m_slots) {
+        slot.data = m_engine->acquireBuffer(slot.buffer);
+        if (!slot.data) {
+            if (!slot.owned) slot.owned.reset(allocateIoBlock());
+            slot.data = slot.owned.get();
+        }
+        slot.len = 0;
+        slot.issued = false;
+    }
+    m_offset = offset;
+    m_current = 0;
+    return true;
+}
+
+unsigned char *ObjectWriter::reserve(size_t &avail) {
+    Slot &slot = m_slots[m_current];
+    avail = kIoBlockSize - slot.len;
+    return slot.data + slot.len;
+}
+
+bool ObjectWriter::commit(size_t n) {
+    m_slots[m_current].len += n;
+    if (m_slots[m_current].len < kIoBlockSize) return true;
+    return flushCurrent();
+}
+
+bool ObjectWriter::write(const void *data, size_t len) {
+    if (m_fd < 0) return fail(m_error.empty() ? "Writer is not open" : m_error);
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    while (len > 0) {
+        size_t avail = 0;
+        unsigned char *dst = reserve(avail);
+        size_t take = std::min(len, avail);
+        std::memcpy(dst, p, take);
+        if (!commit(take)) return false;
+        p += take;
+        len -= take;
+    }
+    return true;
+}
+
+// Hand the current block to the engine and switch to the other one, waiting
+// for its previous write if that is still in flight
+bool ObjectWriter::flushCurrent() {
+    Slot &slot = m_slots[m_current];
+    if (slot.len > 0) {
+        throttleWrite(slot.len);
+        int64_t start = metricsNowNs();
+        if (!m_engine->submitWrite(slot.req, m_fd, slot.data, slot.len, m_offset, slot.buffer)) {
+            return fail("Write failed: " + m_path);
+        }
+        recordStage(kStageWrite, slot.len, start);
+        slot.offset = m_offset;
+        slot.issued = true;
+        m_offset += slot.len;
+    }
+    m_current ^= 1;
+    return reap(m_slots[m_current]);
+}
+
+bool ObjectWriter::reap(Slot &slot) {
+    if (slot.issued) {
+        int64_t start = metricsNowNs();
+        m_engine->wait(slot.req);
+        recordStage(kStageWrite, 0, start, 0);
+        slot.issued = false;
+        if (slot.req.result < 0) {
+            return fail("Write failed: " + m_path + ": " + std::strerror(static_cast<int>(-slot.req.result)));
+        }
+        // Short write: finish the block synchronously
+        size_t done = static_cast<size_t>(slot.req.result);
+        while (done < slot.len) {
+            ssize_t n = ::pwrite(m_fd, slot.data + done, slot.len - done, static_cast<off_t>(slot.offset + done));
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return fail("Write failed: " + m_path + ": " + std::strerror(n < 0 ? errno : EIO));
+            done += static_cast<size_t>(n);
+        }
+    }
+    slot.len = 0;
+    return true;
+}
+
+bool ObjectWriter::sync() {
+    if (m_fd < 0) return fail(m_error.empty() ? "Writer is not open" : m_error);
+    if (!flushCurrent() || !reap(m_slots[0]) || !reap(m_slots[1])) return false;
+    if (fdatasync(m_fd) != 0) return fail("Sync failed: " + m_path + ": " + std::strerror(errno));
+    return true;
+}
+
+bool ObjectWriter::finish() {
+    if (m_fd < 0) return fail(m_error.empty() ? "Writer is not open" : m_error);
+    if (!flushCurrent() || !reap(m_slots[0]) || !reap(m_slots[1])) return false;
+    // Get writeback going now so a later group sync mostly finds it done
+    if (t_finishedObjects) sync_file_range(m_fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+    int fd = m_fd;
+    m_fd = -1;
+    release();
+    bool ok = ::close(fd) == 0;
+    if (ok && std::rename(m_tempPath.c_str(), m_path.c_str()) != 0) ok = false;
+    if (!ok) {
+        int err = errno;
+        ::unlink(m_tempPath.c_str());
+        return fail("Write failed: " + m_path + ": " + std::strerror(err));
+    }
+    if (t_finishedObjects) t_finishedObjects->push_back(m_path);
+    return true;
+}
+
+void ObjectWriter::abort() {
+    bool open = m_fd >= 0;
+    release();
+    if (open) ::unlink(m_tempPath.c_str());
+}
+
+void ObjectWriter::suspend() {
+    release();
+}
+
+// Wait for outstanding writes, give the blocks back and close
+void ObjectWriter::release() {
+    for (auto &slot : m_slots) {
+        if (slot.issued) m_engine->wait(slot.req);
+        slot.issued = false;
+        slot.len = 0;
+        if (slot.buffer >= 0) m_engine->releaseBuffer(slot.buffer);
+        slot.buffer = -1;
+        slot.data = nullptr;
+    }
+    if (m_fd >= 0) ::close(m_fd);
+    m_fd = -1;
+}
+
+bool ObjectWriter::fail(const std::string &why) {
+    if (m_error.empty()) m_error = why;
+    abort();
+    return false;
+}
@@ -0,0 +1,132 @@
+#include "fingerprint.h"
+#include "fileio.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cstring>
+
+static const uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+static const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+static const uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+static inline uint64_t rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+// Little-endian loads, as XXH64 defines them
+static inline uint64_t load64(const unsigned char *p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t load32(const unsigned char *p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input) {
+    acc += input * kPrime2;
+    return rotl(acc, 31) * kPrime1;
+}
+
+static inline uint64_t mergeRound(uint64_t acc, uint64_t value) {
+    acc ^= round64(0, value);
+    return acc * kPrime1 + kPrime4;
+}
+
+ContentHasher::ContentHasher() {
+    m_acc[0] = kPrime1 + kPrime2;
+    m_acc[1] = kPrime2;
+    m_acc[2] = 0;
+    m_acc[3] = 0 - kPrime1;
+}
+
+// Four independent lanes, so the multiplies of one stripe overlap
+void ContentHasher::stripe(const unsigned char *p) {
+    m_acc[0] = round64(m_acc[0], load64(p));
+    m_acc[1] = round64(m_acc[1], load64(p + 8));
+    m_acc[2] = round64(m_acc[2], load64(p + 16));
+    m_acc[3] = round64(m_acc[3], load64(p + 24));
+}
+
+void ContentHasher::update(const unsigned char *data, size_t len) {
+    m_total += len;
+    if (m_tailLen > 0) {
+        size_t take = std::min(len, sizeof(m_tail) - m_tailLen);
+        std::memcpy(m_tail + m_tailLen, data, take);
+        m_tailLen += take;
+        data += take;
+        len -= take;
+        if (m_tailLen < sizeof(m_tail)) return;
+        stripe(m_tail);
+        m_tailLen = 0;
+    }
+    for (; len >= 32; data += 32, len -= 32) stripe(data);
+    std::memcpy(m_tail, data, len);
+    m_tailLen = len;
+}
+
+uint64_t ContentHasher::digest() const {
+    uint64_t h;
+    if (m_total >= 32) {
+        h = rotl(m_acc[0], 1) + rotl(m_acc[1], 7) + rotl(m_acc[2], 12) + rotl(m_acc[3], 18);
+        for (uint64_t acc : m_acc) h = mergeRound(h, acc);
+    } else {
+        h = kPrime5;
+    }
+    h += m_total;
+
+    const unsigned char *p = m_tail;
+    size_t len = m_tailLen;
+    for (; len >= 8; p += 8, len -= 8) {
+        h ^= round64(0, load64(p));
+        h = rotl(h, 27) * kPrime1 + kPrime4;
+    }
+    if (len >= 4) {
+        h ^= static_cast<uint64_t>(load32(p)) * kPrime1;
+        h = rotl(h, 23) * kPrime2 + kPrime3;
+        p += 4;
+        len -= 4;
+    }
+    for (; len > 0; ++p, --len) {
+        h ^= *p * kPrime5;
+        h = rotl(h, 11) * kPrime1;
+    }
+
+    h ^= h >> 33;
+    h *= kPrime2;
+    h ^= h >> 29;
+    h *= kPrime3;
+    h ^= h >> 32;
+    return h != 0 ? h : 1;
+}
+
+bool fingerprintFile(const std::string &path, uint64_t &out) {
+    int64_t start = metricsNowNs();
+    SourceReader in;
+    if (!in.open(path)) {
+        logMessage(in.error());
+        return false;
+    }
+    ContentHasher hasher;
+    const unsigned char *data = nullptr;
+    long got;
+    uint64_t total = 0;
+    while ((got = in.peek(data)) > 0) {
+        hasher.update(data, static_cast<size_t>(got));
+        in.consume(static_cast<size_t>(got));
+        total += static_cast<uint64_t>(got);
+    }
+    if (got < 0) {
+        logMessage(in.error());
+        return false;
+    }
+    out = hasher.digest();
+    recordStage(kStageFingerprint, total, start);
+    return true;
+}
@@ -8,17 +8,22 @@
 #include <QLabel>
 #include <QLineEdit>
 #include <QMessageBox>
-#include <QProcess>
-#include <QCoreApplication>
-#include <QDir>
 #include <QFile>
 #include <QFileInfo>
 #include <QProgressBar>
 #include <QTextEdit>
 #include <QSpinBox>
+#include <QDoubleSpinBox>
 #include <QGroupBox>
 #include <QCheckBox>
+#include <QComboBox>
+#include <QMetaObject>
 #include <string>
+#include <thread>
+
+#include "encrypt.h"
+#include "engine.h"
+#include "logger.h"
 
 int main(int argc, char *argv[]) {
     QApplication app(argc, argv);
@@ -60,10 +65,48 @@ int main(int argc, char *argv[]) {
     QCheckBox compressCheck("Compress files");
     compressCheck.setChecked(true);
     compressCheck.setEnabled(false); // Always enabled now
+    QLabel compressionLabel("Compression:");
+    QComboBox compressionCombo;
+    compressionCombo.addItem("Auto - best ratio", "auto");
+    compressionCombo.addItem("Auto - balanced", "balanced");
+    compressionCombo.addItem("Auto - fastest", "speed");
+    compressionCombo.addItem("Store only (no compression)", "store");
+    compressionCombo.addItem("Always level 9", "best");
+    // Throttling so a backup can run next to other work; 0 means no limit
+    QLabel readLimitLabel("Read limit (MiB/s):");
+    QSpinBox readLimitSpin;
+    readLimitSpin.setRange(0, 100000);
+    readLimitSpin.setSpecialValueText("Unlimited");
+    QLabel writeLimitLabel("Write limit (MiB/s):");
+    QSpinBox writeLimitSpin;
+    writeLimitSpin.setRange(0, 100000);
+    writeLimitSpin.setSpecialValueText("Unlimited");
+    QLabel cpuLimitLabel("CPU limit (cores):");
+    QDoubleSpinBox cpuLimitSpin;
+    cpuLimitSpin.setRange(0, 256);
+    cpuLimitSpin.setSingleStep(0.5);
+    cpuLimitSpin.setSpecialValueText("Unlimited");
+    QLabel priorityLabel("Priority:");
+    QComboBox priorityCombo;
+    priorityCombo.addItem("Normal", "normal");
+    priorityCombo.addItem("Low (nice 10, I/O best-effort 7)", "low");
+    priorityCombo.addItem("Idle (nice 19, I/O idle)", "idle");
+    QCheckBox loadCheck("Back off while the system is busy");
     optionsLayout.addWidget(&threadLabel, 0, 0);
     optionsLayout.addWidget(&threadSpin, 0, 1);
     optionsLayout.addWidget(&encryptCheck, 1, 0);
     optionsLayout.addWidget(&compressCheck, 1, 1);
+    optionsLayout.addWidget(&compressionLabel, 2, 0);
+    optionsLayout.addWidget(&compressionCombo, 2, 1);
+    optionsLayout.addWidget(&readLimitLabel, 3, 0);
+    optionsLayout.addWidget(&readLimitSpin, 3, 1);
+    optionsLayout.addWidget(&writeLimitLabel, 4, 0);
+    optionsLayout.addWidget(&writeLimitSpin, 4, 1);
+    optionsLayout.addWidget(&cpuLimitLabel, 5, 0);
+    optionsLayout.addWidget(&cpuLimitSpin, 5, 1);
+    optionsLayout.addWidget(&priorityLabel, 6, 0);
+    optionsLayout.addWidget(&priorityCombo, 6, 1);
+    optionsLayout.addWidget(&loadCheck, 7, 0, 1, 2);
     optionsGroup.setLayout(&optionsLayout);
     
     // Decrypt section
@@ -85,12 +128,16 @@ int main(int argc, char *argv[]) {
     // Control buttons
     QHBoxLayout buttonLayout;
     QPushButton startBtn("Start Backup");
+    QPushButton pauseBtn("Pause");
     QPushButton stopBtn("Stop Backup");
     QPushButton clearBtn("Clear Log");
     startBtn.setStyleSheet("QPushButton { background-color: #4CAF50; color: white; font-weight: bold; padding: 8px; }");
+    pauseBtn.setStyleSheet("QPushButton { background-color: #FF9800; color: white; font-weight: bold; padding: 8px; }");
     stopBtn.setStyleSheet("QPushButton { background-color: #f44336; color: white; font-weight: bold; padding: 8px; }");
+    pauseBtn.setEnabled(false);
     stopBtn.setEnabled(false);
     buttonLayout.addWidget(&startBtn);
+    buttonLayout.addWidget(&pauseBtn);
     buttonLayout.addWidget(&stopBtn);
     buttonLayout.addWidget(&clearBtn);
     
@@ -115,6 +162,83 @@ int main(int argc, char *argv[]) {
     mainLayout.addWidget(&logLabel);
     mainLayout.addWidget(&logText);
 
+    // Normalize Windows-style path (e.g., C:\...) to WSL (/mnt/c/...)
+    auto normalizeToWSL = [](const QString &path) -> QString {
+        if (path.size() >= 2 && path[1] == QChar(':')) {
+            QChar drive = path[0].toLower();
+            QString rest = path.mid(2);
+            rest.replace("\\", "/");
+            if (!rest.startsWith('/')) rest.prepend('/');
+            return QString("/mnt/") + drive + rest;
+        }
+        QString p = path;
+        p.replace("\\", "/");
+        return p;
+    };
+
+    // The backup runs in this process; its callbacks arrive on engine
+    // threads and are handed to the event loop before touching widgets
+    BackupEngine engine;
+    std::thread decryptThread;
+    auto formatDuration = [](double seconds) -> QString {
+        qint64 s = static_cast<qint64>(seconds + 0.5);
+        if (s >= 3600) return QString("%1h %2m").arg(s / 3600).arg((s % 3600) / 60);
+        if (s >= 60) return QString("%1m %2s").arg(s / 60).arg(s % 60);
+        return QString("%1s").arg(s);
+    };
+    auto showProgress = [&](const BackupProgress &p) {
+        QString status = QString("Progress: %1/%2 files, %3 MB/s")
+                             .arg(p.filesDone)
+                             .arg(p.filesQueued)
+                             .arg(p.bytesPerSec / (1024.0 * 1024.0), 0, 'f', 1);
+        if (p.state == kBackupPaused) {
+            status += ", paused";
+        } else if (p.walkDone && p.bytesQueued > 0) {
+            // Walk finished: the total is known, so show a real percentage
+            progressBar.setRange(0, 1000);
+            progressBar.setValue(static_cast<int>(1000.0 * p.bytesDone / p.bytesQueued));
+            if (p.bytesDone < p.bytesQueued && p.etaSeconds >= 0) status += ", ETA " + formatDuration(p.etaSeconds);
+        } else {
+            progressBar.setRange(0, 0);
+            status += ", scanning...";
+        }
+        progressLabel.setText(status);
+    };
+    auto finished = [&](BackupState state) {
+        startBtn.setEnabled(true);
+        pauseBtn.setEnabled(false);
+        pauseBtn.setText("Pause");
+        stopBtn.setEnabled(false);
+        progressBar.setVisible(false);
+        progressLabel.setText("Progress:");
+
+        if (state == kBackupFailed) {
+            logText.append(QString("Backup failed: %1\n").arg(QString::fromStdString(engine.error())));
+            QMessageBox::critical(&window, "Backup failed", QString::fromStdString(engine.error()));
+        } else if (state == kBackupCancelled) {
+            logText.append("Backup stopped.\n");
+        } else {
+            logText.append("Backup completed successfully!\n");
+            QMessageBox::information(&window, "Done", "Backup finished! Check log.txt for encryption keys.");
+        }
+    };
+    engine.setProgressCallback([&](const BackupProgress &p) {
+        QMetaObject::invokeMethod(&window, [&, p]() {
+            if (p.state == kBackupFinished || p.state == kBackupCancelled || p.state == kBackupFailed) {
+                finished(p.state);
+            } else {
+                showProgress(p);
+            }
+        }, Qt::QueuedConnection);
+    });
+    setLogListener([&](const std::string &line) {
+        QString text = QString::fromStdString(line);
+        QMetaObject::invokeMethod(&window, [&, text]() {
+            logText.append(text);
+            logText.moveCursor(QTextCursor::End);
+        }, Qt::QueuedConnection);
+    });
+
     QObject::connect(&srcBtn, &QPushButton::clicked, [&](){
         // Start in Windows drive root to make OneDrive visible under /mnt/c/Users/<user>/OneDrive
         QString startDir = QString::fromUtf8("/mnt/c/Users");
@@ -136,105 +260,57 @@ int main(int argc, char *argv[]) {
             QMessageBox::warning(&window, "Missing input", "Please select both source and destination.");
             return;
         }
-
-        // Resolve CLI path next to GUI binary
-        QString binDir = QCoreApplication::applicationDirPath();
-        QString cliPath = QDir(binDir).filePath("AdvancedBackupTool");
-
-        if (!QFileInfo::exists(cliPath) || !QFileInfo(cliPath).isExecutable()) {
-            QMessageBox::critical(&window, "CLI not found", QString("Could not find CLI at: %1").arg(cliPath));
+        if (!QFileInfo(normalizeToWSL(src)).isDir()) {
+            QMessageBox::warning(&window, "Missing source", QString("Source is not a directory: %1").arg(src));
             return;
         }
 
-        QStringList args;
-        args << src << dest << QString::number(threadSpin.value());
+        BackupOptions options;
+        options.threadCount = threadSpin.value();
+        parseCompressionPolicy(compressionCombo.currentData().toString().toStdString(), options.compression);
+        options.qos.readBytesPerSec = static_cast<uint64_t>(readLimitSpin.value()) << 20;
+        options.qos.writeBytesPerSec = static_cast<uint64_t>(writeLimitSpin.value()) << 20;
+        options.qos.cpuBudget = cpuLimitSpin.value();
+        QString priority = priorityCombo.currentData().toString();
+        if (priority == "low") {
+            options.qos.nice = 10;
+            options.qos.ioClass = kIoClassBestEffort;
+            options.qos.ioLevel = 7;
+        } else if (priority == "idle") {
+            options.qos.nice = 19;
+            options.qos.ioClass = kIoClassIdle;
+        }
+        if (loadCheck.isChecked()) options.qos.maxLoad = 1;
 
-        static QProcess proc;
-        proc.setProgram(cliPath);
-        proc.setArguments(args);
-        proc.setProcessChannelMode(QProcess::MergedChannels);
-        
+        if (!engine.start(normalizeToWSL(src).toStdString(), normalizeToWSL(dest).toStdString(), options)) {
+            QMessageBox::critical(&window, "Failed to start", "A backup is already running.");
+            return;
+        }
         startBtn.setEnabled(false);
+        pauseBtn.setEnabled(true);
         stopBtn.setEnabled(true);
         progressBar.setVisible(true);
         progressBar.setRange(0, 0); // Indeterminate
         logText.append("Starting backup...\n");
-        
-        proc.start();
-        if (!proc.waitForStarted(5000)) {
-            QMessageBox::critical(&window, "Failed to start", QString("Could not start: %1").arg(cliPath));
-            startBtn.setEnabled(true);
-            stopBtn.setEnabled(false);
-            progressBar.setVisible(false);
-            return;
-        }
-        
-        QObject::connect(&proc, &QProcess::readyRead, [&](){
-            QString output = QString::fromUtf8(proc.readAll());
-            logText.append(output);
-            logText.moveCursor(QTextCursor::End);
-        });
-        
-        QObject::connect(&proc, QOverload<int, QProcess::ExitStatus>::of(&QProcess::finished), &window, [&](int code, QProcess::ExitStatus){
-            startBtn.setEnabled(true);
-            stopBtn.setEnabled(false);
-            progressBar.setVisible(false);
-            
-            if (code == 0) {
-                logText.append("Backup completed successfully!\n");
-                QMessageBox::information(&window, "Done", "Backup finished! Check log.txt for encryption keys.");
-            } else {
-                QString output = QString::fromUtf8(proc.readAll());
-                logText.append(QString("Backup failed with exit code %1\n").arg(code));
-                QMessageBox::critical(&window, "Backup failed", QString("Exit code %1\n\n%2").arg(code).arg(output));
-            }
-        });
     });
 
-    QObject::connect(&stopBtn, &QPushButton::clicked, [&](){
-        // Create a stop-file in the destination root so the CLI loop exits gracefully
-        QString dest = destEdit.text();
-        if (dest.isEmpty()) {
-            QMessageBox::warning(&window, "No destination", "Please select a destination first.");
-            return;
-        }
-
-        // Normalize Windows-style path (e.g., C:\...) to WSL (/mnt/c/...)
-        auto normalizeToWSL = [](const QString &path) -> QString {
-            if (path.size() >= 2 && path[1] == QChar(':')) {
-                QChar drive = path[0].toLower();
-                QString rest = path.mid(2);
-                rest.replace("\\", "/");
-                if (!rest.startsWith('/')) rest.prepend('/');
-                return QString("/mnt/") + drive + rest;
-            }
-            QString p = path;
-            p.replace("\\", "/");
-            return p;
-        };
-
-        QString destWSL = normalizeToWSL(dest);
-        QDir destDir(destWSL);
-        if (!destDir.exists()) {
-            // Try to create the destination if possible
-            if (!destDir.mkpath(".")) {
-                QMessageBox::critical(&window, "Destination missing", QString("Destination does not exist: %1").arg(destWSL));
-                return;
-            }
-        }
-
-        QString stopPath = destDir.filePath(".abt_stop");
-        QFile f(stopPath);
-        if (f.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
-            f.write("stop");
-            f.close();
-            logText.append(QString("Created stop file: %1\n").arg(stopPath));
-            logText.append("Stop requested. Waiting for backup loop to exit...\n");
+    QObject::connect(&pauseBtn, &QPushButton::clicked, [&](){
+        if (engine.state() == kBackupPaused) {
+            engine.resume();
+            pauseBtn.setText("Pause");
         } else {
-            logText.append(QString("Failed to create stop file at %1: %2\n").arg(stopPath, f.errorString()));
-            QMessageBox::critical(&window, "Failed to create stop file", QString("%1\n%2").arg(stopPath, f.errorString()));
+            engine.pause();
+            pauseBtn.setText("Resume");
         }
     });
+
+    QObject::connect(&stopBtn, &QPushButton::clicked, [&](){
+        // Workers notice at their next block, so this takes effect at once
+        engine.cancel();
+        stopBtn.setEnabled(false);
+        pauseBtn.setEnabled(false);
+        logText.append("Stop requested. Waiting for files in progress to wind down...\n");
+    });
     
     QObject::connect(&clearBtn, &QPushButton::clicked, [&](){
         logText.clear();
@@ -262,39 +338,39 @@ int main(int argc, char *argv[]) {
             return;
         }
         
-        // Use CLI to decrypt
-        QString binDir = QCoreApplication::applicationDirPath();
-        QString cliPath = QDir(binDir).filePath("AdvancedBackupTool");
-        
-        QStringList args;
-        args << "--decrypt" << input << output << "log.txt";
-        
-        QProcess proc;
-        proc.setProgram(cliPath);
-        proc.setArguments(args);
-        proc.setProcessChannelMode(QProcess::MergedChannels);
-        
+        // Decrypt in this process on a thread of its own; the result comes
+        // back through the event loop like the backup's progress does
+        if (decryptThread.joinable()) decryptThread.join();
+        decryptBtn.setEnabled(false);
         logText.append("Starting decryption...\n");
-        proc.start();
-        if (!proc.waitForStarted(5000)) {
-            QMessageBox::critical(&window, "Failed to start", QString("Could not start: %1").arg(cliPath));
-            return;
-        }
-        
-        proc.waitForFinished(-1);
-        int exitCode = proc.exitCode();
-        QString output_text = QString::fromUtf8(proc.readAll());
-        logText.append(output_text);
-        
-        if (exitCode == 0) {
-            QMessageBox::information(&window, "Success", "File decrypted successfully!");
-            logText.append("Decryption completed successfully!\n");
-        } else {
-            QMessageBox::critical(&window, "Decryption failed", QString("Exit code %1\n\n%2").arg(exitCode).arg(output_text));
-        }
+        std::string inputPath = normalizeToWSL(input).toStdString();
+        std::string outputPath = normalizeToWSL(output).toStdString();
+        decryptThread = std::thread([&, inputPath, outputPath]() {
+            std::string key, iv, error;
+            bool ok = findBackupKey(logFilePath(), inputPath, key, iv, error) &&
+                      decryptFileWithKey(inputPath, outputPath, key, iv);
+            if (!ok && error.empty()) error = "Decryption failed: " + inputPath + " (see the log for details)";
+            QString message = QString::fromStdString(error);
+            QMetaObject::invokeMethod(&window, [&, ok, message]() {
+                decryptBtn.setEnabled(true);
+                if (ok) {
+                    logText.append("Decryption completed successfully!\n");
+                    QMessageBox::information(&window, "Success", "File decrypted successfully!");
+                } else {
+                    logText.append(message + "\n");
+                    QMessageBox::critical(&window, "Decryption failed", message);
+                }
+            }, Qt::QueuedConnection);
+        });
     });
 
     window.setLayout(&mainLayout);
     window.show();
-    return app.exec();
+    int code = app.exec();
+    // Stop before the widgets the callbacks refer to go away
+    engine.cancel();
+    engine.wait();
+    if (decryptThread.joinable()) decryptThread.join();
+    setLogListener(nullptr);
+    return code;
 }
@@ -0,0 +1,370 @@
+#include "journal.h"
+#include "fileio.h"
+#include "logger.h"
+#include "metrics.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+namespace fs = std::filesystem;
+
+static const char kJournalName[] = ".abt_journal";
+static const char kJournalMagic[8] = {'A', 'B', 'T', 'J', 'R', 'N', 'L', '1'};
+// 2: records carry a content hash
+static const uint32_t kJournalVersion = 2;
+static const char kObjectSuffix[] = ".gz.enc";
+
+// A group is committed once it holds this many files or has waited this long
+static const size_t kCommitGroupFiles = 64;
+static const int kCommitDelayMs = 1000;
+
+enum JournalType : uint32_t { kJournalDone = 1, kJournalCheckpoint = 2 };
+
+struct JournalHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrySize;
+};
+
+// Fixed size with a CRC, so a write torn by the crash is spotted and ignored
+struct JournalEntry {
+    uint32_t type;
+    uint32_t crc;             // crc32 of the entry with this field zeroed
+    ManifestRecord record;
+    uint64_t keyCheck;        // checkpoints only
+    uint64_t chunks;
+    uint64_t offset;
+    int32_t level;
+    uint32_t reserved;
+};
+
+static_assert(sizeof(JournalHeader) == 16, "journal header layout");
+static_assert(sizeof(JournalEntry) == 88, "journal entry layout");
+
+static uint32_t entryCrc(JournalEntry entry) {
+    entry.crc = 0;
+    return static_cast<uint32_t>(crc32(0L, reinterpret_cast<const Bytef *>(&entry), sizeof(entry)));
+}
+
+static JournalEntry makeEntry(JournalType type, const ManifestRecord &record) {
+    JournalEntry entry;
+    std::memset(&entry, 0, sizeof(entry));
+    entry.type = type;
+    entry.record = record;
+    return entry;
+}
+
+static JournalEntry checkpointEntry(const ObjectCheckpoint &point) {
+    JournalEntry entry = makeEntry(kJournalCheckpoint, point.source);
+    entry.keyCheck = point.keyCheck;
+    entry.chunks = point.chunks;
+    entry.offset = point.offset;
+    entry.level = point.level;
+    entry.crc = entryCrc(entry);
+    return entry;
+}
+
+static bool endsWith(const std::string &text, const std::string &suffix) {
+    return text.size() >= suffix.size() && text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static void syncDirectory(const std::string &dir) {
+    int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return;
+    fsync(fd);
+    ::close(fd);
+}
+
+BackupJournal::BackupJournal(const std::string &destDir, BackupManifest &manifest)
+    : m_destDir(destDir), m_path((fs::path(destDir) / kJournalName).string()), m_manifest(manifest) {}
+
+BackupJournal::~BackupJournal() {
+    close();
+}
+
+bool BackupJournal::open() {
+    std::error_code ec;
+    fs::create_directories(m_destDir, ec);
+
+    // The journal only outlives a run that was cut short
+    if (fs::exists(m_path, ec)) {
+        if (!replay()) {
+            logMessage("Journal not recovered, keeping it for a later run: " + m_path);
+            return false;
+        }
+        sweepTemporaries();
+    }
+    if (!rewrite()) {
+        logMessage("Journal unavailable, progress is only saved at the end of each pass: " + m_path);
+        return false;
+    }
+    m_stopping = false;
+    m_thread = std::thread(&BackupJournal::commitLoop, this);
+    return true;
+}
+
+// Fold the completed files into the manifest and keep the checkpoints
+bool BackupJournal::replay() {
+    int fd = ::open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    JournalHeader header;
+    bool valid = ::read(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header)) &&
+                 std::memcmp(header.magic, kJournalMagic, sizeof(kJournalMagic)) == 0 &&
+                 header.version == kJournalVersion && header.entrySize == sizeof(JournalEntry);
+    if (!valid) {
+        ::close(fd);
+        logMessage("Ignoring unreadable journal: " + m_path);
+        return true;
+    }
+
+    uint64_t recovered = 0;
+    JournalEntry entry;
+    while (::read(fd, &entry, sizeof(entry)) == static_cast<ssize_t>(sizeof(entry))) {
+        if (entry.crc != entryCrc(entry)) break;
+        if (entry.type == kJournalDone) {
+            m_manifest.update(entry.record);
+            m_checkpoints.erase(entry.record.pathHash);
+            ++recovered;
+        } else if (entry.type == kJournalCheckpoint) {
+            ObjectCheckpoint &point = m_checkpoints[entry.record.pathHash];
+            point.source = entry.record;
+            point.keyCheck = entry.keyCheck;
+            point.chunks = entry.chunks;
+            point.offset = entry.offset;
+            point.level = entry.level;
+        }
+    }
+    ::close(fd);
+
+    logMessage("Journal: recovered " + std::to_string(recovered) + " file(s) and " +
+               std::to_string(m_checkpoints.size()) + " partial object(s) from an interrupted run");
+    // The records may only be dropped once the manifest holds them
+    return recovered == 0 || m_manifest.save();
+}
+
+// Objects that never got renamed into place, except those a checkpoint can resume
+void BackupJournal::sweepTemporaries() {
+    uint64_t removed = 0;
+    std::error_code ec;
+    fs::recursive_directory_iterator it(m_destDir, fs::directory_options::skip_permission_denied, ec), end;
+    for (; !ec && it != end; it.increment(ec)) {
+        std::string path = it->path().string();
+        if (!endsWith(path, kObjectTempSuffix) || !it->is_regular_file(ec)) continue;
+        std::string object = path.substr(0, path.size() - (sizeof(kObjectTempSuffix) - 1));
+        std::string relative = fs::path(object).lexically_relative(m_destDir).string();
+        if (endsWith(relative, kObjectSuffix)) {
+            relative.resize(relative.size() - (sizeof(kObjectSuffix) - 1));
+            if (m_checkpoints.count(BackupManifest::hashPath(relative))) continue;
+        }
+        std::error_code rm;
+        if (fs::remove(it->path(), rm)) ++removed;
+    }
+    if (removed > 0) logMessage("Journal: removed " + std::to_string(removed) + " unfinished object(s)");
+}
+
+// Start the journal over with just the live checkpoints, atomically
+bool BackupJournal::rewrite() {
+    std::vector<JournalEntry> entries;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto &item : m_checkpoints) entries.push_back(checkpointEntry(item.second));
+    }
+
+    std::lock_guard<std::mutex> lock(m_fileMutex);
+    std::string tmpPath = m_path + ".tmp";
+    int fd = ::open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) return false;
+    JournalHeader header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, kJournalMagic, sizeof(kJournalMagic));
+    header.version = kJournalVersion;
+    header.entrySize = sizeof(JournalEntry);
+    size_t len = entries.size() * sizeof(JournalEntry);
+    bool ok = ::write(fd, &header, sizeof(header)) == static_cast<ssize_t>(sizeof(header)) &&
+              (len == 0 || ::write(fd, entries.data(), len) == static_cast<ssize_t>(len)) &&
+              fdatasync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || std::rename(tmpPath.c_str(), m_path.c_str()) != 0) {
+        ::unlink(tmpPath.c_str());
+        return false;
+    }
+    syncDirectory(m_destDir);
+
+    if (m_fd >= 0) ::close(m_fd);
+    m_fd = ::open(m_path.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+    m_appended = false;
+    return m_fd >= 0;
+}
+
+bool BackupJournal::append(const void *data, size_t len) {
+    std::lock_guard<std::mutex> lock(m_fileMutex);
+    if (m_fd < 0) return false;
+    const char *p = static_cast<const char *>(data);
+    while (len > 0) {
+        ssize_t n = ::write(m_fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    m_appended = true;
+    return fdatasync(m_fd) == 0;
+}
+
+void BackupJournal::complete(const ManifestRecord &record, std::vector<std::string> objects) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_thread.joinable()) {
+            m_pending.push_back(Pending{record, std::move(objects)});
+            ++m_queued;
+            // The first file starts the group's clock, a full group goes now
+            if (m_pending.size() == 1 || m_pending.size() >= kCommitGroupFiles) m_wake.notify_one();
+            return;
+        }
+    }
+    // No journal: the manifest saved at the end of the pass is all there is
+    m_manifest.update(record);
+}
+
+void BackupJournal::flush() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint64_t target = m_queued;
+    if (m_done >= target) return;
+    m_flushRequested = true;
+    m_wake.notify_one();
+    m_committed.wait(lock, [&]() { return m_done >= target; });
+}
+
+void BackupJournal::reset() {
+    if (m_fd < 0) return;
+    flush();
+    {
+        // Nothing new since the last reset, as in an idle rescan
+        std::lock_guard<std::mutex> lock(m_fileMutex);
+        if (!m_appended) return;
+    }
+    if (!rewrite()) logMessage("Failed to reset journal: " + m_path);
+}
+
+void BackupJournal::close() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stopping = true;
+    }
+    m_wake.notify_one();
+    if (m_thread.joinable()) m_thread.join();
+
+    std::lock_guard<std::mutex> lock(m_fileMutex);
+    if (m_fd < 0) return;
+    ::close(m_fd);
+    m_fd = -1;
+    // A journal holding no more than its header means the run finished cleanly
+    struct stat st;
+    if (::stat(m_path.c_str(), &st) == 0 && st.st_size == static_cast<off_t>(sizeof(JournalHeader))) {
+        ::unlink(m_path.c_str());
+    }
+}
+
+void BackupJournal::checkpoint(const ObjectCheckpoint &point) {
+    JournalEntry entry = checkpointEntry(point);
+    if (!append(&entry, sizeof(entry))) return;
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_checkpoints[point.source.pathHash] = point;
+}
+
+bool BackupJournal::findCheckpoint(const ManifestRecord &source, ObjectCheckpoint &out) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_checkpoints.find(source.pathHash);
+    if (it == m_checkpoints.end()) return false;
+    const ManifestRecord &was = it->second.source;
+    if (was.size != source.size || was.mtimeNs != source.mtimeNs || was.inode != source.inode) return false;
+    out = it->second;
+    return true;
+}
+
+void BackupJournal::dropCheckpoint(uint64_t pathHash) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_checkpoints.erase(pathHash);
+}
+
+uint64_t BackupJournal::checkpointKey() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_checkpoints.empty() ? 0 : m_checkpoints.begin()->second.keyCheck;
+}
+
+void BackupJournal::commitLoop() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    for (;;) {
+        m_wake.wait(lock, [this]() { return m_stopping || !m_pending.empty(); });
+        if (m_pending.empty()) return;
+        // Let the group fill up unless someone is waiting for it
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(kCommitDelayMs);
+        m_wake.wait_until(lock, deadline, [this]() {
+            return m_stopping || m_flushRequested || m_pending.size() >= kCommitGroupFiles;
+        });
+        size_t take = std::min(m_pending.size(), kCommitGroupFiles);
+        std::vector<Pending> group;
+        group.reserve(take);
+        for (size_t i = 0; i < take; ++i) {
+            group.push_back(std::move(m_pending.front()));
+            m_pending.pop_front();
+        }
+        if (m_pending.empty()) m_flushRequested = false;
+
+        lock.unlock();
+        commitGroup(group);
+        lock.lock();
+        m_done += group.size();
+        m_committed.notify_all();
+    }
+}
+
+void BackupJournal::commitGroup(std::vector<Pending> &group) {
+    int64_t start = metricsNowNs();
+    std::set<std::string> dirs;
+    std::vector<JournalEntry> entries;
+    std::vector<const ManifestRecord *> durable;
+    // Writeback was started as each object finished, so these mostly wait
+    // for I/O that is already under way
+    for (const auto &item : group) {
+        bool ok = true;
+        for (const auto &path : item.objects) {
+            int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0 || fdatasync(fd) != 0) ok = false;
+            if (fd >= 0) ::close(fd);
+            dirs.insert(fs::path(path).parent_path().string());
+        }
+        if (!ok) {
+            logMessage("Failed to sync backup, it is redone next pass: " + item.objects.front());
+            continue;
+        }
+        JournalEntry entry = makeEntry(kJournalDone, item.record);
+        entry.crc = entryCrc(entry);
+        entries.push_back(entry);
+        durable.push_back(&item.record);
+    }
+    // One sync per directory makes every rename in it durable
+    for (const auto &dir : dirs) syncDirectory(dir);
+
+    if (!entries.empty() && !append(entries.data(), entries.size() * sizeof(JournalEntry))) {
+        logMessage("Failed to write journal: " + m_path);
+    }
+    for (const ManifestRecord *record : durable) m_manifest.update(*record);
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const ManifestRecord *record : durable) m_checkpoints.erase(record->pathHash);
+    }
+
+    BackupMetrics &m = metrics();
+    m.journalGroups.fetch_add(1, std::memory_order_relaxed);
+    m.journalFiles.fetch_add(durable.size(), std::memory_order_relaxed);
+    m.journalSyncNs.fetch_add(static_cast<uint64_t>(metricsNowNs() - start), std::memory_order_relaxed);
+}
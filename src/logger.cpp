@@ -1,20 +1,423 @@
 #include "logger.h"
+#include "metrics.h"
 #include <iostream>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <fstream>
+#include <set>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
-std::mutex logMutex;
+namespace {
 
-void logMessage(const std::string &message) {
-    std::lock_guard<std::mutex> lock(logMutex);
+const size_t kRingSize = 8192;   // must be a power of two
+const size_t kInlineText = 232;  // longer messages spill to the heap
+
+struct LogSlot {
+    std::atomic<size_t> seq;
+    int64_t seconds;
+    uint32_t len;
+    bool pinned;
+    char *heap;
+    char text[kInlineText];
+};
+
+// Bounded MPSC ring (Vyukov-style sequence numbers per slot). Producers only
+// claim a slot with one CAS and copy the text; the writer thread formats the
+// timestamps, batches lines and does the actual write()s.
+class AsyncLogger {
+public:
+    static AsyncLogger &instance() {
+        // Never destroyed, so logging from static destructors or atexit still works
+        static AsyncLogger *logger = new AsyncLogger();
+        return *logger;
+    }
+
+    void push(const std::string &message, bool pinned) {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+
+        // Pinned lines carry the key that seals the objects, so they must be
+        // on disk before the first object is; they skip the ring
+        if (pinned || m_stopped.load(std::memory_order_acquire)) {
+            writeSync(message, now.tv_sec, pinned);
+            return;
+        }
+
+        size_t pos = m_enqueue.load(std::memory_order_relaxed);
+        LogSlot *slot;
+        for (;;) {
+            slot = &m_slots[pos & (kRingSize - 1)];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (m_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+            } else if (diff < 0) {
+                // Ring full: never drop lines (they may carry keys), wait for the writer
+                m_wake.notify_one();
+                std::this_thread::yield();
+                pos = m_enqueue.load(std::memory_order_relaxed);
+            } else {
+                pos = m_enqueue.load(std::memory_order_relaxed);
+            }
+        }
+
+        slot->seconds = now.tv_sec;
+        slot->pinned = pinned;
+        slot->len = static_cast<uint32_t>(message.size());
+        if (message.size() <= kInlineText) {
+            slot->heap = nullptr;
+            std::memcpy(slot->text, message.data(), message.size());
+        } else {
+            slot->heap = new char[message.size()];
+            std::memcpy(slot->heap, message.data(), message.size());
+        }
+        slot->seq.store(pos + 1, std::memory_order_release);
+    }
+
+    void configure(const std::string &path, uint64_t maxBytes, int keepFiles) {
+        std::lock_guard<std::mutex> lock(m_fileMutex);
+        if (path != m_path && m_fd >= 0) {
+            close(m_fd);
+            m_fd = -1;
+        }
+        m_path = path;
+        m_maxBytes = maxBytes;
+        m_keepFiles = keepFiles < 0 ? 0 : keepFiles;
+    }
+
+    std::string path() {
+        std::lock_guard<std::mutex> lock(m_fileMutex);
+        return m_path;
+    }
+
+    void setListener(LogListener listener) {
+        std::lock_guard<std::mutex> lock(m_fileMutex);
+        m_listener = std::move(listener);
+    }
+
+    void flush() {
+        if (!m_stopped.load(std::memory_order_acquire)) {
+            size_t target = m_enqueue.load(std::memory_order_acquire);
+            std::unique_lock<std::mutex> lock(m_wakeMutex);
+            m_flushRequested = true;
+            m_wake.notify_one();
+            // Every drain (and the final one in shutdown()) notifies m_flushed
+            m_flushed.wait(lock, [&]() {
+                return m_consumed.load(std::memory_order_acquire) >= target;
+            });
+        }
+        std::lock_guard<std::mutex> lock(m_fileMutex);
+        syncLocked();
+    }
+
+    void shutdown() {
+        if (m_stopped.exchange(true)) return;
+        {
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            m_wake.notify_one();
+        }
+        if (m_thread.joinable()) m_thread.join();
+        // Pick up anything queued while the writer was exiting
+        drainAndWrite(true);
+    }
+
+    // Best effort from a fatal signal handler, so only atomic loads and
+    // write(2): lines already published are written as ": message", without
+    // the timestamp. It stops at the first slot that is claimed but not
+    // filled (the crashing thread may be the one filling it) and never takes
+    // a lock or allocates. A line the writer thread is busy with may come out
+    // twice.
+    void emergencyFlush() {
+        int fd = m_fd;
+        if (fd < 0) return;
+        for (size_t pos = m_consumed.load(std::memory_order_acquire);; ++pos) {
+            LogSlot &slot = m_slots[pos & (kRingSize - 1)];
+            if (slot.seq.load(std::memory_order_acquire) != pos + 1) break;
+            const char *text = slot.heap ? slot.heap : slot.text;
+            if (::write(fd, ": ", 2) < 0 || ::write(fd, text, slot.len) < 0 || ::write(fd, "\n", 1) < 0) break;
+        }
+    }
+
+private:
+    AsyncLogger() {
+        for (size_t i = 0; i < kRingSize; ++i) m_slots[i].seq.store(i, std::memory_order_relaxed);
+        m_thread = std::thread(&AsyncLogger::run, this);
+        std::atexit([]() { AsyncLogger::instance().shutdown(); });
+        for (int sig : {SIGSEGV, SIGBUS, SIGFPE, SIGABRT, SIGILL}) {
+            std::signal(sig, [](int s) {
+                AsyncLogger::instance().emergencyFlush();
+                std::signal(s, SIG_DFL);
+                std::raise(s);
+            });
+        }
+    }
+
+    void run() {
+        while (!m_stopped.load(std::memory_order_acquire)) {
+            {
+                std::unique_lock<std::mutex> lock(m_wakeMutex);
+                m_wake.wait_for(lock, std::chrono::milliseconds(50), [this]() {
+                    return m_flushRequested || m_stopped.load(std::memory_order_acquire);
+                });
+                m_flushRequested = false;
+            }
+            drainAndWrite(false);
+        }
+    }
+
+    void drainAndWrite(bool final) {
+        std::string batch;
+        std::vector<std::string> echo;
+        size_t taken;
+        do {
+            batch.clear();
+            LogListener listener;
+            {
+                std::lock_guard<std::mutex> lock(m_fileMutex);
+                listener = m_listener;
+                taken = collect(batch, final, listener ? &echo : nullptr);
+                writeLocked(batch);
+            }
+            // Outside the lock: a slow listener must not hold up writeSync callers
+            for (const auto &message : echo) listener(message);
+            echo.clear();
+            std::lock_guard<std::mutex> lock(m_wakeMutex);
+            m_flushed.notify_all();
+        } while (taken > 0 && batch.size() >= kBatchBytes);
+    }
+
+    // Single consumer, caller holds m_fileMutex: move finished slots into
+    // `batch`, formatted as before (ctime line, then ": message"). Unpinned
+    // messages are also copied to `echo` for the listener.
+    size_t collect(std::string &batch, bool waitForClaimed, std::vector<std::string> *echo) {
+        size_t taken = 0;
+        while (batch.size() < kBatchBytes) {
+            LogSlot &slot = m_slots[m_dequeue & (kRingSize - 1)];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            if (seq != m_dequeue + 1) {
+                // A producer may have claimed this slot but not filled it yet
+                if (waitForClaimed && m_dequeue < m_enqueue.load(std::memory_order_acquire)) {
+                    std::this_thread::yield();
+                    continue;
+                }
+                break;
+            }
+
+            const char *text = slot.heap ? slot.heap : slot.text;
+            std::string message(text, slot.len);
+            delete[] slot.heap;
+            slot.heap = nullptr;
+            appendLine(batch, slot.seconds, message);
+            if (slot.pinned) m_pinned.push_back(message);
+            else if (echo) echo->push_back(message);
+            metrics().logLines.fetch_add(1, std::memory_order_relaxed);
+            metrics().logBytes.fetch_add(slot.len, std::memory_order_relaxed);
+
+            slot.seq.store(m_dequeue + kRingSize, std::memory_order_release);
+            ++m_dequeue;
+            ++taken;
+        }
+        m_consumed.store(m_dequeue, std::memory_order_release);
+        return taken;
+    }
+
+    void appendLine(std::string &out, int64_t seconds, const std::string &message) {
+        // ctime formatting is the expensive part; do it once per second
+        if (seconds != m_cachedSecond) {
+            time_t t = static_cast<time_t>(seconds);
+            char buf[32];
+            if (ctime_r(&t, buf)) m_cachedTime = buf;
+            m_cachedSecond = seconds;
+        }
+        out += m_cachedTime;
+        out += ": ";
+        out += message;
+        out += '\n';
+    }
 
-    std::ofstream logFile("log.txt", std::ios::app);
-    if (!logFile.is_open()) {
-        std::cerr << "Failed to open log file!" << std::endl;
-        return;
+    void writeSync(const std::string &message, int64_t seconds, bool pinned) {
+        LogListener listener;
+        {
+            std::lock_guard<std::mutex> lock(m_fileMutex);
+            std::string line;
+            appendLine(line, seconds, message);
+            if (pinned) m_pinned.push_back(message);
+            metrics().logLines.fetch_add(1, std::memory_order_relaxed);
+            metrics().logBytes.fetch_add(message.size(), std::memory_order_relaxed);
+            writeLocked(line);
+            if (pinned) syncLocked();
+            else listener = m_listener;
+        }
+        if (listener) listener(message);
     }
 
-    auto now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
-    logFile << std::ctime(&now) << ": " << message << std::endl;
-    logFile.close();
+    // Caller holds m_fileMutex
+    void writeLocked(const std::string &batch) {
+        if (batch.empty()) return;
+        if (m_fd < 0 && !openLocked()) {
+            std::cerr << "Failed to open log file!" << std::endl;
+            return;
+        }
+        if (m_maxBytes > 0 && m_size > 0 && m_size + batch.size() > m_maxBytes) rotateLocked();
+        writeAll(batch);
+    }
+
+    // Caller holds m_fileMutex
+    void syncLocked() {
+        if (m_fd >= 0 && fdatasync(m_fd) != 0) {
+            std::cerr << "Failed to sync log file: " << std::strerror(errno) << std::endl;
+        }
+    }
+
+    bool openLocked() {
+        m_fd = open(m_path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (m_fd < 0) return false;
+        struct stat st{};
+        m_size = fstat(m_fd, &st) == 0 ? static_cast<uint64_t>(st.st_size) : 0;
+        return true;
+    }
+
+    // Key/IV pairs in the log at `path`, each once, in the order they appear
+    static std::vector<std::string> loggedKeyLines(const std::string &path) {
+        std::vector<std::string> lines;
+        std::set<std::string> seen;
+        std::ifstream in(path);
+        std::string line, key;
+        while (std::getline(in, line)) {
+            auto kpos = line.find("ENCRYPTION_KEY=");
+            if (kpos != std::string::npos) {
+                key = line.substr(kpos);
+                continue;
+            }
+            auto ipos = line.find("ENCRYPTION_IV=");
+            if (ipos == std::string::npos || key.empty()) continue;
+            std::string iv = line.substr(ipos);
+            if (seen.insert(key + iv).second) {
+                lines.push_back(key);
+                lines.push_back(iv);
+            }
+            key.clear();
+        }
+        return lines;
+    }
+
+    void rotateLocked() {
+        // Objects outlive the session that sealed them, so every key still in
+        // the log moves on to the new file, not only this session's
+        std::vector<std::string> keys = loggedKeyLines(m_path);
+        close(m_fd);
+        m_fd = -1;
+        if (m_keepFiles == 0) {
+            std::remove(m_path.c_str());
+        } else {
+            for (int i = m_keepFiles - 1; i >= 1; --i) {
+                std::string from = m_path + "." + std::to_string(i);
+                std::string to = m_path + "." + std::to_string(i + 1);
+                std::rename(from.c_str(), to.c_str());
+            }
+            std::rename(m_path.c_str(), (m_path + ".1").c_str());
+        }
+        if (!openLocked()) return;
+
+        // Keep the keys in the live log so --decrypt can still find them;
+        // this session's pinned lines come last
+        std::string header;
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME_COARSE, &now);
+        for (size_t i = 0; i + 1 < keys.size(); i += 2) {
+            bool pinned = std::find(m_pinned.begin(), m_pinned.end(), keys[i]) != m_pinned.end() &&
+                          std::find(m_pinned.begin(), m_pinned.end(), keys[i + 1]) != m_pinned.end();
+            if (pinned) continue;
+            appendLine(header, now.tv_sec, keys[i]);
+            appendLine(header, now.tv_sec, keys[i + 1]);
+        }
+        for (const auto &message : m_pinned) appendLine(header, now.tv_sec, message);
+        writeAll(header);
+        syncLocked();
+    }
+
+    void writeAll(const std::string &data) {
+        int64_t start = metricsNowNs();
+        const char *p = data.data();
+        size_t left = data.size();
+        while (left > 0) {
+            ssize_t n = ::write(m_fd, p, left);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return;
+            }
+            p += n;
+            left -= static_cast<size_t>(n);
+            m_size += static_cast<uint64_t>(n);
+        }
+        recordStage(kStageLog, data.size() - left, start);
+    }
+
+    static const size_t kBatchBytes = 1 << 16;
+
+    LogSlot m_slots[kRingSize];
+    alignas(64) std::atomic<size_t> m_enqueue{0};
+    alignas(64) size_t m_dequeue = 0;
+    std::atomic<size_t> m_consumed{0};
+    std::atomic<bool> m_stopped{false};
+
+    std::thread m_thread;
+    std::mutex m_wakeMutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_flushed;
+    bool m_flushRequested = false;
+
+    std::mutex m_fileMutex;
+    std::string m_path = "log.txt";
+    uint64_t m_maxBytes = 64ULL << 20;
+    int m_keepFiles = 5;
+    std::atomic<int> m_fd{-1};   // also read by emergencyFlush()
+    uint64_t m_size = 0;
+    std::vector<std::string> m_pinned;
+    LogListener m_listener;
+
+    int64_t m_cachedSecond = -1;
+    std::string m_cachedTime;
+};
+
+} // namespace
+
+void logMessage(const std::string &message) {
+    AsyncLogger::instance().push(message, false);
+}
+
+void logPinnedMessage(const std::string &message) {
+    AsyncLogger::instance().push(message, true);
+}
+
+void configureLogger(const std::string &path, uint64_t maxBytes, int keepFiles) {
+    AsyncLogger::instance().configure(path, maxBytes, keepFiles);
+}
+
+std::string logFilePath() {
+    return AsyncLogger::instance().path();
+}
+
+void setLogListener(LogListener listener) {
+    AsyncLogger::instance().setListener(std::move(listener));
+}
+
+void flushLog() {
+    AsyncLogger::instance().flush();
+}
+
+void shutdownLogger() {
+    AsyncLogger::instance().shutdown();
 }
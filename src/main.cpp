@@ -1,13 +1,23 @@
 #include "backup.h"
+#include "bufferpool.h"
+#include "engine.h"
 #include "logger.h"
 #include "encrypt.h"
+#include "metrics.h"
+#include "restore.h"
+#include "snapshot.h"
+#include "verify.h"
+#include "fileio.h"
 #include <iostream>
 #include <algorithm>
 #include <cctype>
 #include <filesystem>
 #include <fstream>
 #include <sstream>
+#include <stdexcept>
+#include <vector>
 #include <csignal>
+#include <ctime>
 
 static std::string normalizePathForWSL(const std::string &inputPath) {
     if (inputPath.size() >= 2 && std::isalpha(static_cast<unsigned char>(inputPath[0])) && inputPath[1] == ':') {
@@ -28,30 +38,113 @@ static std::string normalizePathForWSL(const std::string &inputPath) {
     return replaced;
 }
 
-static bool parseLogFile(const std::string &logPath, std::string &key, std::string &iv) {
-    std::ifstream log(logPath);
-    if (!log.is_open()) return false;
-    
-    std::string line;
-    while (std::getline(log, line)) {
-        auto kpos = line.find("ENCRYPTION_KEY=");
-        if (kpos != std::string::npos) {
-            key = line.substr(kpos + std::string("ENCRYPTION_KEY=").size());
-        }
-        auto ipos = line.find("ENCRYPTION_IV=");
-        if (ipos != std::string::npos) {
-            iv = line.substr(ipos + std::string("ENCRYPTION_IV=").size());
-        }
-    }
-    return !key.empty() && !iv.empty();
+// Split "--name=value" into its parts; plain flags leave `value` empty
+static void splitOption(const std::string &arg, std::string &name, std::string &value) {
+    auto eq = arg.find('=');
+    name = arg.substr(0, eq);
+    value = eq == std::string::npos ? std::string() : arg.substr(eq + 1);
+}
+
+// The RetentionPolicy count a --keep-* option sets, or nullptr
+static int *retentionField(const std::string &name, RetentionPolicy &policy) {
+    if (name == "--keep-last") return &policy.keepLast;
+    if (name == "--keep-daily") return &policy.keepDaily;
+    if (name == "--keep-weekly") return &policy.keepWeekly;
+    return nullptr;
 }
 
 static void showUsage() {
     std::cout << "Advanced Backup Tool\n";
     std::cout << "Usage:\n";
-    std::cout << "  Backup: " << "AdvancedBackupTool <source> <dest> [threads]\n";
-    std::cout << "  Decrypt: " << "AdvancedBackupTool --decrypt <encrypted_file> <output_file> [log_file]\n";
+    std::cout << "  Backup: " << "AdvancedBackupTool <source> <dest> [threads] [options]\n";
+    std::cout << "  Decrypt: " << "AdvancedBackupTool --decrypt <encrypted_file|recipe> <output_file> [log_file]\n";
+    std::cout << "           [--offset=<bytes>] [--length=<bytes>] extracts part of one file\n";
+    std::cout << "  Restore: " << "AdvancedBackupTool --restore <backup_dir> <target_dir> [threads] [restore options]\n";
+    std::cout << "  Verify: " << "AdvancedBackupTool --verify <backup_dir> [threads] [verify options]\n";
+    std::cout << "  Snapshots: " << "AdvancedBackupTool --snapshot <backup_dir> [name] [--keep-...]\n";
+    std::cout << "             " << "AdvancedBackupTool --snapshots <backup_dir>\n";
+    std::cout << "             " << "AdvancedBackupTool --prune <backup_dir> [name...] [--keep-...]\n";
+    std::cout << "           Snapshots live in <backup_dir>/.abt_snapshots/<name>, hard-linked to the\n";
+    std::cout << "           objects they share; restore or verify that directory like any backup\n";
     std::cout << "  Interactive: " << "AdvancedBackupTool\n";
+    std::cout << "Backup options:\n";
+    std::cout << "  --watch       Follow changes with inotify instead of rescanning every 5 seconds\n";
+    std::cout << "  --fanotify    Like --watch, but mark the whole mount with fanotify (needs CAP_SYS_ADMIN)\n";
+    std::cout << "  --once        Back up everything that changed, then exit instead of monitoring\n";
+    std::cout << "  --dedup       Store files as deduplicated chunks (restore the .abtr.enc with --decrypt)\n";
+    std::cout << "  --pack        Append small files to shared segments in <dest>/.abt_packs instead of\n";
+    std::cout << "                one object per file\n";
+    std::cout << "  --pack-threshold=<KiB>\n";
+    std::cout << "                Largest file that is packed (default 256)\n";
+    std::cout << "  --delta       Back up changes to large files as block deltas against the previous\n";
+    std::cout << "                version, kept in <dest>/.abt_deltas and applied on --restore\n";
+    std::cout << "  --delta-threshold=<MiB>\n";
+    std::cout << "                Smallest file that gets deltas (default 64)\n";
+    std::cout << "  --delta-chain=<n>\n";
+    std::cout << "                Deltas on top of a base before it is rewritten in full (default 8)\n";
+    std::cout << "  --fingerprint Hash what is backed up and skip files that were touched but whose\n";
+    std::cout << "                contents still match the last backup\n";
+    std::cout << "  --snapshot[=<name>]\n";
+    std::cout << "                With --once, snapshot the backup when the pass is done (default name:\n";
+    std::cout << "                the time) and prune old snapshots by the --keep options\n";
+    std::cout << "  --keep-last=<n> --keep-daily=<n> --keep-weekly=<n>\n";
+    std::cout << "                Keep the newest n snapshots, and the newest one of each of the last\n";
+    std::cout << "                n days / weeks; the rest are deleted (default: keep all)\n";
+    std::cout << "  --checkpoint=<MiB>\n";
+    std::cout << "                Chunked objects larger than this record a resume point every <MiB>\n";
+    std::cout << "                so an interrupted run carries on from there (default 64, 0 = off)\n";
+    std::cout << "  --walk-threads=<n>\n";
+    std::cout << "                Threads listing the source tree (default: cores, 2 to 8)\n";
+    std::cout << "  --schedule=<s> lpt (default): start the largest changed files first once the walk is\n";
+    std::cout << "                done; walk: start files in the order they are listed\n";
+    std::cout << "  --format=<fmt> chunked (default): per-file nonce, 1 MiB AES-256-GCM chunks sealed in\n";
+    std::cout << "                parallel; legacy: one AES-256-CTR stream (older versions can read it)\n";
+    std::cout << "  --compression=<mode>\n";
+    std::cout << "                auto|ratio (default), balanced or speed pick a level per file and store\n";
+    std::cout << "                incompressible data; store, fast, best or 0-9 force one level\n";
+    std::cout << "  --log-max-size=<MiB>\n";
+    std::cout << "                Rotate log.txt at this size, keeping 5 old logs (default 64, 0 = never)\n";
+    std::cout << "  --parallel-threshold=<MiB>\n";
+    std::cout << "                Compress files at least this large on all threads (default 64)\n";
+    std::cout << "  --io=<engine> auto (default) uses io_uring when the kernel allows it, uring\n";
+    std::cout << "                insists on it, posix uses blocking pread/pwrite\n";
+    std::cout << "  --io-depth=<blocks>\n";
+    std::cout << "                512 KiB reads each file keeps in flight (1-8, default 4)\n";
+    std::cout << "  --mmap-threshold=<MiB>\n";
+    std::cout << "                Map files at least this large and deflate straight from the page\n";
+    std::cout << "                cache (default 64, 0 = never)\n";
+    std::cout << "  --direct-threshold=<MiB>\n";
+    std::cout << "                Read files at least this large with O_DIRECT, bypassing the page\n";
+    std::cout << "                cache (default 1024, 0 = never)\n";
+    std::cout << "  --memory-limit=<MiB>\n";
+    std::cout << "                Cap on compression/encryption buffers; workers wait before starting\n";
+    std::cout << "                another file while it is reached (default 512, 0 = unlimited)\n";
+    std::cout << "  --read-limit=<MiB/s>\n";
+    std::cout << "  --write-limit=<MiB/s>\n";
+    std::cout << "                Cap source reads / destination writes (default 0 = unlimited)\n";
+    std::cout << "  --cpu-limit=<cores>\n";
+    std::cout << "                Park workers while the backup uses more CPU than this (default 0 = all)\n";
+    std::cout << "  --nice=<0-19>  Nice value for worker threads (default 0)\n";
+    std::cout << "  --ionice=<c>   I/O priority of worker threads: none (default), idle, be or be:<0-7>\n";
+    std::cout << "  --max-load=<per core>\n";
+    std::cout << "                Halve every limit and the worker count while the host's load average\n";
+    std::cout << "                per core stays above this, down to 1/8 (default 0 = ignore load)\n";
+    std::cout << "  --metrics=<file>\n";
+    std::cout << "                Keep per-stage counters, latency histograms and progress in <file>;\n";
+    std::cout << "                .prom or .txt selects Prometheus text format, anything else JSON\n";
+    std::cout << "  --metrics-interval=<seconds>\n";
+    std::cout << "                How often the metrics file is rewritten (default 2)\n";
+    std::cout << "Restore options:\n";
+    std::cout << "  --include=<glob>  Only restore matching paths (repeatable). A path without\n";
+    std::cout << "                    wildcards selects that file or subtree; * also matches /\n";
+    std::cout << "  --exclude=<glob>  Skip matching paths (repeatable)\n";
+    std::cout << "  --log=<file>      Log holding ENCRYPTION_KEY/ENCRYPTION_IV (default log.txt)\n";
+    std::cout << "  --io=<engine>     As for backup\n";
+    std::cout << "  --memory-limit=<MiB>  As for backup\n";
+    std::cout << "Verify options (also --include, --exclude, --log, --io and --memory-limit):\n";
+    std::cout << "  --sample=<percent>    Decode only this share of the objects (default 100)\n";
+    std::cout << "  --sample-seed=<n>     Pick the same sample again (default: a new one each run)\n";
+    std::cout << "  --source=<dir>        Also compare every decoded file with the one in <dir>\n";
 }
 
 int main(int argc, char *argv[]) {
@@ -61,17 +154,44 @@ int main(int argc, char *argv[]) {
     if (argc >= 4 && std::string(argv[1]) == "--decrypt") {
         std::string encryptedFile = argv[2];
         std::string outputFile = argv[3];
-        std::string logFile = (argc >= 5) ? argv[4] : "log.txt";
+        std::string logFile = "log.txt";
+        uint64_t offset = 0, length = UINT64_MAX;
+        bool ranged = false;
+        for (int i = 4; i < argc; ++i) {
+            std::string arg = argv[i];
+            std::string name, value;
+            splitOption(arg, name, value);
+            try {
+                if (name == "--offset" && !value.empty()) {
+                    offset = std::stoull(value);
+                    ranged = true;
+                } else if (name == "--length" && !value.empty()) {
+                    length = std::stoull(value);
+                    ranged = true;
+                } else if (arg.compare(0, 2, "--") == 0) {
+                    std::cerr << "Unknown option: " << arg << std::endl;
+                    showUsage();
+                    return 1;
+                } else {
+                    logFile = arg;
+                }
+            } catch (...) {
+                std::cerr << "Invalid value for " << name << ": " << value << std::endl;
+                return 1;
+            }
+        }
         
-        std::string key, iv;
-        if (!parseLogFile(logFile, key, iv)) {
-            std::cerr << "Error: Could not find encryption keys in " << logFile << std::endl;
+        std::string key, iv, error;
+        if (!findBackupKey(logFile, encryptedFile, key, iv, error)) {
+            std::cerr << "Error: " << error << std::endl;
             std::cerr << "Make sure the log file contains ENCRYPTION_KEY=... and ENCRYPTION_IV=... lines" << std::endl;
             return 1;
         }
         
         std::cout << "Decrypting " << encryptedFile << " to " << outputFile << std::endl;
-        if (decryptFileWithKey(encryptedFile, outputFile, key, iv)) {
+        bool ok = ranged ? decryptFileRange(encryptedFile, outputFile, key, iv, offset, length)
+                         : decryptFileWithKey(encryptedFile, outputFile, key, iv);
+        if (ok) {
             std::cout << "Decryption successful!" << std::endl;
             return 0;
         } else {
@@ -80,6 +200,210 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    if (argc >= 2 && std::string(argv[1]) == "--restore") {
+        std::signal(SIGINT, [](int){ requestStopRestore(); });
+        RestoreOptions restoreOptions;
+        std::string logFile = "log.txt";
+        std::vector<std::string> positional;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            std::string name, value;
+            splitOption(arg, name, value);
+            if (name == "--include" && !value.empty()) {
+                restoreOptions.includes.push_back(value);
+            } else if (name == "--exclude" && !value.empty()) {
+                restoreOptions.excludes.push_back(value);
+            } else if (name == "--log" && !value.empty()) {
+                logFile = value;
+            } else if (name == "--io") {
+                IoBackend backend;
+                if (!parseIoBackend(value, backend)) {
+                    std::cerr << "Invalid value for --io: " << value << std::endl;
+                    return 1;
+                }
+                configureIo(backend);
+            } else if (name == "--memory-limit" && !value.empty()) {
+                try {
+                    configureBufferPool(std::stoull(value) << 20);
+                } catch (...) {
+                    std::cerr << "Invalid value for --memory-limit: " << value << std::endl;
+                    return 1;
+                }
+            } else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+                std::cerr << "Unknown option: " << arg << std::endl;
+                showUsage();
+                return 1;
+            } else {
+                positional.push_back(arg);
+            }
+        }
+        if (positional.size() < 2) {
+            showUsage();
+            return 1;
+        }
+        if (positional.size() >= 3) {
+            try {
+                restoreOptions.threadCount = std::stoi(positional[2]);
+            } catch (...) {
+                restoreOptions.threadCount = 4;
+            }
+        }
+
+        std::string key, iv, error;
+        if (!findBackupKey(logFile, normalizePathForWSL(positional[0]), key, iv, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return 1;
+        }
+
+        RestoreStats stats;
+        bool ok = performRestore(normalizePathForWSL(positional[0]), normalizePathForWSL(positional[1]),
+                                 key, iv, restoreOptions, stats);
+        std::cout << "Restored " << stats.files << " file(s), " << stats.bytes << " bytes";
+        if (stats.failed > 0) std::cout << ", " << stats.failed << " failed (see log.txt)";
+        std::cout << std::endl;
+        return ok ? 0 : 1;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--verify") {
+        std::signal(SIGINT, [](int){ requestStopVerify(); });
+        VerifyOptions verifyOptions;
+        std::string logFile = "log.txt";
+        std::vector<std::string> positional;
+        for (int i = 2; i < argc; ++i) {
+            std::string arg = argv[i];
+            std::string name, value;
+            splitOption(arg, name, value);
+            try {
+                if (name == "--include" && !value.empty()) {
+                    verifyOptions.includes.push_back(value);
+                } else if (name == "--exclude" && !value.empty()) {
+                    verifyOptions.excludes.push_back(value);
+                } else if (name == "--log" && !value.empty()) {
+                    logFile = value;
+                } else if (name == "--source" && !value.empty()) {
+                    verifyOptions.sourceDir = normalizePathForWSL(value);
+                } else if (name == "--sample" && !value.empty()) {
+                    verifyOptions.samplePercent = std::stod(value);
+                    if (verifyOptions.samplePercent <= 0 || verifyOptions.samplePercent > 100) throw std::out_of_range(value);
+                } else if (name == "--sample-seed" && !value.empty()) {
+                    verifyOptions.sampleSeed = std::stoull(value);
+                } else if (name == "--io") {
+                    IoBackend backend;
+                    if (!parseIoBackend(value, backend)) throw std::invalid_argument(value);
+                    configureIo(backend);
+                } else if (name == "--memory-limit" && !value.empty()) {
+                    configureBufferPool(std::stoull(value) << 20);
+                } else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+                    std::cerr << "Unknown option: " << arg << std::endl;
+                    showUsage();
+                    return 1;
+                } else {
+                    positional.push_back(arg);
+                }
+            } catch (...) {
+                std::cerr << "Invalid value for " << name << ": " << value << std::endl;
+                return 1;
+            }
+        }
+        if (positional.empty()) {
+            showUsage();
+            return 1;
+        }
+        if (positional.size() >= 2) {
+            try {
+                verifyOptions.threadCount = std::stoi(positional[1]);
+            } catch (...) {
+                verifyOptions.threadCount = 4;
+            }
+        }
+
+        std::string key, iv, error;
+        if (!findBackupKey(logFile, normalizePathForWSL(positional[0]), key, iv, error)) {
+            std::cerr << "Error: " << error << std::endl;
+            return 1;
+        }
+
+        VerifyStats stats;
+        bool ok = performVerify(normalizePathForWSL(positional[0]), key, iv, verifyOptions, stats);
+        std::cout << "Verified " << stats.files << " file(s), " << stats.bytes << " bytes";
+        if (stats.skipped > 0) std::cout << " (" << stats.skipped << " not sampled, seed " << stats.sampleSeed << ")";
+        std::cout << std::endl;
+        if (!ok) {
+            std::cout << stats.corrupt << " corrupt, " << stats.mismatched << " mismatched, " << stats.missing
+                      << " missing (see log.txt)" << std::endl;
+        }
+        return ok ? 0 : 1;
+    }
+
+    if (argc >= 3 && (std::string(argv[1]) == "--snapshot" || std::string(argv[1]) == "--snapshots" ||
+                      std::string(argv[1]) == "--prune")) {
+        std::string command = argv[1];
+        std::string destDir = normalizePathForWSL(argv[2]);
+        RetentionPolicy retention;
+        std::vector<std::string> names;
+        for (int i = 3; i < argc; ++i) {
+            std::string arg = argv[i];
+            std::string name, value;
+            splitOption(arg, name, value);
+            if (int *keep = retentionField(name, retention)) {
+                try {
+                    *keep = std::stoi(value);
+                    if (*keep < 0) throw std::out_of_range(value);
+                } catch (...) {
+                    std::cerr << "Invalid value for " << name << ": " << value << std::endl;
+                    return 1;
+                }
+            } else if (arg.compare(0, 2, "--") == 0) {
+                std::cerr << "Unknown option: " << arg << std::endl;
+                showUsage();
+                return 1;
+            } else {
+                names.push_back(arg);
+            }
+        }
+
+        if (command == "--snapshots") {
+            std::vector<SnapshotInfo> snapshots;
+            if (!listSnapshots(destDir, snapshots)) {
+                std::cerr << "Could not list snapshots in " << destDir << std::endl;
+                return 1;
+            }
+            for (const auto &s : snapshots) {
+                std::time_t created = static_cast<std::time_t>(s.created);
+                char when[32];
+                std::strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", std::localtime(&created));
+                std::cout << s.name << "  " << when << "  " << s.objects << " object(s), " << s.bytes << " bytes"
+                          << std::endl;
+            }
+            return 0;
+        }
+
+        bool ok = true;
+        PruneStats pruned;
+        if (command == "--snapshot") {
+            if (names.size() > 1) {
+                showUsage();
+                return 1;
+            }
+            SnapshotInfo info;
+            ok = createSnapshot(destDir, names.empty() ? defaultSnapshotName() : names[0], 0, info);
+            if (!ok) {
+                std::cerr << "Snapshot failed (see log.txt)" << std::endl;
+                return 1;
+            }
+            std::cout << "Snapshot " << info.name << ": " << info.objects << " object(s), " << info.bytes << " bytes"
+                      << std::endl;
+        } else {
+            for (const auto &name : names) ok = deleteSnapshot(destDir, name, 0, pruned) && ok;
+        }
+        ok = pruneSnapshots(destDir, retention, 0, pruned) && ok;
+        if (pruned.snapshots > 0 || command == "--prune") {
+            std::cout << "Deleted " << pruned.snapshots << " snapshot(s), freed " << pruned.filesFreed
+                      << " file(s), " << pruned.bytesFreed << " bytes" << std::endl;
+        }
+        return ok ? 0 : 1;
+    }
+
     // Check for help
     if (argc >= 2 && (std::string(argv[1]) == "--help" || std::string(argv[1]) == "-h")) {
         showUsage();
@@ -88,13 +412,208 @@ int main(int argc, char *argv[]) {
     
     std::string sourceDir, destDir;
     int threadCount = 4;
+    BackupOptions options;
+    std::string metricsPath;
+    int metricsIntervalMs = 2000;
+    IoBackend ioBackend = kIoAuto;
+    int ioDepth = 4;
+    uint64_t mmapThreshold = 64ULL << 20;
+    uint64_t directThreshold = 1ULL << 30;
+    uint64_t memoryLimit = kDefaultBufferPoolCap;
 
-    if (argc >= 3) {
-        sourceDir = argv[1];
-        destDir = argv[2];
-        if (argc >= 4) {
+    std::vector<std::string> positional;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        std::string name, value;
+        splitOption(arg, name, value);
+        if (name == "--compression") {
+            if (!parseCompressionPolicy(value, options.compression)) {
+                std::cerr << "Invalid value for --compression: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--log-max-size" && !value.empty()) {
             try {
-                threadCount = std::stoi(argv[3]);
+                configureLogger("log.txt", std::stoull(value) << 20, 5);
+            } catch (...) {
+                std::cerr << "Invalid value for --log-max-size: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--parallel-threshold" && !value.empty()) {
+            try {
+                options.parallelThreshold = std::stoull(value) << 20;
+            } catch (...) {
+                std::cerr << "Invalid value for --parallel-threshold: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--pack-threshold" && !value.empty()) {
+            try {
+                options.packThreshold = std::stoull(value) << 10;
+            } catch (...) {
+                std::cerr << "Invalid value for --pack-threshold: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--delta-threshold" && !value.empty()) {
+            try {
+                options.deltaThreshold = std::stoull(value) << 20;
+            } catch (...) {
+                std::cerr << "Invalid value for --delta-threshold: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--checkpoint" && !value.empty()) {
+            try {
+                options.checkpointBytes = std::stoull(value) << 20;
+            } catch (...) {
+                std::cerr << "Invalid value for --checkpoint: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--delta-chain" && !value.empty()) {
+            try {
+                options.deltaMaxChain = std::stoi(value);
+            } catch (...) {
+                std::cerr << "Invalid value for --delta-chain: " << value << std::endl;
+                return 1;
+            }
+        } else if (int *keep = retentionField(name, options.retention)) {
+            try {
+                *keep = std::stoi(value);
+                if (*keep < 0) throw std::out_of_range(value);
+            } catch (...) {
+                std::cerr << "Invalid value for " << name << ": " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--snapshot") {
+            options.snapshot = true;
+            options.snapshotName = value;
+        } else if (name == "--walk-threads" && !value.empty()) {
+            try {
+                options.walkThreads = std::stoi(value);
+            } catch (...) {
+                std::cerr << "Invalid value for --walk-threads: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--schedule") {
+            if (!parseSchedulePolicy(value, options.schedule)) {
+                std::cerr << "Invalid value for --schedule: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--format") {
+            if (!parseObjectFormat(value, options.format)) {
+                std::cerr << "Invalid value for --format: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--io") {
+            if (!parseIoBackend(value, ioBackend)) {
+                std::cerr << "Invalid value for --io: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--io-depth" && !value.empty()) {
+            try {
+                ioDepth = std::stoi(value);
+            } catch (...) {
+                std::cerr << "Invalid value for --io-depth: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--mmap-threshold" && !value.empty()) {
+            try {
+                mmapThreshold = std::stoull(value) << 20;
+            } catch (...) {
+                std::cerr << "Invalid value for --mmap-threshold: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--direct-threshold" && !value.empty()) {
+            try {
+                directThreshold = std::stoull(value) << 20;
+            } catch (...) {
+                std::cerr << "Invalid value for --direct-threshold: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--memory-limit" && !value.empty()) {
+            try {
+                memoryLimit = std::stoull(value) << 20;
+            } catch (...) {
+                std::cerr << "Invalid value for --memory-limit: " << value << std::endl;
+                return 1;
+            }
+        } else if ((name == "--read-limit" || name == "--write-limit") && !value.empty()) {
+            try {
+                uint64_t rate = static_cast<uint64_t>(std::stod(value) * (1 << 20));
+                if (name == "--read-limit") {
+                    options.qos.readBytesPerSec = rate;
+                } else {
+                    options.qos.writeBytesPerSec = rate;
+                }
+            } catch (...) {
+                std::cerr << "Invalid value for " << name << ": " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--cpu-limit" && !value.empty()) {
+            try {
+                options.qos.cpuBudget = std::stod(value);
+            } catch (...) {
+                std::cerr << "Invalid value for --cpu-limit: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--nice" && !value.empty()) {
+            try {
+                options.qos.nice = std::stoi(value);
+            } catch (...) {
+                options.qos.nice = -1;
+            }
+            if (options.qos.nice < 0 || options.qos.nice > 19) {
+                std::cerr << "Invalid value for --nice: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--ionice") {
+            if (!parseIoPriority(value, options.qos.ioClass, options.qos.ioLevel)) {
+                std::cerr << "Invalid value for --ionice: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--max-load" && !value.empty()) {
+            try {
+                options.qos.maxLoad = std::stod(value);
+            } catch (...) {
+                std::cerr << "Invalid value for --max-load: " << value << std::endl;
+                return 1;
+            }
+        } else if (name == "--metrics" && !value.empty()) {
+            metricsPath = value;
+        } else if (name == "--metrics-interval" && !value.empty()) {
+            try {
+                metricsIntervalMs = static_cast<int>(std::stod(value) * 1000);
+            } catch (...) {
+                std::cerr << "Invalid value for --metrics-interval: " << value << std::endl;
+                return 1;
+            }
+        } else if (arg == "--watch") {
+            options.watch = true;
+        } else if (arg == "--fanotify") {
+            options.watch = true;
+            options.useFanotify = true;
+        } else if (arg == "--once") {
+            options.once = true;
+        } else if (arg == "--dedup") {
+            options.dedup = true;
+        } else if (arg == "--delta") {
+            options.delta = true;
+        } else if (arg == "--pack") {
+            options.pack = true;
+        } else if (arg == "--fingerprint") {
+            options.fingerprint = true;
+        } else if (arg.size() > 2 && arg.compare(0, 2, "--") == 0) {
+            std::cerr << "Unknown option: " << arg << std::endl;
+            showUsage();
+            return 1;
+        } else {
+            positional.push_back(arg);
+        }
+    }
+
+    if (positional.size() >= 2) {
+        sourceDir = positional[0];
+        destDir = positional[1];
+        if (positional.size() >= 3) {
+            try {
+                threadCount = std::stoi(positional[2]);
             } catch (...) {
                 threadCount = 4;
             }
@@ -120,14 +639,24 @@ int main(int argc, char *argv[]) {
         return 1;
     }
 
+    configureIo(ioBackend, ioDepth);
+    configureReadStrategy(mmapThreshold, directThreshold);
+    configureBufferPool(memoryLimit);
+
+    if (!metricsPath.empty() && !startMetricsExporter(normalizePathForWSL(metricsPath), metricsIntervalMs)) {
+        std::cerr << "Warning: could not write metrics to " << metricsPath << std::endl;
+    }
+
     logMessage("Backup started.");
-    try {
-        performBackup(sourceDir, destDir, threadCount);
-    } catch (const std::exception &ex) {
-        std::cerr << "Backup failed: " << ex.what() << std::endl;
-        logMessage(std::string("Backup failed: ") + ex.what());
+    options.threadCount = threadCount;
+    // Same engine as the GUI; Ctrl+C reaches it through requestStopBackup
+    BackupEngine engine;
+    if (!engine.start(sourceDir, destDir, options) || engine.wait() == kBackupFailed) {
+        std::cerr << "Backup failed: " << engine.error() << std::endl;
+        stopMetricsExporter();
         return 1;
     }
+    stopMetricsExporter();
     logMessage("Backup finished.");
 
     std::cout << "Backup completed. Check log.txt for details." << std::endl;
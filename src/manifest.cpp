@@ -0,0 +1,256 @@
+#include "manifest.h"
+#include "logger.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+static const char kManifestName[] = ".abt_manifest";
+static const char kManifestMagic[8] = {'A', 'B', 'T', 'M', 'A', 'N', 'I', '1'};
+static const uint32_t kManifestVersion = 3;
+
+// Version 1 records had no content hash; they load with contentHash = 0
+struct ManifestRecordV1 {
+    uint64_t pathHash;
+    uint64_t size;
+    int64_t mtimeNs;
+    uint64_t inode;
+    uint64_t location;
+};
+
+struct ManifestHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t recordSize;
+    uint64_t count;
+    uint64_t keyCheck;   // version 3 on
+};
+
+// Versions 1 and 2 end the header before keyCheck
+static size_t headerSize(uint32_t version) {
+    return version >= 3 ? sizeof(ManifestHeader) : offsetof(ManifestHeader, keyCheck);
+}
+
+BackupManifest::BackupManifest(const std::string &destDir)
+    : m_path((fs::path(destDir) / kManifestName).string()) {
+    rebuildIndex(1024);
+}
+
+uint64_t BackupManifest::hashPath(const std::string &relativePath) {
+    // FNV-1a; 64 bits keeps collisions negligible for tens of millions of paths
+    uint64_t h = 1469598103934665603ULL;
+    for (unsigned char c : relativePath) {
+        h ^= c;
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+bool BackupManifest::readKeyCheck(const std::string &destDir, uint64_t &check) {
+    FILE *f = std::fopen((fs::path(destDir) / kManifestName).c_str(), "rb");
+    if (!f) return false;
+    ManifestHeader header{};
+    size_t got = std::fread(&header, 1, sizeof(header), f);
+    std::fclose(f);
+    if (got < headerSize(1) || std::memcmp(header.magic, kManifestMagic, sizeof(kManifestMagic)) != 0) return false;
+    check = header.version >= 3 && got >= headerSize(header.version) ? header.keyCheck : 0;
+    return true;
+}
+
+bool BackupManifest::load() {
+    auto started = std::chrono::steady_clock::now();
+    int fd = open(m_path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+
+    struct stat st{};
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < headerSize(1)) {
+        close(fd);
+        logMessage("Ignoring truncated manifest: " + m_path);
+        return false;
+    }
+
+    size_t len = static_cast<size_t>(st.st_size);
+    void *map = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return false;
+    madvise(map, len, MADV_SEQUENTIAL);
+
+    ManifestHeader header{};
+    std::memcpy(&header, map, headerSize(1));
+    size_t dataOffset = headerSize(header.version);
+    if (header.version >= 3 && len >= dataOffset) std::memcpy(&header, map, dataOffset);
+    else header.keyCheck = 0;
+    size_t recordSize = header.version == 1 ? sizeof(ManifestRecordV1) : sizeof(ManifestRecord);
+    bool valid = std::memcmp(header.magic, kManifestMagic, sizeof(kManifestMagic)) == 0 &&
+                 header.version >= 1 && header.version <= kManifestVersion &&
+                 header.recordSize == recordSize && len >= dataOffset &&
+                 header.count <= (len - dataOffset) / recordSize;
+    if (!valid) {
+        munmap(map, len);
+        logMessage("Ignoring unreadable manifest: " + m_path);
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_records.resize(header.count);
+        const char *base = static_cast<const char *>(map) + dataOffset;
+        if (header.version != 1) {
+            std::memcpy(m_records.data(), base, header.count * sizeof(ManifestRecord));
+        } else {
+            for (uint64_t i = 0; i < header.count; ++i) {
+                ManifestRecordV1 old;
+                std::memcpy(&old, base + i * sizeof(old), sizeof(old));
+                ManifestRecord &rec = m_records[i];
+                rec.pathHash = old.pathHash;
+                rec.size = old.size;
+                rec.mtimeNs = old.mtimeNs;
+                rec.inode = old.inode;
+                rec.location = old.location;
+                rec.contentHash = 0;
+            }
+        }
+        m_keyCheck = header.keyCheck;
+        rebuildIndex(header.count * 2);
+        // An upgraded manifest is written back in the new format
+        m_dirty = header.version != kManifestVersion;
+    }
+    munmap(map, len);
+
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - started).count();
+    logMessage("Loaded manifest with " + std::to_string(header.count) + " entries in " + std::to_string(ms) + " ms");
+    return true;
+}
+
+bool BackupManifest::save() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_dirty) return true;
+
+    std::error_code ec;
+    fs::create_directories(fs::path(m_path).parent_path(), ec);
+
+    std::string tmpPath = m_path + ".tmp";
+    FILE *f = std::fopen(tmpPath.c_str(), "wb");
+    if (!f) {
+        logMessage("Failed to write manifest: " + tmpPath);
+        return false;
+    }
+
+    ManifestHeader header{};
+    std::memcpy(header.magic, kManifestMagic, sizeof(kManifestMagic));
+    header.version = kManifestVersion;
+    header.recordSize = sizeof(ManifestRecord);
+    header.count = m_records.size();
+    header.keyCheck = m_keyCheck;
+
+    bool ok = std::fwrite(&header, sizeof(header), 1, f) == 1;
+    if (ok && !m_records.empty()) {
+        ok = std::fwrite(m_records.data(), sizeof(ManifestRecord), m_records.size(), f) == m_records.size();
+    }
+    ok = std::fflush(f) == 0 && ok;
+    ok = fsync(fileno(f)) == 0 && ok;
+    ok = std::fclose(f) == 0 && ok;
+
+    // Replace atomically so a crash never leaves a half-written manifest behind
+    if (!ok || std::rename(tmpPath.c_str(), m_path.c_str()) != 0) {
+        std::remove(tmpPath.c_str());
+        logMessage("Failed to write manifest: " + m_path);
+        return false;
+    }
+    m_dirty = false;
+    return true;
+}
+
+bool BackupManifest::isUnchanged(uint64_t pathHash, uint64_t size, int64_t mtimeNs, uint64_t inode) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint32_t idx = m_slots[slotFor(pathHash)];
+    if (idx == 0) return false;
+    const ManifestRecord &rec = m_records[idx - 1];
+    return rec.size == size && rec.mtimeNs == mtimeNs && rec.inode == inode;
+}
+
+bool BackupManifest::find(uint64_t pathHash, ManifestRecord &out) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint32_t idx = m_slots[slotFor(pathHash)];
+    if (idx == 0) return false;
+    out = m_records[idx - 1];
+    return true;
+}
+
+void BackupManifest::update(const ManifestRecord &record) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    size_t slot = slotFor(record.pathHash);
+    if (m_slots[slot] != 0) {
+        m_records[m_slots[slot] - 1] = record;
+    } else {
+        m_records.push_back(record);
+        // Keep the load factor at or below one half
+        if (m_records.size() * 2 > m_slots.size()) {
+            rebuildIndex(m_slots.size() * 2);
+        } else {
+            m_slots[slot] = static_cast<uint32_t>(m_records.size());
+        }
+    }
+    m_dirty = true;
+}
+
+void BackupManifest::clear() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_records.clear();
+    rebuildIndex(1024);
+    m_dirty = true;
+}
+
+uint64_t BackupManifest::keyCheck() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_keyCheck;
+}
+
+void BackupManifest::setKeyCheck(uint64_t check) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_keyCheck == check) return;
+    m_keyCheck = check;
+    m_dirty = true;
+}
+
+std::vector<ManifestRecord> BackupManifest::records() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_records;
+}
+
+size_t BackupManifest::size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_records.size();
+}
+
+bool BackupManifest::dirty() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_dirty;
+}
+
+size_t BackupManifest::slotFor(uint64_t pathHash) const {
+    // Linear probing; capacity is always a power of two
+    size_t mask = m_slots.size() - 1;
+    size_t slot = static_cast<size_t>(pathHash ^ (pathHash >> 32)) & mask;
+    while (m_slots[slot] != 0 && m_records[m_slots[slot] - 1].pathHash != pathHash) {
+        slot = (slot + 1) & mask;
+    }
+    return slot;
+}
+
+void BackupManifest::rebuildIndex(size_t capacity) {
+    size_t cap = 1024;
+    while (cap < capacity) cap <<= 1;
+    m_slots.assign(cap, 0);
+    for (size_t i = 0; i < m_records.size(); ++i) {
+        m_slots[slotFor(m_records[i].pathHash)] = static_cast<uint32_t>(i + 1);
+    }
+}
@@ -0,0 +1,369 @@
+#include "metrics.h"
+#include "logger.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <filesystem>
+#include <mutex>
+#include <sstream>
+#include <thread>
+
+static const char *kStageNames[kStageCount] = {
+    "read", "deflate", "encrypt", "write", "chunk", "fingerprint", "walk", "log",
+};
+
+static const int64_t g_startNs = metricsNowNs();
+
+const char *metricStageName(MetricStage stage) {
+    return stage >= 0 && stage < kStageCount ? kStageNames[stage] : "unknown";
+}
+
+void LatencyHistogram::record(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    int bucket = us <= 1 ? 0 : 64 - __builtin_clzll(us - 1);
+    if (bucket >= kHistogramBuckets) bucket = kHistogramBuckets - 1;
+    buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sumNs.fetch_add(ns, std::memory_order_relaxed);
+}
+
+BackupMetrics &metrics() {
+    // Never destroyed: workers and the logger thread may still report at exit
+    static BackupMetrics *m = new BackupMetrics();
+    return *m;
+}
+
+void recordStage(MetricStage stage, uint64_t bytes, int64_t startNs, uint64_t ops) {
+    StageMetrics &s = metrics().stages[stage];
+    int64_t elapsed = metricsNowNs() - startNs;
+    s.bytes.fetch_add(bytes, std::memory_order_relaxed);
+    s.ops.fetch_add(ops, std::memory_order_relaxed);
+    s.latency.record(elapsed > 0 ? static_cast<uint64_t>(elapsed) : 0);
+}
+
+void beginMetricsPass() {
+    BackupMetrics &m = metrics();
+    m.passFilesQueued = 0;
+    m.passBytesQueued = 0;
+    m.passFilesDone = 0;
+    m.passBytesDone = 0;
+    m.passWalkDone = false;
+    m.passStartNs = metricsNowNs();
+    m.passes++;
+}
+
+namespace {
+
+struct Snapshot {
+    uint64_t buckets[kHistogramBuckets];
+    uint64_t count;
+    double sumSeconds;
+};
+
+Snapshot snapshot(const LatencyHistogram &h) {
+    Snapshot s;
+    s.count = 0;
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+        s.buckets[i] = h.buckets[i].load(std::memory_order_relaxed);
+        s.count += s.buckets[i];
+    }
+    s.sumSeconds = static_cast<double>(h.sumNs.load(std::memory_order_relaxed)) / 1e9;
+    return s;
+}
+
+// Upper bound of bucket i in microseconds; the last bucket is unbounded
+double bucketBoundUs(int i) {
+    return static_cast<double>(1ULL << i);
+}
+
+double percentileUs(const Snapshot &s, double q) {
+    if (s.count == 0) return 0.0;
+    uint64_t target = static_cast<uint64_t>(q * static_cast<double>(s.count) + 0.5);
+    if (target == 0) target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+        seen += s.buckets[i];
+        if (seen >= target) return bucketBoundUs(i);
+    }
+    return bucketBoundUs(kHistogramBuckets - 1);
+}
+
+std::string number(double v) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.6g", v);
+    return buf;
+}
+
+std::string histogramJson(const LatencyHistogram &h) {
+    Snapshot s = snapshot(h);
+    std::ostringstream out;
+    out << "{\"count\": " << s.count << ", \"seconds\": " << number(s.sumSeconds)
+        << ", \"p50_us\": " << number(percentileUs(s, 0.5))
+        << ", \"p90_us\": " << number(percentileUs(s, 0.9))
+        << ", \"p99_us\": " << number(percentileUs(s, 0.99)) << ", \"buckets_us\": {";
+    bool first = true;
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+        if (s.buckets[i] == 0) continue;
+        out << (first ? "" : ", ") << "\""
+            << (i == kHistogramBuckets - 1 ? std::string("+Inf") : number(bucketBoundUs(i))) << "\": " << s.buckets[i];
+        first = false;
+    }
+    out << "}}";
+    return out.str();
+}
+
+void histogramPrometheus(std::ostringstream &out, const std::string &name, const std::string &labels,
+                         const LatencyHistogram &h) {
+    Snapshot s = snapshot(h);
+    std::string sep = labels.empty() ? "" : labels + ",";
+    uint64_t cumulative = 0;
+    for (int i = 0; i < kHistogramBuckets; ++i) {
+        cumulative += s.buckets[i];
+        std::string le = i == kHistogramBuckets - 1 ? "+Inf" : number(bucketBoundUs(i) / 1e6);
+        out << name << "_bucket{" << sep << "le=\"" << le << "\"} " << cumulative << "\n";
+    }
+    std::string braces = labels.empty() ? "" : "{" + labels + "}";
+    out << name << "_sum" << braces << " " << number(s.sumSeconds) << "\n";
+    out << name << "_count" << braces << " " << s.count << "\n";
+}
+
+} // namespace
+
+PassProgress passProgress() {
+    BackupMetrics &m = metrics();
+    PassProgress p;
+    p.filesQueued = m.passFilesQueued.load();
+    p.bytesQueued = m.passBytesQueued.load();
+    p.filesDone = m.passFilesDone.load();
+    p.bytesDone = m.passBytesDone.load();
+    p.walkDone = m.passWalkDone.load();
+    int64_t start = m.passStartNs.load();
+    p.elapsed = start > 0 ? static_cast<double>(metricsNowNs() - start) / 1e9 : 0.0;
+    p.rate = p.elapsed > 0 ? static_cast<double>(p.bytesDone) / p.elapsed : 0.0;
+    // Only meaningful once the walk has seen everything; -1 until then
+    p.eta = p.walkDone && p.rate > 0 ? static_cast<double>(p.bytesQueued - std::min(p.bytesQueued, p.bytesDone)) / p.rate
+                                     : -1.0;
+    return p;
+}
+
+std::string renderMetricsJson() {
+    BackupMetrics &m = metrics();
+    PassProgress p = passProgress();
+    std::ostringstream out;
+    out << "{\n";
+    out << "  \"timestamp\": " << std::time(nullptr) << ",\n";
+    out << "  \"uptime_s\": " << number(static_cast<double>(metricsNowNs() - g_startNs) / 1e9) << ",\n";
+    out << "  \"files\": {\"backed_up\": " << m.filesBackedUp << ", \"failed\": " << m.filesFailed
+        << ", \"skipped\": " << m.filesSkipped << ", \"fingerprint_matched\": " << m.fingerprintSkips << "},\n";
+    out << "  \"bytes\": {\"source\": " << m.bytesBackedUp << ", \"stored\": " << m.bytesStored << "},\n";
+    out << "  \"passes\": " << m.passes << ",\n";
+    out << "  \"pass\": {\"files_queued\": " << p.filesQueued << ", \"bytes_queued\": " << p.bytesQueued
+        << ", \"files_done\": " << p.filesDone << ", \"bytes_done\": " << p.bytesDone
+        << ", \"walk_done\": " << (p.walkDone ? "true" : "false") << ", \"elapsed_s\": " << number(p.elapsed)
+        << ", \"bytes_per_s\": " << number(p.rate) << ", \"eta_s\": " << number(p.eta) << "},\n";
+    out << "  \"schedule\": {\"predicted_s\": " << number(static_cast<double>(m.schedulePredictedNs.load()) / 1e9)
+        << ", \"makespan_s\": " << number(static_cast<double>(m.scheduleMakespanNs.load()) / 1e9)
+        << ", \"tail_s\": " << number(static_cast<double>(m.scheduleTailNs.load()) / 1e9) << "},\n";
+    out << "  \"workers\": {\"count\": " << m.workers << ", \"busy\": " << m.workersBusy
+        << ", \"queue_depth\": " << m.queueDepth
+        << ", \"busy_s\": " << number(static_cast<double>(m.workerBusyNs.load()) / 1e9)
+        << ", \"idle_s\": " << number(static_cast<double>(m.workerIdleNs.load()) / 1e9) << "},\n";
+    out << "  \"qos\": {\"active_workers\": " << m.qosActiveWorkers
+        << ", \"scale\": " << number(static_cast<double>(m.qosScalePermille.load()) / 1000.0)
+        << ", \"read_wait_s\": " << number(static_cast<double>(m.qosReadWaitNs.load()) / 1e9)
+        << ", \"write_wait_s\": " << number(static_cast<double>(m.qosWriteWaitNs.load()) / 1e9) << "},\n";
+    out << "  \"journal\": {\"groups\": " << m.journalGroups << ", \"files\": " << m.journalFiles
+        << ", \"sync_s\": " << number(static_cast<double>(m.journalSyncNs.load()) / 1e9) << "},\n";
+    out << "  \"buffers\": {\"allocs\": " << m.poolAllocs << ", \"reuses\": " << m.poolReuses
+        << ", \"in_use_bytes\": " << m.poolBytesInUse << ", \"peak_bytes\": " << m.poolBytesPeak
+        << ", \"waits\": " << m.poolWaits
+        << ", \"wait_s\": " << number(static_cast<double>(m.poolWaitNs.load()) / 1e9)
+        << ", \"codec_inits\": " << m.codecInits << ", \"codec_reuses\": " << m.codecReuses << "},\n";
+    out << "  \"log\": {\"lines\": " << m.logLines << ", \"bytes\": " << m.logBytes << "},\n";
+    out << "  \"file_latency\": " << histogramJson(m.fileLatency) << ",\n";
+    out << "  \"stages\": {";
+    for (int i = 0; i < kStageCount; ++i) {
+        const StageMetrics &s = m.stages[i];
+        out << (i ? ",\n" : "\n") << "    \"" << kStageNames[i] << "\": {\"bytes\": " << s.bytes
+            << ", \"ops\": " << s.ops << ", \"latency\": " << histogramJson(s.latency) << "}";
+    }
+    out << "\n  }\n}\n";
+    return out.str();
+}
+
+std::string renderMetricsPrometheus() {
+    BackupMetrics &m = metrics();
+    PassProgress p = passProgress();
+    std::ostringstream out;
+
+    out << "# TYPE abt_files_total counter\n";
+    out << "abt_files_total{result=\"backed_up\"} " << m.filesBackedUp << "\n";
+    out << "abt_files_total{result=\"failed\"} " << m.filesFailed << "\n";
+    out << "abt_files_total{result=\"skipped\"} " << m.filesSkipped << "\n";
+    out << "# TYPE abt_files_fingerprint_matched_total counter\n";
+    out << "abt_files_fingerprint_matched_total " << m.fingerprintSkips << "\n";
+    out << "# TYPE abt_bytes_total counter\n";
+    out << "abt_bytes_total{kind=\"source\"} " << m.bytesBackedUp << "\n";
+    out << "abt_bytes_total{kind=\"stored\"} " << m.bytesStored << "\n";
+    out << "# TYPE abt_passes_total counter\n";
+    out << "abt_passes_total " << m.passes << "\n";
+
+    out << "# TYPE abt_stage_bytes_total counter\n";
+    for (int i = 0; i < kStageCount; ++i) {
+        out << "abt_stage_bytes_total{stage=\"" << kStageNames[i] << "\"} " << m.stages[i].bytes << "\n";
+    }
+    out << "# TYPE abt_stage_ops_total counter\n";
+    for (int i = 0; i < kStageCount; ++i) {
+        out << "abt_stage_ops_total{stage=\"" << kStageNames[i] << "\"} " << m.stages[i].ops << "\n";
+    }
+    out << "# TYPE abt_stage_latency_seconds histogram\n";
+    for (int i = 0; i < kStageCount; ++i) {
+        histogramPrometheus(out, "abt_stage_latency_seconds", std::string("stage=\"") + kStageNames[i] + "\"",
+                            m.stages[i].latency);
+    }
+    out << "# TYPE abt_file_latency_seconds histogram\n";
+    histogramPrometheus(out, "abt_file_latency_seconds", "", m.fileLatency);
+
+    out << "# TYPE abt_pass_files gauge\n";
+    out << "abt_pass_files{state=\"queued\"} " << p.filesQueued << "\n";
+    out << "abt_pass_files{state=\"done\"} " << p.filesDone << "\n";
+    out << "# TYPE abt_pass_bytes gauge\n";
+    out << "abt_pass_bytes{state=\"queued\"} " << p.bytesQueued << "\n";
+    out << "abt_pass_bytes{state=\"done\"} " << p.bytesDone << "\n";
+    out << "# TYPE abt_pass_walk_done gauge\n";
+    out << "abt_pass_walk_done " << (p.walkDone ? 1 : 0) << "\n";
+    out << "# TYPE abt_pass_bytes_per_second gauge\n";
+    out << "abt_pass_bytes_per_second " << number(p.rate) << "\n";
+    out << "# TYPE abt_pass_eta_seconds gauge\n";
+    out << "abt_pass_eta_seconds " << number(p.eta) << "\n";
+
+    out << "# TYPE abt_schedule_seconds gauge\n";
+    out << "abt_schedule_seconds{kind=\"predicted\"} " << number(static_cast<double>(m.schedulePredictedNs.load()) / 1e9) << "\n";
+    out << "abt_schedule_seconds{kind=\"makespan\"} " << number(static_cast<double>(m.scheduleMakespanNs.load()) / 1e9) << "\n";
+    out << "abt_schedule_seconds{kind=\"tail\"} " << number(static_cast<double>(m.scheduleTailNs.load()) / 1e9) << "\n";
+
+    out << "# TYPE abt_queue_depth gauge\n";
+    out << "abt_queue_depth " << m.queueDepth << "\n";
+    out << "# TYPE abt_workers gauge\n";
+    out << "abt_workers " << m.workers << "\n";
+    out << "# TYPE abt_workers_busy gauge\n";
+    out << "abt_workers_busy " << m.workersBusy << "\n";
+    out << "# TYPE abt_worker_seconds_total counter\n";
+    out << "abt_worker_seconds_total{state=\"busy\"} " << number(static_cast<double>(m.workerBusyNs.load()) / 1e9) << "\n";
+    out << "abt_worker_seconds_total{state=\"idle\"} " << number(static_cast<double>(m.workerIdleNs.load()) / 1e9) << "\n";
+    out << "# TYPE abt_qos_active_workers gauge\n";
+    out << "abt_qos_active_workers " << m.qosActiveWorkers << "\n";
+    out << "# TYPE abt_qos_scale gauge\n";
+    out << "abt_qos_scale " << number(static_cast<double>(m.qosScalePermille.load()) / 1000.0) << "\n";
+    out << "# TYPE abt_qos_wait_seconds_total counter\n";
+    out << "abt_qos_wait_seconds_total{dir=\"read\"} " << number(static_cast<double>(m.qosReadWaitNs.load()) / 1e9) << "\n";
+    out << "abt_qos_wait_seconds_total{dir=\"write\"} " << number(static_cast<double>(m.qosWriteWaitNs.load()) / 1e9) << "\n";
+    out << "# TYPE abt_journal_groups_total counter\n";
+    out << "abt_journal_groups_total " << m.journalGroups << "\n";
+    out << "# TYPE abt_journal_files_total counter\n";
+    out << "abt_journal_files_total " << m.journalFiles << "\n";
+    out << "# TYPE abt_journal_sync_seconds_total counter\n";
+    out << "abt_journal_sync_seconds_total " << number(static_cast<double>(m.journalSyncNs.load()) / 1e9) << "\n";
+    out << "# TYPE abt_buffer_allocations_total counter\n";
+    out << "abt_buffer_allocations_total{source=\"malloc\"} " << m.poolAllocs << "\n";
+    out << "abt_buffer_allocations_total{source=\"cache\"} " << m.poolReuses << "\n";
+    out << "# TYPE abt_buffer_bytes gauge\n";
+    out << "abt_buffer_bytes " << m.poolBytesInUse << "\n";
+    out << "# TYPE abt_buffer_peak_bytes gauge\n";
+    out << "abt_buffer_peak_bytes " << m.poolBytesPeak << "\n";
+    out << "# TYPE abt_buffer_waits_total counter\n";
+    out << "abt_buffer_waits_total " << m.poolWaits << "\n";
+    out << "# TYPE abt_buffer_wait_seconds_total counter\n";
+    out << "abt_buffer_wait_seconds_total " << number(static_cast<double>(m.poolWaitNs.load()) / 1e9) << "\n";
+    out << "# TYPE abt_codec_contexts_total counter\n";
+    out << "abt_codec_contexts_total{source=\"new\"} " << m.codecInits << "\n";
+    out << "abt_codec_contexts_total{source=\"reused\"} " << m.codecReuses << "\n";
+
+    out << "# TYPE abt_log_lines_total counter\n";
+    out << "abt_log_lines_total " << m.logLines << "\n";
+    out << "# TYPE abt_log_bytes_total counter\n";
+    out << "abt_log_bytes_total " << m.logBytes << "\n";
+    return out.str();
+}
+
+namespace {
+
+class MetricsExporter {
+public:
+    ~MetricsExporter() { stop(); }
+
+    bool start(const std::string &path, int intervalMs) {
+        stop();
+        m_path = path;
+        m_prometheus = endsWith(path, ".prom") || endsWith(path, ".txt");
+        m_interval = std::chrono::milliseconds(intervalMs > 0 ? intervalMs : 1000);
+        std::error_code ec;
+        std::filesystem::path parent = std::filesystem::path(path).parent_path();
+        if (!parent.empty()) std::filesystem::create_directories(parent, ec);
+        if (!writeOnce()) {
+            logMessage("Failed to write metrics file: " + path);
+            return false;
+        }
+        m_stop = false;
+        m_thread = std::thread(&MetricsExporter::run, this);
+        return true;
+    }
+
+    void stop() {
+        if (!m_thread.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_stop = true;
+        }
+        m_cv.notify_all();
+        m_thread.join();
+        writeOnce(); // Final numbers
+    }
+
+private:
+    static bool endsWith(const std::string &s, const std::string &suffix) {
+        return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_cv.wait_for(lock, m_interval, [this]() { return m_stop; })) {
+            lock.unlock();
+            writeOnce();
+            lock.lock();
+        }
+    }
+
+    // Write to a sibling temp file and rename, so scrapers never see half a file
+    bool writeOnce() {
+        std::string text = m_prometheus ? renderMetricsPrometheus() : renderMetricsJson();
+        std::string tmp = m_path + ".tmp";
+        FILE *f = std::fopen(tmp.c_str(), "w");
+        if (!f) return false;
+        bool ok = std::fwrite(text.data(), 1, text.size(), f) == text.size();
+        ok = std::fclose(f) == 0 && ok;
+        return ok && std::rename(tmp.c_str(), m_path.c_str()) == 0;
+    }
+
+    std::string m_path;
+    bool m_prometheus = false;
+    std::chrono::milliseconds m_interval{1000};
+    std::thread m_thread;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_stop = false;
+};
+
+MetricsExporter g_exporter;
+
+} // namespace
+
+bool startMetricsExporter(const std::string &path, int intervalMs) {
+    return g_exporter.start(path, intervalMs);
+}
+
+void stopMetricsExporter() {
+    g_exporter.stop();
+}
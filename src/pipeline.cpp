@@ -0,0 +1,262 @@
+#include "pipeline.h"
+#include "metrics.h"
+
+static const size_t kPipelineBufSize = 1 << 16;
+
+EncryptedFileWriter::EncryptedFileWriter() {}
+
+EncryptedFileWriter::~EncryptedFileWriter() {
+    release();
+}
+
+bool EncryptedFileWriter::open(const std::string &outPath, const unsigned char *key, const unsigned char *iv) {
+    release();
+    m_error.clear();
+
+    if (!m_cipher.begin()) return fail("Failed to create encryption context");
+    if (EVP_EncryptInit_ex(m_cipher.get(), EVP_aes_256_ctr(), nullptr, key, iv) != 1) {
+        return fail("Failed to initialize encryption");
+    }
+
+    if (!m_out.open(outPath)) return fail(m_out.error());
+    return true;
+}
+
+bool EncryptedFileWriter::write(const void *data, size_t len) {
+    if (!m_cipher.get()) return fail("Writer is not open");
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    while (len > 0) {
+        // CTR output is exactly as long as its input, so encrypt straight
+        // into the writer's block
+        size_t avail = 0;
+        unsigned char *dst = m_out.reserve(avail);
+        size_t take = len < avail ? len : avail;
+        if (take > kPipelineBufSize) take = kPipelineBufSize;
+        int outLen = 0;
+        int64_t start = metricsNowNs();
+        if (EVP_EncryptUpdate(m_cipher.get(), dst, &outLen, p, static_cast<int>(take)) != 1) {
+            return fail("Encryption failed");
+        }
+        recordStage(kStageEncrypt, take, start);
+        if (!m_out.commit(static_cast<size_t>(outLen))) return fail(m_out.error());
+        metrics().bytesStored.fetch_add(static_cast<uint64_t>(outLen), std::memory_order_relaxed);
+        p += take;
+        len -= take;
+    }
+    return true;
+}
+
+bool EncryptedFileWriter::finish() {
+    if (!m_cipher.get()) return fail("Writer is not open");
+    unsigned char tail[EVP_MAX_BLOCK_LENGTH];
+    int outLen = 0;
+    if (EVP_EncryptFinal_ex(m_cipher.get(), tail, &outLen) != 1) {
+        return fail("Encryption final failed");
+    }
+    if (outLen > 0 && !m_out.write(tail, static_cast<size_t>(outLen))) return fail(m_out.error());
+    bool ok = m_out.finish();
+    if (!ok) return fail(m_out.error());
+    release();
+    return true;
+}
+
+bool EncryptedFileWriter::fail(const std::string &why) {
+    if (m_error.empty()) m_error = why;
+    release();
+    return false;
+}
+
+void EncryptedFileWriter::release() {
+    m_cipher.end();
+    m_out.abort();
+}
+
+EncryptedGzipWriter::EncryptedGzipWriter() {}
+
+EncryptedGzipWriter::~EncryptedGzipWriter() {
+    release();
+}
+
+bool EncryptedGzipWriter::open(const std::string &outPath, const unsigned char *key,
+                               const unsigned char *iv, int level) {
+    release();
+    m_error.clear();
+
+    // windowBits 15+16 and memLevel 8 are what gzopen uses, so the gzip header
+    // and deflate stream match the old two-pass output exactly.
+    if (!m_zs.begin(level, MAX_WBITS + 16)) return fail("deflateInit2 failed");
+    m_zbuf.reserve(kPipelineBufSize);
+
+    if (!m_file.open(outPath, key, iv)) {
+        release();
+        return false;
+    }
+    return true;
+}
+
+bool EncryptedGzipWriter::write(const void *data, size_t len) {
+    if (!m_zs.get()) return fail("Writer is not open");
+    const unsigned char *p = static_cast<const unsigned char *>(data);
+    while (len > 0) {
+        // avail_in is 32-bit; feed very large spans in pieces
+        uInt take = static_cast<uInt>(len > (1u << 30) ? (1u << 30) : len);
+        m_zs->next_in = const_cast<Bytef *>(p);
+        m_zs->avail_in = take;
+        if (!deflateChunk(Z_NO_FLUSH)) return false;
+        p += take;
+        len -= take;
+    }
+    return true;
+}
+
+bool EncryptedGzipWriter::finish() {
+    if (!m_zs.get()) return fail("Writer is not open");
+    m_zs->next_in = nullptr;
+    m_zs->avail_in = 0;
+    if (!deflateChunk(Z_FINISH)) return false;
+    bool ok = m_file.finish();
+    release();
+    return ok;
+}
+
+bool EncryptedGzipWriter::deflateChunk(int flush) {
+    int ret;
+    do {
+        m_zs->next_out = m_zbuf.data();
+        m_zs->avail_out = static_cast<uInt>(kPipelineBufSize);
+        uInt availIn = m_zs->avail_in;
+        int64_t start = metricsNowNs();
+        ret = deflate(m_zs.get(), flush);
+        if (ret == Z_STREAM_ERROR) return fail("Compression failed");
+        recordStage(kStageDeflate, availIn - m_zs->avail_in, start);
+
+        size_t have = kPipelineBufSize - m_zs->avail_out;
+        if (have > 0 && !m_file.write(m_zbuf.data(), have)) {
+            release();
+            return false;
+        }
+    } while (m_zs->avail_out == 0 || (flush == Z_FINISH && ret != Z_STREAM_END));
+    return true;
+}
+
+bool EncryptedGzipWriter::fail(const std::string &why) {
+    if (m_error.empty()) m_error = why;
+    release();
+    return false;
+}
+
+void EncryptedGzipWriter::release() {
+    // Back to the thread's caches for the next file
+    m_zs.end();
+    m_zbuf.release();
+}
+
+EncryptedGzipReader::EncryptedGzipReader() {}
+
+EncryptedGzipReader::~EncryptedGzipReader() {
+    release();
+}
+
+bool EncryptedGzipReader::open(const std::string &inPath, const unsigned char *key, const unsigned char *iv) {
+    release();
+    m_error.clear();
+    m_eof = false;
+    m_done = false;
+    m_inMember = false;
+    m_sawMember = false;
+
+    // 15+32 auto-detects the gzip header, the same as gzread
+    if (!m_zs.begin(MAX_WBITS + 32)) {
+        fail("inflateInit2 failed");
+        return false;
+    }
+    m_pbuf.reserve(kPipelineBufSize + EVP_MAX_BLOCK_LENGTH);
+
+    if (!m_cipher.begin() || EVP_DecryptInit_ex(m_cipher.get(), EVP_aes_256_ctr(), nullptr, key, iv) != 1) {
+        fail("Failed to initialize decryption");
+        return false;
+    }
+
+    if (!m_in.open(inPath)) {
+        fail("Failed to open: " + inPath);
+        return false;
+    }
+    return true;
+}
+
+long EncryptedGzipReader::read(void *buf, size_t len) {
+    if (m_done) return 0;
+    if (!m_zs.get()) return fail(m_error.empty() ? "Reader is not open" : m_error);
+    m_zs->next_out = static_cast<Bytef *>(buf);
+    m_zs->avail_out = static_cast<uInt>(len > (1u << 30) ? (1u << 30) : len);
+    uInt want = m_zs->avail_out;
+
+    while (m_zs->avail_out > 0) {
+        if (m_zs->avail_in == 0) {
+            if (!m_eof && !refill()) return -1;
+            if (m_zs->avail_in == 0) {
+                if (m_inMember) return fail("Truncated gzip stream");
+                m_done = true;
+                break;
+            }
+        }
+        // Like gzread, anything after a complete member that is not another
+        // gzip header ends the stream
+        if (!m_inMember && m_zs->next_in[0] != 0x1f) {
+            // ...but with nothing inflated yet it is the wrong key or not ours
+            if (!m_sawMember) return fail("Not a gzip stream (wrong key?)");
+            m_done = true;
+            break;
+        }
+
+        m_inMember = true;
+        m_sawMember = true;
+        int ret = inflate(m_zs.get(), Z_NO_FLUSH);
+        if (ret == Z_STREAM_END) {
+            m_inMember = false;
+            inflateReset(m_zs.get());
+            continue;
+        }
+        if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            return fail(std::string("Decompression failed: ") + (m_zs->msg ? m_zs->msg : "corrupt data"));
+        }
+    }
+
+    return static_cast<long>(want - m_zs->avail_out);
+}
+
+bool EncryptedGzipReader::refill() {
+    const unsigned char *data = nullptr;
+    long got = m_in.peek(data);
+    if (got < 0) {
+        fail(m_in.error());
+        return false;
+    }
+    if (got == 0) {
+        m_eof = true;
+        return true;
+    }
+    size_t take = static_cast<size_t>(got) < kPipelineBufSize ? static_cast<size_t>(got) : kPipelineBufSize;
+    int outLen = 0;
+    if (EVP_DecryptUpdate(m_cipher.get(), m_pbuf.data(), &outLen, data, static_cast<int>(take)) != 1) {
+        fail("Decryption failed");
+        return false;
+    }
+    m_in.consume(take);
+    m_zs->next_in = m_pbuf.data();
+    m_zs->avail_in = static_cast<uInt>(outLen);
+    return true;
+}
+
+long EncryptedGzipReader::fail(const std::string &why) {
+    if (m_error.empty()) m_error = why;
+    release();
+    return -1;
+}
+
+void EncryptedGzipReader::release() {
+    m_zs.end();
+    m_cipher.end();
+    m_pbuf.release();
+    m_in.close();
+}
@@ -0,0 +1,240 @@
+#include "qos.h"
+#include "logger.h"
+#include "metrics.h"
+#include "workpool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+// ioprio_set has no glibc wrapper
+static const int kIoprioWhoProcess = 1;
+static const int kIoprioClassShift = 13;
+static const int kIoprioClassBe = 2;
+static const int kIoprioClassIdle = 3;
+
+// A bucket holds at most this much time's worth of tokens, so an idle spell
+// does not buy an unthrottled burst afterwards
+static const double kBurstSeconds = 0.25;
+static const double kMinScale = 0.125;
+static const int64_t kScaleDownIntervalNs = 5000000000LL;
+static const int64_t kScaleUpIntervalNs = 15000000000LL;
+
+namespace {
+
+// Callers take what they need up front and sleep off any debt, so one large
+// read is not split up and several threads sharing a bucket queue up fairly
+class TokenBucket {
+public:
+    void configure(uint64_t bytesPerSec) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_baseRate = static_cast<double>(bytesPerSec);
+        m_rate = m_baseRate;
+        m_tokens = m_rate * kBurstSeconds;
+        m_last = metricsNowNs();
+        m_enabled = bytesPerSec > 0;
+    }
+
+    bool enabled() const { return m_enabled.load(std::memory_order_relaxed); }
+
+    void setScale(double scale) {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        refill(metricsNowNs());
+        m_rate = std::max(1.0, m_baseRate * scale);
+    }
+
+    // Nanoseconds slept
+    uint64_t acquire(uint64_t bytes) {
+        int64_t waitNs;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            refill(metricsNowNs());
+            m_tokens -= static_cast<double>(bytes);
+            if (m_tokens >= 0) return 0;
+            waitNs = static_cast<int64_t>(-m_tokens / m_rate * 1e9);
+        }
+        std::this_thread::sleep_for(std::chrono::nanoseconds(waitNs));
+        return static_cast<uint64_t>(waitNs);
+    }
+
+private:
+    void refill(int64_t now) {
+        m_tokens = std::min(m_rate * kBurstSeconds, m_tokens + m_rate * static_cast<double>(now - m_last) / 1e9);
+        m_last = now;
+    }
+
+    std::mutex m_mutex;
+    std::atomic<bool> m_enabled{false};
+    double m_baseRate = 0;
+    double m_rate = 0;
+    double m_tokens = 0;
+    int64_t m_last = 0;
+};
+
+} // namespace
+
+static QosOptions g_qos;
+static TokenBucket g_readBucket;
+static TokenBucket g_writeBucket;
+static std::atomic<bool> g_priorityWarned{false};
+
+bool parseIoPriority(const std::string &text, IoPriorityClass &ioClass, int &level) {
+    if (text == "none") {
+        ioClass = kIoClassNone;
+        return true;
+    }
+    if (text == "idle") {
+        ioClass = kIoClassIdle;
+        return true;
+    }
+    if (text == "be") {
+        ioClass = kIoClassBestEffort;
+        level = 4;
+        return true;
+    }
+    if (text.size() == 4 && text.compare(0, 3, "be:") == 0 && text[3] >= '0' && text[3] <= '7') {
+        ioClass = kIoClassBestEffort;
+        level = text[3] - '0';
+        return true;
+    }
+    return false;
+}
+
+void configureQos(const QosOptions &options) {
+    g_qos = options;
+    g_readBucket.configure(options.readBytesPerSec);
+    g_writeBucket.configure(options.writeBytesPerSec);
+    metrics().qosScalePermille.store(1000, std::memory_order_relaxed);
+}
+
+void throttleRead(uint64_t bytes) {
+    if (!g_readBucket.enabled() || bytes == 0) return;
+    uint64_t waited = g_readBucket.acquire(bytes);
+    if (waited > 0) metrics().qosReadWaitNs.fetch_add(waited, std::memory_order_relaxed);
+}
+
+void throttleWrite(uint64_t bytes) {
+    if (!g_writeBucket.enabled() || bytes == 0) return;
+    uint64_t waited = g_writeBucket.acquire(bytes);
+    if (waited > 0) metrics().qosWriteWaitNs.fetch_add(waited, std::memory_order_relaxed);
+}
+
+void applyWorkerPriority() {
+    if (g_qos.nice <= 0 && g_qos.ioClass == kIoClassNone) return;
+    pid_t tid = static_cast<pid_t>(::syscall(SYS_gettid));
+    bool ok = true;
+    if (g_qos.nice > 0) {
+        // Only ever lower our priority; raising it back would need privileges
+        errno = 0;
+        int current = ::getpriority(PRIO_PROCESS, static_cast<id_t>(tid));
+        if (errno == 0 && current < g_qos.nice && ::setpriority(PRIO_PROCESS, static_cast<id_t>(tid), g_qos.nice) != 0) {
+            ok = false;
+        }
+    }
+    if (g_qos.ioClass != kIoClassNone) {
+        int value = g_qos.ioClass == kIoClassIdle ? kIoprioClassIdle << kIoprioClassShift
+                                                  : (kIoprioClassBe << kIoprioClassShift) | g_qos.ioLevel;
+        if (::syscall(SYS_ioprio_set, kIoprioWhoProcess, tid, value) != 0) ok = false;
+    }
+    if (!ok && !g_priorityWarned.exchange(true)) {
+        logMessage(std::string("Failed to lower worker priority: ") + std::strerror(errno));
+    }
+}
+
+static int64_t processCpuNs() {
+    struct rusage usage;
+    if (::getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+    return (static_cast<int64_t>(usage.ru_utime.tv_sec) + usage.ru_stime.tv_sec) * 1000000000LL
+         + (static_cast<int64_t>(usage.ru_utime.tv_usec) + usage.ru_stime.tv_usec) * 1000LL;
+}
+
+QosController::QosController(WorkerPool &pool, const QosOptions &options)
+    : m_pool(pool), m_options(options), m_active(pool.threadCount()) {
+    if (m_options.cpuBudget > 0) {
+        // A budget under one core still leaves one worker running
+        m_active = std::max(1, std::min(m_active, static_cast<int>(std::ceil(m_options.cpuBudget))));
+    }
+    m_pool.setActiveLimit(m_active);
+    metrics().qosActiveWorkers.store(m_active, std::memory_order_relaxed);
+    if (m_options.cpuBudget > 0 || m_options.maxLoad > 0) {
+        m_thread = std::thread(&QosController::run, this);
+    }
+}
+
+QosController::~QosController() {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    if (m_thread.joinable()) m_thread.join();
+}
+
+void QosController::run() {
+    const int threads = m_pool.threadCount();
+    const double cores = std::max(1u, std::thread::hardware_concurrency());
+    int64_t prevCpu = processCpuNs();
+    int64_t prevWall = metricsNowNs();
+    int64_t lastScaleChange = prevWall;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (!m_cv.wait_for(lock, std::chrono::seconds(1), [this]() { return m_stop; })) {
+        int64_t now = metricsNowNs();
+        int64_t cpu = processCpuNs();
+        double used = static_cast<double>(cpu - prevCpu) / static_cast<double>(std::max<int64_t>(1, now - prevWall));
+        prevCpu = cpu;
+        prevWall = now;
+
+        double load;
+        if (m_options.maxLoad > 0 && ::getloadavg(&load, 1) == 1) {
+            // Our own threads show up in the load average too; what they
+            // burned over the last second is the best guess of their share
+            double host = std::max(0.0, load - used) / cores;
+            double scale = m_scale;
+            if (host > m_options.maxLoad && now - lastScaleChange >= kScaleDownIntervalNs) {
+                scale = std::max(kMinScale, m_scale / 2);
+            } else if (host < m_options.maxLoad * 0.75 && now - lastScaleChange >= kScaleUpIntervalNs) {
+                scale = std::min(1.0, m_scale * 2);
+            }
+            if (scale != m_scale) {
+                m_scale = scale;
+                lastScaleChange = now;
+                g_readBucket.setScale(scale);
+                g_writeBucket.setScale(scale);
+                metrics().qosScalePermille.store(static_cast<int64_t>(scale * 1000), std::memory_order_relaxed);
+                char text[96];
+                std::snprintf(text, sizeof(text), "QoS: host load %.2f per core, limits at %d%%",
+                              host, static_cast<int>(scale * 100));
+                logMessage(text);
+            }
+        }
+
+        int maxActive = std::max(1, static_cast<int>(std::lround(threads * m_scale)));
+        int active = std::min(m_active, maxActive);
+        if (m_options.cpuBudget > 0) {
+            double target = m_options.cpuBudget * m_scale;
+            if (used > target * 1.1 && active > 1) {
+                --active;
+            } else if (used < target * 0.9 && active < maxActive
+                       && metrics().workersBusy.load() >= m_active) {
+                // Only widen when every active worker has work, i.e. when
+                // the budget and not the workload is what holds us back
+                ++active;
+            }
+        } else {
+            active = maxActive;
+        }
+        if (active != m_active) {
+            m_active = active;
+            m_pool.setActiveLimit(active);
+            metrics().qosActiveWorkers.store(active, std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,243 @@
+#include "restore.h"
+#include "bufferpool.h"
+#include "container.h"
+#include "delta.h"
+#include "encrypt.h"
+#include "logger.h"
+#include "segmentstore.h"
+#include "workpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <map>
+#include <fnmatch.h>
+
+namespace fs = std::filesystem;
+
+static const std::string kObjectSuffix = ".gz.enc";
+static const std::string kRecipeSuffix = ".abtr.enc";
+
+static std::atomic<bool> g_restoreStop{false};
+
+void requestStopRestore() {
+    g_restoreStop.store(true);
+}
+
+static bool endsWith(const std::string &s, const std::string &suffix) {
+    return s.size() > suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static bool hasWildcards(const std::string &pattern) {
+    return pattern.find_first_of("*?[") != std::string::npos;
+}
+
+static std::string trimSlashes(std::string s) {
+    while (!s.empty() && s.back() == '/') s.pop_back();
+    while (!s.empty() && s.front() == '/') s.erase(s.begin());
+    return s;
+}
+
+static bool globMatches(const std::string &pattern, const std::string &path) {
+    if (!hasWildcards(pattern)) {
+        // A plain path selects that file or everything below it
+        std::string p = trimSlashes(pattern);
+        return p.empty() || path == p || (path.size() > p.size() && path.compare(0, p.size(), p) == 0 && path[p.size()] == '/');
+    }
+    return fnmatch(trimSlashes(pattern).c_str(), path.c_str(), 0) == 0;
+}
+
+bool restoreFilterMatches(const RestoreOptions &options, const std::string &relativePath) {
+    if (!options.includes.empty() &&
+        std::none_of(options.includes.begin(), options.includes.end(),
+                     [&](const std::string &p) { return globMatches(p, relativePath); })) {
+        return false;
+    }
+    return std::none_of(options.excludes.begin(), options.excludes.end(),
+                        [&](const std::string &p) { return globMatches(p, relativePath); });
+}
+
+// Could anything below `dir` pass the filters? Lets a subtree restore skip
+// listing the rest of the backup.
+static bool shouldDescend(const RestoreOptions &options, const std::string &dir) {
+    for (const auto &p : options.excludes) {
+        if (!hasWildcards(p) && globMatches(p, dir)) return false;
+    }
+    if (options.includes.empty()) return true;
+    std::string d = dir + "/";
+    for (const auto &p : options.includes) {
+        std::string pattern = trimSlashes(p);
+        std::string literal = pattern.substr(0, pattern.find_first_of("*?["));
+        if (!hasWildcards(pattern)) literal += "/";
+        size_t n = std::min(literal.size(), d.size());
+        if (literal.compare(0, n, d, 0, n) == 0) return true;
+    }
+    return false;
+}
+
+// Entries the backup keeps for itself. They only live at the backup root
+// (the snapshot marker at a snapshot's root); user files that happen to
+// start with ".abt_" are ordinary objects at any depth.
+static bool isReservedEntry(const std::string &dir, const std::string &name) {
+    static const char *const kReservedNames[] = {
+        ".abt_manifest", ".abt_chunks", ".abt_packs", ".abt_deltas",
+        ".abt_snapshots", ".abt_snapshot", ".abt_journal", ".abt_stop",
+    };
+    if (endsWith(name, kObjectTempSuffix)) return true;
+    if (!dir.empty()) return false;
+    for (const char *reserved : kReservedNames) {
+        if (name == reserved) return true;
+    }
+    return false;
+}
+
+void listBackupDirectory(const std::string &backupDir, const std::string &dir, const RestoreOptions &options,
+                         std::vector<std::string> &subdirs, std::vector<BackupObject> &objects) {
+    fs::path root(backupDir);
+    std::error_code ec;
+    fs::directory_iterator it(dir.empty() ? root : root / dir, ec), end;
+    if (ec) {
+        logMessage("Failed to list " + (root / dir).string() + ": " + ec.message());
+        return;
+    }
+
+    // A file may have both an object and a recipe if --dedup was toggled
+    // between runs; the newer one is current
+    std::map<std::string, std::pair<fs::file_time_type, BackupObject>> found;
+    for (; it != end; it.increment(ec)) {
+        if (ec) break;
+        std::string name = it->path().filename().string();
+        if (isReservedEntry(dir, name)) continue;
+        std::string relative = dir.empty() ? name : dir + "/" + name;
+
+        if (it->is_directory(ec) && !it->is_symlink(ec)) {
+            if (shouldDescend(options, relative)) subdirs.push_back(relative);
+            continue;
+        }
+        if (!it->is_regular_file(ec)) continue;
+
+        std::string original;
+        if (endsWith(relative, kObjectSuffix)) original = relative.substr(0, relative.size() - kObjectSuffix.size());
+        else if (endsWith(relative, kRecipeSuffix)) original = relative.substr(0, relative.size() - kRecipeSuffix.size());
+        else continue;
+        if (!restoreFilterMatches(options, original)) continue;
+
+        fs::file_time_type mtime = it->last_write_time(ec);
+        auto existing = found.find(original);
+        if (existing == found.end() || existing->second.first < mtime) {
+            found[original] = {mtime, BackupObject{it->path().string(), original}};
+        }
+    }
+    for (auto &entry : found) objects.push_back(std::move(entry.second.second));
+}
+
+bool performRestore(const std::string &backupDir, const std::string &targetDir,
+                    const std::string &keyHex, const std::string &ivHex,
+                    const RestoreOptions &options, RestoreStats &stats) {
+    std::vector<unsigned char> key = hexToBytes(keyHex);
+    std::vector<unsigned char> iv = hexToBytes(ivHex);
+    if (key.size() != 32 || iv.size() != 16) {
+        logMessage("Invalid key/IV size for restore");
+        return false;
+    }
+
+    fs::path root(backupDir);
+    if (!fs::is_directory(root)) {
+        logMessage("Backup directory does not exist: " + backupDir);
+        return false;
+    }
+    logMessage("Starting restore from " + backupDir + " to " + targetDir);
+
+    int threadCount = options.threadCount > 0 ? options.threadCount : 1;
+    WorkerPool pool(threadCount, static_cast<size_t>(threadCount) * 4, &g_restoreStop);
+    std::atomic<uint64_t> files{0}, failed{0}, bytes{0};
+
+    // Packed objects come straight from the sorted index: plain-path includes
+    // are prefix lookups, so restoring one file or subtree is a seek and a read
+    SegmentStore packs(backupDir);
+    if (packs.exists() && packs.open(false)) {
+        std::vector<std::string> prefixes;
+        bool literalOnly = !options.includes.empty() &&
+                           std::none_of(options.includes.begin(), options.includes.end(), hasWildcards);
+        if (literalOnly) {
+            for (const auto &p : options.includes) prefixes.push_back(trimSlashes(p));
+            // forEach("a") already covers "a/b" and "ab"
+            std::sort(prefixes.begin(), prefixes.end());
+            prefixes.erase(std::unique(prefixes.begin(), prefixes.end(),
+                                       [](const std::string &a, const std::string &b) { return b.compare(0, a.size(), a) == 0; }),
+                           prefixes.end());
+        } else {
+            prefixes.push_back("");
+        }
+        for (const auto &prefix : prefixes) {
+            packs.forEach(prefix, [&](const std::string &relative, const PackEntry &) {
+                if (g_restoreStop.load() || !restoreFilterMatches(options, relative)) return;
+                fs::path out = fs::path(targetDir) / relative;
+                pool.submit([relative, out, &packs, &key, &iv, &files, &failed, &bytes]() {
+                    std::error_code ec;
+                    fs::create_directories(out.parent_path(), ec);
+                    if (packs.restoreFile(relative, out.string(), key.data(), iv.data())) {
+                        files++;
+                        bytes += fs::file_size(out, ec);
+                    } else {
+                        failed++;
+                    }
+                });
+            });
+        }
+    }
+
+    // Large files backed up with --delta have a chain to apply after the base
+    bool haveDeltas = DeltaStore(backupDir).exists();
+
+    // Level-synchronous walk: each level's directories are listed in parallel,
+    // and their files are queued for restore before the next level is listed,
+    // so restores start as soon as the first directory has been read.
+    std::vector<std::string> frontier{""};
+    while (!frontier.empty() && !g_restoreStop.load()) {
+        std::vector<std::vector<std::string>> subdirs(frontier.size());
+        std::vector<std::vector<BackupObject>> items(frontier.size());
+        pool.parallelFor(frontier.size(), [&](size_t i) {
+            listBackupDirectory(backupDir, frontier[i], options, subdirs[i], items[i]);
+        });
+
+        for (auto &level : items) {
+            for (auto &item : level) {
+                fs::path out = fs::path(targetDir) / item.relative;
+                std::string object = item.object;
+                std::string relative = haveDeltas && endsWith(object, kObjectSuffix) ? item.relative : std::string();
+                bool queued = pool.submit([object, out, relative, &backupDir, &key, &iv, &files, &failed, &bytes, &pool]() {
+                    // Same backpressure as the backup side: wait for room
+                    // under the memory cap before taking on another file
+                    waitForBufferMemory(2ULL * kContainerChunkSize);
+                    std::error_code ec;
+                    fs::create_directories(out.parent_path(), ec);
+                    if (decryptFileWithKeyBytes(object, out.string(), key.data(), iv.data(), &pool) &&
+                        (relative.empty() || DeltaStore::applyChain(backupDir, relative, out.string(), key.data()))) {
+                        files++;
+                        bytes += fs::file_size(out, ec);
+                    } else {
+                        failed++;
+                        logMessage("Failed to restore " + object);
+                    }
+                });
+                if (!queued) break; // Stop requested
+            }
+        }
+
+        std::vector<std::string> next;
+        for (auto &level : subdirs) next.insert(next.end(), level.begin(), level.end());
+        frontier.swap(next);
+    }
+
+    pool.waitIdle();
+    pool.shutdown(false);
+
+    stats.files = files.load();
+    stats.failed = failed.load();
+    stats.bytes = bytes.load();
+    logMessage("Restore " + std::string(g_restoreStop.load() ? "stopped" : "complete") + ": " +
+               std::to_string(stats.files) + " file(s), " + std::to_string(stats.bytes) + " bytes, " +
+               std::to_string(stats.failed) + " failed");
+    return stats.failed == 0 && !g_restoreStop.load();
+}
@@ -0,0 +1,596 @@
+#include "segmentstore.h"
+#include "bufferpool.h"
+#include "codec.h"
+#include "fingerprint.h"
+#include "logger.h"
+#include "metrics.h"
+#include "fileio.h"
+#include "qos.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+
+namespace fs = std::filesystem;
+
+static const char kPackDirName[] = ".abt_packs";
+static const char kPackIndexName[] = "index";
+// Records from before per-record nonces: gzip+AES-256-CTR under the session IV
+static const char kRecordMagicCtr[4] = {'A', 'B', 'T', 'P'};
+// nonce || gzip sealed with AES-256-GCM, the path as associated data || tag
+static const char kRecordMagic[4] = {'A', 'B', 'T', 'G'};
+static const size_t kGcmNonceSize = 12;
+static const size_t kGcmTagSize = 16;
+static const char kIndexMagic[8] = {'A', 'B', 'T', 'P', 'I', 'D', 'X', '1'};
+
+struct PackRecordHeader {
+    char magic[4];
+    uint32_t pathLen;
+    uint64_t dataLen;
+};
+
+struct PackIndexHeader {
+    char magic[8];
+    uint32_t segmentCount;
+    uint32_t reserved;
+    uint64_t entryCount;
+};
+
+struct PackIndexSegment {
+    uint32_t id;
+    uint32_t reserved;
+    uint64_t size;
+};
+
+struct PackIndexEntry {
+    uint32_t segment;
+    uint32_t pathLen;
+    uint64_t offset;
+    uint64_t length;
+};
+
+static uint64_t recordSize(const std::string &relativePath, uint64_t dataLen) {
+    return sizeof(PackRecordHeader) + relativePath.size() + dataLen;
+}
+
+static bool writeAllFd(int fd, const void *data, size_t len) {
+    const char *p = static_cast<const char *>(data);
+    while (len > 0) {
+        ssize_t n = ::write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool preadAll(int fd, void *data, size_t len, uint64_t offset) {
+    char *p = static_cast<char *>(data);
+    while (len > 0) {
+        ssize_t n = ::pread(fd, p, len, static_cast<off_t>(offset));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= static_cast<size_t>(n);
+        offset += static_cast<uint64_t>(n);
+    }
+    return true;
+}
+
+static bool isRecordMagic(const char *magic) {
+    return std::memcmp(magic, kRecordMagic, sizeof(kRecordMagic)) == 0 ||
+           std::memcmp(magic, kRecordMagicCtr, sizeof(kRecordMagicCtr)) == 0;
+}
+
+// gzip (the same stream EncryptedGzipWriter produces) then AES-256-GCM under
+// a random nonce, in memory. Binding the path means a record copied under
+// another name does not open.
+static bool sealObject(const std::string &plain, int level, const unsigned char *key,
+                       const std::string &relativePath, std::string &out) {
+    DeflateStream zs;
+    if (!zs.begin(level, MAX_WBITS + 16)) return false;
+    size_t room = deflateBound(zs.get(), static_cast<uLong>(plain.size())) + 32;
+    PoolBuffer gz(room);
+    zs->next_in = reinterpret_cast<Bytef *>(const_cast<char *>(plain.data()));
+    zs->avail_in = static_cast<uInt>(plain.size());
+    zs->next_out = gz.data();
+    zs->avail_out = static_cast<uInt>(room);
+    int64_t start = metricsNowNs();
+    int ret = deflate(zs.get(), Z_FINISH);
+    if (ret != Z_STREAM_END) return false;
+    size_t gzLen = room - zs->avail_out;
+    recordStage(kStageDeflate, plain.size(), start);
+
+    start = metricsNowNs();
+    CipherContext cipher;
+    if (!cipher.begin()) return false;
+    EVP_CIPHER_CTX *ctx = cipher.get();
+    out.resize(kGcmNonceSize + gzLen + kGcmTagSize);
+    unsigned char *nonce = reinterpret_cast<unsigned char *>(&out[0]);
+    unsigned char *payload = nonce + kGcmNonceSize;
+    unsigned char tail[EVP_MAX_BLOCK_LENGTH];
+    int len = 0;
+    bool ok = RAND_bytes(nonce, static_cast<int>(kGcmNonceSize)) == 1 &&
+              EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key, nonce) == 1 &&
+              EVP_EncryptUpdate(ctx, nullptr, &len, reinterpret_cast<const unsigned char *>(relativePath.data()),
+                                static_cast<int>(relativePath.size())) == 1 &&
+              EVP_EncryptUpdate(ctx, payload, &len, gz.data(), static_cast<int>(gzLen)) == 1 &&
+              EVP_EncryptFinal_ex(ctx, tail, &len) == 1 &&
+              EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, static_cast<int>(kGcmTagSize), payload + gzLen) == 1;
+    if (ok) recordStage(kStageEncrypt, gzLen, start);
+    return ok;
+}
+
+// `gcm` tells a kRecordMagic record from a kRecordMagicCtr one
+static bool openObject(const std::string &object, bool gcm, const std::string &relativePath,
+                       const unsigned char *key, const unsigned char *iv,
+                       const std::function<bool(const unsigned char *, size_t)> &sink) {
+    const size_t kInflateBufSize = 1 << 16;
+    if (gcm && object.size() < kGcmNonceSize + kGcmTagSize) return false;
+    const unsigned char *data = reinterpret_cast<const unsigned char *>(object.data());
+    size_t dataLen = gcm ? object.size() - kGcmNonceSize - kGcmTagSize : object.size();
+    PoolBuffer gz(dataLen);
+    CipherContext cipher;
+    if (!cipher.begin()) return false;
+    EVP_CIPHER_CTX *ctx = cipher.get();
+    unsigned char tail[EVP_MAX_BLOCK_LENGTH];
+    int outLen = 0, len = 0;
+    bool ok;
+    if (gcm) {
+        const unsigned char *nonce = data;
+        unsigned char *tag = const_cast<unsigned char *>(data + kGcmNonceSize + dataLen);
+        ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), nullptr, key, nonce) == 1 &&
+             EVP_DecryptUpdate(ctx, nullptr, &len, reinterpret_cast<const unsigned char *>(relativePath.data()),
+                               static_cast<int>(relativePath.size())) == 1 &&
+             EVP_DecryptUpdate(ctx, gz.data(), &outLen, data + kGcmNonceSize, static_cast<int>(dataLen)) == 1 &&
+             EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, static_cast<int>(kGcmTagSize), tag) == 1 &&
+             EVP_DecryptFinal_ex(ctx, tail, &len) == 1;
+    } else {
+        ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_ctr(), nullptr, key, iv) == 1 &&
+             EVP_DecryptUpdate(ctx, gz.data(), &outLen, data, static_cast<int>(dataLen)) == 1;
+    }
+    if (!ok) return false;
+
+    InflateStream zs;
+    if (!zs.begin(MAX_WBITS + 32)) return false;
+    zs->next_in = gz.data();
+    zs->avail_in = static_cast<uInt>(outLen);
+    PoolBuffer buf(kInflateBufSize);
+    int ret;
+    do {
+        zs->next_out = buf.data();
+        zs->avail_out = static_cast<uInt>(kInflateBufSize);
+        ret = inflate(zs.get(), Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) break;
+        if (!sink(buf.data(), kInflateBufSize - zs->avail_out)) return false;
+    } while (ret != Z_STREAM_END);
+    return ret == Z_STREAM_END;
+}
+
+SegmentStore::SegmentStore(const std::string &destDir)
+    : m_root((fs::path(destDir) / kPackDirName).string()),
+      m_indexPath((fs::path(destDir) / kPackDirName / kPackIndexName).string()) {}
+
+SegmentStore::~SegmentStore() {
+    if (m_activeFd >= 0) close(m_activeFd);
+}
+
+std::string SegmentStore::segmentPath(uint32_t id) const {
+    char name[32];
+    std::snprintf(name, sizeof(name), "seg-%06u.pack", id);
+    return (fs::path(m_root) / name).string();
+}
+
+bool SegmentStore::exists() const {
+    return fs::is_directory(m_root);
+}
+
+bool SegmentStore::open(bool forWriting) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (forWriting) {
+        std::error_code ec;
+        fs::create_directories(m_root, ec);
+        if (ec) {
+            logMessage("Failed to create pack store: " + m_root);
+            return false;
+        }
+    }
+
+    loadIndex();
+
+    // Pick up segments written after the last index save, and anything
+    // appended to known segments since then
+    std::error_code ec;
+    for (fs::directory_iterator it(m_root, ec), end; !ec && it != end; it.increment(ec)) {
+        unsigned id = 0;
+        if (std::sscanf(it->path().filename().c_str(), "seg-%u.pack", &id) != 1) continue;
+        uint64_t onDisk = it->file_size(ec);
+        auto known = m_segments.find(id);
+        uint64_t from = known == m_segments.end() ? 0 : known->second.size;
+        if (onDisk > from) scanSegment(id, from, forWriting);
+    }
+
+    // Live bytes follow from the entries
+    for (auto &seg : m_segments) seg.second.live = 0;
+    for (const auto &e : m_entries) {
+        auto seg = m_segments.find(e.second.segment);
+        if (seg != m_segments.end()) seg->second.live += recordSize(e.first, e.second.length);
+    }
+    m_active = m_segments.empty() ? 1 : m_segments.rbegin()->first;
+    logMessage("Pack store has " + std::to_string(m_entries.size()) + " objects in " +
+               std::to_string(m_segments.size()) + " segment(s)");
+    return true;
+}
+
+bool SegmentStore::loadIndex() {
+    std::ifstream in(m_indexPath, std::ios::binary);
+    if (!in.is_open()) return false;
+
+    PackIndexHeader header;
+    if (!in.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+        std::memcmp(header.magic, kIndexMagic, sizeof(kIndexMagic)) != 0) {
+        logMessage("Ignoring unreadable pack index: " + m_indexPath);
+        return false;
+    }
+    for (uint32_t i = 0; i < header.segmentCount; ++i) {
+        PackIndexSegment seg;
+        if (!in.read(reinterpret_cast<char *>(&seg), sizeof(seg))) return false;
+        m_segments[seg.id].size = seg.size;
+    }
+    // Entries are stored in path order, so hinted inserts keep this linear
+    std::string path;
+    for (uint64_t i = 0; i < header.entryCount; ++i) {
+        PackIndexEntry e;
+        if (!in.read(reinterpret_cast<char *>(&e), sizeof(e))) return false;
+        path.resize(e.pathLen);
+        if (!in.read(&path[0], e.pathLen)) return false;
+        m_entries.emplace_hint(m_entries.end(), path, PackEntry{e.segment, e.offset, e.length});
+    }
+    return true;
+}
+
+// Caller holds m_mutex
+bool SegmentStore::scanSegment(uint32_t id, uint64_t from, bool trimTorn) {
+    std::string path = segmentPath(id);
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    struct stat st{};
+    fstat(fd, &st);
+    uint64_t end = static_cast<uint64_t>(st.st_size);
+
+    uint64_t pos = from;
+    std::string relative;
+    while (pos + sizeof(PackRecordHeader) <= end) {
+        PackRecordHeader h;
+        if (!preadAll(fd, &h, sizeof(h), pos) || !isRecordMagic(h.magic)) break;
+        uint64_t next = pos + sizeof(h) + h.pathLen + h.dataLen;
+        if (next > end) break;
+        relative.resize(h.pathLen);
+        if (!preadAll(fd, &relative[0], h.pathLen, pos + sizeof(h))) break;
+        m_entries[relative] = PackEntry{id, pos + sizeof(h) + h.pathLen, h.dataLen};
+        pos = next;
+    }
+    close(fd);
+
+    if (pos < end) {
+        logMessage("Pack segment " + path + " has a torn record at offset " + std::to_string(pos));
+        if (trimTorn && ::truncate(path.c_str(), static_cast<off_t>(pos)) != 0) {
+            logMessage("Failed to trim " + path);
+        }
+    }
+    m_segments[id].size = pos;
+    m_dirty = true;
+    return true;
+}
+
+bool SegmentStore::saveIndex() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (!m_dirty) return true;
+    if (m_activeFd >= 0) fdatasync(m_activeFd);   // Never index bytes that may not be on disk
+
+    std::string tmp = m_indexPath + ".tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    if (!out.is_open()) return false;
+
+    PackIndexHeader header{};
+    std::memcpy(header.magic, kIndexMagic, sizeof(kIndexMagic));
+    header.segmentCount = static_cast<uint32_t>(m_segments.size());
+    header.entryCount = m_entries.size();
+    out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+    for (const auto &seg : m_segments) {
+        PackIndexSegment s{seg.first, 0, seg.second.size};
+        out.write(reinterpret_cast<const char *>(&s), sizeof(s));
+    }
+    for (const auto &e : m_entries) {
+        PackIndexEntry rec{e.second.segment, static_cast<uint32_t>(e.first.size()), e.second.offset, e.second.length};
+        out.write(reinterpret_cast<const char *>(&rec), sizeof(rec));
+        out.write(e.first.data(), static_cast<std::streamsize>(e.first.size()));
+    }
+    out.close();
+    if (out.fail() || std::rename(tmp.c_str(), m_indexPath.c_str()) != 0) {
+        std::remove(tmp.c_str());
+        logMessage("Failed to save pack index: " + m_indexPath);
+        return false;
+    }
+    m_dirty = false;
+    return true;
+}
+
+// Caller holds m_mutex
+void SegmentStore::setEntry(const std::string &relativePath, const PackEntry &entry) {
+    auto it = m_entries.find(relativePath);
+    if (it != m_entries.end()) {
+        auto seg = m_segments.find(it->second.segment);
+        if (seg != m_segments.end()) seg->second.live -= recordSize(relativePath, it->second.length);
+        it->second = entry;
+    } else {
+        m_entries.emplace(relativePath, entry);
+    }
+    m_segments[entry.segment].live += recordSize(relativePath, entry.length);
+    m_dirty = true;
+}
+
+// Caller holds m_mutex
+bool SegmentStore::appendRecord(const std::string &relativePath, const std::string &object, bool gcm) {
+    SegmentInfo &active = m_segments[m_active];
+    if (m_activeFd >= 0 && active.size >= kSegmentTargetSize) {
+        fdatasync(m_activeFd);
+        close(m_activeFd);
+        m_activeFd = -1;
+        ++m_active;
+    }
+    if (m_activeFd < 0) {
+        m_activeFd = ::open(segmentPath(m_active).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+        if (m_activeFd < 0) {
+            logMessage("Failed to open pack segment " + segmentPath(m_active));
+            return false;
+        }
+        // Start at our own idea of the end, which drops any torn tail
+        if (::ftruncate(m_activeFd, static_cast<off_t>(m_segments[m_active].size)) != 0 ||
+            ::lseek(m_activeFd, static_cast<off_t>(m_segments[m_active].size), SEEK_SET) < 0) {
+            close(m_activeFd);
+            m_activeFd = -1;
+            return false;
+        }
+    }
+
+    SegmentInfo &seg = m_segments[m_active];
+    PackRecordHeader h;
+    std::memcpy(h.magic, gcm ? kRecordMagic : kRecordMagicCtr, sizeof(h.magic));
+    h.pathLen = static_cast<uint32_t>(relativePath.size());
+    h.dataLen = object.size();
+
+    std::string record(reinterpret_cast<const char *>(&h), sizeof(h));
+    record += relativePath;
+    record += object;
+    int64_t start = metricsNowNs();
+    if (!writeAllFd(m_activeFd, record.data(), record.size())) {
+        logMessage("Failed to append to pack segment " + segmentPath(m_active));
+        // Put the file position back so the next record is not misaligned
+        if (::ftruncate(m_activeFd, static_cast<off_t>(seg.size)) != 0 ||
+            ::lseek(m_activeFd, static_cast<off_t>(seg.size), SEEK_SET) < 0) {
+            close(m_activeFd);
+            m_activeFd = -1;
+        }
+        return false;
+    }
+    recordStage(kStageWrite, record.size(), start);
+    metrics().bytesStored.fetch_add(record.size(), std::memory_order_relaxed);
+
+    PackEntry entry{m_active, seg.size + sizeof(h) + relativePath.size(), object.size()};
+    seg.size += record.size();
+    setEntry(relativePath, entry);
+    return true;
+}
+
+bool SegmentStore::storeFile(const std::string &srcPath, const std::string &relativePath,
+                             const CompressionPolicy &policy, const unsigned char *key, uint64_t *fingerprint) {
+    SourceReader in;
+    if (!in.open(srcPath)) {
+        logMessage(in.error());
+        return false;
+    }
+    std::string plain(in.size(), '\0');
+    long got = plain.empty() ? 0 : in.read(&plain[0], plain.size());
+    if (got < 0) {
+        logMessage(in.error());
+        return false;
+    }
+    plain.resize(static_cast<size_t>(got));
+    if (fingerprint) {
+        ContentHasher hasher;
+        hasher.update(reinterpret_cast<const unsigned char *>(plain.data()), plain.size());
+        *fingerprint = hasher.digest();
+    }
+
+    size_t sample = plain.size() < kCompressionSampleSize ? plain.size() : kCompressionSampleSize;
+    int level = chooseCompressionLevel(reinterpret_cast<const unsigned char *>(plain.data()), sample, policy);
+    std::string object;
+    if (!sealObject(plain, level, key, relativePath, object)) {
+        logMessage("Compression/encryption failed: " + srcPath);
+        return false;
+    }
+
+    // Outside the lock, so a capped writer does not hold up the others
+    throttleWrite(object.size());
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return appendRecord(relativePath, object, true);
+}
+
+void SegmentStore::remove(const std::string &relativePath) {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_entries.find(relativePath);
+    if (it == m_entries.end()) return;
+    auto seg = m_segments.find(it->second.segment);
+    if (seg != m_segments.end()) seg->second.live -= recordSize(relativePath, it->second.length);
+    m_entries.erase(it);
+    m_dirty = true;
+}
+
+bool SegmentStore::find(const std::string &relativePath, PackEntry &out) const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    auto it = m_entries.find(relativePath);
+    if (it == m_entries.end()) return false;
+    out = it->second;
+    return true;
+}
+
+void SegmentStore::forEach(const std::string &prefix,
+                           const std::function<void(const std::string &, const PackEntry &)> &fn) const {
+    std::vector<std::pair<std::string, PackEntry>> matches;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (auto it = m_entries.lower_bound(prefix);
+             it != m_entries.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it) {
+            matches.emplace_back(it->first, it->second);
+        }
+    }
+    for (const auto &m : matches) fn(m.first, m.second);
+}
+
+bool SegmentStore::readObject(const std::string &relativePath, const PackEntry &entry, std::string &out,
+                              bool &gcm) const {
+    // Header, path and object in one read; the header says how it is sealed
+    size_t prefix = sizeof(PackRecordHeader) + relativePath.size();
+    if (entry.offset < prefix) return false;
+    int fd = ::open(segmentPath(entry.segment).c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    out.resize(prefix + entry.length);
+    bool ok = preadAll(fd, &out[0], out.size(), entry.offset - prefix);
+    close(fd);
+    PackRecordHeader h;
+    std::memcpy(&h, out.data(), sizeof(h));
+    ok = ok && isRecordMagic(h.magic) && h.pathLen == relativePath.size() && h.dataLen == entry.length &&
+         out.compare(sizeof(h), relativePath.size(), relativePath) == 0;
+    gcm = std::memcmp(h.magic, kRecordMagic, sizeof(kRecordMagic)) == 0;
+    out.erase(0, prefix);
+    return ok;
+}
+
+bool SegmentStore::restoreFile(const std::string &relativePath, const std::string &outPath,
+                               const unsigned char *key, const unsigned char *iv) const {
+    PackEntry entry;
+    std::string object;
+    bool gcm = false;
+    if (!find(relativePath, entry) || !readObject(relativePath, entry, object, gcm)) {
+        logMessage("Packed object not found or unreadable: " + relativePath);
+        return false;
+    }
+    std::ofstream out(outPath, std::ios::binary | std::ios::trunc);
+    auto write = [&out](const unsigned char *data, size_t len) {
+        out.write(reinterpret_cast<const char *>(data), static_cast<std::streamsize>(len));
+        return static_cast<bool>(out);
+    };
+    if (!out.is_open() || !openObject(object, gcm, relativePath, key, iv, write)) {
+        out.close();
+        std::remove(outPath.c_str());
+        logMessage("Failed to restore packed object " + relativePath);
+        return false;
+    }
+    return true;
+}
+
+bool SegmentStore::readFile(const std::string &relativePath, const unsigned char *key, const unsigned char *iv,
+                            const std::function<bool(const unsigned char *, size_t)> &sink) const {
+    PackEntry entry;
+    std::string object;
+    bool gcm = false;
+    if (!find(relativePath, entry) || !readObject(relativePath, entry, object, gcm)) {
+        logMessage("Packed object not found or unreadable: " + relativePath);
+        return false;
+    }
+    if (!openObject(object, gcm, relativePath, key, iv, sink)) {
+        logMessage("Failed to read packed object " + relativePath);
+        return false;
+    }
+    return true;
+}
+
+bool SegmentStore::seal() {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_activeFd >= 0) {
+        if (fdatasync(m_activeFd) != 0) return false;
+        close(m_activeFd);
+        m_activeFd = -1;
+    }
+    auto active = m_segments.find(m_active);
+    if (active == m_segments.end() || active->second.size == 0) return true;
+    // Listed in the index with size 0, so the next open() appends there
+    ++m_active;
+    m_segments[m_active];
+    m_dirty = true;
+    return true;
+}
+
+bool SegmentStore::compact() {
+    std::vector<uint32_t> victims;
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (const auto &seg : m_segments) {
+            if (seg.first == m_active || seg.second.size == 0) continue;
+            if (static_cast<double>(seg.second.live) < kSegmentCompactLiveRatio * static_cast<double>(seg.second.size)) {
+                victims.push_back(seg.first);
+            }
+        }
+    }
+    if (victims.empty()) return true;
+
+    for (uint32_t victim : victims) {
+        // Objects are copied as-is: already compressed and encrypted
+        std::vector<std::pair<std::string, PackEntry>> live;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (const auto &e : m_entries) {
+                if (e.second.segment == victim) live.emplace_back(e.first, e.second);
+            }
+        }
+        uint64_t moved = 0;
+        for (const auto &e : live) {
+            std::string object;
+            bool gcm = false;
+            if (!readObject(e.first, e.second, object, gcm)) {
+                logMessage("Compaction could not read " + e.first + ", keeping " + segmentPath(victim));
+                return false;
+            }
+            throttleWrite(object.size());
+            std::lock_guard<std::mutex> lock(m_mutex);
+            auto current = m_entries.find(e.first);
+            // Skip objects replaced while we were copying
+            if (current == m_entries.end() || current->second.segment != victim ||
+                current->second.offset != e.second.offset) {
+                continue;
+            }
+            if (!appendRecord(e.first, object, gcm)) return false;
+            moved += object.size();
+        }
+
+        // The index must point at the copies before the old segment goes
+        if (!saveIndex()) return false;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_segments[victim].live != 0) continue; // Something new landed there; try next time
+        std::remove(segmentPath(victim).c_str());
+        uint64_t reclaimed = m_segments[victim].size - moved;
+        m_segments.erase(victim);
+        m_dirty = true;
+        logMessage("Compacted pack segment " + std::to_string(victim) + ", reclaimed " +
+                   std::to_string(reclaimed) + " bytes");
+    }
+    return saveIndex();
+}
+
+size_t SegmentStore::size() const {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_entries.size();
+}
@@ -0,0 +1,372 @@
+#include "snapshot.h"
+#include "fileio.h"
+#include "logger.h"
+#include "segmentstore.h"
+#include "walker.h"
+#include "workpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <filesystem>
+#include <fstream>
+#include <set>
+#include <unistd.h>
+#include <sys/stat.h>
+
+namespace fs = std::filesystem;
+
+static const char kSnapshotDirName[] = ".abt_snapshots";
+static const char kSnapshotInfoName[] = ".abt_snapshot";
+// Snapshots being built or deleted; anything left with these prefixes is
+// garbage from an interrupted run
+static const std::string kBuildingPrefix = ".building-";
+static const std::string kDeletingPrefix = ".deleting-";
+// Files linked or unlinked per parallelFor job
+static const size_t kSnapshotBatch = 1024;
+
+static bool endsWith(const std::string &s, const std::string &suffix) {
+    return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+static fs::path snapshotRoot(const std::string &destDir) {
+    return fs::path(destDir) / kSnapshotDirName;
+}
+
+static bool validName(const std::string &name) {
+    return !name.empty() && name[0] != '.' && name.find('/') == std::string::npos;
+}
+
+// What a snapshot leaves out: the snapshots themselves, per-run state and
+// temporaries, and the chunk indexes, which only dedup writes read
+static bool skipEntry(const std::string &dir, const std::string &name) {
+    if (dir.empty() && (name == kSnapshotDirName || name == ".abt_journal" || name == ".abt_stop")) return true;
+    if ((dir == ".abt_chunks" || dir.compare(0, 12, ".abt_chunks/") == 0) && name == "index") return true;
+    return endsWith(name, kObjectTempSuffix) || endsWith(name, ".tmp");
+}
+
+std::string defaultSnapshotName() {
+    std::time_t now = std::time(nullptr);
+    std::tm local{};
+    localtime_r(&now, &local);
+    char name[32];
+    std::strftime(name, sizeof(name), "%Y%m%d-%H%M%S", &local);
+    return name;
+}
+
+namespace {
+
+struct LevelFile {
+    std::string relative;
+    uint64_t size;
+};
+
+} // namespace
+
+// List one level of directories in parallel: regular files into `files`,
+// subdirectories into `next`
+static void listLevel(WorkerPool &pool, const fs::path &root, const std::vector<std::string> &frontier, bool filter,
+                      std::vector<LevelFile> &files, std::vector<std::string> &next, std::atomic<uint64_t> &errors) {
+    std::vector<std::vector<LevelFile>> levelFiles(frontier.size());
+    std::vector<std::vector<std::string>> subdirs(frontier.size());
+    pool.parallelFor(frontier.size(), [&](size_t i) {
+        const std::string &dir = frontier[i];
+        std::error_code ec;
+        fs::directory_iterator it(dir.empty() ? root : root / dir, ec), end;
+        if (ec) {
+            logMessage("Failed to list " + (root / dir).string() + ": " + ec.message());
+            errors++;
+            return;
+        }
+        for (; it != end; it.increment(ec)) {
+            if (ec) break;
+            std::string name = it->path().filename().string();
+            if (filter && skipEntry(dir, name)) continue;
+            std::string relative = dir.empty() ? name : dir + "/" + name;
+            if (it->is_symlink(ec)) {
+                // Never linked into a snapshot, but removed with one
+                if (!filter) levelFiles[i].push_back({relative, 0});
+                continue;
+            }
+            if (it->is_directory(ec)) {
+                subdirs[i].push_back(relative);
+            } else if (it->is_regular_file(ec)) {
+                uint64_t size = it->file_size(ec);
+                levelFiles[i].push_back({relative, ec ? 0 : size});
+            }
+        }
+    });
+    for (auto &level : levelFiles) files.insert(files.end(), level.begin(), level.end());
+    for (auto &level : subdirs) next.insert(next.end(), level.begin(), level.end());
+}
+
+static int snapshotThreads(int threads) {
+    return threads > 0 ? threads : defaultWalkThreads();
+}
+
+bool createSnapshot(const std::string &destDir, const std::string &name, int threads, SnapshotInfo &info) {
+    if (!validName(name)) {
+        logMessage("Invalid snapshot name: " + name);
+        return false;
+    }
+    fs::path root(destDir);
+    fs::path target = snapshotRoot(destDir) / name;
+    fs::path building = snapshotRoot(destDir) / (kBuildingPrefix + name);
+    std::error_code ec;
+    if (!fs::is_directory(root)) {
+        logMessage("Backup directory does not exist: " + destDir);
+        return false;
+    }
+    if (fs::exists(target, ec)) {
+        logMessage("Snapshot already exists: " + name);
+        return false;
+    }
+    int64_t started = static_cast<int64_t>(std::time(nullptr));
+
+    // Pack segments are the one thing appended to in place; later records
+    // go to a new segment so the linked ones stay as they are now
+    SegmentStore packs(destDir);
+    if (packs.exists() && !(packs.open(true) && packs.seal() && packs.saveIndex())) {
+        logMessage("Failed to seal the pack store for snapshot " + name);
+        return false;
+    }
+
+    fs::remove_all(building, ec);
+    fs::create_directories(building, ec);
+    if (ec) {
+        logMessage("Failed to create " + building.string() + ": " + ec.message());
+        return false;
+    }
+
+    int threadCount = snapshotThreads(threads);
+    WorkerPool pool(threadCount, static_cast<size_t>(threadCount) * 4);
+    std::atomic<uint64_t> objects{0}, bytes{0}, copied{0}, errors{0};
+
+    // Level by level: each level's directories are made, then its files are
+    // linked in batches on every worker so one huge directory is not left
+    // to a single thread
+    std::vector<std::string> frontier{""};
+    while (!frontier.empty() && errors.load() == 0) {
+        std::vector<LevelFile> files;
+        std::vector<std::string> next;
+        listLevel(pool, root, frontier, true, files, next, errors);
+        for (const auto &dir : next) {
+            if (::mkdir((building / dir).c_str(), 0755) != 0 && errno != EEXIST) {
+                logMessage("Failed to create " + (building / dir).string() + ": " + std::strerror(errno));
+                errors++;
+            }
+        }
+
+        size_t batches = (files.size() + kSnapshotBatch - 1) / kSnapshotBatch;
+        pool.parallelFor(batches, [&](size_t b) {
+            size_t end = std::min(files.size(), (b + 1) * kSnapshotBatch);
+            for (size_t i = b * kSnapshotBatch; i < end; ++i) {
+                fs::path from = root / files[i].relative, to = building / files[i].relative;
+                if (::link(from.c_str(), to.c_str()) != 0) {
+                    // No hard links here (or across this mount): fall back to a copy
+                    std::error_code copyError;
+                    if (errno != EXDEV && errno != EPERM && errno != ENOTSUP) {
+                        logMessage("Failed to link " + from.string() + ": " + std::strerror(errno));
+                        errors++;
+                        continue;
+                    }
+                    if (!fs::copy_file(from, to, copyError)) {
+                        logMessage("Failed to copy " + from.string() + ": " + copyError.message());
+                        errors++;
+                        continue;
+                    }
+                    copied++;
+                }
+                objects++;
+                bytes += files[i].size;
+            }
+        });
+        frontier.swap(next);
+    }
+    pool.shutdown();
+
+    if (errors.load() == 0) {
+        std::ofstream out(building / kSnapshotInfoName, std::ios::trunc);
+        out << "created=" << started << "\nobjects=" << objects.load() << "\nbytes=" << bytes.load() << "\n";
+        out.close();
+        if (out.fail()) errors++;
+    }
+    if (errors.load() != 0 || std::rename(building.c_str(), target.c_str()) != 0) {
+        logMessage("Snapshot " + name + " failed; removing the partial copy");
+        fs::remove_all(building, ec);
+        return false;
+    }
+
+    info.name = name;
+    info.created = started;
+    info.objects = objects.load();
+    info.bytes = bytes.load();
+    logMessage("Snapshot " + name + ": " + std::to_string(info.objects) + " object(s), " +
+               std::to_string(info.bytes) + " bytes" +
+               (copied.load() ? ", " + std::to_string(copied.load()) + " copied for lack of hard links" : std::string()));
+    return true;
+}
+
+static bool readInfo(const fs::path &dir, SnapshotInfo &info) {
+    std::ifstream in(dir / kSnapshotInfoName);
+    if (!in.is_open()) return false;
+    std::string line;
+    while (std::getline(in, line)) {
+        auto eq = line.find('=');
+        if (eq == std::string::npos) continue;
+        std::string key = line.substr(0, eq);
+        try {
+            if (key == "created") info.created = std::stoll(line.substr(eq + 1));
+            else if (key == "objects") info.objects = std::stoull(line.substr(eq + 1));
+            else if (key == "bytes") info.bytes = std::stoull(line.substr(eq + 1));
+        } catch (...) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool listSnapshots(const std::string &destDir, std::vector<SnapshotInfo> &out) {
+    out.clear();
+    std::error_code ec;
+    fs::directory_iterator it(snapshotRoot(destDir), ec), end;
+    if (ec) return ec == std::errc::no_such_file_or_directory;
+    for (; it != end; it.increment(ec)) {
+        if (ec) return false;
+        std::string name = it->path().filename().string();
+        if (!validName(name) || !it->is_directory(ec)) continue;
+        SnapshotInfo info;
+        info.name = name;
+        if (!readInfo(it->path(), info)) {
+            logMessage("Snapshot " + name + " has no readable " + kSnapshotInfoName + ", skipping it");
+            continue;
+        }
+        out.push_back(info);
+    }
+    std::sort(out.begin(), out.end(), [](const SnapshotInfo &a, const SnapshotInfo &b) {
+        return a.created != b.created ? a.created < b.created : a.name < b.name;
+    });
+    return true;
+}
+
+// Unlink everything under `dir`, counting the objects whose last link this was
+static bool removeTree(const fs::path &dir, int threads, PruneStats &stats) {
+    int threadCount = snapshotThreads(threads);
+    WorkerPool pool(threadCount, static_cast<size_t>(threadCount) * 4);
+    std::atomic<uint64_t> freed{0}, freedBytes{0}, errors{0};
+    std::vector<std::string> dirs;
+    std::vector<std::string> frontier{""};
+    while (!frontier.empty()) {
+        std::vector<LevelFile> files;
+        std::vector<std::string> next;
+        listLevel(pool, dir, frontier, false, files, next, errors);
+        size_t batches = (files.size() + kSnapshotBatch - 1) / kSnapshotBatch;
+        pool.parallelFor(batches, [&](size_t b) {
+            size_t end = std::min(files.size(), (b + 1) * kSnapshotBatch);
+            for (size_t i = b * kSnapshotBatch; i < end; ++i) {
+                fs::path path = dir / files[i].relative;
+                struct stat st{};
+                bool last = ::lstat(path.c_str(), &st) == 0 && st.st_nlink == 1;
+                if (::unlink(path.c_str()) != 0) {
+                    errors++;
+                    continue;
+                }
+                if (last) {
+                    freed++;
+                    freedBytes += static_cast<uint64_t>(st.st_blocks) * 512;
+                }
+            }
+        });
+        dirs.insert(dirs.end(), next.begin(), next.end());
+        frontier.swap(next);
+    }
+    pool.shutdown();
+
+    // Deepest first
+    for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+        if (::rmdir((dir / *it).c_str()) != 0) errors++;
+    }
+    if (::rmdir(dir.c_str()) != 0) errors++;
+    stats.filesFreed += freed.load();
+    stats.bytesFreed += freedBytes.load();
+    if (errors.load() != 0) logMessage("Could not remove everything under " + dir.string());
+    return errors.load() == 0;
+}
+
+bool deleteSnapshot(const std::string &destDir, const std::string &name, int threads, PruneStats &stats) {
+    if (!validName(name)) {
+        logMessage("Invalid snapshot name: " + name);
+        return false;
+    }
+    // Renamed away first, so a half-deleted snapshot is never listed
+    fs::path dir = snapshotRoot(destDir) / name;
+    fs::path deleting = snapshotRoot(destDir) / (kDeletingPrefix + name);
+    if (std::rename(dir.c_str(), deleting.c_str()) != 0) {
+        logMessage("No snapshot named " + name + " in " + destDir);
+        return false;
+    }
+    uint64_t before = stats.bytesFreed;
+    bool ok = removeTree(deleting, threads, stats);
+    stats.snapshots++;
+    logMessage("Deleted snapshot " + name + ", " + std::to_string(stats.bytesFreed - before) + " bytes freed");
+    return ok;
+}
+
+// Newest snapshot of each of the `count` most recent periods that have one;
+// `format` is the strftime key of a period
+static void keepPerPeriod(const std::vector<SnapshotInfo> &newestFirst, int count, const char *format,
+                          std::set<std::string> &keep) {
+    std::string last;
+    for (const auto &s : newestFirst) {
+        if (count <= 0) break;
+        std::time_t t = static_cast<std::time_t>(s.created);
+        std::tm local{};
+        localtime_r(&t, &local);
+        char period[32];
+        std::strftime(period, sizeof(period), format, &local);
+        if (last == period) continue;
+        last = period;
+        keep.insert(s.name);
+        --count;
+    }
+}
+
+bool pruneSnapshots(const std::string &destDir, const RetentionPolicy &policy, int threads, PruneStats &stats) {
+    bool ok = true;
+
+    // Garbage from creates and deletes that did not finish
+    std::error_code ec;
+    std::vector<fs::path> leftovers;
+    for (fs::directory_iterator it(snapshotRoot(destDir), ec), end; !ec && it != end; it.increment(ec)) {
+        std::string name = it->path().filename().string();
+        if (name.compare(0, kBuildingPrefix.size(), kBuildingPrefix) == 0 ||
+            name.compare(0, kDeletingPrefix.size(), kDeletingPrefix) == 0) {
+            leftovers.push_back(it->path());
+        }
+    }
+    for (const auto &path : leftovers) {
+        logMessage("Removing unfinished snapshot " + path.filename().string());
+        ok = removeTree(path, threads, stats) && ok;
+    }
+    if (policy.empty()) return ok;
+
+    std::vector<SnapshotInfo> snapshots;
+    if (!listSnapshots(destDir, snapshots)) return false;
+    std::vector<SnapshotInfo> newestFirst(snapshots.rbegin(), snapshots.rend());
+
+    std::set<std::string> keep;
+    for (int i = 0; i < policy.keepLast && i < static_cast<int>(newestFirst.size()); ++i) keep.insert(newestFirst[i].name);
+    keepPerPeriod(newestFirst, policy.keepDaily, "%Y%m%d", keep);
+    keepPerPeriod(newestFirst, policy.keepWeekly, "%G%V", keep);
+
+    for (const auto &s : snapshots) {
+        if (keep.count(s.name)) continue;
+        ok = deleteSnapshot(destDir, s.name, threads, stats) && ok;
+    }
+    logMessage("Pruned " + std::to_string(stats.snapshots) + " snapshot(s), kept " + std::to_string(keep.size()) +
+               "; " + std::to_string(stats.filesFreed) + " object(s) and " + std::to_string(stats.bytesFreed) +
+               " bytes no longer referenced were freed");
+    return ok;
+}
@@ -0,0 +1,243 @@
+#include "verify.h"
+#include "bufferpool.h"
+#include "container.h"
+#include "delta.h"
+#include "encrypt.h"
+#include "fingerprint.h"
+#include "logger.h"
+#include "manifest.h"
+#include "restore.h"
+#include "segmentstore.h"
+#include "workpool.h"
+
+#include <atomic>
+#include <chrono>
+#include <filesystem>
+#include <unordered_set>
+
+namespace fs = std::filesystem;
+
+static const std::string kObjectSuffix = ".gz.enc";
+
+static std::atomic<bool> g_verifyStop{false};
+
+void requestStopVerify() {
+    g_verifyStop.store(true);
+}
+
+static bool endsWith(const std::string &s, const std::string &suffix) {
+    return s.size() > suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Same answer for the same path and seed, spread evenly over [0, 1e6)
+static bool inSample(const std::string &relative, uint64_t seed, double percent) {
+    if (percent >= 100) return true;
+    uint64_t z = BackupManifest::hashPath(relative) ^ seed;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return static_cast<double>(z % 1000000) < percent * 10000;
+}
+
+namespace {
+
+struct VerifyJob {
+    std::string object;     // empty for packed files
+    std::string relative;
+    bool known = false;     // the manifest has a record stored this way
+    ManifestRecord record{};
+};
+
+struct VerifyCounters {
+    std::atomic<uint64_t> files{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> corrupt{0};
+    std::atomic<uint64_t> mismatched{0};
+};
+
+} // namespace
+
+// Why the decoded file is not what was backed up, or empty if it is. A delta
+// chain is only checked for size: its content is never rebuilt in memory.
+static std::string compareFile(const VerifyJob &job, const VerifyOptions &options, uint64_t size,
+                               uint64_t digest, uint32_t deltas) {
+    if (job.known && size != job.record.size) {
+        return "size is " + std::to_string(size) + ", the manifest has " + std::to_string(job.record.size);
+    }
+    if (job.known && deltas == 0 && job.record.contentHash != 0 && digest != job.record.contentHash) {
+        return "contents do not match the manifest fingerprint";
+    }
+    if (options.sourceDir.empty()) return std::string();
+
+    std::string source = (fs::path(options.sourceDir) / job.relative).string();
+    std::error_code ec;
+    uint64_t sourceSize = fs::file_size(source, ec);
+    if (ec) return "not in the source";
+    if (sourceSize != size) return "size differs from the source";
+    uint64_t sourceDigest = 0;
+    if (deltas == 0 && (!fingerprintFile(source, sourceDigest) || sourceDigest != digest)) {
+        return "contents differ from the source";
+    }
+    return std::string();
+}
+
+static void verifyFile(const VerifyJob &job, const std::string &backupDir, const SegmentStore &packs,
+                       bool haveDeltas, const std::vector<unsigned char> &key, const std::vector<unsigned char> &iv,
+                       const VerifyOptions &options, WorkerPool &pool, VerifyCounters &counters) {
+    // Only pay for the hash when there is something to hold it against
+    bool hash = !options.sourceDir.empty() || (job.known && job.record.contentHash != 0);
+    ContentHasher hasher;
+    uint64_t size = 0;
+    auto sink = [&](const unsigned char *data, size_t len) {
+        if (g_verifyStop.load()) return false;
+        if (hash) hasher.update(data, len);
+        size += len;
+        return true;
+    };
+
+    std::string label = job.object.empty() ? "packed " + job.relative : job.object;
+    bool ok = job.object.empty() ? packs.readFile(job.relative, key.data(), iv.data(), sink)
+                                 : readObjectWithKeyBytes(job.object, key.data(), iv.data(), &pool, sink);
+    counters.bytes += size;
+    uint32_t deltas = 0;
+    if (ok && haveDeltas && endsWith(job.object, kObjectSuffix)) {
+        ok = DeltaStore::checkChain(backupDir, job.relative, key.data(), size, deltas);
+    }
+    if (g_verifyStop.load()) return;
+    if (!ok) {
+        counters.corrupt++;
+        logMessage("Verify: corrupt " + label);
+        return;
+    }
+
+    std::string why = compareFile(job, options, size, hasher.digest(), deltas);
+    if (!why.empty()) {
+        counters.mismatched++;
+        logMessage("Verify: " + label + ": " + why);
+        return;
+    }
+    counters.files++;
+}
+
+bool performVerify(const std::string &backupDir, const std::string &keyHex, const std::string &ivHex,
+                   const VerifyOptions &options, VerifyStats &stats) {
+    std::vector<unsigned char> key = hexToBytes(keyHex);
+    std::vector<unsigned char> iv = hexToBytes(ivHex);
+    if (key.size() != 32 || iv.size() != 16) {
+        logMessage("Invalid key/IV size for verify");
+        return false;
+    }
+    if (!fs::is_directory(backupDir)) {
+        logMessage("Backup directory does not exist: " + backupDir);
+        return false;
+    }
+
+    uint64_t seed = options.sampleSeed;
+    if (seed == 0) {
+        seed = static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count()) | 1;
+    }
+    stats.sampleSeed = seed;
+    logMessage("Starting verify of " + backupDir +
+               (options.samplePercent < 100 ? " (sample " + std::to_string(options.samplePercent) +
+                                                  "%, seed " + std::to_string(seed) + ")"
+                                            : std::string()));
+    auto started = std::chrono::steady_clock::now();
+
+    RestoreOptions filter;
+    filter.includes = options.includes;
+    filter.excludes = options.excludes;
+
+    // Files the manifest knows about and that were found stored the way it
+    // says; whatever is left over at the end is missing. With filters only
+    // part of the backup is listed, so nothing can be called missing.
+    BackupManifest manifest(backupDir);
+    bool haveManifest = manifest.load();
+    bool findMissing = haveManifest && options.includes.empty() && options.excludes.empty();
+    std::unordered_set<uint64_t> seen;
+    auto expect = [&](VerifyJob &job, ManifestLocation a, ManifestLocation b) {
+        if (!haveManifest) return;
+        uint64_t pathHash = BackupManifest::hashPath(job.relative);
+        if (!manifest.find(pathHash, job.record)) return;
+        job.known = job.record.location == a || job.record.location == b;
+        if (job.known && findMissing) seen.insert(pathHash);
+    };
+
+    int threadCount = options.threadCount > 0 ? options.threadCount : 1;
+    WorkerPool pool(threadCount, static_cast<size_t>(threadCount) * 4, &g_verifyStop);
+    VerifyCounters counters;
+    uint64_t skipped = 0;
+    bool haveDeltas = DeltaStore(backupDir).exists();
+    SegmentStore packs(backupDir);
+    bool havePacks = packs.exists() && packs.open(false);
+
+    auto queue = [&](VerifyJob job) {
+        if (!inSample(job.relative, seed, options.samplePercent)) {
+            ++skipped;
+            return true;
+        }
+        return pool.submit([job, &backupDir, &packs, haveDeltas, &key, &iv, &options, &pool, &counters]() {
+            // Decoded objects use pooled buffers like a restore does
+            waitForBufferMemory(2ULL * kContainerChunkSize);
+            verifyFile(job, backupDir, packs, haveDeltas, key, iv, options, pool, counters);
+        });
+    };
+
+    if (havePacks) {
+        packs.forEach("", [&](const std::string &relative, const PackEntry &) {
+            if (g_verifyStop.load() || !restoreFilterMatches(filter, relative)) return;
+            VerifyJob job;
+            job.relative = relative;
+            expect(job, kLocationPacked, kLocationPacked);
+            queue(std::move(job));
+        });
+    }
+
+    // Listed level by level like a restore, decoding as soon as each level is known
+    std::vector<std::string> frontier{""};
+    while (!frontier.empty() && !g_verifyStop.load()) {
+        std::vector<std::vector<std::string>> subdirs(frontier.size());
+        std::vector<std::vector<BackupObject>> objects(frontier.size());
+        pool.parallelFor(frontier.size(), [&](size_t i) {
+            listBackupDirectory(backupDir, frontier[i], filter, subdirs[i], objects[i]);
+        });
+
+        for (auto &level : objects) {
+            for (auto &object : level) {
+                VerifyJob job;
+                job.object = object.object;
+                job.relative = object.relative;
+                if (endsWith(job.object, kObjectSuffix)) expect(job, kLocationObject, kLocationDelta);
+                else expect(job, kLocationRecipe, kLocationRecipe);
+                if (!queue(std::move(job))) break; // Stop requested
+            }
+        }
+
+        std::vector<std::string> next;
+        for (auto &level : subdirs) next.insert(next.end(), level.begin(), level.end());
+        frontier.swap(next);
+    }
+
+    pool.waitIdle();
+    pool.shutdown(false);
+
+    if (findMissing && !g_verifyStop.load()) {
+        // The manifest only keeps path hashes, so missing files are counted, not named
+        for (const ManifestRecord &record : manifest.records()) {
+            if (seen.count(record.pathHash) == 0) stats.missing++;
+        }
+    }
+    stats.files = counters.files.load();
+    stats.bytes = counters.bytes.load();
+    stats.corrupt = counters.corrupt.load();
+    stats.mismatched = counters.mismatched.load();
+    stats.skipped = skipped;
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    double mbps = seconds > 0 ? static_cast<double>(stats.bytes) / (1 << 20) / seconds : 0;
+    logMessage("Verify " + std::string(g_verifyStop.load() ? "stopped" : "complete") + ": " +
+               std::to_string(stats.files) + " file(s) ok, " + std::to_string(stats.bytes) + " bytes at " +
+               std::to_string(static_cast<uint64_t>(mbps)) + " MiB/s, " + std::to_string(stats.corrupt) +
+               " corrupt, " + std::to_string(stats.mismatched) + " mismatched, " + std::to_string(stats.missing) +
+               " missing, " + std::to_string(stats.skipped) + " not sampled");
+    return stats.corrupt == 0 && stats.mismatched == 0 && stats.missing == 0 && !g_verifyStop.load();
+}
@@ -0,0 +1,237 @@
+#include "walker.h"
+#include "logger.h"
+#include "qos.h"
+#include "workpool.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+// Files per batch handed to the caller, and batches allowed in flight before
+// the walker threads wait for it to catch up
+static const size_t kWalkBatchSize = 256;
+static const size_t kWalkMaxBatches = 64;
+static const size_t kDirentBufferSize = 64 * 1024;
+
+struct LinuxDirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+int defaultWalkThreads() {
+    unsigned hw = std::thread::hardware_concurrency();
+    return static_cast<int>(std::max(2u, std::min(8u, hw)));
+}
+
+namespace {
+
+class ParallelWalker {
+public:
+    ParallelWalker(int rootFd, const std::string &root, int threads, const std::atomic<bool> *stop)
+        : m_rootFd(rootFd), m_root(root), m_out(kWalkMaxBatches, &m_abort), m_stop(stop) {
+        for (int i = 0; i < threads; ++i) m_queues.emplace_back(new DirQueue);
+    }
+
+    bool run(const std::function<bool(const WalkEntry &)> &visit, WalkStats &stats) {
+        push(0, std::string());
+        m_running = static_cast<int>(m_queues.size());
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < m_queues.size(); ++i) threads.emplace_back(&ParallelWalker::workerLoop, this, i);
+
+        bool ok = true;
+        std::vector<WalkEntry> batch;
+        while (m_out.pop(batch)) {
+            for (const auto &entry : batch) {
+                if ((m_stop && m_stop->load()) || !visit(entry)) {
+                    ok = false;
+                    break;
+                }
+            }
+            if (!ok) break;
+        }
+        if (!ok || (m_stop && m_stop->load())) {
+            ok = false;
+            m_abort = true;
+        }
+        for (auto &t : threads) t.join();
+
+        stats.entries = m_entries.load();
+        stats.directories = m_directories.load();
+        stats.errors = m_errors.load();
+        return ok;
+    }
+
+private:
+    struct DirQueue {
+        std::mutex mutex;
+        std::deque<std::string> dirs;
+    };
+
+    bool aborted() const { return m_abort.load() || (m_stop && m_stop->load()); }
+
+    void push(size_t self, std::string relative) {
+        m_pending.fetch_add(1);
+        DirQueue &q = *m_queues[self];
+        std::lock_guard<std::mutex> lock(q.mutex);
+        q.dirs.push_back(std::move(relative));
+    }
+
+    // Own work depth-first from the back, others' from the front: the oldest
+    // entries are the shallowest and so tend to be the biggest subtrees
+    bool take(size_t self, std::string &relative) {
+        {
+            DirQueue &q = *m_queues[self];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.dirs.empty()) {
+                relative = std::move(q.dirs.back());
+                q.dirs.pop_back();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < m_queues.size(); ++i) {
+            DirQueue &q = *m_queues[(self + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(q.mutex);
+            if (!q.dirs.empty()) {
+                relative = std::move(q.dirs.front());
+                q.dirs.pop_front();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void publish(std::vector<WalkEntry> &batch) {
+        if (batch.empty()) return;
+        m_out.push(std::move(batch));
+        batch.clear();
+        batch.reserve(kWalkBatchSize);
+    }
+
+    void workerLoop(size_t self) {
+        applyWorkerPriority();
+        std::vector<WalkEntry> batch;
+        batch.reserve(kWalkBatchSize);
+        std::unique_ptr<char[]> buf(new char[kDirentBufferSize]);
+        std::string relative;
+        while (!aborted()) {
+            if (!take(self, relative)) {
+                // Hand over what we have before waiting for more directories
+                publish(batch);
+                if (m_pending.load() == 0) break;
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                continue;
+            }
+            listDirectory(self, relative, batch, buf.get());
+            m_pending.fetch_sub(1);
+        }
+        if (!aborted()) publish(batch);
+
+        std::lock_guard<std::mutex> lock(m_runningMutex);
+        if (--m_running == 0) m_out.close();
+    }
+
+    void listDirectory(size_t self, const std::string &relative, std::vector<WalkEntry> &batch, char *buf) {
+        int fd = ::openat(m_rootFd, relative.empty() ? "." : relative.c_str(),
+                          O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (fd < 0) {
+            m_errors.fetch_add(1, std::memory_order_relaxed);
+            logMessage("Failed to list " + m_root + "/" + relative + ": " + std::strerror(errno));
+            return;
+        }
+        m_directories.fetch_add(1, std::memory_order_relaxed);
+
+        uint64_t entries = 0;
+        while (!aborted()) {
+            long n = ::syscall(SYS_getdents64, fd, buf, kDirentBufferSize);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) {
+                m_errors.fetch_add(1, std::memory_order_relaxed);
+                logMessage("Failed to list " + m_root + "/" + relative + ": " + std::strerror(errno));
+                break;
+            }
+            if (n == 0) break;
+            for (long off = 0; off < n;) {
+                const LinuxDirent64 *d = reinterpret_cast<const LinuxDirent64 *>(buf + off);
+                off += d->d_reclen;
+                const char *name = d->d_name;
+                if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+                ++entries;
+
+                WalkEntry entry;
+                entry.relative.reserve(relative.size() + 1 + std::strlen(name));
+                if (!relative.empty()) {
+                    entry.relative = relative;
+                    entry.relative += '/';
+                }
+                entry.relative += name;
+
+                unsigned char type = d->d_type;
+                bool haveStat = false;
+                if (type == DT_UNKNOWN) {
+                    // Some filesystems leave the type to us
+                    if (::fstatat(fd, name, &entry.st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                    haveStat = true;
+                    type = S_ISDIR(entry.st.st_mode) ? DT_DIR : S_ISREG(entry.st.st_mode) ? DT_REG
+                         : S_ISLNK(entry.st.st_mode) ? DT_LNK : DT_UNKNOWN;
+                }
+                if (type == DT_DIR) {
+                    push(self, std::move(entry.relative));
+                    continue;
+                }
+                if (type == DT_REG) {
+                    if (!haveStat && ::fstatat(fd, name, &entry.st, AT_SYMLINK_NOFOLLOW) != 0) continue;
+                } else if (type == DT_LNK) {
+                    if (::fstatat(fd, name, &entry.st, 0) != 0 || !S_ISREG(entry.st.st_mode)) continue;
+                } else {
+                    continue;
+                }
+                batch.push_back(std::move(entry));
+                if (batch.size() >= kWalkBatchSize) publish(batch);
+            }
+        }
+        ::close(fd);
+        m_entries.fetch_add(entries, std::memory_order_relaxed);
+    }
+
+    int m_rootFd;
+    std::string m_root;
+    std::vector<std::unique_ptr<DirQueue>> m_queues;
+    std::atomic<int64_t> m_pending{0};   // directories queued or being listed
+    std::atomic<bool> m_abort{false};
+    BoundedQueue<std::vector<WalkEntry>> m_out;
+    const std::atomic<bool> *m_stop;
+    std::mutex m_runningMutex;
+    int m_running = 0;
+    std::atomic<uint64_t> m_entries{0};
+    std::atomic<uint64_t> m_directories{0};
+    std::atomic<uint64_t> m_errors{0};
+};
+
+} // namespace
+
+bool walkTree(const std::string &root, int threads, const std::atomic<bool> *stop,
+              const std::function<bool(const WalkEntry &)> &visit, WalkStats &stats) {
+    stats = WalkStats();
+    int rootFd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (rootFd < 0) {
+        logMessage("Failed to open " + root + ": " + std::strerror(errno));
+        return false;
+    }
+    ParallelWalker walker(rootFd, root, threads > 0 ? threads : defaultWalkThreads(), stop);
+    bool ok = walker.run(visit, stats);
+    ::close(rootFd);
+    return ok;
+}
@@ -0,0 +1,289 @@
+#include "watcher.h"
+#include "logger.h"
+
+#include <filesystem>
+#include <cerrno>
+#include <cstring>
+#include <climits>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/fanotify.h>
+
+namespace fs = std::filesystem;
+
+static const uint32_t kDirMask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB | IN_CREATE |
+                                 IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR;
+
+ChangeWatcher::ChangeWatcher(const std::string &root, bool useFanotify)
+    : m_root(fs::absolute(root).lexically_normal().string()), m_wantFanotify(useFanotify), m_buf(1 << 16) {
+    while (m_root.size() > 1 && m_root.back() == '/') m_root.pop_back();
+}
+
+ChangeWatcher::~ChangeWatcher() {
+    if (m_fd >= 0) close(m_fd);
+    if (m_mountFd >= 0) close(m_mountFd);
+}
+
+// Every regular file below `dir`, for a directory that arrived in one piece
+static void addFilesBelow(const std::string &dir, std::set<std::string> &found) {
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end;
+         !ec && it != end; it.increment(ec)) {
+        if (it->is_regular_file(ec)) found.insert(it->path().string());
+    }
+}
+
+bool ChangeWatcher::start() {
+    if (m_wantFanotify) {
+        if (startFanotify()) return true;
+        logMessage(std::string("fanotify unavailable (") + std::strerror(errno) + "), falling back to inotify");
+    }
+    return startInotify();
+}
+
+bool ChangeWatcher::startFanotify() {
+    // Renames and moves only come as directory-entry events, which need name
+    // reporting and a file system mark rather than a mount mark
+    int fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK | FAN_REPORT_DFID_NAME,
+                           O_RDONLY | O_LARGEFILE);
+    if (fd >= 0) {
+        int mountFd = ::open(m_root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (mountFd >= 0 && fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_FILESYSTEM,
+                                          FAN_CLOSE_WRITE | FAN_MOVED_TO | FAN_CREATE | FAN_ONDIR,
+                                          AT_FDCWD, m_root.c_str()) == 0) {
+            m_fd = fd;
+            m_mountFd = mountFd;
+            m_fanotify = true;
+            m_fanotifyNames = true;
+            logMessage("Watching " + m_root + " with fanotify");
+            return true;
+        }
+        if (mountFd >= 0) close(mountFd);
+        close(fd);
+    }
+
+    fd = fanotify_init(FAN_CLASS_NOTIF | FAN_CLOEXEC | FAN_NONBLOCK, O_RDONLY | O_LARGEFILE);
+    if (fd < 0) return false;
+    // A mount mark covers every directory below the root, including ones created later
+    if (fanotify_mark(fd, FAN_MARK_ADD | FAN_MARK_MOUNT, FAN_CLOSE_WRITE, AT_FDCWD, m_root.c_str()) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return false;
+    }
+    m_fd = fd;
+    m_fanotify = true;
+    logMessage("Watching " + m_root + " with fanotify (writes only, renames are found by periodic rescans)");
+    return true;
+}
+
+bool ChangeWatcher::startInotify() {
+    m_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (m_fd < 0) {
+        logMessage(std::string("inotify_init1 failed: ") + std::strerror(errno));
+        return false;
+    }
+    addWatchTree(m_root, nullptr);
+    logMessage("Watching " + m_root + " with inotify (" + std::to_string(m_watches.size()) + " directories)");
+    return true;
+}
+
+// Directories past the watch limit are remembered for rescanUnwatched()
+bool ChangeWatcher::addWatch(const std::string &dir) {
+    int wd = inotify_add_watch(m_fd, dir.c_str(), kDirMask);
+    if (wd < 0) {
+        if (errno == ENOSPC) m_unwatched.insert(dir);
+        return false;
+    }
+    m_watches[wd] = dir;
+    return true;
+}
+
+void ChangeWatcher::addWatchTree(const std::string &dir, std::set<std::string> *found) {
+    size_t unwatched = m_unwatched.size();
+    addWatch(dir);
+    std::error_code ec;
+    for (fs::recursive_directory_iterator it(dir, fs::directory_options::skip_permission_denied, ec), end;
+         !ec && it != end; it.increment(ec)) {
+        if (it->is_directory(ec)) {
+            addWatch(it->path().string());
+        } else if (found && it->is_regular_file(ec)) {
+            // Files that landed before the watch existed would otherwise be missed
+            found->insert(it->path().string());
+        }
+    }
+    size_t added = m_unwatched.size() - unwatched;
+    if (added > 0) {
+        logMessage("inotify watch limit reached (fs.inotify.max_user_watches): " + std::to_string(added) +
+                   (added == 1 ? " directory under " : " directories under ") + dir +
+                   " will be rescanned periodically instead");
+    }
+}
+
+void ChangeWatcher::rescanUnwatched(std::set<std::string> &changed) {
+    if (m_unwatched.empty()) return;
+    std::set<std::string> dirs;
+    dirs.swap(m_unwatched);
+    std::set<std::string> watched;
+    for (const auto &watch : m_watches) watched.insert(watch.second);
+
+    for (const auto &dir : dirs) {
+        std::error_code ec;
+        if (!fs::is_directory(dir, ec)) continue;
+        // Watched or not, nothing reported what happened in it so far
+        addWatch(dir);
+        for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+            std::string path = it->path().string();
+            if (it->is_directory(ec) && !it->is_symlink(ec)) {
+                // Created since the last look, so no watch was tried for it
+                if (!watched.count(path) && !dirs.count(path) && !m_unwatched.count(path)) {
+                    addWatchTree(path, &changed);
+                }
+            } else if (it->is_regular_file(ec)) {
+                changed.insert(path);
+            }
+        }
+    }
+}
+
+bool ChangeWatcher::poll(std::set<std::string> &changed, bool &overflowed,
+                         std::chrono::milliseconds timeout,
+                         std::chrono::milliseconds settle,
+                         std::chrono::milliseconds maxBatch) {
+    if (m_fd < 0) return false;
+    struct pollfd pfd{m_fd, POLLIN, 0};
+    int ready = ::poll(&pfd, 1, static_cast<int>(timeout.count()));
+    if (ready <= 0) return ready == 0 || errno == EINTR;
+    if (!drain(changed, overflowed)) return false;
+
+    // Coalesce the rest of the burst so an editor's save-rename-chmod dance or
+    // an untar only queues each path once
+    auto deadline = std::chrono::steady_clock::now() + maxBatch;
+    while (std::chrono::steady_clock::now() < deadline) {
+        pfd.revents = 0;
+        ready = ::poll(&pfd, 1, static_cast<int>(settle.count()));
+        if (ready <= 0) break;
+        if (!drain(changed, overflowed)) return false;
+    }
+    return true;
+}
+
+bool ChangeWatcher::drain(std::set<std::string> &changed, bool &overflowed) {
+    return m_fanotify ? drainFanotify(changed, overflowed) : drainInotify(changed, overflowed);
+}
+
+bool ChangeWatcher::drainInotify(std::set<std::string> &changed, bool &overflowed) {
+    for (;;) {
+        ssize_t len = read(m_fd, m_buf.data(), m_buf.size());
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) return true;
+            logMessage(std::string("inotify read failed: ") + std::strerror(errno));
+            return false;
+        }
+        if (len == 0) return true;
+
+        for (char *p = m_buf.data(); p < m_buf.data() + len;) {
+            auto *ev = reinterpret_cast<struct inotify_event *>(p);
+            p += sizeof(struct inotify_event) + ev->len;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                overflowed = true;
+                continue;
+            }
+            if (ev->mask & IN_IGNORED) {
+                m_watches.erase(ev->wd);
+                continue;
+            }
+            auto it = m_watches.find(ev->wd);
+            if (it == m_watches.end() || ev->len == 0) continue;
+
+            std::string path = it->second + "/" + ev->name;
+            if (ev->mask & IN_ISDIR) {
+                if (ev->mask & (IN_CREATE | IN_MOVED_TO)) addWatchTree(path, &changed);
+            } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO | IN_ATTRIB)) {
+                changed.insert(path);
+            }
+        }
+    }
+}
+
+bool ChangeWatcher::drainFanotify(std::set<std::string> &changed, bool &overflowed) {
+    for (;;) {
+        ssize_t len = read(m_fd, m_buf.data(), m_buf.size());
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR) return true;
+            logMessage(std::string("fanotify read failed: ") + std::strerror(errno));
+            return false;
+        }
+        if (len == 0) return true;
+
+        auto *ev = reinterpret_cast<struct fanotify_event_metadata *>(m_buf.data());
+        while (FAN_EVENT_OK(ev, len)) {
+            if (ev->vers != FANOTIFY_METADATA_VERSION) {
+                logMessage("fanotify metadata version mismatch");
+                return false;
+            }
+            std::string path;
+            if (ev->mask & FAN_Q_OVERFLOW) {
+                overflowed = true;
+            } else if (m_fanotifyNames) {
+                if (eventPath(ev, path) && underRoot(path)) {
+                    if (!(ev->mask & FAN_ONDIR)) {
+                        changed.insert(path);
+                    } else if (ev->mask & FAN_MOVED_TO) {
+                        // A directory moved in brings files no event will name
+                        addFilesBelow(path, changed);
+                    }
+                }
+            } else if (ev->fd >= 0) {
+                char link[64];
+                char target[PATH_MAX];
+                std::snprintf(link, sizeof(link), "/proc/self/fd/%d", ev->fd);
+                ssize_t n = readlink(link, target, sizeof(target) - 1);
+                if (n > 0) {
+                    path.assign(target, static_cast<size_t>(n));
+                    if (underRoot(path)) changed.insert(path);
+                }
+            }
+            if (ev->fd >= 0) close(ev->fd);
+            ev = FAN_EVENT_NEXT(ev, len);
+        }
+    }
+}
+
+// Directory handle plus entry name, as reported with FAN_REPORT_DFID_NAME.
+// False when the directory is already gone.
+bool ChangeWatcher::eventPath(const struct fanotify_event_metadata *ev, std::string &path) const {
+    const char *info = reinterpret_cast<const char *>(ev) + ev->metadata_len;
+    const char *end = reinterpret_cast<const char *>(ev) + ev->event_len;
+    while (info + sizeof(struct fanotify_event_info_header) <= end) {
+        auto *header = reinterpret_cast<const struct fanotify_event_info_header *>(info);
+        if (header->len == 0) break;
+        if (header->info_type == FAN_EVENT_INFO_TYPE_DFID_NAME) {
+            auto *fid = reinterpret_cast<const struct fanotify_event_info_fid *>(info);
+            auto *handle = reinterpret_cast<struct file_handle *>(const_cast<unsigned char *>(fid->handle));
+            const char *name = reinterpret_cast<const char *>(handle->f_handle + handle->handle_bytes);
+            int dirFd = open_by_handle_at(m_mountFd, handle, O_PATH | O_CLOEXEC);
+            if (dirFd < 0) return false;
+            char link[64];
+            char target[PATH_MAX];
+            std::snprintf(link, sizeof(link), "/proc/self/fd/%d", dirFd);
+            ssize_t n = readlink(link, target, sizeof(target) - 1);
+            close(dirFd);
+            if (n <= 0) return false;
+            path.assign(target, static_cast<size_t>(n));
+            if (std::strcmp(name, ".") != 0) path += std::string("/") + name;
+            return true;
+        }
+        info += header->len;
+    }
+    return false;
+}
+
+bool ChangeWatcher::underRoot(const std::string &path) const {
+    if (m_root == "/") return true;
+    return path.size() > m_root.size() && path.compare(0, m_root.size(), m_root) == 0 &&
+           path[m_root.size()] == '/';
+}
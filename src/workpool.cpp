@@ -0,0 +1,223 @@
+#include "workpool.h"
+#include "logger.h"
+#include "metrics.h"
+#include "qos.h"
+
+#include <algorithm>
+
+namespace {
+
+// The pool the calling thread works for, and the task it claimed early
+struct WorkerState {
+    WorkerPool *pool = nullptr;
+    std::function<void()> next;
+    bool claiming = false;
+};
+
+thread_local WorkerState t_worker;
+
+} // namespace
+
+WorkerPool::WorkerPool(int threadCount, size_t queueCapacity, const std::atomic<bool> *cancel)
+    : m_queue(queueCapacity, cancel), m_cancel(cancel) {
+    if (threadCount <= 0) threadCount = 1;
+    m_activeLimit = threadCount;
+    m_workers.reserve(static_cast<size_t>(threadCount));
+    for (int i = 0; i < threadCount; ++i) {
+        m_workers.emplace_back(&WorkerPool::workerLoop, this, i);
+    }
+    metrics().workers.fetch_add(threadCount, std::memory_order_relaxed);
+}
+
+WorkerPool::~WorkerPool() {
+    shutdown(false);
+}
+
+bool WorkerPool::submit(Task task, Task prefetch) {
+    {
+        std::lock_guard<std::mutex> lock(m_idleMutex);
+        if (m_shutdown) return false;
+        ++m_outstanding;
+    }
+    metrics().queueDepth.fetch_add(1, std::memory_order_relaxed);
+    if (!m_queue.push(Job{std::move(task), std::move(prefetch)})) {
+        metrics().queueDepth.fetch_sub(1, std::memory_order_relaxed);
+        finishTasks(1);
+        return false;
+    }
+    return true;
+}
+
+void WorkerPool::parallelFor(size_t count, const std::function<void(size_t)> &job) {
+    if (count == 0) return;
+
+    struct Batch {
+        std::atomic<size_t> next{0};
+        size_t remaining;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+    auto batch = std::make_shared<Batch>();
+    batch->remaining = count;
+
+    // Helpers and the caller claim indices from a shared counter, so a helper
+    // that only gets scheduled after the caller finished just returns
+    auto runSome = [batch, count, &job]() {
+        size_t finished = 0;
+        for (size_t i = batch->next++; i < count; i = batch->next++) {
+            try {
+                job(i);
+            } catch (...) {
+                logMessage("Parallel job failed");
+            }
+            ++finished;
+        }
+        if (finished == 0) return;
+        std::lock_guard<std::mutex> lock(batch->mutex);
+        batch->remaining -= finished;
+        if (batch->remaining == 0) batch->done.notify_all();
+    };
+
+    size_t helpers = std::min(count - 1, m_workers.size() > 0 ? m_workers.size() - 1 : 0);
+    for (size_t h = 0; h < helpers; ++h) {
+        {
+            std::lock_guard<std::mutex> lock(m_idleMutex);
+            if (m_shutdown) break;
+            ++m_outstanding;
+        }
+        // `job` outlives the helper's use of it: we wait for all indices below
+        metrics().queueDepth.fetch_add(1, std::memory_order_relaxed);
+        if (!m_queue.pushFront(Job{runSome, nullptr})) {
+            metrics().queueDepth.fetch_sub(1, std::memory_order_relaxed);
+            finishTasks(1);
+            break;
+        }
+    }
+
+    runSome();
+    std::unique_lock<std::mutex> lock(batch->mutex);
+    batch->done.wait(lock, [&]() { return batch->remaining == 0; });
+}
+
+void WorkerPool::waitIdle() {
+    std::unique_lock<std::mutex> lock(m_idleMutex);
+    while (m_outstanding > 0) {
+        if (m_cancel && m_cancel->load()) {
+            // Workers stop popping once cancelled, so account for the leftovers here
+            lock.unlock();
+            size_t dropped = m_queue.clear();
+            metrics().queueDepth.fetch_sub(static_cast<int64_t>(dropped), std::memory_order_relaxed);
+            finishTasks(dropped);
+            lock.lock();
+            if (m_outstanding == 0) break;
+        }
+        m_idleCv.wait_for(lock, std::chrono::milliseconds(100));
+    }
+}
+
+void WorkerPool::shutdown(bool drain) {
+    {
+        std::lock_guard<std::mutex> lock(m_idleMutex);
+        if (m_shutdown && m_workers.empty()) return;
+        m_shutdown = true;
+    }
+    // Parked workers have to come back to see the closed queue
+    setActiveLimit(static_cast<int>(m_workers.size()));
+    if (!drain) {
+        size_t dropped = m_queue.clear();
+        metrics().queueDepth.fetch_sub(static_cast<int64_t>(dropped), std::memory_order_relaxed);
+        if (dropped > 0) {
+            logMessage("Worker pool discarded " + std::to_string(dropped) + " queued task(s)");
+        }
+        finishTasks(dropped);
+    }
+    m_queue.close();
+    for (auto &t : m_workers) {
+        if (t.joinable()) t.join();
+    }
+    metrics().workers.fetch_sub(static_cast<int64_t>(m_workers.size()), std::memory_order_relaxed);
+    m_workers.clear();
+}
+
+void WorkerPool::setActiveLimit(int count) {
+    {
+        std::lock_guard<std::mutex> lock(m_parkMutex);
+        m_activeLimit = std::max(1, count);
+    }
+    m_parkCv.notify_all();
+}
+
+void WorkerPool::waitUntilActive(int index) {
+    if (index < m_activeLimit.load()) return;
+    std::unique_lock<std::mutex> lock(m_parkMutex);
+    while (index >= m_activeLimit.load() && !(m_cancel && m_cancel->load())) {
+        m_parkCv.wait_for(lock, std::chrono::milliseconds(100));
+    }
+}
+
+void WorkerPool::claimNextTask() {
+    WorkerState &worker = t_worker;
+    if (!worker.pool || worker.next || worker.claiming) return;
+    WorkerPool &pool = *worker.pool;
+    // An idle worker takes the next task at once; claiming it would only delay it
+    if (pool.m_waiting.load(std::memory_order_relaxed) > 0) return;
+    Job job;
+    if (!pool.m_queue.tryPop(job, [](const Job &queued) { return static_cast<bool>(queued.prefetch); })) return;
+    metrics().queueDepth.fetch_sub(1, std::memory_order_relaxed);
+    worker.claiming = true;
+    try {
+        job.prefetch();
+    } catch (...) {
+        // Only a head start; the task itself reports what went wrong
+    }
+    worker.claiming = false;
+    worker.next = std::move(job.run);
+}
+
+void WorkerPool::workerLoop(int index) {
+    applyWorkerPriority();
+    t_worker.pool = this;
+    BackupMetrics &m = metrics();
+    Job job;
+    int64_t idleSince = metricsNowNs();
+    for (;;) {
+        waitUntilActive(index);
+        if (t_worker.next) {
+            job.run = std::move(t_worker.next);
+            t_worker.next = nullptr;
+            if (m_cancel && m_cancel->load()) {
+                job.run = nullptr;
+                finishTasks(1);
+                continue;
+            }
+        } else {
+            m_waiting.fetch_add(1, std::memory_order_relaxed);
+            bool got = m_queue.pop(job);
+            m_waiting.fetch_sub(1, std::memory_order_relaxed);
+            if (!got) break;
+            m.queueDepth.fetch_sub(1, std::memory_order_relaxed);
+        }
+        int64_t busySince = metricsNowNs();
+        m.workerIdleNs.fetch_add(static_cast<uint64_t>(busySince - idleSince), std::memory_order_relaxed);
+        m.workersBusy.fetch_add(1, std::memory_order_relaxed);
+        try {
+            job.run();
+        } catch (const std::exception &ex) {
+            logMessage(std::string("Worker task failed: ") + ex.what());
+        } catch (...) {
+            logMessage("Worker task failed");
+        }
+        job = Job();
+        idleSince = metricsNowNs();
+        m.workersBusy.fetch_sub(1, std::memory_order_relaxed);
+        m.workerBusyNs.fetch_add(static_cast<uint64_t>(idleSince - busySince), std::memory_order_relaxed);
+        finishTasks(1);
+    }
+}
+
+void WorkerPool::finishTasks(size_t count) {
+    if (count == 0) return;
+    std::lock_guard<std::mutex> lock(m_idleMutex);
+    m_outstanding = count > m_outstanding ? 0 : m_outstanding - count;
+    if (m_outstanding == 0) m_idleCv.notify_all();
+}